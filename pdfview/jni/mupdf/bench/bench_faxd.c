@@ -0,0 +1,151 @@
+/*
+ * Fax decoder benchmark: synthetic A4 pages of text, optionally with a
+ * dithered halftone block, at 300 and 600 dpi, are encoded with the
+ * reference encoder in fax_encode.c and decoded through fz_open_faxd from
+ * memory. Reports the best of 5 decodes per page; the decoded bitmap must
+ * match the source one.
+ *
+ *	bench_faxd
+ */
+
+#include "fitz-internal.h"
+
+#include <time.h>
+
+#include "fax_encode.h"
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+fill_rect(unsigned char *bitmap, int stride, int x0, int y0, int x1, int y1)
+{
+	int x, y;
+	for (y = y0; y < y1; y++)
+		for (x = x0; x < x1; x++)
+			bitmap[y * stride + (x >> 3)] |= 0x80 >> (x & 7);
+}
+
+/* Lines of words of glyphs made of a few strokes, inside 1 inch margins */
+static unsigned char *
+make_page(int dpi, int halftone, int *wp, int *hp)
+{
+	int w = 827 * dpi / 100, h = 1169 * dpi / 100, stride = (w + 7) / 8;
+	int s = dpi / 100, margin = 100 * s;
+	int line_h = 17 * s, glyph_w = 8 * s, glyph_h = 11 * s;
+	unsigned char *bitmap = calloc(stride, h);
+	int x, y, i, k;
+
+	for (y = margin; y + line_h < h - margin; y += line_h)
+	{
+		if (rand() % 20 == 0)
+			continue; /* paragraph break */
+		for (x = margin; x + glyph_w < w - margin; x += 4 * s)
+		{
+			int letters = 2 + rand() % 9;
+			for (i = 0; i < letters && x + glyph_w < w - margin; i++, x += glyph_w + s)
+			{
+				int strokes = 2 + rand() % 4;
+				for (k = 0; k < strokes; k++)
+				{
+					int t = s + 1;
+					if (rand() & 1)
+					{
+						int xx = x + rand() % (glyph_w - t);
+						fill_rect(bitmap, stride, xx, y + rand() % (glyph_h / 3), xx + t, y + glyph_h - rand() % (glyph_h / 3));
+					}
+					else
+					{
+						int yy = y + rand() % (glyph_h - t);
+						fill_rect(bitmap, stride, x + rand() % (glyph_w / 3), yy, x + glyph_w - rand() % (glyph_w / 3), yy + t);
+					}
+				}
+			}
+		}
+	}
+
+	if (halftone)
+		for (y = h / 2; y < h / 2 + h / 5; y++)
+			for (x = w / 5; x < w * 4 / 5; x++)
+				if (rand() % 255 < x * 255 / w)
+					bitmap[y * stride + (x >> 3)] |= 0x80 >> (x & 7);
+
+	*wp = w;
+	*hp = h;
+	return bitmap;
+}
+
+static double
+decode(fz_context *ctx, unsigned char *out, unsigned char *data, int len, int k, int w, int h)
+{
+	int size = (w + 7) / 8 * h;
+	double best = 1e9, t;
+	int i, n, r;
+
+	for (i = 0; i < 5; i++)
+	{
+		fz_stream *stm = fz_open_memory(ctx, data, len);
+		t = now();
+		stm = fz_open_faxd(stm, k, 0, 0, w, h, 1, 1);
+		for (n = 0; (r = fz_read(stm, out + n, fz_mini(size - n, 65536))) > 0; n += r)
+			;
+		fz_close(stm);
+		t = now() - t;
+		if (t < best)
+			best = t;
+		if (n != size)
+			return -1;
+	}
+	return best;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct { int dpi, halftone, k; } runs[] =
+	{
+		{ 300, 0, -1 },
+		{ 300, 1, -1 },
+		{ 600, 0, -1 },
+		{ 600, 1, -1 },
+		{ 300, 0, 0 },
+		{ 600, 0, 0 },
+	};
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	int r, bad = 0;
+
+	srand(7);
+	for (r = 0; r < nelem(runs); r++)
+	{
+		int w, h, len, size;
+		unsigned char *bitmap = make_page(runs[r].dpi, runs[r].halftone, &w, &h);
+		unsigned char *data = fax_encode(bitmap, w, h, runs[r].k, &len);
+		unsigned char *out;
+		double t;
+
+		size = (w + 7) / 8 * h;
+		out = malloc(size);
+		t = decode(ctx, out, data, len, runs[r].k, w, h);
+		printf("A4 %d dpi %-13s %-5s %5d kB", runs[r].dpi, runs[r].halftone ? "text+halftone" : "text",
+			runs[r].k < 0 ? "G4" : "G3 1D", len / 1024);
+		if (t < 0 || memcmp(out, bitmap, size))
+		{
+			printf("  MISMATCH\n");
+			bad++;
+		}
+		else
+			printf("  %7.1f ms %7.1f MB/s\n", t * 1e3, size / t / 1e6);
+
+		free(bitmap);
+		free(data);
+		free(out);
+	}
+
+	fz_free_context(ctx);
+	return bad != 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Hash table benchmark, with keys laid out as the glyph cache and the
+ * store use them. Reports nanoseconds per insert, per lookup (half of
+ * them misses) and per remove plus insert, for several table sizes, for
+ * fz_hash_table and for the table it replaced (old_hash.c) side by side.
+ *
+ *	bench_hash
+ */
+
+#include "fitz-internal.h"
+
+#include <time.h>
+
+#include "old_hash.h"
+
+/* Same layout as fz_glyph_key in draw_glyph.c */
+typedef struct
+{
+	void *font;
+	int a, b;
+	int c, d;
+	unsigned short gid;
+	unsigned char e, f;
+	int aa;
+} glyph_key;
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* A few fonts, a size per 3000 glyphs, quarter pixel offsets */
+static void
+make_glyph_key(void *out, int i)
+{
+	glyph_key *key = out;
+	memset(key, 0, sizeof *key);
+	key->font = (char *)0x1000 + (i % 7) * 0x340;
+	key->a = key->d = 65536 * (10 + i / 3000);
+	key->gid = i % 3000;
+	key->e = (i * 7) % 4 * 64;
+	key->aa = 8;
+}
+
+/* Objects of a few kinds, keyed by object number */
+static void
+make_store_key(void *out, int i)
+{
+	fz_store_hash *key = out;
+	memset(key, 0, sizeof *key);
+	key->free = (fz_store_free_fn *)((char *)0x4000 + (i % 5) * 0x10);
+	key->u.i.i0 = i;
+	key->u.i.i1 = 0;
+}
+
+/* One hash table implementation, so both are driven by the same code */
+typedef struct
+{
+	void *(*new_table)(fz_context *ctx, int initialsize, int keylen);
+	void (*free_table)(fz_context *ctx, void *table);
+	void *(*find)(fz_context *ctx, void *table, void *key);
+	void *(*insert)(fz_context *ctx, void *table, void *key, void *val);
+	void (*remove)(fz_context *ctx, void *table, void *key);
+} hash_impl;
+
+#define HASH_IMPL(P, T) \
+static void *bench_##P##_new(fz_context *ctx, int initialsize, int keylen) \
+	{ return P##_new_hash_table(ctx, initialsize, keylen, -1); } \
+static void bench_##P##_free(fz_context *ctx, void *table) \
+	{ P##_free_hash(ctx, (T *)table); } \
+static void *bench_##P##_find(fz_context *ctx, void *table, void *key) \
+	{ return P##_hash_find(ctx, (T *)table, key); } \
+static void *bench_##P##_insert(fz_context *ctx, void *table, void *key, void *val) \
+	{ return P##_hash_insert(ctx, (T *)table, key, val); } \
+static void bench_##P##_remove(fz_context *ctx, void *table, void *key) \
+	{ P##_hash_remove(ctx, (T *)table, key); } \
+static const hash_impl P##_impl = \
+	{ bench_##P##_new, bench_##P##_free, bench_##P##_find, bench_##P##_insert, bench_##P##_remove };
+
+HASH_IMPL(fz, fz_hash_table)
+HASH_IMPL(old, old_hash_table)
+
+typedef struct
+{
+	double insert, find, churn;
+	int found;
+} timing;
+
+static timing
+run(fz_context *ctx, const hash_impl *impl, void (*make_key)(void *, int), int keylen, int initial, int n)
+{
+	void *table = impl->new_table(ctx, initial, keylen);
+	unsigned char key[64];
+	double t0, t1, t2, t3;
+	int i, r, found = 0;
+	timing res;
+
+	t0 = now();
+	for (i = 0; i < n; i++)
+	{
+		make_key(key, i);
+		impl->insert(ctx, table, key, (void *)(intptr_t)(i + 1));
+	}
+	t1 = now();
+	for (r = 0; r < 20; r++)
+	{
+		for (i = 0; i < n; i++)
+		{
+			make_key(key, (i * 2654435761u) % (2 * n));
+			found += impl->find(ctx, table, key) != NULL;
+		}
+	}
+	t2 = now();
+	for (i = 0; i < n; i++)
+	{
+		make_key(key, i);
+		impl->remove(ctx, table, key);
+		make_key(key, i + n);
+		impl->insert(ctx, table, key, (void *)1);
+	}
+	t3 = now();
+	impl->free_table(ctx, table);
+
+	res.insert = (t1 - t0) / n * 1e9;
+	res.find = (t2 - t1) / (20.0 * n) * 1e9;
+	res.churn = (t3 - t2) / n * 1e9;
+	res.found = found * 5 / n;
+	return res;
+}
+
+static void
+compare(fz_context *ctx, const char *name, void (*make_key)(void *, int), int keylen, int initial, int n)
+{
+	timing o = run(ctx, &old_impl, make_key, keylen, initial, n);
+	timing t = run(ctx, &fz_impl, make_key, keylen, initial, n);
+
+	printf("%-6s n=%6d  insert %6.1f -> %6.1f ns  find %6.1f -> %6.1f ns  churn %6.1f -> %6.1f ns  (found %d%%%s)\n",
+		name, n, o.insert, t.insert, o.find, t.find, o.churn, t.churn,
+		t.found, o.found == t.found ? "" : ", MISMATCH");
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int sizes[] = { 500, 2000, 8000, 50000 };
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	int s;
+
+	for (s = 0; s < nelem(sizes); s++)
+		compare(ctx, "glyph", make_glyph_key, sizeof(glyph_key), 509, sizes[s]);
+	for (s = 0; s < nelem(sizes); s++)
+		compare(ctx, "store", make_store_key, sizeof(fz_store_hash), 4096 / FZ_STORE_SHARDS, sizes[s]);
+
+	fz_free_context(ctx);
+	return 0;
+}
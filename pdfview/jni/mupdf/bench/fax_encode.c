@@ -0,0 +1,219 @@
+/*
+ * Straightforward CCITT fax encoder, used to make test data for the
+ * decoder in filt_faxd.c. Codes are written out bit by bit from the
+ * tables of T.4, so it is slow, but easy to check against the spec.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fax_encode.h"
+
+#define nelem(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Terminating codes, run lengths 0 to 63 */
+static const char *white_term[] =
+{
+	"00110101", "000111", "0111", "1000", "1011", "1100", "1110", "1111",
+	"10011", "10100", "00111", "01000", "001000", "000011", "110100", "110101",
+	"101010", "101011", "0100111", "0001100", "0001000", "0010111", "0000011", "0000100",
+	"0101000", "0101011", "0010011", "0100100", "0011000", "00000010", "00000011", "00011010",
+	"00011011", "00010010", "00010011", "00010100", "00010101", "00010110", "00010111", "00101000",
+	"00101001", "00101010", "00101011", "00101100", "00101101", "00000100", "00000101", "00001010",
+	"00001011", "01010010", "01010011", "01010100", "01010101", "00100100", "00100101", "01011000",
+	"01011001", "01011010", "01011011", "01001010", "01001011", "00110010", "00110011", "00110100",
+};
+
+/* Terminating codes, run lengths 0 to 63 */
+static const char *black_term[] =
+{
+	"0000110111", "010", "11", "10", "011", "0011",
+	"0010", "00011", "000101", "000100", "0000100", "0000101",
+	"0000111", "00000100", "00000111", "000011000", "0000010111", "0000011000",
+	"0000001000", "00001100111", "00001101000", "00001101100", "00000110111", "00000101000",
+	"00000010111", "00000011000", "000011001010", "000011001011", "000011001100", "000011001101",
+	"000001101000", "000001101001", "000001101010", "000001101011", "000011010010", "000011010011",
+	"000011010100", "000011010101", "000011010110", "000011010111", "000001101100", "000001101101",
+	"000011011010", "000011011011", "000001010100", "000001010101", "000001010110", "000001010111",
+	"000001100100", "000001100101", "000001010010", "000001010011", "000000100100", "000000110111",
+	"000000111000", "000000100111", "000000101000", "000001011000", "000001011001", "000000101011",
+	"000000101100", "000001011010", "000001100110", "000001100111",
+};
+
+/* Make-up codes, run lengths 64 to 1728 */
+static const char *white_makeup[] =
+{
+	"11011", "10010", "010111", "0110111", "00110110", "00110111", "01100100", "01100101",
+	"01101000", "01100111", "011001100", "011001101", "011010010", "011010011", "011010100", "011010101",
+	"011010110", "011010111", "011011000", "011011001", "011011010", "011011011", "010011000", "010011001",
+	"010011010", "011000", "010011011",
+};
+
+/* Make-up codes, run lengths 64 to 1728 */
+static const char *black_makeup[] =
+{
+	"0000001111", "000011001000", "000011001001", "000001011011", "000000110011", "000000110100",
+	"000000110101", "0000001101100", "0000001101101", "0000001001010", "0000001001011", "0000001001100",
+	"0000001001101", "0000001110010", "0000001110011", "0000001110100", "0000001110101", "0000001110110",
+	"0000001110111", "0000001010010", "0000001010011", "0000001010100", "0000001010101", "0000001011010",
+	"0000001011011", "0000001100100", "0000001100101",
+};
+
+/* Make-up codes for both colors, run lengths 1792 to 2560 */
+static const char *ext_makeup[] =
+{
+	"00000001000", "00000001100", "00000001101", "000000010010", "000000010011", "000000010100",
+	"000000010101", "000000010110", "000000010111", "000000011100", "000000011101", "000000011110",
+	"000000011111",
+};
+
+typedef struct
+{
+	unsigned char *data;
+	int cap;
+	int pos; /* in bits */
+} bit_writer;
+
+static void
+put_code(bit_writer *bw, const char *code)
+{
+	for (; *code; code++)
+	{
+		if (bw->pos / 8 >= bw->cap)
+		{
+			bw->cap = bw->cap * 2 + 4096;
+			bw->data = realloc(bw->data, bw->cap);
+		}
+		if (bw->pos % 8 == 0)
+			bw->data[bw->pos / 8] = 0;
+		if (*code == '1')
+			bw->data[bw->pos / 8] |= 0x80 >> (bw->pos % 8);
+		bw->pos++;
+	}
+}
+
+static void
+put_run(bit_writer *bw, int len, int black)
+{
+	while (len >= 2560 + 64)
+	{
+		put_code(bw, ext_makeup[nelem(ext_makeup) - 1]);
+		len -= 2560;
+	}
+	if (len >= 1792)
+	{
+		put_code(bw, ext_makeup[(len - 1792) / 64]);
+		len %= 64;
+	}
+	else if (len >= 64)
+	{
+		put_code(bw, black ? black_makeup[len / 64 - 1] : white_makeup[len / 64 - 1]);
+		len %= 64;
+	}
+	put_code(bw, black ? black_term[len] : white_term[len]);
+}
+
+/* Pixels left of the line are white */
+static int
+pixel(const unsigned char *line, int x)
+{
+	return x < 0 ? 0 : (line[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+/* First pixel right of x with color other than color, w if none */
+static int
+next_change(const unsigned char *line, int x, int w, int color)
+{
+	for (x++; x < w; x++)
+		if (pixel(line, x) != color)
+			return x;
+	return w;
+}
+
+/* First changing element of reference line right of a0 and of the color
+ * opposite to that of a0 */
+static int
+find_b1(const unsigned char *ref, int a0, int w, int color)
+{
+	int x;
+	for (x = a0 + 1; x < w; x++)
+		if (pixel(ref, x) != color && pixel(ref, x - 1) == color)
+			return x;
+	return w;
+}
+
+static void
+encode_1d(bit_writer *bw, const unsigned char *line, int w)
+{
+	int x = 0, color = 0, next;
+	while (x < w)
+	{
+		next = next_change(line, x - 1, w, color);
+		put_run(bw, next - x, color);
+		x = next;
+		color = !color;
+	}
+}
+
+static void
+encode_2d(bit_writer *bw, const unsigned char *line, const unsigned char *ref, int w)
+{
+	static const char *vertical[] = { "0000010", "000010", "010", "1", "011", "000011", "0000011" };
+	int a0 = -1, color = 0;
+	int a1, a2, b1, b2;
+
+	while (a0 < w)
+	{
+		a1 = next_change(line, a0, w, color);
+		b1 = find_b1(ref, a0, w, color);
+		b2 = b1 < w ? next_change(ref, b1, w, !color) : w;
+		if (b2 < a1)
+		{
+			/* pass mode */
+			put_code(bw, "0001");
+			a0 = b2;
+		}
+		else if (a1 - b1 >= -3 && a1 - b1 <= 3)
+		{
+			put_code(bw, vertical[a1 - b1 + 3]);
+			a0 = a1;
+			color = !color;
+		}
+		else
+		{
+			a2 = next_change(line, a1, w, !color);
+			put_code(bw, "001");
+			put_run(bw, a1 - (a0 < 0 ? 0 : a0), color);
+			put_run(bw, a2 - a1, !color);
+			a0 = a2;
+		}
+	}
+}
+
+unsigned char *
+fax_encode(const unsigned char *bitmap, int w, int h, int k, int *len)
+{
+	int stride = (w + 7) / 8;
+	unsigned char *white = calloc(stride, 1);
+	bit_writer bw = { NULL, 0, 0 };
+	int y;
+
+	for (y = 0; y < h; y++)
+	{
+		const unsigned char *line = bitmap + y * stride;
+		if (k < 0)
+			encode_2d(&bw, line, y ? line - stride : white, w);
+		else
+			encode_1d(&bw, line, w);
+	}
+	if (k < 0)
+	{
+		/* EOFB */
+		put_code(&bw, "000000000001");
+		put_code(&bw, "000000000001");
+	}
+	free(white);
+
+	*len = (bw.pos + 7) / 8;
+	return bw.data;
+}
@@ -0,0 +1,12 @@
+#ifndef FAX_ENCODE_H
+#define FAX_ENCODE_H
+
+/*
+ * Reference CCITT fax encoder for bench_faxd. bitmap has 1 bit per pixel,
+ * 1 being black, rows padded to whole bytes. k < 0 encodes Group 4 (T.6)
+ * ending with EOFB, k == 0 Group 3 one-dimensional (T.4) without EOLs.
+ * Returns malloc'ed data, its length is stored in *len.
+ */
+unsigned char *fax_encode(const unsigned char *bitmap, int w, int h, int k, int *len);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef OLD_HASH_H
+#define OLD_HASH_H
+
+/*
+ * fz_hash_table before the split array rewrite, see old_hash.c. Same
+ * interface as the fz_hash_ functions in fitz-internal.h.
+ */
+
+typedef struct old_hash_table_s old_hash_table;
+
+old_hash_table *old_new_hash_table(fz_context *ctx, int initialsize, int keylen, int lock);
+void old_empty_hash(fz_context *ctx, old_hash_table *table);
+void old_free_hash(fz_context *ctx, old_hash_table *table);
+
+void *old_hash_find(fz_context *ctx, old_hash_table *table, void *key);
+void *old_hash_insert(fz_context *ctx, old_hash_table *table, void *key, void *val);
+void old_hash_remove(fz_context *ctx, old_hash_table *table, void *key);
+
+int old_hash_len(fz_context *ctx, old_hash_table *table);
+void *old_hash_get_key(fz_context *ctx, old_hash_table *table, int idx);
+void *old_hash_get_val(fz_context *ctx, old_hash_table *table, int idx);
+
+void old_print_hash(fz_context *ctx, FILE *out, old_hash_table *table);
+
+#endif
@@ -789,6 +789,9 @@ fz_draw_fill_shade(fz_device *devp, fz_shade *shade, fz_matrix ctm, float alpha)
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model = state->dest->colorspace;
 
+	if (devp->hints & FZ_IGNORE_SHADE)
+		return;
+
 	bounds = fz_bound_shade(dev->ctx, shade, ctm);
 	scissor = state->scissor;
 	bbox = fz_intersect_bbox(fz_bbox_covering_rect(bounds), scissor);
@@ -925,6 +928,79 @@ fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_matrix *ctm, int x, in
 	return NULL;
 }
 
+/*
+	The size at which an image is requested from fz_image_to_pixmap_region.
+	Draft renders ask for a quarter of the drawn size, so that images
+	are decoded subsampled and scaled up.
+*/
+static void
+fz_draw_image_size(fz_device *devp, fz_matrix ctm, int *dx, int *dy)
+{
+	*dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+	*dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+	if (devp->hints & FZ_DRAFT_IMAGE)
+	{
+		*dx = fz_maxi(*dx / 4, 1);
+		*dy = fz_maxi(*dy / 4, 1);
+	}
+}
+
+/*
+	Get the part of an image that shows through clip. ctm is changed
+	to map the unit square onto that part, and dx, dy are set to the
+	size it is drawn at.
+*/
+static fz_pixmap *
+fz_draw_image_to_pixmap(fz_device *devp, fz_image *image, fz_matrix *ctm, fz_bbox clip, int *dx, int *dy)
+{
+	fz_context *ctx = devp->ctx;
+	fz_pixmap *pixmap;
+	fz_bbox area;
+	fz_matrix m;
+	fz_rect r;
+
+	fz_draw_image_size(devp, *ctm, dx, dy);
+
+	area.x0 = area.y0 = 0;
+	area.x1 = image->w;
+	area.y1 = image->h;
+
+	/* Find the clip in image space, allowing a couple of pixels either
+	 * side for the scaler's filter. */
+	if (fabsf(ctm->a * ctm->d - ctm->b * ctm->c) > FLT_EPSILON && !fz_is_infinite_bbox(clip))
+	{
+		r.x0 = clip.x0 - 2;
+		r.y0 = clip.y0 - 2;
+		r.x1 = clip.x1 + 2;
+		r.y1 = clip.y1 + 2;
+		r = fz_transform_rect(fz_invert_matrix(*ctm), r);
+		area.x0 = floorf(fz_clamp(r.x0, 0, 1) * image->w) - 2;
+		area.y0 = floorf(fz_clamp(r.y0, 0, 1) * image->h) - 2;
+		area.x1 = ceilf(fz_clamp(r.x1, 0, 1) * image->w) + 2;
+		area.y1 = ceilf(fz_clamp(r.y1, 0, 1) * image->h) + 2;
+		area.x0 = fz_maxi(area.x0, 0);
+		area.y0 = fz_maxi(area.y0, 0);
+		area.x1 = fz_mini(area.x1, image->w);
+		area.y1 = fz_mini(area.y1, image->h);
+	}
+
+	pixmap = fz_image_to_pixmap_region(ctx, image, *dx, *dy, &area);
+
+	if (area.x0 != 0 || area.y0 != 0 || area.x1 != image->w || area.y1 != image->h)
+	{
+		m.a = (float)(area.x1 - area.x0) / image->w;
+		m.b = 0;
+		m.c = 0;
+		m.d = (float)(area.y1 - area.y0) / image->h;
+		m.e = (float)area.x0 / image->w;
+		m.f = (float)area.y0 / image->h;
+		*ctm = fz_concat(m, *ctm);
+		fz_draw_image_size(devp, *ctm, dx, dy);
+	}
+
+	return pixmap;
+}
+
 static void
 fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 {
@@ -953,10 +1029,7 @@ fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 	if (image->w == 0 || image->h == 0)
 		return;
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-
-	pixmap = fz_image_to_pixmap(ctx, image, dx, dy);
+	pixmap = fz_draw_image_to_pixmap(devp, image, &ctm, clip, &dx, &dy);
 	orig_pixmap = pixmap;
 
 	/* convert images with more components (cmyk->rgb) before scaling */
@@ -1049,9 +1122,7 @@ fz_draw_fill_image_mask(fz_device *devp, fz_image *image, fz_matrix ctm,
 	if (image->w == 0 || image->h == 0)
 		return;
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-	pixmap = fz_image_to_pixmap(ctx, image, dx, dy);
+	pixmap = fz_draw_image_to_pixmap(devp, image, &ctm, clip, &dx, &dy);
 	orig_pixmap = pixmap;
 
 	fz_try(ctx)
@@ -1140,9 +1211,7 @@ fz_draw_clip_image_mask(fz_device *devp, fz_image *image, fz_rect *rect, fz_matr
 	if (rect)
 		bbox = fz_intersect_bbox(bbox, fz_bbox_covering_rect(*rect));
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-	pixmap = fz_image_to_pixmap(ctx, image, dx, dy);
+	pixmap = fz_draw_image_to_pixmap(devp, image, &ctm, clip, &dx, &dy);
 	orig_pixmap = pixmap;
 
 	fz_try(ctx)
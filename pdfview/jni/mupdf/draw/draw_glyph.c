@@ -1,16 +1,25 @@
 #include "fitz-internal.h"
 
 #define MAX_GLYPH_SIZE 256
-#define MAX_CACHE_SIZE (1024*1024)
+#define MAX_CACHE_SIZE (2*1024*1024)
 
-typedef struct fz_glyph_key_s fz_glyph_key;
+/* Cached glyphs are packed into atlases of this many bytes, a glyph too
+ * big for that gets an atlas of its own. */
+#define ATLAS_SIZE (64*1024)
+#define ATLAS_ALIGN 16
+#define ATLAS_ROUND(n) (((n) + ATLAS_ALIGN - 1) & ~(ATLAS_ALIGN - 1))
+#define ATLAS_HEADER ATLAS_ROUND(sizeof(fz_glyph_atlas))
+#define ENTRY_SIZE ATLAS_ROUND(sizeof(fz_glyph_cache_entry))
 
-struct fz_glyph_cache_s
-{
-	int refs;
-	fz_hash_table *hash;
-	int total;
-};
+/* Number of glyphs in the front cache of each context */
+#define FRONT_SIZE 256
+/* Front cache hits of a glyph are passed on to the shared cache, under
+ * its lock, in batches of this many */
+#define FRONT_HIT_BATCH 64
+
+typedef struct fz_glyph_key_s fz_glyph_key;
+typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
+typedef struct fz_glyph_atlas_s fz_glyph_atlas;
 
 struct fz_glyph_key_s
 {
@@ -22,6 +31,67 @@ struct fz_glyph_key_s
 	int aa;
 };
 
+/* Lives in an atlas, followed by the samples of the glyph. The pixmap
+ * handed out to callers is pix, so a cached glyph needs no allocation
+ * of its own; while callers hold it, it keeps its atlas alive. */
+struct fz_glyph_cache_entry_s
+{
+	fz_pixmap pix;
+	fz_glyph_key key;
+	fz_glyph_atlas *atlas;
+	fz_glyph_cache_entry *atlas_next;
+};
+
+struct fz_glyph_atlas_s
+{
+	/* One for the cache, plus one for each glyph in it that is alive */
+	int refs;
+	unsigned int size; /* bytes for entries */
+	unsigned int used;
+	fz_glyph_cache_entry *entries;
+	fz_glyph_atlas *lru_prev;
+	fz_glyph_atlas *lru_next;
+};
+
+struct fz_glyph_cache_s
+{
+	int refs;
+	fz_hash_table *hash;
+	/* Atlases, most recently used first; glyphs are evicted an atlas
+	 * at a time */
+	fz_glyph_atlas *lru_head;
+	fz_glyph_atlas *lru_tail;
+	/* Atlas new glyphs are added to */
+	fz_glyph_atlas *fill;
+	unsigned int total;
+	unsigned int max;
+	unsigned int items;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+	/* Bumped once per shrink or purge that evicts glyphs, so that front
+	 * caches let go of them (and of their atlases) too */
+	int generation;
+};
+
+typedef struct fz_glyph_front_entry_s fz_glyph_front_entry;
+
+struct fz_glyph_front_entry_s
+{
+	fz_glyph_key key;
+	fz_pixmap *val;
+	int hits; /* not passed on to the shared cache yet */
+};
+
+/* Direct mapped cache in front of the shared one, private to a context,
+ * so glyphs drawn over and over are found without taking the glyph
+ * cache lock. Each entry holds a reference to its font and glyph. */
+struct fz_glyph_front_s
+{
+	int generation;
+	fz_glyph_front_entry entries[FRONT_SIZE];
+};
+
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
@@ -38,33 +108,369 @@ fz_new_glyph_cache_context(fz_context *ctx)
 		fz_rethrow(ctx);
 	}
 	cache->total = 0;
+	cache->max = MAX_CACHE_SIZE;
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
+static void
+unlink_atlas(fz_glyph_cache *cache, fz_glyph_atlas *atlas)
+{
+	if (atlas->lru_next)
+		atlas->lru_next->lru_prev = atlas->lru_prev;
+	else
+		cache->lru_tail = atlas->lru_prev;
+	if (atlas->lru_prev)
+		atlas->lru_prev->lru_next = atlas->lru_next;
+	else
+		cache->lru_head = atlas->lru_next;
+}
+
+static void
+link_atlas_at_head(fz_glyph_cache *cache, fz_glyph_atlas *atlas)
+{
+	atlas->lru_prev = NULL;
+	atlas->lru_next = cache->lru_head;
+	if (atlas->lru_next)
+		atlas->lru_next->lru_prev = atlas;
+	else
+		cache->lru_tail = atlas;
+	cache->lru_head = atlas;
+}
+
+static void
+drop_atlas(fz_context *ctx, fz_glyph_atlas *atlas)
+{
+	if (fz_drop_refs(ctx, &atlas->refs))
+		fz_free(ctx, atlas);
+}
+
+/* Called when the last reference to a cached glyph is dropped */
+static void
+fz_free_glyph_imp(fz_context *ctx, fz_storable *pix_)
+{
+	fz_glyph_cache_entry *entry = (fz_glyph_cache_entry *)pix_;
+
+	if (entry->pix.colorspace)
+		fz_drop_colorspace(ctx, entry->pix.colorspace);
+	drop_atlas(ctx, entry->atlas);
+}
+
+/* The glyph cache lock is always held when this function is called.
+ * Removes all glyphs of atlas from the cache and returns their number.
+ * Glyphs being drawn stay alive, with their atlas, until dropped. */
+static int
+evict_atlas(fz_context *ctx, fz_glyph_atlas *atlas)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_cache_entry *entry, *next;
+	int count = 0;
+
+	unlink_atlas(cache, atlas);
+	if (cache->fill == atlas)
+		cache->fill = NULL;
+	for (entry = atlas->entries; entry; entry = next)
+	{
+		next = entry->atlas_next;
+		fz_hash_remove(ctx, cache->hash, &entry->key);
+		fz_drop_font(ctx, entry->key.font);
+		fz_drop_pixmap(ctx, &entry->pix);
+		count++;
+	}
+	cache->items -= count;
+	cache->total -= ATLAS_HEADER + atlas->size;
+	drop_atlas(ctx, atlas);
+	return count;
+}
+
+/* The glyph cache lock is always held when this function is called.
+ * Evicts least recently used atlases until total is at most max. */
+static void
+fz_shrink_glyph_cache(fz_context *ctx, unsigned int max)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int evicted = 0;
+
+	while (cache->lru_tail && cache->total > max)
+		evicted += evict_atlas(ctx, cache->lru_tail);
+	if (evicted)
+	{
+		cache->evictions += evicted;
+		cache->generation++;
+	}
+}
+
 /* The glyph cache lock is always held when this function is called. */
 static void
 fz_evict_glyph_cache(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
-	fz_glyph_key *key;
-	fz_pixmap *pixmap;
-	int i;
 
-	for (i = 0; i < fz_hash_len(ctx, cache->hash); i++)
+	while (cache->lru_head)
+		evict_atlas(ctx, cache->lru_head);
+}
+
+/* The glyph cache lock is always held when this function is called.
+ * Finds need bytes in an atlas, starting a new one if the one being
+ * filled is full. Space is not taken until atlas->used is bumped.
+ * Returns NULL if budget of cache is too small. */
+static unsigned char *
+atlas_alloc(fz_context *ctx, unsigned int need, fz_glyph_atlas **atlasp)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_atlas *atlas = cache->fill;
+	unsigned int size, bytes;
+	int category;
+
+	if (!atlas || atlas->size - atlas->used < need)
 	{
-		key = fz_hash_get_key(ctx, cache->hash, i);
-		if (key->font)
-			fz_drop_font(ctx, key->font);
-		pixmap = fz_hash_get_val(ctx, cache->hash, i);
-		if (pixmap)
-			fz_drop_pixmap(ctx, pixmap);
+		size = need > ATLAS_SIZE ? need : ATLAS_SIZE;
+		bytes = ATLAS_HEADER + size;
+		fz_shrink_glyph_cache(ctx, cache->max > bytes ? cache->max - bytes : 0);
+		if (cache->total + bytes > cache->max)
+			return NULL;
+		category = fz_set_alloc_category(ctx, FZ_ALLOC_GLYPH);
+		atlas = fz_malloc(ctx, bytes);
+		fz_set_alloc_category(ctx, category);
+		atlas->refs = 1;
+		atlas->size = size;
+		atlas->used = 0;
+		atlas->entries = NULL;
+		link_atlas_at_head(cache, atlas);
+		cache->total += bytes;
+		if (size == ATLAS_SIZE)
+			cache->fill = atlas;
 	}
+	*atlasp = atlas;
+	return (unsigned char *)atlas + ATLAS_HEADER + atlas->used;
+}
 
-	cache->total = 0;
+/* The glyph cache lock is always held when this function is called.
+ * Copies val into an atlas and returns the cached copy, or val itself
+ * if it can't be cached. */
+static fz_pixmap *
+encache_glyph(fz_context *ctx, fz_glyph_key *key, fz_pixmap *val)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_cache_entry *entry = NULL;
+	fz_glyph_atlas *atlas = NULL;
+	unsigned int len = val->w * val->h * val->n;
+	unsigned int need = ENTRY_SIZE + ATLAS_ROUND(len);
+
+	fz_var(entry);
+	fz_try(ctx)
+	{
+		entry = (fz_glyph_cache_entry *)atlas_alloc(ctx, need, &atlas);
+		if (entry)
+		{
+			entry->pix = *val;
+			FZ_INIT_STORABLE(&entry->pix, 1, fz_free_glyph_imp);
+			entry->pix.samples = (unsigned char *)entry + ENTRY_SIZE;
+			entry->pix.free_samples = 0;
+			entry->key = *key;
+			fz_hash_insert(ctx, cache->hash, key, entry);
+		}
+	}
+	fz_catch(ctx)
+	{
+		entry = NULL;
+		fz_warn(ctx, "Failed to encache glyph - continuing");
+	}
+	if (!entry)
+		return val;
+
+	memcpy(entry->pix.samples, val->samples, len);
+	if (entry->pix.colorspace)
+		fz_keep_colorspace(ctx, entry->pix.colorspace);
+	fz_keep_font(ctx, key->font);
+	fz_keep_refs(ctx, &atlas->refs);
+	entry->atlas = atlas;
+	entry->atlas_next = atlas->entries;
+	atlas->entries = entry;
+	atlas->used += need;
+	cache->items++;
 
-	fz_empty_hash(ctx, cache->hash);
+	fz_drop_pixmap(ctx, val);
+	return fz_keep_pixmap(ctx, &entry->pix);
+}
+
+/* The glyph cache lock is always held when this function is called.
+ * Passes hits of a front cache slot on to the shared cache: they are
+ * counted as hits, and the atlas of the glyph moves to the front of the
+ * LRU. If glyphs were evicted
+ * since the front cache was last synced, the atlas may be out of the
+ * LRU, so it is left alone. */
+static void
+pass_front_hits(fz_context *ctx, fz_glyph_front_entry *slot)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_cache_entry *entry = (fz_glyph_cache_entry *)slot->val;
+
+	if (ctx->glyph_front->generation == cache->generation)
+	{
+		unlink_atlas(cache, entry->atlas);
+		link_atlas_at_head(cache, entry->atlas);
+	}
+	cache->hits += slot->hits;
+	slot->hits = 0;
+}
+
+void
+fz_new_glyph_front_context(fz_context *ctx)
+{
+	ctx->glyph_front = fz_malloc_struct(ctx, fz_glyph_front);
+}
+
+void
+fz_flush_glyph_front(fz_context *ctx)
+{
+	fz_glyph_front *front = ctx->glyph_front;
+	fz_glyph_front_entry *entry;
+	int i, pending = 0;
+
+	if (!front)
+		return;
+	for (i = 0; i < FRONT_SIZE; i++)
+		pending |= front->entries[i].hits;
+	if (pending && ctx->glyph_cache)
+	{
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+		for (i = 0; i < FRONT_SIZE; i++)
+			if (front->entries[i].hits)
+				pass_front_hits(ctx, &front->entries[i]);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	}
+	for (i = 0; i < FRONT_SIZE; i++)
+	{
+		entry = &front->entries[i];
+		if (entry->val)
+		{
+			fz_drop_pixmap(ctx, entry->val);
+			fz_drop_font(ctx, entry->key.font);
+			entry->val = NULL;
+			entry->hits = 0;
+		}
+	}
+}
+
+void
+fz_sync_glyph_front(fz_context *ctx)
+{
+	fz_glyph_front *front = ctx->glyph_front;
+	int generation;
+
+	if (!front || !ctx->glyph_cache)
+		return;
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	generation = ctx->glyph_cache->generation;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (front->generation != generation)
+	{
+		fz_flush_glyph_front(ctx);
+		front->generation = generation;
+	}
+}
+
+void
+fz_free_glyph_front_context(fz_context *ctx)
+{
+	if (!ctx->glyph_front)
+		return;
+	fz_flush_glyph_front(ctx);
+	fz_free(ctx, ctx->glyph_front);
+	ctx->glyph_front = NULL;
+}
+
+static fz_glyph_front_entry *
+front_entry(fz_glyph_front *front, fz_glyph_key *key)
+{
+	unsigned int h;
+
+	h = (unsigned int)((size_t)key->font >> 4);
+	h = h * 31 + key->gid;
+	h = h * 31 + key->a + key->d;
+	h = h * 31 + key->e * 256 + key->f;
+	h = h ^ (h >> 11);
+	return &front->entries[h % FRONT_SIZE];
+}
+
+/* Put glyph found in (or added to) the shared cache into the front
+ * cache, replacing whatever was in its slot. Pending hits of the slot
+ * must have been passed on already. */
+static void
+remember_glyph(fz_context *ctx, fz_glyph_front_entry *slot, fz_glyph_key *key, fz_pixmap *val)
+{
+	if (!slot || !val || val->storable.free != fz_free_glyph_imp)
+		return;
+	if (slot->val)
+	{
+		fz_drop_pixmap(ctx, slot->val);
+		fz_drop_font(ctx, slot->key.font);
+	}
+	slot->key = *key;
+	slot->val = fz_keep_pixmap(ctx, val);
+	slot->hits = 0;
+	fz_keep_font(ctx, key->font);
+}
+
+void
+fz_purge_glyph_cache(fz_context *ctx)
+{
+	fz_flush_glyph_front(ctx);
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_evict_glyph_cache(ctx);
+	ctx->glyph_cache->generation++;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+unsigned int
+fz_glyph_cache_usage(fz_context *ctx)
+{
+	unsigned int total;
+
+	if (!ctx->glyph_cache)
+		return 0;
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	total = ctx->glyph_cache->total;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	return total;
+}
+
+void
+fz_set_glyph_cache_max(fz_context *ctx, unsigned int max)
+{
+	if (!ctx->glyph_cache)
+		return;
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache->max = max;
+	fz_shrink_glyph_cache(ctx, max);
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+/* Hits still batched in front caches of other contexts are not counted,
+ * those of ctx are passed on first. */
+void
+fz_get_glyph_cache_stats(fz_context *ctx, fz_store_stats *stats)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_front *front = ctx->glyph_front;
+	int i;
+
+	memset(stats, 0, sizeof *stats);
+	if (!cache)
+		return;
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	for (i = 0; front && i < FRONT_SIZE; i++)
+		if (front->entries[i].hits)
+			pass_front_hits(ctx, &front->entries[i]);
+	stats->size = cache->total;
+	stats->max = cache->max;
+	stats->items = cache->items;
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 }
 
 void
@@ -120,6 +526,9 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_color
 {
 	fz_glyph_cache *cache;
 	fz_glyph_key key;
+	fz_glyph_cache_entry *entry;
+	fz_glyph_front *front;
+	fz_glyph_front_entry *front_slot = NULL;
 	fz_pixmap *val;
 	float size = fz_matrix_expansion(ctm);
 	int do_cache;
@@ -152,14 +561,47 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_color
 	ctm.e = floorf(ctm.e) + key.e / 256.0f;
 	ctm.f = floorf(ctm.f) + key.f / 256.0f;
 
+	/* Try the front cache first, it needs no locking. Reading the
+	 * generation unlocked is fine: a glyph evicted meanwhile is still
+	 * valid, as the front cache holds a reference to it. Its hits are
+	 * batched, so the atlas LRU still sees glyphs that are in use. */
+	front = ctx->glyph_front;
+	if (front && do_cache)
+	{
+		if (front->generation != cache->generation)
+		{
+			fz_flush_glyph_front(ctx);
+			front->generation = cache->generation;
+		}
+		front_slot = front_entry(front, &key);
+		if (front_slot->val && !memcmp(&front_slot->key, &key, sizeof key))
+		{
+			if (++front_slot->hits >= FRONT_HIT_BATCH)
+			{
+				fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+				pass_front_hits(ctx, front_slot);
+				fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			}
+			return fz_keep_pixmap(ctx, front_slot->val);
+		}
+	}
+
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	val = fz_hash_find(ctx, cache->hash, &key);
-	if (val)
+	if (front_slot && front_slot->hits)
+		pass_front_hits(ctx, front_slot);
+	entry = fz_hash_find(ctx, cache->hash, &key);
+	if (entry)
 	{
-		fz_keep_pixmap(ctx, val);
+		/* LRU: move the atlas of the glyph to the front */
+		unlink_atlas(cache, entry->atlas);
+		link_atlas_at_head(cache, entry->atlas);
+		cache->hits++;
+		val = fz_keep_pixmap(ctx, &entry->pix);
 		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+		remember_glyph(ctx, front_slot, &key, val);
 		return val;
 	}
+	cache->misses++;
 
 	fz_try(ctx)
 	{
@@ -198,28 +640,19 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_color
 	{
 		if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
 		{
-			if (cache->total + val->w * val->h > MAX_CACHE_SIZE)
-				fz_evict_glyph_cache(ctx);
-			fz_try(ctx)
-			{
-				fz_pixmap *pix = fz_hash_insert(ctx, cache->hash, &key, val);
-				if (pix)
-				{
-					fz_drop_pixmap(ctx, val);
-					val = pix;
-				}
-				else
-					fz_keep_font(ctx, key.font);
-				val = fz_keep_pixmap(ctx, val);
-			}
-			fz_catch(ctx)
+			entry = fz_hash_find(ctx, cache->hash, &key);
+			if (entry)
 			{
-				fz_warn(ctx, "Failed to encache glyph - continuing");
+				/* Someone else rendered it meanwhile, use theirs */
+				fz_drop_pixmap(ctx, val);
+				val = fz_keep_pixmap(ctx, &entry->pix);
 			}
-			cache->total += val->w * val->h;
+			else
+				val = encache_glyph(ctx, &key, val);
 		}
 	}
 
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	remember_glyph(ctx, front_slot, &key, val);
 	return val;
 }
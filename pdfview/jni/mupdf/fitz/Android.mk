@@ -5,8 +5,9 @@ include $(CLEAR_VARS)
 LOCAL_CFLAGS := -O3
 
 ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
-  LOCAL_CFLAGS += -DJDCT_FASTEST=JDCT_FLOAT -DARCH_ARM
+  LOCAL_CFLAGS += -DJDCT_FASTEST=JDCT_FLOAT -DARCH_ARM -DARCH_ARM_NEON
   LOCAL_ARM_MODE := arm
+  LOCAL_STATIC_LIBRARIES := fitzneon cpufeatures
 endif
 
 ifeq ($(TARGET_ARCH_ABI),armeabi)
@@ -66,5 +67,26 @@ LOCAL_SRC_FILES := \
 
 include $(BUILD_STATIC_LIBRARY)
 
+# Kernels that use NEON are kept apart, so that the rest of fitz doesn't
+# need it; they are only called if android_getCpuFeatures finds NEON.
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -O3 -DARCH_ARM -DARCH_ARM_NEON
+LOCAL_ARM_MODE := arm
+LOCAL_ARM_NEON := true
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../mupdf
+LOCAL_MODULE := fitzneon
+LOCAL_SRC_FILES := \
+	filt_predict_neon.c
+
+include $(BUILD_STATIC_LIBRARY)
+
+$(call import-module,android/cpufeatures)
+
+endif
+
 # vim: set sts=8 sw=8 ts=8 noet:
 
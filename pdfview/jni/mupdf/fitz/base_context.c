@@ -7,6 +7,7 @@ fz_free_context(fz_context *ctx)
 		return;
 
 	/* Other finalisation calls go here (in reverse order) */
+	fz_free_glyph_front_context(ctx);
 	fz_drop_glyph_cache_context(ctx);
 	fz_drop_store_context(ctx);
 	fz_free_aa_context(ctx);
@@ -24,6 +25,8 @@ fz_free_context(fz_context *ctx)
 		fz_free(ctx, ctx->error);
 	}
 
+	fz_drop_alloc_stats_context(ctx);
+
 	/* Free the context itself */
 	ctx->alloc->free(ctx->alloc->user, ctx);
 }
@@ -42,6 +45,7 @@ new_context_phase1(fz_alloc_context *alloc, fz_locks_context *locks)
 	memset(ctx, 0, sizeof *ctx);
 	ctx->alloc = alloc;
 	ctx->locks = locks;
+	ctx->alloc_category = FZ_ALLOC_SCRATCH;
 
 	ctx->glyph_cache = NULL;
 
@@ -61,6 +65,7 @@ new_context_phase1(fz_alloc_context *alloc, fz_locks_context *locks)
 	fz_try(ctx)
 	{
 		fz_new_aa_context(ctx);
+		fz_new_glyph_front_context(ctx);
 	}
 	fz_catch(ctx)
 	{
@@ -91,6 +96,7 @@ fz_new_context(fz_alloc_context *alloc, fz_locks_context *locks, unsigned int ma
 	/* Now initialise sections that are shared */
 	fz_try(ctx)
 	{
+		fz_new_alloc_stats_context(ctx);
 		fz_new_store_context(ctx, max_store);
 		fz_new_glyph_cache_context(ctx);
 		fz_new_font_context(ctx);
@@ -125,6 +131,8 @@ fz_clone_context_internal(fz_context *ctx)
 	/* Inherit AA defaults from old context. */
 	fz_copy_aa_context(new_ctx, ctx);
 	/* Keep thread lock checking happy by copying pointers first and locking under new context */
+	new_ctx->alloc_stats = ctx->alloc_stats;
+	new_ctx->alloc_stats = fz_keep_alloc_stats_context(new_ctx);
 	new_ctx->store = ctx->store;
 	new_ctx->store = fz_keep_store_context(new_ctx);
 	new_ctx->glyph_cache = ctx->glyph_cache;
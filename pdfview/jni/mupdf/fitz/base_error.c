@@ -43,9 +43,13 @@ void fz_warn(fz_context *ctx, char *fmt, ...)
 
 /* Error context */
 
-static void throw(fz_error_context *ex)
+static void throw(fz_context *ctx)
 {
+	fz_error_context *ex = ctx->error;
+
 	if (ex->top >= 0) {
+		/* Allocation category scopes skipped by the jump end here */
+		ctx->alloc_category = ex->stack[ex->top].alloc_category;
 		fz_longjmp(ex->stack[ex->top].buffer, 1);
 	} else {
 		fprintf(stderr, "uncaught exception: %s\n", ex->message);
@@ -54,13 +58,18 @@ static void throw(fz_error_context *ex)
 	}
 }
 
-int fz_push_try(fz_error_context *ex)
+int fz_push_try(fz_context *ctx)
 {
+	fz_error_context *ex = ctx->error;
+
 	assert(ex);
 	ex->top++;
 	/* Normal case, get out of here quick */
 	if (ex->top < nelem(ex->stack)-1)
+	{
+		ex->stack[ex->top].alloc_category = ctx->alloc_category;
 		return 1;
+	}
 	/* We reserve the top slot on the exception stack purely to cope with
 	 * the case when we overflow. If we DO hit this, then we 'throw'
 	 * immediately - returning 0 stops the setjmp happening and takes us
@@ -89,10 +98,10 @@ void fz_throw(fz_context *ctx, char *fmt, ...)
 	fprintf(stderr, "error: %s\n", ctx->error->message);
 	LOGE("error: %s\n", ctx->error->message);
 
-	throw(ctx->error);
+	throw(ctx);
 }
 
 void fz_rethrow(fz_context *ctx)
 {
-	throw(ctx->error);
+	throw(ctx);
 }
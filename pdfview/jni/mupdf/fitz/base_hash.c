@@ -2,62 +2,98 @@
 
 /*
 Simple hashtable with open addressing linear probe.
-Unlike text book examples, removing entries works
-correctly in this implementation, so it wont start
-exhibiting bad behaviour if entries are inserted
-and removed frequently.
+Hashes, keys and values are kept in separate arrays: probing walks only
+the array of hashes, and a key is compared only when its full hash
+matches. Keys are stored at their exact length. Unlike text book
+examples, removing entries works correctly in this implementation, so it
+wont start exhibiting bad behaviour if entries are inserted and removed
+frequently.
 */
 
-enum { MAX_KEY_LEN = 48 };
-typedef struct fz_hash_entry_s fz_hash_entry;
-
-struct fz_hash_entry_s
-{
-	unsigned char key[MAX_KEY_LEN];
-	void *val;
-};
-
 struct fz_hash_table_s
 {
 	int keylen;
-	int size;
+	int size; /* always a power of two */
 	int load;
 	int lock; /* -1 or the lock used to protect this hash table */
-	fz_hash_entry *ents;
+	/* All three arrays live in one block, vals first */
+	void **vals;
+	unsigned int *hashes; /* hash of key in each slot, 0 if empty */
+	unsigned char *keys; /* keylen bytes for each slot */
 };
 
+/* Hashes 4 bytes at a time (murmur3), keys are rarely byte sized */
 static unsigned hash(unsigned char *s, int len)
 {
-	unsigned val = 0;
-	int i;
-	for (i = 0; i < len; i++)
+	unsigned val = len;
+	unsigned k;
+
+	while (len >= 4)
+	{
+		memcpy(&k, s, 4);
+		k *= 0xcc9e2d51;
+		k = (k << 15) | (k >> 17);
+		k *= 0x1b873593;
+		val ^= k;
+		val = (val << 13) | (val >> 19);
+		val = val * 5 + 0xe6546b64;
+		s += 4;
+		len -= 4;
+	}
+	k = 0;
+	while (len > 0)
+		k = (k << 8) | s[--len];
+	if (k)
 	{
-		val += s[i];
-		val += (val << 10);
-		val ^= (val >> 6);
+		k *= 0xcc9e2d51;
+		k = (k << 15) | (k >> 17);
+		k *= 0x1b873593;
+		val ^= k;
 	}
-	val += (val << 3);
-	val ^= (val >> 11);
-	val += (val << 15);
-	return val;
+	val ^= val >> 16;
+	val *= 0x85ebca6b;
+	val ^= val >> 13;
+	val *= 0xc2b2ae35;
+	val ^= val >> 16;
+	/* 0 marks empty slots */
+	return val ? val : 1;
+}
+
+/* Hashes, values and keys of size slots, in one block */
+static unsigned char *
+new_slots(fz_context *ctx, int size, int keylen)
+{
+	unsigned char *block;
+
+	block = fz_malloc_array(ctx, size, sizeof(void *) + sizeof(unsigned int) + keylen);
+	memset(block, 0, size * (sizeof(void *) + sizeof(unsigned int)));
+	return block;
+}
+
+static void
+set_slots(fz_hash_table *table, unsigned char *block, int size)
+{
+	table->size = size;
+	table->vals = (void **)block;
+	table->hashes = (unsigned int *)(block + size * sizeof(void *));
+	table->keys = block + size * (sizeof(void *) + sizeof(unsigned int));
 }
 
 fz_hash_table *
 fz_new_hash_table(fz_context *ctx, int initialsize, int keylen, int lock)
 {
 	fz_hash_table *table;
+	int size;
 
-	assert(keylen <= MAX_KEY_LEN);
+	for (size = 16; size < initialsize; size <<= 1);
 
 	table = fz_malloc_struct(ctx, fz_hash_table);
 	table->keylen = keylen;
-	table->size = initialsize;
 	table->load = 0;
 	table->lock = lock;
 	fz_try(ctx)
 	{
-		table->ents = fz_malloc_array(ctx, table->size, sizeof(fz_hash_entry));
-		memset(table->ents, 0, sizeof(fz_hash_entry) * table->size);
+		set_slots(table, new_slots(ctx, size, keylen), size);
 	}
 	fz_catch(ctx)
 	{
@@ -72,7 +108,7 @@ void
 fz_empty_hash(fz_context *ctx, fz_hash_table *table)
 {
 	table->load = 0;
-	memset(table->ents, 0, sizeof(fz_hash_entry) * table->size);
+	memset(table->vals, 0, table->size * (sizeof(void *) + sizeof(unsigned int)));
 }
 
 int
@@ -84,125 +120,143 @@ fz_hash_len(fz_context *ctx, fz_hash_table *table)
 void *
 fz_hash_get_key(fz_context *ctx, fz_hash_table *table, int idx)
 {
-	return table->ents[idx].key;
+	return table->keys + idx * table->keylen;
 }
 
 void *
 fz_hash_get_val(fz_context *ctx, fz_hash_table *table, int idx)
 {
-	return table->ents[idx].val;
+	return table->vals[idx];
 }
 
 void
 fz_free_hash(fz_context *ctx, fz_hash_table *table)
 {
-	fz_free(ctx, table->ents);
+	fz_free(ctx, table->vals);
 	fz_free(ctx, table);
 }
 
 static void *
-do_hash_insert(fz_context *ctx, fz_hash_table *table, void *key, void *val)
+do_hash_insert(fz_context *ctx, fz_hash_table *table, void *key, unsigned h, void *val)
 {
-	fz_hash_entry *ents;
-	unsigned size;
-	unsigned pos;
-
-	ents = table->ents;
-	size = table->size;
-	pos = hash(key, table->keylen) % size;
+	unsigned mask = table->size - 1;
+	unsigned pos = h & mask;
+	int keylen = table->keylen;
 
 	if (table->lock >= 0)
 		fz_assert_lock_held(ctx, table->lock);
 
 	while (1)
 	{
-		if (!ents[pos].val)
+		if (!table->hashes[pos])
 		{
-			memcpy(ents[pos].key, key, table->keylen);
-			ents[pos].val = val;
+			memcpy(table->keys + pos * keylen, key, keylen);
+			table->hashes[pos] = h;
+			table->vals[pos] = val;
 			table->load ++;
 			return NULL;
 		}
 
-		if (memcmp(key, ents[pos].key, table->keylen) == 0)
+		if (table->hashes[pos] == h && memcmp(key, table->keys + pos * keylen, keylen) == 0)
 		{
 			fz_warn(ctx, "assert: overwrite hash slot");
-			return ents[pos].val;
+			return table->vals[pos];
 		}
 
-		pos = (pos + 1) % size;
+		pos = (pos + 1) & mask;
 	}
 }
 
+/*
+	The allocator takes FZ_LOCK_ALLOC, and scavenges the store (taking
+	the store shard locks) when it runs out of memory, so tables guarded
+	by any of these locks drop it while allocating.
+*/
+static int
+unlock_to_alloc(fz_hash_table *table)
+{
+	return table->lock == FZ_LOCK_ALLOC ||
+		(table->lock >= FZ_LOCK_STORE && table->lock < FZ_LOCK_STORE + FZ_STORE_SHARDS);
+}
+
 static void
 fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 {
-	fz_hash_entry *oldents = table->ents;
-	fz_hash_entry *newents;
-	int oldsize = table->size;
-	int oldload = table->load;
+	fz_hash_table old = *table;
+	unsigned char *newslots = NULL;
 	int i;
 
-	if (newsize < oldload * 8 / 10)
+	if (newsize < old.load * 8 / 10)
 	{
 		fz_warn(ctx, "assert: resize hash too small");
 		return;
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-	newents = fz_malloc_array(ctx, newsize, sizeof(fz_hash_entry));
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (unlock_to_alloc(table))
+		fz_unlock(ctx, table->lock);
+	fz_try(ctx)
+	{
+		newslots = new_slots(ctx, newsize, table->keylen);
+	}
+	fz_always(ctx)
+	{
+		if (unlock_to_alloc(table))
+			fz_lock(ctx, table->lock);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 	if (table->lock >= 0)
 	{
 		if (table->size >= newsize)
 		{
 			/* Someone else fixed it before we could lock! */
-			fz_unlock(ctx, table->lock);
-			fz_free(ctx, newents);
+			if (unlock_to_alloc(table))
+				fz_unlock(ctx, table->lock);
+			fz_free(ctx, newslots);
+			if (unlock_to_alloc(table))
+				fz_lock(ctx, table->lock);
 			return;
 		}
+		old = *table;
 	}
-	table->ents = newents;
-	memset(table->ents, 0, sizeof(fz_hash_entry) * newsize);
-	table->size = newsize;
+	set_slots(table, newslots, newsize);
 	table->load = 0;
 
-	for (i = 0; i < oldsize; i++)
+	for (i = 0; i < old.size; i++)
 	{
-		if (oldents[i].val)
-		{
-			do_hash_insert(ctx, table, oldents[i].key, oldents[i].val);
-		}
+		if (old.hashes[i])
+			do_hash_insert(ctx, table, old.keys + i * old.keylen, old.hashes[i], old.vals[i]);
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-	fz_free(ctx, oldents);
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (unlock_to_alloc(table))
+		fz_unlock(ctx, table->lock);
+	fz_free(ctx, old.vals);
+	if (unlock_to_alloc(table))
+		fz_lock(ctx, table->lock);
 }
 
 void *
 fz_hash_find(fz_context *ctx, fz_hash_table *table, void *key)
 {
-	fz_hash_entry *ents = table->ents;
-	unsigned size = table->size;
-	unsigned pos = hash(key, table->keylen) % size;
+	unsigned h = hash(key, table->keylen);
+	unsigned mask = table->size - 1;
+	unsigned pos = h & mask;
+	int keylen = table->keylen;
 
 	if (table->lock >= 0)
 		fz_assert_lock_held(ctx, table->lock);
 
 	while (1)
 	{
-		if (!ents[pos].val)
+		if (!table->hashes[pos])
 			return NULL;
 
-		if (memcmp(key, ents[pos].key, table->keylen) == 0)
-			return ents[pos].val;
+		if (table->hashes[pos] == h && memcmp(key, table->keys + pos * keylen, keylen) == 0)
+			return table->vals[pos];
 
-		pos = (pos + 1) % size;
+		pos = (pos + 1) & mask;
 	}
 }
 
@@ -214,15 +268,16 @@ fz_hash_insert(fz_context *ctx, fz_hash_table *table, void *key, void *val)
 		fz_resize_hash(ctx, table, table->size * 2);
 	}
 
-	return do_hash_insert(ctx, table, key, val);
+	return do_hash_insert(ctx, table, key, hash(key, table->keylen), val);
 }
 
 void
 fz_hash_remove(fz_context *ctx, fz_hash_table *table, void *key)
 {
-	fz_hash_entry *ents = table->ents;
-	unsigned size = table->size;
-	unsigned pos = hash(key, table->keylen) % size;
+	unsigned h = hash(key, table->keylen);
+	unsigned mask = table->size - 1;
+	unsigned pos = h & mask;
+	int keylen = table->keylen;
 	unsigned hole, look, code;
 
 	if (table->lock >= 0)
@@ -230,32 +285,36 @@ fz_hash_remove(fz_context *ctx, fz_hash_table *table, void *key)
 
 	while (1)
 	{
-		if (!ents[pos].val)
+		if (!table->hashes[pos])
 		{
 			fz_warn(ctx, "assert: remove non-existent hash entry");
 			return;
 		}
 
-		if (memcmp(key, ents[pos].key, table->keylen) == 0)
+		if (table->hashes[pos] == h && memcmp(key, table->keys + pos * keylen, keylen) == 0)
 		{
-			ents[pos].val = NULL;
+			table->hashes[pos] = 0;
+			table->vals[pos] = NULL;
 
 			hole = pos;
-			look = (hole + 1) % size;
+			look = (hole + 1) & mask;
 
-			while (ents[look].val)
+			while (table->hashes[look])
 			{
-				code = hash(ents[look].key, table->keylen) % size;
+				code = table->hashes[look] & mask;
 				if ((code <= hole && hole < look) ||
 					(look < code && code <= hole) ||
 					(hole < look && look < code))
 				{
-					ents[hole] = ents[look];
-					ents[look].val = NULL;
+					memcpy(table->keys + hole * keylen, table->keys + look * keylen, keylen);
+					table->hashes[hole] = table->hashes[look];
+					table->vals[hole] = table->vals[look];
+					table->hashes[look] = 0;
+					table->vals[look] = NULL;
 					hole = look;
 				}
 
-				look = (look + 1) % size;
+				look = (look + 1) & mask;
 			}
 
 			table->load --;
@@ -263,7 +322,7 @@ fz_hash_remove(fz_context *ctx, fz_hash_table *table, void *key)
 			return;
 		}
 
-		pos = (pos + 1) % size;
+		pos = (pos + 1) & mask;
 	}
 }
 
@@ -277,14 +336,14 @@ fz_print_hash(fz_context *ctx, FILE *out, fz_hash_table *table)
 
 	for (i = 0; i < table->size; i++)
 	{
-		if (!table->ents[i].val)
+		if (!table->hashes[i])
 			fprintf(out, "table % 4d: empty\n", i);
 		else
 		{
 			fprintf(out, "table % 4d: key=", i);
-			for (k = 0; k < MAX_KEY_LEN; k++)
-				fprintf(out, "%02x", ((char*)table->ents[i].key)[k]);
-			fprintf(out, " val=$%p\n", table->ents[i].val);
+			for (k = 0; k < table->keylen; k++)
+				fprintf(out, "%02x", table->keys[i * table->keylen + k]);
+			fprintf(out, " val=$%p\n", table->vals[i]);
 		}
 	}
 }
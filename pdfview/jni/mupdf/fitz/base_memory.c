@@ -1,21 +1,255 @@
 #include "fitz-internal.h"
 
+/*
+ * Allocation accounting. The raw_ functions wrap the underlying
+ * allocator and are called with FZ_LOCK_ALLOC held, which also guards
+ * the counters. They are shared by all clones of a context rather than
+ * kept per context: the lock is taken for the allocation anyway, so
+ * counting adds no locking, and the peak of a category can only be
+ * tracked on its total. Blocks are often freed by another context than
+ * the one that allocated them (store eviction, glyph atlases).
+ */
+
+#ifdef FZ_ALLOC_STATS
+
+struct fz_alloc_stats_context_s
+{
+	int refs;
+	fz_alloc_stats cats[FZ_ALLOC_CATEGORIES];
+};
+
+static const char *category_names[FZ_ALLOC_CATEGORIES] =
+{
+	"images", "fonts", "shades", "functions", "other resources",
+	"objects", "display lists", "glyphs", "scratch"
+};
+
+/* Each block starts with its size and category; blocks allocated
+ * before the context got its statistics have category -1 and are not
+ * counted. */
+typedef union
+{
+	struct
+	{
+		unsigned int size;
+		int category;
+	} h;
+	double align_d;
+	void *align_p;
+} fz_alloc_header;
+
+static void
+count_block(fz_context *ctx, fz_alloc_header *hdr, int sign)
+{
+	fz_alloc_stats *stats;
+
+	if (hdr->h.category < 0 || !ctx->alloc_stats)
+		return;
+
+	stats = &ctx->alloc_stats->cats[hdr->h.category];
+	if (sign > 0)
+	{
+		stats->size += hdr->h.size;
+		stats->blocks++;
+		if (stats->size > stats->peak)
+			stats->peak = stats->size;
+	}
+	else
+	{
+		stats->size -= hdr->h.size;
+		stats->blocks--;
+	}
+}
+
+static void *
+raw_malloc(fz_context *ctx, unsigned int size)
+{
+	fz_alloc_header *hdr;
+
+	if (size > UINT_MAX - sizeof(fz_alloc_header))
+		return NULL;
+	hdr = ctx->alloc->malloc(ctx->alloc->user, size + sizeof(fz_alloc_header));
+	if (!hdr)
+		return NULL;
+	hdr->h.size = size;
+	hdr->h.category = ctx->alloc_stats ? ctx->alloc_category : -1;
+	count_block(ctx, hdr, 1);
+	return hdr + 1;
+}
+
+static void *
+raw_realloc(fz_context *ctx, void *p, unsigned int size)
+{
+	fz_alloc_header *hdr, *nhdr;
+
+	if (!p)
+		return raw_malloc(ctx, size);
+	if (size > UINT_MAX - sizeof(fz_alloc_header))
+		return NULL;
+	hdr = (fz_alloc_header *)p - 1;
+	count_block(ctx, hdr, -1);
+	nhdr = ctx->alloc->realloc(ctx->alloc->user, hdr, size + sizeof(fz_alloc_header));
+	if (!nhdr)
+	{
+		count_block(ctx, hdr, 1);
+		return NULL;
+	}
+	nhdr->h.size = size;
+	count_block(ctx, nhdr, 1);
+	return nhdr + 1;
+}
+
+static void
+raw_free(fz_context *ctx, void *p)
+{
+	fz_alloc_header *hdr;
+
+	if (!p)
+		return;
+	hdr = (fz_alloc_header *)p - 1;
+	count_block(ctx, hdr, -1);
+	ctx->alloc->free(ctx->alloc->user, hdr);
+}
+
+void
+fz_new_alloc_stats_context(fz_context *ctx)
+{
+	ctx->alloc_stats = fz_malloc_struct(ctx, fz_alloc_stats_context);
+	ctx->alloc_stats->refs = 1;
+}
+
+fz_alloc_stats_context *
+fz_keep_alloc_stats_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->alloc_stats)
+		return NULL;
+	fz_keep_refs(ctx, &ctx->alloc_stats->refs);
+	return ctx->alloc_stats;
+}
+
+void
+fz_drop_alloc_stats_context(fz_context *ctx)
+{
+	fz_alloc_stats_context *stats;
+
+	if (!ctx || !ctx->alloc_stats)
+		return;
+	stats = ctx->alloc_stats;
+	ctx->alloc_stats = NULL;
+	if (fz_drop_refs(ctx, &stats->refs))
+		fz_free(ctx, stats);
+}
+
+int
+fz_get_alloc_stats(fz_context *ctx, fz_alloc_stats *stats)
+{
+	if (!ctx->alloc_stats)
+	{
+		memset(stats, 0, FZ_ALLOC_CATEGORIES * sizeof(*stats));
+		return 0;
+	}
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	memcpy(stats, ctx->alloc_stats->cats, FZ_ALLOC_CATEGORIES * sizeof(*stats));
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return 1;
+}
+
+void
+fz_reset_alloc_peaks(fz_context *ctx)
+{
+	int i;
+
+	if (!ctx->alloc_stats)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < FZ_ALLOC_CATEGORIES; i++)
+		ctx->alloc_stats->cats[i].peak = ctx->alloc_stats->cats[i].size;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+void
+fz_print_alloc_stats(fz_context *ctx, FILE *out)
+{
+	fz_alloc_stats stats[FZ_ALLOC_CATEGORIES];
+	int i;
+
+	if (!fz_get_alloc_stats(ctx, stats))
+		return;
+	for (i = 0; i < FZ_ALLOC_CATEGORIES; i++)
+		fprintf(out, "%-16s %10u bytes (peak %u) in %u blocks\n", category_names[i],
+			stats[i].size, stats[i].peak, stats[i].blocks);
+}
+
+#else
+
+static inline void *
+raw_malloc(fz_context *ctx, unsigned int size)
+{
+	return ctx->alloc->malloc(ctx->alloc->user, size);
+}
+
+static inline void *
+raw_realloc(fz_context *ctx, void *p, unsigned int size)
+{
+	return ctx->alloc->realloc(ctx->alloc->user, p, size);
+}
+
+static inline void
+raw_free(fz_context *ctx, void *p)
+{
+	ctx->alloc->free(ctx->alloc->user, p);
+}
+
+void
+fz_new_alloc_stats_context(fz_context *ctx)
+{
+}
+
+fz_alloc_stats_context *
+fz_keep_alloc_stats_context(fz_context *ctx)
+{
+	return NULL;
+}
+
+void
+fz_drop_alloc_stats_context(fz_context *ctx)
+{
+}
+
+int
+fz_get_alloc_stats(fz_context *ctx, fz_alloc_stats *stats)
+{
+	memset(stats, 0, FZ_ALLOC_CATEGORIES * sizeof(*stats));
+	return 0;
+}
+
+void
+fz_reset_alloc_peaks(fz_context *ctx)
+{
+}
+
+void
+fz_print_alloc_stats(fz_context *ctx, FILE *out)
+{
+}
+
+#endif /* FZ_ALLOC_STATS */
+
 static void *
 do_scavenging_malloc(fz_context *ctx, unsigned int size)
 {
 	void *p;
 	int phase = 0;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	/* Scavenging takes the store lock, so the allocator lock is
+	 * only held around the allocation itself. */
 	do {
-		p = ctx->alloc->malloc(ctx->alloc->user, size);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		p = raw_malloc(ctx, size);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		if (p != NULL)
-		{
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
 			return p;
-		}
 	} while (fz_store_scavenge(ctx, size, &phase));
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
 }
@@ -26,20 +260,223 @@ do_scavenging_realloc(fz_context *ctx, void *p, unsigned int size)
 	void *q;
 	int phase = 0;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	/* Scavenging takes the store lock, so the allocator lock is
+	 * only held around the allocation itself. */
 	do {
-		q = ctx->alloc->realloc(ctx->alloc->user, p, size);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		q = raw_realloc(ctx, p, size);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		if (q != NULL)
-		{
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
 			return q;
-		}
 	} while (fz_store_scavenge(ctx, size, &phase));
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
 }
 
+/*
+ * Arena allocator. Each block is preceded by its rounded size, so that
+ * blocks can be copied when resized, and the most recent one can grow
+ * or be given back in place.
+ */
+
+typedef struct fz_arena_chunk_s fz_arena_chunk;
+
+struct fz_arena_chunk_s
+{
+	fz_arena_chunk *next;
+	unsigned char *end;
+};
+
+typedef union
+{
+	unsigned int size;
+	double align_d;
+	void *align_p;
+} fz_arena_header;
+
+#define ARENA_ROUND(n) (((n) + sizeof(fz_arena_header) - 1) & ~(sizeof(fz_arena_header) - 1))
+#define ARENA_CHUNK_HEADER ARENA_ROUND(sizeof(fz_arena_chunk))
+
+struct fz_arena_s
+{
+	unsigned int chunk_size;
+	unsigned int max_block;
+	fz_arena_chunk *chunks; /* most recent first */
+	unsigned char *pos; /* free space left in most recent chunk */
+	unsigned char *end;
+};
+
+static void
+heap_free(fz_context *ctx, void *p)
+{
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	raw_free(ctx, p);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+/* Blocks are freed mostly in reverse order, so most recent chunk is
+ * checked first. */
+static int
+arena_owns(fz_arena *arena, void *p)
+{
+	fz_arena_chunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		if ((unsigned char *)p > (unsigned char *)chunk && (unsigned char *)p < chunk->end)
+			return 1;
+	return 0;
+}
+
+/* Returns NULL if the block should come from the heap instead */
+static void *
+arena_alloc(fz_context *ctx, fz_arena *arena, unsigned int size)
+{
+	fz_arena_header *hdr;
+	fz_arena_chunk *chunk;
+	unsigned int rounded = ARENA_ROUND(size);
+
+	if (size == 0 || rounded > arena->max_block)
+		return NULL;
+
+	if ((unsigned int)(arena->end - arena->pos) < sizeof(fz_arena_header) + rounded)
+	{
+		chunk = do_scavenging_malloc(ctx, arena->chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->chunks;
+		chunk->end = (unsigned char *)chunk + arena->chunk_size;
+		arena->chunks = chunk;
+		arena->pos = (unsigned char *)chunk + ARENA_CHUNK_HEADER;
+		arena->end = chunk->end;
+	}
+
+	hdr = (fz_arena_header *)arena->pos;
+	hdr->size = rounded;
+	arena->pos += sizeof(fz_arena_header) + rounded;
+	return hdr + 1;
+}
+
+static void
+arena_free(fz_arena *arena, void *p)
+{
+	fz_arena_header *hdr = (fz_arena_header *)p - 1;
+
+	if ((unsigned char *)p + hdr->size == arena->pos)
+		arena->pos = (unsigned char *)hdr;
+}
+
+static void *
+arena_resize(fz_context *ctx, fz_arena *arena, void *p, unsigned int size)
+{
+	fz_arena_header *hdr = (fz_arena_header *)p - 1;
+	unsigned int rounded = ARENA_ROUND(size);
+	unsigned int old = hdr->size;
+	void *np;
+
+	if (rounded <= old)
+		return p;
+
+	/* Most recent block grows in place */
+	if ((unsigned char *)p + old == arena->pos && rounded <= arena->max_block &&
+		(unsigned int)(arena->end - (unsigned char *)p) >= rounded)
+	{
+		hdr->size = rounded;
+		arena->pos = (unsigned char *)p + rounded;
+		return p;
+	}
+
+	/* Others are copied, to the heap once they get large, so that
+	 * blocks growing one after another don't waste the arena */
+	np = arena_alloc(ctx, arena, size);
+	if (!np)
+		np = do_scavenging_malloc(ctx, size);
+	if (!np)
+		return NULL;
+	memcpy(np, p, old);
+	arena_free(arena, p);
+	return np;
+}
+
+static void *
+do_resize(fz_context *ctx, void *p, unsigned int size)
+{
+	if (ctx->arena && p && arena_owns(ctx->arena, p))
+		return arena_resize(ctx, ctx->arena, p, size);
+	return do_scavenging_realloc(ctx, p, size);
+}
+
+fz_arena *
+fz_new_arena(fz_context *ctx, unsigned int chunk_size)
+{
+	fz_arena *arena;
+
+	arena = fz_malloc_struct(ctx, fz_arena);
+	arena->chunk_size = chunk_size;
+	arena->max_block = chunk_size / 4;
+	arena->chunks = NULL;
+	arena->pos = arena->end = NULL;
+	return arena;
+}
+
+void
+fz_reset_arena(fz_context *ctx, fz_arena *arena)
+{
+	fz_arena_chunk *chunk;
+
+	if (!arena || !arena->chunks)
+		return;
+
+	/* Keep the oldest chunk */
+	while (arena->chunks->next)
+	{
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		heap_free(ctx, chunk);
+	}
+	arena->pos = (unsigned char *)arena->chunks + ARENA_CHUNK_HEADER;
+	arena->end = arena->chunks->end;
+}
+
+void
+fz_free_arena(fz_context *ctx, fz_arena *arena)
+{
+	fz_arena_chunk *chunk;
+
+	if (!arena)
+		return;
+
+	while (arena->chunks)
+	{
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		heap_free(ctx, chunk);
+	}
+	heap_free(ctx, arena);
+}
+
+fz_arena *
+fz_attach_arena(fz_context *ctx, fz_arena *arena)
+{
+	fz_arena *old = ctx->arena;
+
+	ctx->arena = arena;
+	return old;
+}
+
+void *
+fz_malloc_transient(fz_context *ctx, unsigned int size)
+{
+	void *p;
+
+	if (ctx->arena)
+	{
+		p = arena_alloc(ctx, ctx->arena, size);
+		if (p)
+			return p;
+	}
+	return fz_malloc(ctx, size);
+}
+
 void *
 fz_malloc(fz_context *ctx, unsigned int size)
 {
@@ -150,7 +587,7 @@ fz_resize_array(fz_context *ctx, void *p, unsigned int count, unsigned int size)
 	if (count > UINT_MAX / size)
 		fz_throw(ctx, "resize array (%d x %d bytes) failed (integer overflow)", count, size);
 
-	np = do_scavenging_realloc(ctx, p, count * size);
+	np = do_resize(ctx, p, count * size);
 	if (!np)
 		fz_throw(ctx, "resize array (%d x %d bytes) failed", count, size);
 	return np;
@@ -171,15 +608,16 @@ fz_resize_array_no_throw(fz_context *ctx, void *p, unsigned int count, unsigned
 		return NULL;
 	}
 
-	return do_scavenging_realloc(ctx, p, count * size);
+	return do_resize(ctx, p, count * size);
 }
 
 void
 fz_free(fz_context *ctx, void *p)
 {
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	ctx->alloc->free(ctx->alloc->user, p);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (ctx->arena && p && arena_owns(ctx->arena, p))
+		arena_free(ctx->arena, p);
+	else
+		heap_free(ctx, p);
 }
 
 char *
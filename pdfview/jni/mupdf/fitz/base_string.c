@@ -255,3 +255,19 @@ float fz_atof(const char *s)
 	d = fz_clampd(d, -FLT_MAX, FLT_MAX);
 	return (float)d;
 }
+
+fz_off_t fz_atoo(const char *s)
+{
+	fz_off_t v = 0;
+	int neg = 0;
+
+	while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n' || *s == '\f')
+		s++;
+	if (*s == '-')
+		neg = 1, s++;
+	else if (*s == '+')
+		s++;
+	while (*s >= '0' && *s <= '9')
+		v = v * 10 + (*s++ - '0');
+	return neg ? -v : v;
+}
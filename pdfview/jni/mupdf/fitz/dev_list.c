@@ -52,6 +52,7 @@ struct fz_display_list_s
 {
 	fz_display_node *first;
 	fz_display_node *last;
+	int len;
 
 	int top;
 	struct {
@@ -59,18 +60,41 @@ struct fz_display_list_s
 		fz_rect rect;
 	} stack[STACK_SIZE];
 	int tiled;
+	int slow; /* number of image and shading nodes */
 };
 
 enum { ISOLATED = 1, KNOCKOUT = 2 };
 
+/* Copies of paths and text kept in the list are accounted to it */
+static fz_path *
+list_clone_path(fz_context *ctx, fz_path *path)
+{
+	int category = fz_set_alloc_category(ctx, FZ_ALLOC_DISPLAY_LIST);
+	path = fz_clone_path(ctx, path);
+	fz_set_alloc_category(ctx, category);
+	return path;
+}
+
+static fz_text *
+list_clone_text(fz_context *ctx, fz_text *text)
+{
+	int category = fz_set_alloc_category(ctx, FZ_ALLOC_DISPLAY_LIST);
+	text = fz_clone_text(ctx, text);
+	fz_set_alloc_category(ctx, category);
+	return text;
+}
+
 static fz_display_node *
 fz_new_display_node(fz_context *ctx, fz_display_command cmd, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
 	fz_display_node *node;
 	int i;
+	int category;
 
+	category = fz_set_alloc_category(ctx, FZ_ALLOC_DISPLAY_LIST);
 	node = fz_malloc_struct(ctx, fz_display_node);
+	fz_set_alloc_category(ctx, category);
 	node->cmd = cmd;
 	node->next = NULL;
 	node->rect = fz_empty_rect;
@@ -99,6 +123,10 @@ fz_new_display_node(fz_context *ctx, fz_display_command cmd, fz_matrix ctm,
 static void
 fz_append_display_node(fz_display_list *list, fz_display_node *node)
 {
+	if (node->cmd == FZ_CMD_FILL_SHADE || node->cmd == FZ_CMD_FILL_IMAGE ||
+		node->cmd == FZ_CMD_FILL_IMAGE_MASK || node->cmd == FZ_CMD_CLIP_IMAGE_MASK)
+		list->slow++;
+
 	switch (node->cmd)
 	{
 	case FZ_CMD_CLIP_PATH:
@@ -173,6 +201,7 @@ fz_append_display_node(fz_display_list *list, fz_display_node *node)
 		list->last->next = node;
 		list->last = node;
 	}
+	list->len++;
 }
 
 static void
@@ -227,7 +256,7 @@ fz_list_fill_path(fz_device *dev, fz_path *path, int even_odd, fz_matrix ctm,
 	fz_try(ctx)
 	{
 		node->rect = fz_bound_path(dev->ctx, path, NULL, ctm);
-		node->item.path = fz_clone_path(dev->ctx, path);
+		node->item.path = list_clone_path(dev->ctx, path);
 		node->flag = even_odd;
 	}
 	fz_catch(ctx)
@@ -248,7 +277,7 @@ fz_list_stroke_path(fz_device *dev, fz_path *path, fz_stroke_state *stroke, fz_m
 	fz_try(ctx)
 	{
 		node->rect = fz_bound_path(dev->ctx, path, stroke, ctm);
-		node->item.path = fz_clone_path(dev->ctx, path);
+		node->item.path = list_clone_path(dev->ctx, path);
 		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
 	}
 	fz_catch(ctx)
@@ -270,7 +299,7 @@ fz_list_clip_path(fz_device *dev, fz_path *path, fz_rect *rect, int even_odd, fz
 		node->rect = fz_bound_path(dev->ctx, path, NULL, ctm);
 		if (rect)
 			node->rect = fz_intersect_rect(node->rect, *rect);
-		node->item.path = fz_clone_path(dev->ctx, path);
+		node->item.path = list_clone_path(dev->ctx, path);
 		node->flag = even_odd;
 	}
 	fz_catch(ctx)
@@ -292,7 +321,7 @@ fz_list_clip_stroke_path(fz_device *dev, fz_path *path, fz_rect *rect, fz_stroke
 		node->rect = fz_bound_path(dev->ctx, path, stroke, ctm);
 		if (rect)
 			node->rect = fz_intersect_rect(node->rect, *rect);
-		node->item.path = fz_clone_path(dev->ctx, path);
+		node->item.path = list_clone_path(dev->ctx, path);
 		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
 	}
 	fz_catch(ctx)
@@ -313,7 +342,7 @@ fz_list_fill_text(fz_device *dev, fz_text *text, fz_matrix ctm,
 	fz_try(ctx)
 	{
 		node->rect = fz_bound_text(dev->ctx, text, ctm);
-		node->item.text = fz_clone_text(dev->ctx, text);
+		node->item.text = list_clone_text(dev->ctx, text);
 	}
 	fz_catch(ctx)
 	{
@@ -335,7 +364,7 @@ fz_list_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, fz_m
 	{
 		node->rect = fz_bound_text(dev->ctx, text, ctm);
 		fz_adjust_rect_for_stroke(&node->rect, stroke, &ctm);
-		node->item.text = fz_clone_text(dev->ctx, text);
+		node->item.text = list_clone_text(dev->ctx, text);
 		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
 	}
 	fz_catch(ctx)
@@ -355,7 +384,7 @@ fz_list_clip_text(fz_device *dev, fz_text *text, fz_matrix ctm, int accumulate)
 	fz_try(ctx)
 	{
 		node->rect = fz_bound_text(dev->ctx, text, ctm);
-		node->item.text = fz_clone_text(dev->ctx, text);
+		node->item.text = list_clone_text(dev->ctx, text);
 		node->flag = accumulate;
 		/* when accumulating, be conservative about culling */
 		if (accumulate)
@@ -379,7 +408,7 @@ fz_list_clip_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke,
 	{
 		node->rect = fz_bound_text(dev->ctx, text, ctm);
 		fz_adjust_rect_for_stroke(&node->rect, stroke, &ctm);
-		node->item.text = fz_clone_text(dev->ctx, text);
+		node->item.text = list_clone_text(dev->ctx, text);
 		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
 	}
 	fz_catch(ctx)
@@ -399,7 +428,7 @@ fz_list_ignore_text(fz_device *dev, fz_text *text, fz_matrix ctm)
 	fz_try(ctx)
 	{
 		node->rect = fz_bound_text(dev->ctx, text, ctm);
-		node->item.text = fz_clone_text(dev->ctx, text);
+		node->item.text = list_clone_text(dev->ctx, text);
 	}
 	fz_catch(ctx)
 	{
@@ -562,11 +591,19 @@ fz_new_display_list(fz_context *ctx)
 	fz_display_list *list = fz_malloc_struct(ctx, fz_display_list);
 	list->first = NULL;
 	list->last = NULL;
+	list->len = 0;
 	list->top = 0;
 	list->tiled = 0;
+	list->slow = 0;
 	return list;
 }
 
+int
+fz_count_slow_display_nodes(fz_display_list *list)
+{
+	return list->slow;
+}
+
 void
 fz_free_display_list(fz_context *ctx, fz_display_list *list)
 {
@@ -599,7 +636,7 @@ fz_run_display_list(fz_display_list *list, fz_device *dev, fz_matrix top_ctm, fz
 
 	if (cookie)
 	{
-		cookie->progress_max = list->last - list->first;
+		cookie->progress_max = list->len;
 		cookie->progress = 0;
 	}
 
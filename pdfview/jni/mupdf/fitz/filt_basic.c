@@ -14,7 +14,7 @@ struct null_filter
 {
 	fz_stream *chain;
 	int remain;
-	int pos;
+	fz_off_t pos;
 };
 
 static int
@@ -41,7 +41,7 @@ close_null(fz_context *ctx, void *state_)
 }
 
 fz_stream *
-fz_open_null(fz_stream *chain, int len, int offset)
+fz_open_null(fz_stream *chain, int len, fz_off_t offset)
 {
 	struct null_filter *state;
 	fz_context *ctx = chain->ctx;
@@ -206,7 +206,11 @@ close_dctd(fz_context *ctx, void *state_)
 		goto skip;
 	}
 
-	if (state->init)
+	/* Readers that only want the top of the image stop early, and
+	 * finishing would only complain about the missing lines. */
+	if (state->init && state->cinfo.output_scanline < state->cinfo.output_height)
+		jpeg_abort_decompress(&state->cinfo);
+	else if (state->init)
 		jpeg_finish_decompress(&state->cinfo);
 
 skip:
@@ -175,34 +175,83 @@ static inline int getbit(const unsigned char *buf, int x)
 	return ( buf[x >> 3] >> ( 7 - (x & 7) ) ) & 1;
 }
 
+/* number of leading zero bits in a byte */
+static const unsigned char clz8[256] = {
+	8,7,6,6,5,5,5,5,4,4,4,4,4,4,4,4,
+	3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+	2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+	2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+static const unsigned char lm[8] = {
+	0xFF, 0x7F, 0x3F, 0x1F, 0x0F, 0x07, 0x03, 0x01
+};
+
+static const unsigned char rm[8] = {
+	0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE
+};
+
+/*
+ * Find the first pixel after x whose color differs from the pixel at x
+ * (or from white, when x is -1). The run is skipped a byte at a time,
+ * and a word at a time once aligned, by comparing against the run color;
+ * the first differing bit is then found with a table lookup.
+ */
 static int
 find_changing(const unsigned char *line, int x, int w)
 {
-	int a, b;
+	int i, last, skip, t;
 
 	if (!line)
 		return w;
 
 	if (x == -1)
 	{
-		a = 0;
+		skip = 0;
 		x = 0;
 	}
 	else
 	{
-		a = getbit(line, x);
+		skip = getbit(line, x) ? 0xFF : 0;
 		x++;
 	}
 
-	while (x < w)
+	if (x >= w)
+		return x;
+
+	last = (w - 1) >> 3;
+	i = x >> 3;
+	t = (line[i] ^ skip) & lm[x & 7];
+
+	while (!t)
 	{
-		b = getbit(line, x);
-		if (a != b)
-			break;
-		x++;
+		if (++i > last)
+			return w;
+
+		if ((i & (sizeof(unsigned int) - 1)) == 0)
+		{
+			unsigned int word = skip ? ~0U : 0;
+			while (i + (int)sizeof(unsigned int) <= last && *(const unsigned int *)(line + i) == word)
+				i += sizeof(unsigned int);
+		}
+
+		t = line[i] ^ skip;
 	}
 
-	return x;
+	x = (i << 3) + clz8[t];
+	return x < w ? x : w;
 }
 
 static int
@@ -219,17 +268,9 @@ find_changing_color(const unsigned char *line, int x, int w, int color)
 	return x;
 }
 
-static const unsigned char lm[8] = {
-	0xFF, 0x7F, 0x3F, 0x1F, 0x0F, 0x07, 0x03, 0x01
-};
-
-static const unsigned char rm[8] = {
-	0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE
-};
-
 static inline void setbits(unsigned char *line, int x0, int x1)
 {
-	int a0, a1, b0, b1, a;
+	int a0, a1, b0, b1;
 
 	a0 = x0 >> 3;
 	a1 = x1 >> 3;
@@ -245,8 +286,8 @@ static inline void setbits(unsigned char *line, int x0, int x1)
 	else
 	{
 		line[a0] |= lm[b0];
-		for (a = a0 + 1; a < a1; a++)
-			line[a] = 0xFF;
+		if (a1 - a0 > 1)
+			memset(line + a0 + 1, 0xFF, a1 - a0 - 1);
 		if (b1)
 			line[a1] |= rm[b1];
 	}
@@ -428,55 +469,10 @@ dec2d(fz_context *ctx, fz_faxd *fax)
 		fax->a = b2;
 		break;
 
-	case V0:
-		b1 = find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VR1:
-		b1 = 1 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 >= fax->columns) b1 = fax->columns;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VR2:
-		b1 = 2 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 >= fax->columns) b1 = fax->columns;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VR3:
-		b1 = 3 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
+	case VR3: case VR2: case VR1: case V0: case VL1: case VL2: case VL3:
+		/* VR3..VL3 are numbered so that V0 - code is the offset from b1 */
+		b1 = find_changing_color(fax->ref, fax->a, fax->columns, !fax->c) + V0 - code;
 		if (b1 >= fax->columns) b1 = fax->columns;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VL1:
-		b1 = -1 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 < 0) b1 = 0;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VL2:
-		b1 = -2 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 < 0) b1 = 0;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VL3:
-		b1 = -3 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
 		if (b1 < 0) b1 = 0;
 		if (fax->c) setbits(fax->dst, fax->a, b1);
 		fax->a = b1;
@@ -501,6 +497,7 @@ read_faxd(fz_stream *stm, unsigned char *buf, int len)
 	unsigned char *p = buf;
 	unsigned char *ep = buf + len;
 	unsigned char *tmp;
+	int i, n;
 
 	if (fax->stage == STATE_DONE)
 		return 0;
@@ -580,16 +577,16 @@ loop:
 eol:
 	fax->stage = STATE_EOL;
 
+	n = fz_mini(fax->wp - fax->rp, ep - p);
 	if (fax->black_is_1)
-	{
-		while (fax->rp < fax->wp && p < ep)
-			*p++ = *fax->rp++;
-	}
+		memcpy(p, fax->rp, n);
 	else
 	{
-		while (fax->rp < fax->wp && p < ep)
-			*p++ = *fax->rp++ ^ 0xff;
+		for (i = 0; i < n; i++)
+			p[i] = fax->rp[i] ^ 0xff;
 	}
+	fax->rp += n;
+	p += n;
 
 	if (fax->rp < fax->wp)
 		return p - buf;
@@ -1,11 +1,19 @@
 #include "fitz-internal.h"
 
-/* TODO: check if this works with 16bpp images */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef ARCH_ARM_NEON
+#include <cpu-features.h>
+#endif
 
 enum { MAXC = 32 };
 
 typedef struct fz_predict_s fz_predict;
 
+typedef void (predict_fn)(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp);
+
 struct fz_predict_s
 {
 	fz_stream *chain;
@@ -21,6 +29,8 @@ struct fz_predict_s
 	unsigned char *out;
 	unsigned char *ref;
 	unsigned char *rp, *wp;
+
+	predict_fn *up, *sub, *avg, *paeth, *tiff;
 };
 
 static inline int getcomponent(unsigned char *line, int x, int bpc)
@@ -58,6 +68,306 @@ static inline int paeth(int a, int b, int c)
 	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
 }
 
+/*
+ * Row kernels. PNG predictors work on bytes, with bpp being the distance
+ * to the corresponding byte of the pixel to the left; TIFF predictor 2
+ * with 8 bits per component is the same operation as PNG Sub. Kernels
+ * are picked once per stream in fz_open_predict, from the pixel size;
+ * on armeabi-v7a CPUs with NEON, those of filt_predict_neon.c are used.
+ */
+
+static void
+predict_up(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(ref + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(x, b));
+	}
+#endif
+	for (; i < len; i++)
+		out[i] = in[i] + ref[i];
+}
+
+/* Scalar kernels, also used for the tails the vector kernels leave. */
+
+static void
+predict_sub_from(unsigned char *out, const unsigned char *in, int i, int len, int bpp)
+{
+	for (; i < bpp && i < len; i++)
+		out[i] = in[i];
+	for (; i < len; i++)
+		out[i] = in[i] + out[i - bpp];
+}
+
+static void
+predict_avg_from(unsigned char *out, const unsigned char *in, const unsigned char *ref, int i, int len, int bpp)
+{
+	for (; i < bpp && i < len; i++)
+		out[i] = in[i] + (ref[i] >> 1);
+	for (; i < len; i++)
+		out[i] = in[i] + ((out[i - bpp] + ref[i]) >> 1);
+}
+
+static void
+predict_paeth_from(unsigned char *out, const unsigned char *in, const unsigned char *ref, int i, int len, int bpp)
+{
+	for (; i < bpp && i < len; i++)
+		out[i] = in[i] + ref[i];
+	for (; i < len; i++)
+		out[i] = in[i] + paeth(out[i - bpp], ref[i], ref[i - bpp]);
+}
+
+static void
+predict_sub(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	switch (bpp)
+	{
+	case 1: predict_sub_from(out, in, 0, len, 1); break;
+	case 2: predict_sub_from(out, in, 0, len, 2); break;
+	default: predict_sub_from(out, in, 0, len, bpp); break;
+	}
+}
+
+static void
+predict_avg(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	switch (bpp)
+	{
+	case 1: predict_avg_from(out, in, ref, 0, len, 1); break;
+	case 2: predict_avg_from(out, in, ref, 0, len, 2); break;
+	default: predict_avg_from(out, in, ref, 0, len, bpp); break;
+	}
+}
+
+static void
+predict_paeth(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	switch (bpp)
+	{
+	case 1: predict_paeth_from(out, in, ref, 0, len, 1); break;
+	case 2: predict_paeth_from(out, in, ref, 0, len, 2); break;
+	default: predict_paeth_from(out, in, ref, 0, len, bpp); break;
+	}
+}
+
+/* 16 bits per component, big endian, so the carry crosses byte pairs. */
+static void
+predict_tiff16(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	int i;
+	for (i = 0; i + 1 < len && i < bpp; i += 2)
+	{
+		out[i] = in[i];
+		out[i + 1] = in[i + 1];
+	}
+	for (; i + 1 < len; i += 2)
+	{
+		int v = (in[i] << 8) + in[i + 1] + (out[i - bpp] << 8) + out[i - bpp + 1];
+		out[i] = v >> 8;
+		out[i + 1] = v;
+	}
+}
+
+#ifdef __SSE2__
+
+/*
+ * The left-dependent predictors are serial in pixels, so the vector
+ * kernels handle one whole pixel (3, 4, 6 or 8 bytes) per step. Loads
+ * and stores move exactly bpp bytes; with a constant bpp they compile
+ * down to one or two moves.
+ */
+
+static inline unsigned int
+load_bytes(const unsigned char *p, int n)
+{
+	unsigned int v;
+	unsigned short h;
+	switch (n)
+	{
+	case 2: memcpy(&h, p, 2); return h;
+	case 3: memcpy(&h, p, 2); return h | (p[2] << 16);
+	default: memcpy(&v, p, 4); return v;
+	}
+}
+
+static inline void
+store_bytes(unsigned char *p, unsigned int v, int n)
+{
+	unsigned short h = v;
+	switch (n)
+	{
+	case 2: memcpy(p, &h, 2); break;
+	case 3: memcpy(p, &h, 2); p[2] = v >> 16; break;
+	default: memcpy(p, &v, 4); break;
+	}
+}
+
+static inline __m128i
+load_pixel(const unsigned char *p, int bpp)
+{
+	__m128i lo = _mm_cvtsi32_si128(load_bytes(p, bpp < 4 ? bpp : 4));
+	if (bpp <= 4)
+		return lo;
+	return _mm_unpacklo_epi32(lo, _mm_cvtsi32_si128(load_bytes(p + 4, bpp - 4)));
+}
+
+static inline void
+store_pixel(unsigned char *p, __m128i v, int bpp)
+{
+	store_bytes(p, _mm_cvtsi128_si32(v), bpp < 4 ? bpp : 4);
+	if (bpp > 4)
+		store_bytes(p + 4, _mm_cvtsi128_si32(_mm_srli_si128(v, 4)), bpp - 4);
+}
+
+static inline void
+predict_sub_sse2(unsigned char *out, const unsigned char *in, int len, int bpp)
+{
+	__m128i a = _mm_setzero_si128();
+	int i;
+	for (i = 0; i + bpp <= len; i += bpp)
+	{
+		a = _mm_add_epi8(load_pixel(in + i, bpp), a);
+		store_pixel(out + i, a, bpp);
+	}
+	predict_sub_from(out, in, i, len, bpp);
+}
+
+static inline void
+predict_avg_sse2(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	int i;
+	for (i = 0; i + bpp <= len; i += bpp)
+	{
+		__m128i b = load_pixel(ref + i, bpp);
+		/* pavgb rounds up; subtract the dropped low bit to truncate */
+		__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(load_pixel(in + i, bpp), avg);
+		store_pixel(out + i, a, bpp);
+	}
+	predict_avg_from(out, in, ref, i, len, bpp);
+}
+
+static inline __m128i
+abs_epi16(__m128i x)
+{
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i
+select_epi16(__m128i mask, __m128i t, __m128i f)
+{
+	return _mm_or_si128(_mm_and_si128(mask, t), _mm_andnot_si128(mask, f));
+}
+
+static inline void
+predict_paeth_sse2(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, c = zero;
+	int i;
+	for (i = 0; i + bpp <= len; i += bpp)
+	{
+		__m128i b = _mm_unpacklo_epi8(load_pixel(ref + i, bpp), zero);
+		__m128i pa = _mm_sub_epi16(b, c);
+		__m128i pb = _mm_sub_epi16(a, c);
+		__m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+		__m128i min, pred, x;
+		pa = abs_epi16(pa);
+		pb = abs_epi16(pb);
+		min = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+		pred = select_epi16(_mm_cmpeq_epi16(min, pa), a,
+			select_epi16(_mm_cmpeq_epi16(min, pb), b, c));
+		x = _mm_add_epi8(load_pixel(in + i, bpp), _mm_packus_epi16(pred, pred));
+		store_pixel(out + i, x, bpp);
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
+	}
+	predict_paeth_from(out, in, ref, i, len, bpp);
+}
+
+static inline __m128i
+swap_epi16(__m128i x)
+{
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static inline void
+predict_tiff16_sse2(unsigned char *out, const unsigned char *in, int len, int bpp)
+{
+	__m128i a = _mm_setzero_si128();
+	int i;
+	for (i = 0; i + bpp <= len; i += bpp)
+	{
+		a = _mm_add_epi16(swap_epi16(load_pixel(in + i, bpp)), a);
+		store_pixel(out + i, swap_epi16(a), bpp);
+	}
+}
+
+#define PIXEL_KERNELS(N) \
+static void predict_sub_##N(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp) \
+	{ predict_sub_sse2(out, in, len, N); } \
+static void predict_avg_##N(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp) \
+	{ predict_avg_sse2(out, in, ref, len, N); } \
+static void predict_paeth_##N(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp) \
+	{ predict_paeth_sse2(out, in, ref, len, N); }
+
+PIXEL_KERNELS(3)
+PIXEL_KERNELS(4)
+PIXEL_KERNELS(6)
+PIXEL_KERNELS(8)
+
+static void predict_tiff16_6(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+	{ predict_tiff16_sse2(out, in, len, 6); }
+static void predict_tiff16_8(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+	{ predict_tiff16_sse2(out, in, len, 8); }
+
+#endif
+
+#ifdef ARCH_ARM_NEON
+
+static void
+predict_up_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	int i;
+	for (i = fz_predict_up_neon(out, in, ref, len); i < len; i++)
+		out[i] = in[i] + ref[i];
+}
+
+static void
+predict_sub_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	predict_sub_from(out, in, fz_predict_sub_neon(out, in, len, bpp), len, bpp);
+}
+
+static void
+predict_avg_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	predict_avg_from(out, in, ref, fz_predict_avg_neon(out, in, ref, len, bpp), len, bpp);
+}
+
+static void
+predict_paeth_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	predict_paeth_from(out, in, ref, fz_predict_paeth_neon(out, in, ref, len, bpp), len, bpp);
+}
+
+/* Not every armeabi-v7a CPU has NEON (Tegra 2 hasn't); cpufeatures
+ * probes the CPU on first call only */
+static int
+have_neon(void)
+{
+	return android_getCpuFamily() == ANDROID_CPU_FAMILY_ARM &&
+		(android_getCpuFeatures() & ANDROID_CPU_ARM_FEATURE_NEON);
+}
+
+#endif
+
 static void
 fz_predict_tiff(fz_predict *state, unsigned char *out, unsigned char *in, int len)
 {
@@ -65,6 +375,12 @@ fz_predict_tiff(fz_predict *state, unsigned char *out, unsigned char *in, int le
 	int i, k;
 	const int mask = (1 << state->bpc)-1;
 
+	if (state->tiff)
+	{
+		state->tiff(out, in, NULL, state->stride, state->bpp);
+		return;
+	}
+
 	for (k = 0; k < state->colors; k++)
 		left[k] = 0;
 	memset(out, 0, state->stride);
@@ -85,8 +401,6 @@ fz_predict_tiff(fz_predict *state, unsigned char *out, unsigned char *in, int le
 static void
 fz_predict_png(fz_predict *state, unsigned char *out, unsigned char *in, int len, int predictor)
 {
-	int bpp = state->bpp;
-	int i;
 	unsigned char *ref = state->ref;
 
 	switch (predictor)
@@ -95,50 +409,84 @@ fz_predict_png(fz_predict *state, unsigned char *out, unsigned char *in, int len
 		memcpy(out, in, len);
 		break;
 	case 1:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++;
-		}
-		for (i = len - bpp; i > 0; i--)
-		{
-			*out = *in++ + out[-bpp];
-			out++;
-		}
+		state->sub(out, in, ref, len, state->bpp);
 		break;
 	case 2:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++ + *ref++;
-		}
-		for (i = len - bpp; i > 0; i--)
-		{
-			*out++ = *in++ + *ref++;
-		}
+		state->up(out, in, ref, len, state->bpp);
 		break;
 	case 3:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++ + (*ref++) / 2;
-		}
-		for (i = len - bpp; i > 0; i--)
-		{
-			*out = *in++ + (out[-bpp] + *ref++) / 2;
-			out++;
-		}
+		state->avg(out, in, ref, len, state->bpp);
 		break;
 	case 4:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++ + paeth(0, *ref++, 0);
-		}
-		for (i = len - bpp; i > 0; i --)
+		state->paeth(out, in, ref, len, state->bpp);
+		break;
+	default:
+		/* unknown filter type: repeat the previous row */
+		memcpy(out, ref, len);
+		break;
+	}
+}
+
+static void
+select_kernels(fz_predict *state)
+{
+	state->up = predict_up;
+	state->sub = predict_sub;
+	state->avg = predict_avg;
+	state->paeth = predict_paeth;
+	state->tiff = NULL;
+
+	if (state->bpc == 8)
+		state->tiff = predict_sub;
+	else if (state->bpc == 16)
+		state->tiff = predict_tiff16;
+
+#ifdef __SSE2__
+	switch (state->bpp)
+	{
+	case 3:
+		state->sub = predict_sub_3;
+		state->avg = predict_avg_3;
+		state->paeth = predict_paeth_3;
+		break;
+	case 4:
+		state->sub = predict_sub_4;
+		state->avg = predict_avg_4;
+		state->paeth = predict_paeth_4;
+		break;
+	case 6:
+		state->sub = predict_sub_6;
+		state->avg = predict_avg_6;
+		state->paeth = predict_paeth_6;
+		break;
+	case 8:
+		state->sub = predict_sub_8;
+		state->avg = predict_avg_8;
+		state->paeth = predict_paeth_8;
+		break;
+	}
+	if (state->bpc == 8)
+		state->tiff = state->sub;
+	else if (state->bpc == 16 && state->bpp == 6)
+		state->tiff = predict_tiff16_6;
+	else if (state->bpc == 16 && state->bpp == 8)
+		state->tiff = predict_tiff16_8;
+#endif
+
+#ifdef ARCH_ARM_NEON
+	if (have_neon())
+	{
+		state->up = predict_up_neon;
+		if (state->bpp == 3 || state->bpp == 4 || state->bpp == 6 || state->bpp == 8)
 		{
-			*out = *in++ + paeth(out[-bpp], *ref, ref[-bpp]);
-			ref++;
-			out++;
+			state->sub = predict_sub_neon;
+			state->avg = predict_avg_neon;
+			state->paeth = predict_paeth_neon;
+			if (state->bpc == 8)
+				state->tiff = state->sub;
 		}
-		break;
 	}
+#endif
 }
 
 static int
@@ -150,30 +498,39 @@ read_predict(fz_stream *stm, unsigned char *buf, int len)
 	int ispng = state->predictor >= 10;
 	int n;
 
-	while (state->rp < state->wp && p < ep)
-		*p++ = *state->rp++;
-
 	while (p < ep)
 	{
-		n = fz_read(state->chain, state->in, state->stride + ispng);
-		if (n == 0)
-			return p - buf;
-
-		if (state->predictor == 1)
-			memcpy(state->out, state->in, n);
-		else if (state->predictor == 2)
-			fz_predict_tiff(state, state->out, state->in, n);
-		else
+		if (state->rp == state->wp)
 		{
-			fz_predict_png(state, state->out, state->in + 1, n - 1, state->in[0]);
-			memcpy(state->ref, state->out, state->stride);
-		}
+			n = fz_read(state->chain, state->in, state->stride + ispng);
+			if (n == 0)
+				break;
 
-		state->rp = state->out;
-		state->wp = state->out + n - ispng;
+			if (state->predictor == 1)
+				memcpy(state->out, state->in, n);
+			else if (state->predictor == 2)
+				fz_predict_tiff(state, state->out, state->in, n);
+			else
+			{
+				unsigned char *tmp;
+				fz_predict_png(state, state->out, state->in + 1, n - 1, state->in[0]);
+				/* this row is the next row's reference; the old one is scratch */
+				tmp = state->ref;
+				state->ref = state->out;
+				state->out = tmp;
+				state->rp = state->ref;
+				state->wp = state->ref + n - 1;
+				continue;
+			}
 
-		while (state->rp < state->wp && p < ep)
-			*p++ = *state->rp++;
+			state->rp = state->out;
+			state->wp = state->out + n;
+		}
+
+		n = fz_mini(state->wp - state->rp, ep - p);
+		memcpy(p, state->rp, n);
+		state->rp += n;
+		p += n;
 	}
 
 	return p - buf;
@@ -230,6 +587,8 @@ fz_open_predict(fz_stream *chain, int predictor, int columns, int colors, int bp
 		state->wp = state->out;
 
 		memset(state->ref, 0, state->stride);
+
+		select_kernels(state);
 	}
 	fz_catch(ctx)
 	{
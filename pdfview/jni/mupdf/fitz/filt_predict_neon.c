@@ -0,0 +1,129 @@
+#include "fitz-internal.h"
+
+#include <arm_neon.h>
+
+/*
+ * NEON row kernels for the predictor filter. This file is built with
+ * NEON enabled (see Android.mk), the rest of fitz is not; filt_predict.c
+ * only picks these kernels when android_getCpuFeatures reports NEON.
+ *
+ * Kernels return the number of bytes done; the caller finishes the row
+ * with its scalar kernels. The left-dependent predictors are serial in
+ * pixels, so they handle one whole pixel (3, 4, 6 or 8 bytes) per step,
+ * in the low lanes of a 64 bit vector.
+ */
+
+static inline uint8x8_t
+load_pixel(const unsigned char *p, int bpp)
+{
+	uint64_t v = 0;
+	memcpy(&v, p, bpp);
+	return vreinterpret_u8_u64(vcreate_u64(v));
+}
+
+static inline void
+store_pixel(unsigned char *p, uint8x8_t v, int bpp)
+{
+	uint64_t u = vget_lane_u64(vreinterpret_u64_u8(v), 0);
+	memcpy(p, &u, bpp);
+}
+
+static inline int
+predict_sub_pixels(unsigned char *out, const unsigned char *in, int len, int bpp)
+{
+	uint8x8_t a = vdup_n_u8(0);
+	int i;
+	for (i = 0; i + bpp <= len; i += bpp)
+	{
+		a = vadd_u8(load_pixel(in + i, bpp), a);
+		store_pixel(out + i, a, bpp);
+	}
+	return i;
+}
+
+static inline int
+predict_avg_pixels(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	uint8x8_t a = vdup_n_u8(0);
+	int i;
+	for (i = 0; i + bpp <= len; i += bpp)
+	{
+		/* vhadd truncates, as the PNG average does */
+		a = vadd_u8(load_pixel(in + i, bpp), vhadd_u8(a, load_pixel(ref + i, bpp)));
+		store_pixel(out + i, a, bpp);
+	}
+	return i;
+}
+
+static inline int
+predict_paeth_pixels(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0);
+	int i;
+	for (i = 0; i + bpp <= len; i += bpp)
+	{
+		uint8x8_t b = load_pixel(ref + i, bpp);
+		int16x8_t ac = vreinterpretq_s16_u16(vsubl_u8(b, c));
+		int16x8_t bc = vreinterpretq_s16_u16(vsubl_u8(a, c));
+		uint16x8_t pa = vreinterpretq_u16_s16(vabsq_s16(ac));
+		uint16x8_t pb = vreinterpretq_u16_s16(vabsq_s16(bc));
+		uint16x8_t pc = vreinterpretq_u16_s16(vabsq_s16(vaddq_s16(ac, bc)));
+		uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+		uint8x8_t use_b = vmovn_u16(vcleq_u16(pb, pc));
+		uint8x8_t pred = vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+		a = vadd_u8(load_pixel(in + i, bpp), pred);
+		store_pixel(out + i, a, bpp);
+		c = b;
+	}
+	return i;
+}
+
+int
+fz_predict_up_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len)
+{
+	int i;
+	for (i = 0; i + 16 <= len; i += 16)
+		vst1q_u8(out + i, vaddq_u8(vld1q_u8(in + i), vld1q_u8(ref + i)));
+	return i;
+}
+
+/* Constant bpp lets the pixel loads and stores compile to single moves */
+
+int
+fz_predict_sub_neon(unsigned char *out, const unsigned char *in, int len, int bpp)
+{
+	switch (bpp)
+	{
+	case 3: return predict_sub_pixels(out, in, len, 3);
+	case 4: return predict_sub_pixels(out, in, len, 4);
+	case 6: return predict_sub_pixels(out, in, len, 6);
+	case 8: return predict_sub_pixels(out, in, len, 8);
+	}
+	return 0;
+}
+
+int
+fz_predict_avg_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	switch (bpp)
+	{
+	case 3: return predict_avg_pixels(out, in, ref, len, 3);
+	case 4: return predict_avg_pixels(out, in, ref, len, 4);
+	case 6: return predict_avg_pixels(out, in, ref, len, 6);
+	case 8: return predict_avg_pixels(out, in, ref, len, 8);
+	}
+	return 0;
+}
+
+int
+fz_predict_paeth_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp)
+{
+	switch (bpp)
+	{
+	case 3: return predict_paeth_pixels(out, in, ref, len, 3);
+	case 4: return predict_paeth_pixels(out, in, ref, len, 4);
+	case 6: return predict_paeth_pixels(out, in, ref, len, 6);
+	case 8: return predict_paeth_pixels(out, in, ref, len, 8);
+	}
+	return 0;
+}
@@ -71,6 +71,111 @@ fz_unlock(fz_context *ctx, int lock)
 	ctx->locks->unlock(ctx->locks->user, lock);
 }
 
+/*
+	Reference counts of objects shared between threads (storables,
+	fonts, buffers, stroke states) are changed with fz_keep_refs and
+	fz_drop_refs. Where the compiler has atomic builtins these don't
+	take any lock; build with FZ_LOCKED_REFS defined to protect the
+	counts with FZ_LOCK_ALLOC instead.
+
+	Negative counts mark static objects and are never changed.
+*/
+#if !defined(FZ_LOCKED_REFS) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define FZ_ATOMIC_REFS
+#endif
+
+/*
+	fz_keep_refs: Take a new reference. The caller must already hold
+	one (or hold the lock that guards finding the object), so the
+	count can't drop to zero meanwhile.
+*/
+static inline void
+fz_keep_refs(fz_context *ctx, int *refs)
+{
+#ifdef FZ_ATOMIC_REFS
+	if (*refs > 0)
+		__sync_add_and_fetch(refs, 1);
+#else
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (*refs > 0)
+		++*refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
+}
+
+/*
+	fz_drop_refs: Drop a reference. Returns non zero if it was the
+	last one, and the caller must free the object.
+*/
+static inline int
+fz_drop_refs(fz_context *ctx, int *refs)
+{
+#ifdef FZ_ATOMIC_REFS
+	if (*refs <= 0)
+		return 0;
+	return __sync_sub_and_fetch(refs, 1) == 0;
+#else
+	int drop = 0;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (*refs > 0)
+		drop = (--*refs == 0);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return drop;
+#endif
+}
+
+/*
+ * Arena allocator.
+ *
+ * Interpreting a page creates and frees many small short lived objects
+ * (paths, text). While an arena is attached to a context, those are
+ * carved from large chunks by bumping a pointer, and all of them are
+ * released at once by fz_reset_arena. fz_free and fz_resize_array
+ * recognise blocks of the attached arena: freeing the most recent block
+ * gives its space back, freeing any other is a no-op until reset.
+ *
+ * Blocks must not outlive the page: anything kept longer (display list
+ * nodes, stored resources) is copied to the heap, as fz_clone_path and
+ * fz_clone_text do. Large blocks, and blocks resized after other
+ * allocations, move to the heap by themselves.
+ */
+
+/*
+	fz_new_arena: Create an arena taking memory from the heap in chunks
+	of chunk_size bytes. Blocks over a quarter of that are always taken
+	from the heap.
+*/
+fz_arena *fz_new_arena(fz_context *ctx, unsigned int chunk_size);
+
+/*
+	fz_free_arena: Free an arena and everything allocated from it. It
+	must not be attached to any context.
+*/
+void fz_free_arena(fz_context *ctx, fz_arena *arena);
+
+/*
+	fz_reset_arena: Release everything allocated from an arena at once,
+	keeping one chunk for reuse.
+*/
+void fz_reset_arena(fz_context *ctx, fz_arena *arena);
+
+/*
+	fz_attach_arena: Make transient allocations in ctx come from arena
+	(or from the heap if arena is NULL). An arena may be attached to one
+	context at a time, and must stay attached until all blocks taken
+	from it are freed or it is reset.
+
+	Returns the previously attached arena.
+*/
+fz_arena *fz_attach_arena(fz_context *ctx, fz_arena *arena);
+
+/*
+	fz_malloc_transient: Allocate a block that will be freed before the
+	current page run ends, from the attached arena if there is one.
+	Throws exception on failure to allocate.
+*/
+void *fz_malloc_transient(fz_context *ctx, unsigned int size);
+
 
 /*
  * Basic runtime and utility functions
@@ -79,6 +184,9 @@ fz_unlock(fz_context *ctx, int lock)
 /* Range checking atof */
 float fz_atof(const char *s);
 
+/* atoi for file offsets; stops at the first non-digit */
+fz_off_t fz_atoo(const char *s);
+
 /*
  * Generic hash-table with fixed-length keys.
  */
@@ -303,13 +411,35 @@ struct fz_store_hash_s
 			void *ptr;
 			int i;
 		} pi;
+		struct
+		{
+			void *ptr;
+			int i;
+			fz_bbox r;
+		} pir;
 	} u;
 };
 
+/*
+	Kinds of items in the store. Each kind can be given its own budget
+	(see fz_set_store_kind_max), so that, for example, decoding one huge
+	image doesn't flush all the fonts, and has its own statistics.
+*/
+enum
+{
+	FZ_STORE_IMAGE = 0, /* images and their decoded tiles */
+	FZ_STORE_FONT, /* fonts and cmaps */
+	FZ_STORE_SHADE,
+	FZ_STORE_FUNCTION,
+	FZ_STORE_OTHER, /* colorspaces, patterns, forms */
+	FZ_STORE_KINDS
+};
+
 typedef struct fz_store_type_s fz_store_type;
 
 struct fz_store_type_s
 {
+	int kind;
 	int (*make_hash_key)(fz_store_hash *, void *);
 	void *(*keep_key)(fz_context *,void *);
 	void (*drop_key)(fz_context *,void *);
@@ -391,6 +521,68 @@ void fz_remove_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store
 */
 void fz_empty_store(fz_context *ctx);
 
+/*
+	fz_set_store_max: Change maximum size of the store. If the store
+	is above the new size, unused items are evicted until it fits.
+
+	max: New maximum size in bytes, or FZ_STORE_UNLIMITED.
+*/
+void fz_set_store_max(fz_context *ctx, unsigned int max);
+
+/*
+	fz_shrink_store: Evict unused items from the store until it is
+	at most the given percentage of its current size.
+
+	Returns non zero if the store was shrunk that far (items that are
+	in use can't be evicted).
+*/
+int fz_shrink_store(fz_context *ctx, unsigned int percent);
+
+/*
+	fz_get_store_usage: Get the current and maximum size of the store,
+	in bytes.
+*/
+void fz_get_store_usage(fz_context *ctx, unsigned int *size, unsigned int *max);
+
+/*
+	fz_set_store_kind_max: Limit the size of items of one kind in the
+	store. Items of that kind are evicted to make room for new ones
+	once they use max bytes, even if the store as a whole is not full.
+	If items of that kind are above the new size, unused ones are
+	evicted until they fit.
+
+	kind: One of FZ_STORE_IMAGE...FZ_STORE_OTHER.
+
+	max: Budget in bytes, or FZ_STORE_UNLIMITED (the default) to
+	only limit the store as a whole.
+*/
+void fz_set_store_kind_max(fz_context *ctx, int kind, unsigned int max);
+
+typedef struct fz_store_stats_s fz_store_stats;
+
+struct fz_store_stats_s
+{
+	unsigned int size; /* bytes used by items of this kind */
+	unsigned int max; /* budget set by fz_set_store_kind_max */
+	unsigned int items;
+	unsigned int hits; /* fz_find_item calls that found an item */
+	unsigned int misses; /* fz_find_item calls that didn't */
+	unsigned int evictions; /* items evicted to make space */
+};
+
+/*
+	fz_get_store_stats: Get size, budget and usage statistics of
+	each kind of item in the store.
+
+	stats: Array of FZ_STORE_KINDS entries, indexed by kind.
+*/
+void fz_get_store_stats(fz_context *ctx, fz_store_stats *stats);
+
+/*
+	fz_print_store_stats: Print store statistics, one line per kind.
+*/
+void fz_print_store_stats(fz_context *ctx, FILE *out);
+
 /*
 	fz_store_scavenge: Internal function used as part of the scavenging
 	allocator; when we fail to allocate memory, before returning a
@@ -401,6 +593,9 @@ void fz_empty_store(fz_context *ctx);
 
 	phase: What phase of the scavenge we are in. Updated on exit.
 
+	Takes the store shard locks, so must be called without any of them
+	or FZ_LOCK_ALLOC held.
+
 	Returns non zero if we managed to free any memory.
 */
 int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase);
@@ -412,6 +607,73 @@ int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase);
 void fz_print_store(fz_context *ctx, FILE *out);
 #endif
 
+/*
+ * Allocation accounting.
+ *
+ * When built with FZ_ALLOC_STATS defined, every block from fz_malloc
+ * and friends carries its size and the category that was current in
+ * its context when it was allocated, and live and peak bytes of each
+ * category are counted under FZ_LOCK_ALLOC (which the allocator takes
+ * anyway). Without it only the categories are tracked, which costs
+ * nothing, and the statistics read as zero.
+ *
+ * A category is current from fz_set_alloc_category until the old one
+ * is put back, or until an exception thrown meanwhile is caught.
+ * Blocks keep their category when resized.
+ */
+enum
+{
+	/* FZ_STORE_IMAGE...FZ_STORE_OTHER: resources loaded for the store */
+	FZ_ALLOC_OBJECT = FZ_STORE_KINDS, /* pdf objects */
+	FZ_ALLOC_DISPLAY_LIST,
+	FZ_ALLOC_GLYPH, /* glyph cache atlases */
+	FZ_ALLOC_SCRATCH, /* everything else */
+	FZ_ALLOC_CATEGORIES
+};
+
+static inline int
+fz_set_alloc_category(fz_context *ctx, int category)
+{
+	int old = ctx->alloc_category;
+	ctx->alloc_category = category;
+	return old;
+}
+
+typedef struct fz_alloc_stats_s fz_alloc_stats;
+
+struct fz_alloc_stats_s
+{
+	unsigned int size; /* bytes allocated and not freed yet */
+	unsigned int peak; /* highest size since start or fz_reset_alloc_peaks */
+	unsigned int blocks;
+};
+
+void fz_new_alloc_stats_context(fz_context *ctx);
+fz_alloc_stats_context *fz_keep_alloc_stats_context(fz_context *ctx);
+void fz_drop_alloc_stats_context(fz_context *ctx);
+
+/*
+	fz_get_alloc_stats: Take a snapshot of allocations of all contexts
+	sharing ctx's allocator.
+
+	stats: Array of FZ_ALLOC_CATEGORIES entries, indexed by category.
+
+	Returns 0 (and zeroed stats) if built without FZ_ALLOC_STATS.
+*/
+int fz_get_alloc_stats(fz_context *ctx, fz_alloc_stats *stats);
+
+/*
+	fz_reset_alloc_peaks: Set peak of each category to its current size,
+	for example to measure peaks of each page separately.
+*/
+void fz_reset_alloc_peaks(fz_context *ctx);
+
+/*
+	fz_print_alloc_stats: Print allocation statistics, one line per
+	category.
+*/
+void fz_print_alloc_stats(fz_context *ctx, FILE *out);
+
 struct fz_buffer_s
 {
 	int refs;
@@ -480,14 +742,14 @@ struct fz_stream_s
 	int refs;
 	int error;
 	int eof;
-	int pos;
+	fz_off_t pos;
 	int avail;
 	int bits;
 	unsigned char *bp, *rp, *wp, *ep;
 	void *state;
 	int (*read)(fz_stream *stm, unsigned char *buf, int len);
 	void (*close)(fz_context *ctx, void *state);
-	void (*seek)(fz_stream *stm, int offset, int whence);
+	void (*seek)(fz_stream *stm, fz_off_t offset, int whence);
 	unsigned char buf[4096];
 };
 
@@ -495,6 +757,19 @@ fz_stream *fz_new_stream(fz_context *ctx, void*, int(*)(fz_stream*, unsigned cha
 fz_stream *fz_keep_stream(fz_stream *stm);
 void fz_fill_buffer(fz_stream *stm);
 
+/*
+	fz_open_reader: Open a reader over the file that stm reads, with its
+	own position and buffer, starting at offset. Readers use positional
+	reads (or share the file's mapping), so reading one never disturbs
+	stm or any other reader, and each may be used on a different thread
+	with its own context. The file stays open until stm and all of its
+	readers are closed.
+
+	Returns NULL if stm is not a file stream, or the platform has no
+	pread; callers must then share stm itself.
+*/
+fz_stream *fz_open_reader(fz_context *ctx, fz_stream *stm, fz_off_t offset);
+
 void fz_read_line(fz_stream *stm, char *buf, int max);
 
 static inline int fz_read_byte(fz_stream *stm)
@@ -581,7 +856,7 @@ static inline int fz_is_eof_bits(fz_stream *stm)
  */
 
 fz_stream *fz_open_copy(fz_stream *chain);
-fz_stream *fz_open_null(fz_stream *chain, int len, int offset);
+fz_stream *fz_open_null(fz_stream *chain, int len, fz_off_t offset);
 fz_stream *fz_open_concat(fz_context *ctx, int max, int pad);
 void fz_concat_push(fz_stream *concat, fz_stream *chain); /* Ownership of chain is passed in */
 fz_stream *fz_open_arc4(fz_stream *chain, unsigned char *key, unsigned keylen);
@@ -599,6 +874,14 @@ fz_stream *fz_open_lzwd(fz_stream *chain, int early_change);
 fz_stream *fz_open_predict(fz_stream *chain, int predictor, int columns, int colors, int bpc);
 fz_stream *fz_open_jbig2d(fz_stream *chain, fz_buffer *global);
 
+#ifdef ARCH_ARM_NEON
+/* Predictor row kernels in filt_predict_neon.c; return bytes done */
+int fz_predict_up_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len);
+int fz_predict_sub_neon(unsigned char *out, const unsigned char *in, int len, int bpp);
+int fz_predict_avg_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp);
+int fz_predict_paeth_neon(unsigned char *out, const unsigned char *in, const unsigned char *ref, int len, int bpp);
+#endif
+
 /*
  * Resources and other graphics related objects.
  */
@@ -671,6 +954,17 @@ void fz_clear_pixmap_rect_with_value(fz_context *ctx, fz_pixmap *pix, int value,
 void fz_copy_pixmap_rect(fz_context *ctx, fz_pixmap *dest, fz_pixmap *src, fz_bbox r);
 void fz_premultiply_pixmap(fz_context *ctx, fz_pixmap *pix);
 fz_pixmap *fz_alpha_from_gray(fz_context *ctx, fz_pixmap *gray, int luminosity);
+
+/*
+	fz_subsample_pixmap: Reduce a pixmap by an integer factor in both
+	directions, averaging each factor x factor block of pixels.
+
+	fz_subsample_band: Reduce the rows of band (at most factor of them,
+	at the full source width) into row y of dst. Images that are too
+	large to unpack whole are subsampled band by band while streaming.
+*/
+fz_pixmap *fz_subsample_pixmap(fz_context *ctx, fz_pixmap *src, int factor);
+void fz_subsample_band(fz_pixmap *dst, int y, fz_pixmap *band, int factor);
 unsigned int fz_pixmap_size(fz_context *ctx, fz_pixmap *pix);
 
 fz_pixmap *fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, fz_bbox *clip);
@@ -683,10 +977,25 @@ struct fz_image_s
 	int w, h;
 	fz_image *mask;
 	fz_colorspace *colorspace;
-	fz_pixmap *(*get_pixmap)(fz_context *, fz_image *, int w, int h);
+	fz_pixmap *(*get_pixmap)(fz_context *, fz_image *, int w, int h, fz_bbox *subarea);
 };
 
-fz_pixmap *fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int indexed);
+/*
+	fz_image_to_pixmap_region: Like fz_image_to_pixmap, but only the
+	part of the image within subarea (in image pixels) is needed, so
+	a huge image can be decoded piecewise.
+
+	subarea: On entry, the wanted area. On exit, the area the returned
+	pixmap actually covers; this may be larger, up to the whole image.
+*/
+fz_pixmap *fz_image_to_pixmap_region(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *subarea);
+
+/*
+	fz_load_jpx: Decode a JPEG 2000 image. reduce discards that many
+	of the highest resolution levels, halving the size each time; it
+	throws if the codestream has fewer levels than that.
+*/
+fz_pixmap *fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int indexed, int reduce);
 fz_pixmap *fz_load_jpeg(fz_context *doc, unsigned char *data, int size);
 fz_pixmap *fz_load_png(fz_context *doc, unsigned char *data, int size);
 fz_pixmap *fz_load_tiff(fz_context *doc, unsigned char *data, int size);
@@ -751,6 +1060,7 @@ struct fz_font_s
 	fz_buffer **t3procs; /* has 256 entries if used */
 	float *t3widths; /* has 256 entries if used */
 	char *t3flags; /* has 256 entries if used */
+	fz_display_list **t3lists; /* has 256 entries if used */
 	void *t3doc; /* a pdf_document for the callback */
 	void (*t3run)(void *doc, void *resources, fz_buffer *contents, fz_device *dev, fz_matrix ctm, void *gstate);
 	void (*t3freeres)(void *doc, void *resources);
@@ -781,6 +1091,7 @@ void fz_drop_font(fz_context *ctx, fz_font *font);
 
 void fz_set_font_bbox(fz_context *ctx, fz_font *font, float xmin, float ymin, float xmax, float ymax);
 fz_rect fz_bound_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm);
+void fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid);
 int fz_glyph_cacheable(fz_context *ctx, fz_font *font, int gid);
 
 #ifndef NDEBUG
@@ -886,6 +1197,19 @@ void fz_new_glyph_cache_context(fz_context *ctx);
 fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 void fz_purge_glyph_cache(fz_context *ctx);
+unsigned int fz_glyph_cache_usage(fz_context *ctx);
+/* Least recently used glyphs are evicted to keep cache below max bytes */
+void fz_set_glyph_cache_max(fz_context *ctx, unsigned int max);
+/* Size, budget, number of glyphs, hits, misses and evictions. Hits in
+ * the front caches of contexts are counted too, in batches. */
+void fz_get_glyph_cache_stats(fz_context *ctx, fz_store_stats *stats);
+/* Per context cache of recently drawn glyphs, looked up without locking */
+void fz_new_glyph_front_context(fz_context *ctx);
+void fz_free_glyph_front_context(fz_context *ctx);
+void fz_flush_glyph_front(fz_context *ctx);
+/* Flush front cache of ctx if shared cache evicted glyphs since it was
+ * last used; may be called by other thread while ctx is not drawing */
+void fz_sync_glyph_front(fz_context *ctx);
 
 fz_path *fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm);
 fz_path *fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm);
@@ -1011,6 +1335,7 @@ enum
 	/* Hints */
 	FZ_IGNORE_IMAGE = 1,
 	FZ_IGNORE_SHADE = 2,
+	FZ_DRAFT_IMAGE = 4,
 
 	/* Flags */
 	FZ_DEVFLAG_MASK = 1,
@@ -1088,6 +1413,13 @@ void fz_end_tile(fz_device *dev);
 
 fz_device *fz_new_device(fz_context *ctx, void *user);
 
+/*
+	fz_count_slow_display_nodes: Number of images, image masks and
+	shadings recorded in a display list. Lists without them draw
+	quickly whatever the device does.
+*/
+int fz_count_slow_display_nodes(fz_display_list *list);
+
 
 
 /*
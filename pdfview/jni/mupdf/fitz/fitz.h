@@ -75,6 +75,12 @@ int gettimeofday(struct timeval *tv, struct timezone *tz);
 
 #endif
 
+/*
+	File offsets are 64 bits wide everywhere, so that documents larger
+	than 2 GB can be opened even where off_t is 32 bits.
+*/
+typedef long long fz_off_t;
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
@@ -196,6 +202,9 @@ typedef struct fz_aa_context_s fz_aa_context;
 typedef struct fz_locks_context_s fz_locks_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
+typedef struct fz_glyph_front_s fz_glyph_front;
+typedef struct fz_arena_s fz_arena;
+typedef struct fz_alloc_stats_context_s fz_alloc_stats_context;
 typedef struct fz_context_s fz_context;
 
 struct fz_alloc_context_s
@@ -229,6 +238,7 @@ struct fz_error_context_s
 	int top;
 	struct {
 		int code;
+		int alloc_category; /* restored when an exception lands here */
 		fz_jmp_buf buffer;
 	} stack[256];
 	char message[256];
@@ -244,7 +254,7 @@ void fz_var_imp(void *);
 */
 
 #define fz_try(ctx) \
-	if (fz_push_try(ctx->error) && \
+	if (fz_push_try(ctx) && \
 		((ctx->error->stack[ctx->error->top].code = fz_setjmp(ctx->error->stack[ctx->error->top].buffer)) == 0))\
 	{ do {
 
@@ -258,7 +268,7 @@ void fz_var_imp(void *);
 	} \
 	if (ctx->error->stack[ctx->error->top--].code)
 
-int fz_push_try(fz_error_context *ex);
+int fz_push_try(fz_context *ctx);
 void fz_throw(fz_context *, char *, ...) __printflike(2, 3);
 void fz_rethrow(fz_context *);
 void fz_warn(fz_context *ctx, char *fmt, ...) __printflike(2, 3);
@@ -286,6 +296,10 @@ struct fz_context_s
 	fz_aa_context *aa;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_glyph_front *glyph_front;
+	fz_arena *arena;
+	int alloc_category;
+	fz_alloc_stats_context *alloc_stats;
 };
 
 /*
@@ -402,9 +416,16 @@ struct fz_locks_context_s
 	void (*unlock)(void *user, int lock);
 };
 
+/*
+	The resource store is split into FZ_STORE_SHARDS shards by key, each
+	guarded by its own lock, FZ_LOCK_STORE + n.
+*/
+#define FZ_STORE_SHARDS 4
+
 enum {
 	FZ_LOCK_ALLOC = 0,
-	FZ_LOCK_FILE,
+	FZ_LOCK_STORE,
+	FZ_LOCK_FILE = FZ_LOCK_STORE + FZ_STORE_SHARDS,
 	FZ_LOCK_FREETYPE,
 	FZ_LOCK_GLYPHCACHE,
 	FZ_LOCK_MAX
@@ -1100,6 +1121,20 @@ fz_stream *fz_open_file_w(fz_context *ctx, const wchar_t *filename);
 */
 fz_stream *fz_open_fd(fz_context *ctx, int file);
 
+/*
+	fz_open_mmap: Map an open file descriptor into memory and wrap
+	the mapping in a stream.
+
+	Reads are served straight from the mapping without copying into
+	the stream buffer. Where the address space is small the file is
+	mapped a window at a time, so files of any size can be read.
+
+	file: An open file descriptor of a regular file. Ownership is
+	taken as for fz_open_fd. If the file cannot be mapped (or the
+	platform has no mmap) this falls back to fz_open_fd.
+*/
+fz_stream *fz_open_mmap(fz_context *ctx, int file);
+
 /*
 	fz_open_memory: Open a block of memory as a stream.
 
@@ -1138,7 +1173,7 @@ void fz_close(fz_stream *stm);
 /*
 	fz_tell: return the current reading position within a stream
 */
-int fz_tell(fz_stream *stm);
+fz_off_t fz_tell(fz_stream *stm);
 
 /*
 	fz_seek: Seek within a stream.
@@ -1149,7 +1184,7 @@ int fz_tell(fz_stream *stm);
 
 	whence: From where the offset is measured (see fseek).
 */
-void fz_seek(fz_stream *stm, int offset, int whence);
+void fz_seek(fz_stream *stm, fz_off_t offset, int whence);
 
 /*
 	fz_read: Read from a stream into a given data block.
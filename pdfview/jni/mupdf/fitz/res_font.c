@@ -40,6 +40,7 @@ fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
 	font->t3procs = NULL;
 	font->t3widths = NULL;
 	font->t3flags = NULL;
+	font->t3lists = NULL;
 	font->t3doc = NULL;
 	font->t3run = NULL;
 
@@ -75,9 +76,7 @@ fz_keep_font(fz_context *ctx, fz_font *font)
 {
 	if (!font)
 		return NULL;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	font->refs ++;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_keep_refs(ctx, &font->refs);
 	return font;
 }
 
@@ -87,9 +86,7 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 	int fterr;
 	int i, drop;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	drop = (font && --font->refs == 0);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	drop = (font && fz_drop_refs(ctx, &font->refs));
 	if (!drop)
 		return;
 
@@ -98,9 +95,14 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 		if (font->t3resources)
 			font->t3freeres(font->t3doc, font->t3resources);
 		for (i = 0; i < 256; i++)
+		{
 			if (font->t3procs[i])
 				fz_drop_buffer(ctx, font->t3procs[i]);
+			if (font->t3lists[i])
+				fz_free_display_list(ctx, font->t3lists[i]);
+		}
 		fz_free(ctx, font->t3procs);
+		fz_free(ctx, font->t3lists);
 		fz_free(ctx, font->t3widths);
 		fz_free(ctx, font->t3flags);
 	}
@@ -165,21 +167,15 @@ fz_keep_font_context(fz_context *ctx)
 {
 	if (!ctx || !ctx->font)
 		return NULL;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	ctx->font->ctx_refs++;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_keep_refs(ctx, &ctx->font->ctx_refs);
 	return ctx->font;
 }
 
 void fz_drop_font_context(fz_context *ctx)
 {
-	int drop;
 	if (!ctx || !ctx->font)
 		return;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	drop = --ctx->font->ctx_refs;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (drop == 0)
+	if (fz_drop_refs(ctx, &ctx->font->ctx_refs))
 		fz_free(ctx, ctx->font);
 }
 
@@ -817,11 +813,13 @@ fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix)
 	font->t3procs = fz_malloc_array(ctx, 256, sizeof(fz_buffer*));
 	font->t3widths = fz_malloc_array(ctx, 256, sizeof(float));
 	font->t3flags = fz_malloc_array(ctx, 256, sizeof(char));
+	font->t3lists = fz_malloc_array(ctx, 256, sizeof(fz_display_list*));
 
 	font->t3matrix = matrix;
 	for (i = 0; i < 256; i++)
 	{
 		font->t3procs[i] = NULL;
+		font->t3lists[i] = NULL;
 		font->t3widths[i] = 0;
 		font->t3flags[i] = 0;
 	}
@@ -829,6 +827,61 @@ fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix)
 	return font;
 }
 
+/*
+ * Record the glyph procedure into a display list the first time the glyph
+ * is seen. This must happen while interpreting the page (when the document
+ * is safe to use); afterwards the glyph can be bound and rendered from any
+ * context by replaying the list, without calling back into the document.
+ */
+void
+fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid)
+{
+	fz_buffer *contents;
+	fz_device *dev;
+
+	if (gid < 0 || gid > 255)
+		return;
+
+	contents = font->t3procs[gid];
+	if (!contents || font->t3lists[gid])
+		return;
+
+	/* Set the list before running it, to catch glyphs that use themselves */
+	font->t3lists[gid] = fz_new_display_list(ctx);
+
+	dev = fz_new_list_device(ctx, font->t3lists[gid]);
+	dev->flags = FZ_DEVFLAG_FILLCOLOR_UNDEFINED |
+			FZ_DEVFLAG_STROKECOLOR_UNDEFINED |
+			FZ_DEVFLAG_STARTCAP_UNDEFINED |
+			FZ_DEVFLAG_DASHCAP_UNDEFINED |
+			FZ_DEVFLAG_ENDCAP_UNDEFINED |
+			FZ_DEVFLAG_LINEJOIN_UNDEFINED |
+			FZ_DEVFLAG_MITERLIMIT_UNDEFINED |
+			FZ_DEVFLAG_LINEWIDTH_UNDEFINED;
+	fz_try(ctx)
+	{
+		font->t3run(font->t3doc, font->t3resources, contents, dev, fz_identity, NULL);
+	}
+	fz_always(ctx)
+	{
+		font->t3flags[gid] = dev->flags;
+		fz_free_device(dev);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot record type3 glyph %d", gid);
+	}
+}
+
+static void
+fz_run_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_device *dev, fz_matrix ctm)
+{
+	if (font->t3lists[gid])
+		fz_run_display_list(font->t3lists[gid], dev, ctm, fz_infinite_bbox, NULL);
+	else
+		font->t3run(font->t3doc, font->t3resources, font->t3procs[gid], dev, ctm, NULL);
+}
+
 static fz_rect
 fz_bound_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
@@ -842,18 +895,11 @@ fz_bound_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	if (!contents)
 		return fz_transform_rect(trm, fz_empty_rect);
 
+	fz_prepare_t3_glyph(ctx, font, gid);
+
 	ctm = fz_concat(font->t3matrix, trm);
 	dev = fz_new_bbox_device(ctx, &bbox);
-	dev->flags = FZ_DEVFLAG_FILLCOLOR_UNDEFINED |
-			FZ_DEVFLAG_STROKECOLOR_UNDEFINED |
-			FZ_DEVFLAG_STARTCAP_UNDEFINED |
-			FZ_DEVFLAG_DASHCAP_UNDEFINED |
-			FZ_DEVFLAG_ENDCAP_UNDEFINED |
-			FZ_DEVFLAG_LINEJOIN_UNDEFINED |
-			FZ_DEVFLAG_MITERLIMIT_UNDEFINED |
-			FZ_DEVFLAG_LINEWIDTH_UNDEFINED;
-	font->t3run(font->t3doc, font->t3resources, contents, dev, ctm, NULL);
-	font->t3flags[gid] = dev->flags;
+	fz_run_t3_glyph(ctx, font, gid, dev, ctm);
 	fz_free_device(dev);
 
 	bounds.x0 = bbox.x0;
@@ -910,7 +956,7 @@ fz_render_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_co
 
 	ctm = fz_concat(font->t3matrix, trm);
 	dev = fz_new_draw_device_type3(ctx, glyph);
-	font->t3run(font->t3doc, font->t3resources, contents, dev, ctm, NULL);
+	fz_run_t3_glyph(ctx, font, gid, dev, ctm);
 	fz_free_device(dev);
 
 	if (!model)
@@ -6,7 +6,8 @@ fz_new_path(fz_context *ctx)
 {
 	fz_path *path;
 
-	path = fz_malloc_struct(ctx, fz_path);
+	/* Paths being built are transient, fz_clone_path keeps one */
+	path = fz_malloc_transient(ctx, sizeof(fz_path));
 	path->len = 0;
 	path->cap = 0;
 	path->items = NULL;
@@ -58,7 +59,10 @@ grow_path(fz_context *ctx, fz_path *path, int n)
 	}
 	while (path->len + n > newcap)
 		newcap = newcap + 36;
-	path->items = fz_resize_array(ctx, path->items, newcap, sizeof(fz_path_item));
+	if (path->items)
+		path->items = fz_resize_array(ctx, path->items, newcap, sizeof(fz_path_item));
+	else
+		path->items = fz_malloc_transient(ctx, newcap * sizeof(fz_path_item));
 	path->cap = newcap;
 	path->last = path->len;
 }
@@ -418,25 +422,17 @@ fz_keep_stroke_state(fz_context *ctx, fz_stroke_state *stroke)
 	if (!stroke)
 		return NULL;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (stroke->refs > 0)
-		stroke->refs++;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_keep_refs(ctx, &stroke->refs);
 	return stroke;
 }
 
 void
 fz_drop_stroke_state(fz_context *ctx, fz_stroke_state *stroke)
 {
-	int drop;
-
 	if (!stroke)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	drop = (stroke->refs > 0 ? --stroke->refs == 0 : 0);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (drop)
+	if (fz_drop_refs(ctx, &stroke->refs))
 		fz_free(ctx, stroke);
 }
 
@@ -477,9 +473,8 @@ fz_unshare_stroke_state_with_len(fz_context *ctx, fz_stroke_state *shared, int l
 	int single, unsize, shsize, shlen, drop;
 	fz_stroke_state *unshared;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	/* If ours is the only reference, nobody else can take one */
 	single = (shared->refs == 1);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	shlen = shared->dash_len - nelem(shared->dash_list);
 	if (shlen < 0)
@@ -494,9 +489,7 @@ fz_unshare_stroke_state_with_len(fz_context *ctx, fz_stroke_state *shared, int l
 	unshared = Memento_label(fz_malloc(ctx, unsize), "fz_stroke_state");
 	memcpy(unshared, shared, (shsize > unsize ? unsize : shsize));
 	unshared->refs = 1;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	drop = (shared->refs > 0 ? --shared->refs == 0 : 0);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	drop = fz_drop_refs(ctx, &shared->refs);
 	if (drop)
 		fz_free(ctx, shared);
 	return unshared;
@@ -362,6 +362,69 @@ fz_alpha_from_gray(fz_context *ctx, fz_pixmap *gray, int luminosity)
 	return alpha;
 }
 
+/*
+ * Box filter up to factor rows of sp (sw pixels wide) into one row of
+ * dp. Each destination pixel is the rounded mean of its factor x factor
+ * block, clipped at the right and bottom edges.
+ */
+static void
+subsample_row(unsigned char *dp, unsigned char *sp, int sw, int rows, int n, int factor)
+{
+	int sum[FZ_MAX_COLORS + 1];
+	int sstride = sw * n;
+	int x, y, k, i, fw, count;
+	unsigned char *p;
+
+	for (x = 0; x < sw; x += factor)
+	{
+		fw = fz_mini(factor, sw - x);
+		count = fw * rows;
+		for (k = 0; k < n; k++)
+			sum[k] = 0;
+		for (y = 0; y < rows; y++)
+		{
+			p = sp + y * sstride + x * n;
+			for (i = 0; i < fw; i++)
+			{
+				for (k = 0; k < n; k++)
+					sum[k] += p[k];
+				p += n;
+			}
+		}
+		for (k = 0; k < n; k++)
+			*dp++ = (sum[k] + (count >> 1)) / count;
+	}
+}
+
+void
+fz_subsample_band(fz_pixmap *dst, int y, fz_pixmap *band, int factor)
+{
+	assert(dst->n == band->n && dst->w == (band->w + factor - 1) / factor);
+	assert(y < dst->h && band->h <= factor);
+
+	subsample_row(dst->samples + (unsigned int)(y * dst->w * dst->n), band->samples, band->w, band->h, band->n, factor);
+}
+
+fz_pixmap *
+fz_subsample_pixmap(fz_context *ctx, fz_pixmap *src, int factor)
+{
+	fz_pixmap *dst;
+	int y, rows;
+
+	dst = fz_new_pixmap(ctx, src->colorspace, (src->w + factor - 1) / factor, (src->h + factor - 1) / factor);
+	dst->interpolate = src->interpolate;
+
+	for (y = 0; y < dst->h; y++)
+	{
+		rows = fz_mini(factor, src->h - y * factor);
+		subsample_row(dst->samples + (unsigned int)(y * dst->w * dst->n),
+			src->samples + (unsigned int)(y * factor * src->w * src->n),
+			src->w, rows, src->n, factor);
+	}
+
+	return dst;
+}
+
 void
 fz_invert_pixmap(fz_context *ctx, fz_pixmap *pix)
 {
@@ -672,7 +735,15 @@ fz_image_to_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 {
 	if (image == NULL)
 		return NULL;
-	return image->get_pixmap(ctx, image, w, h);
+	return image->get_pixmap(ctx, image, w, h, NULL);
+}
+
+fz_pixmap *
+fz_image_to_pixmap_region(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *subarea)
+{
+	if (image == NULL)
+		return NULL;
+	return image->get_pixmap(ctx, image, w, h, subarea);
 }
 
 fz_image *
@@ -13,11 +13,11 @@ struct fz_item_s
 	fz_store_type *type;
 };
 
-struct fz_store_s
-{
-	int refs;
+typedef struct fz_store_shard_s fz_store_shard;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
+struct fz_store_shard_s
+{
+	/* Every item in the shard is kept in a doubly linked list, ordered
 	 * by usage (so LRU entries are at the end). */
 	fz_item *head;
 	fz_item *tail;
@@ -25,29 +25,54 @@ struct fz_store_s
 	/* We have a hash table that allows to quickly find a subset of the
 	 * entries (those whose keys are indirect objects). */
 	fz_hash_table *hash;
+};
+
+struct fz_store_s
+{
+	int refs;
 
-	/* We keep track of the size of the store, and keep it below max. */
+	/* Items are spread over the shards by the hash of their key, each
+	 * shard guarded by its own lock (FZ_LOCK_STORE + n), so threads
+	 * looking up different items don't wait for each other. Items with
+	 * keys that can't be hashed all live in shard 0. */
+	fz_store_shard shards[FZ_STORE_SHARDS];
+
+	/* We keep track of the size of the store, and keep it below max.
+	 * Sizes are updated under different shard locks, so only ever
+	 * through add_count. */
 	unsigned int max;
 	unsigned int size;
+
+	/* Size, budget and statistics of each kind of item */
+	fz_store_stats kinds[FZ_STORE_KINDS];
+};
+
+static const char *kind_names[FZ_STORE_KINDS] =
+{
+	"images", "fonts", "shades", "functions", "other"
 };
 
 void
 fz_new_store_context(fz_context *ctx, unsigned int max)
 {
 	fz_store *store;
+	int i;
+
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC);
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			store->shards[i].hash = fz_new_hash_table(ctx, 4096 / FZ_STORE_SHARDS, sizeof(fz_store_hash), FZ_LOCK_STORE + i);
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			if (store->shards[i].hash)
+				fz_free_hash(ctx, store->shards[i].hash);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
 	store->size = 0;
 	store->max = max;
 	ctx->store = store;
@@ -58,145 +83,259 @@ fz_keep_storable(fz_context *ctx, fz_storable *s)
 {
 	if (s == NULL)
 		return NULL;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (s->refs > 0)
-		s->refs++;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_keep_refs(ctx, &s->refs);
 	return s;
 }
 
 void
 fz_drop_storable(fz_context *ctx, fz_storable *s)
 {
-	int do_free = 0;
-
 	if (s == NULL)
 		return;
+	/* If we are dropping the last reference to an object, then
+	 * it cannot possibly be in the store (as the store always
+	 * keeps a ref to everything in it, and doesn't drop via
+	 * this method. So we can simply drop the storable object
+	 * itself without any operations on the fz_store. Static
+	 * objects are never dropped. */
+	if (fz_drop_refs(ctx, &s->refs))
+		s->free(ctx, s);
+}
+
+static void
+add_count(fz_context *ctx, unsigned int *count, int delta)
+{
+#ifdef FZ_ATOMIC_REFS
+	__sync_add_and_fetch(count, delta);
+#else
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (s->refs < 0)
-	{
-		/* It's a static object. Dropping does nothing. */
-	}
-	else if (--s->refs == 0)
-	{
-		/* If we are dropping the last reference to an object, then
-		 * it cannot possibly be in the store (as the store always
-		 * keeps a ref to everything in it, and doesn't drop via
-		 * this method. So we can simply drop the storable object
-		 * itself without any operations on the fz_store. */
-		do_free = 1;
-	}
+	*count += delta;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (do_free)
-		s->free(ctx, s);
+#endif
 }
 
+/* Add (sign 1) or remove (sign -1) item to/from the store's sizes */
 static void
-evict(fz_context *ctx, fz_item *item)
+account(fz_context *ctx, fz_item *item, int sign)
 {
 	fz_store *store = ctx->store;
-	int drop;
+	fz_store_stats *stats = &store->kinds[item->type->kind];
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
+	add_count(ctx, &store->size, sign * (int)item->size);
+	add_count(ctx, &stats->size, sign * (int)item->size);
+	add_count(ctx, &stats->items, sign);
+}
+
+static int
+shard_of(fz_store_hash *hash, int use_hash)
+{
+	unsigned char *s = (unsigned char *)hash;
+	unsigned int h = 0;
+	int i;
+
+	if (!use_hash)
+		return 0;
+	for (i = 0; i < sizeof(fz_store_hash); i++)
+		h = h * 31 + s[i];
+	return (h ^ (h >> 16)) % FZ_STORE_SHARDS;
+}
+
+static void
+unlink_item(fz_store_shard *shard, fz_item *item)
+{
 	if (item->next)
 		item->next->prev = item->prev;
 	else
-		store->tail = item->prev;
+		shard->tail = item->prev;
 	if (item->prev)
 		item->prev->next = item->next;
 	else
-		store->head = item->next;
+		shard->head = item->next;
+}
+
+static void
+link_item_at_head(fz_store_shard *shard, fz_item *item)
+{
+	item->next = shard->head;
+	if (item->next)
+		item->next->prev = item;
+	else
+		shard->tail = item;
+	item->prev = NULL;
+	shard->head = item;
+}
+
+/* Called with the lock of shard n held, drops it while freeing */
+static void
+evict(fz_context *ctx, int n, fz_item *item)
+{
+	fz_store_shard *shard = &ctx->store->shards[n];
+	int drop;
+
+	account(ctx, item, -1);
+	unlink_item(shard, item);
 	/* Drop a reference to the value (freeing if required) */
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
+	drop = fz_drop_refs(ctx, &item->val->refs);
 	/* Remove from the hash table */
 	if (item->type->make_hash_key)
 	{
 		fz_store_hash hash = { NULL };
 		hash.free = item->val->free;
 		if (item->type->make_hash_key(&hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
+			fz_hash_remove(ctx, shard->hash, &hash);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, FZ_LOCK_STORE + n);
 	if (drop)
 		item->val->free(ctx, item->val);
 	/* Always drops the key and free the item */
 	item->type->drop_key(ctx, item->key);
 	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, FZ_LOCK_STORE + n);
 }
 
-static int
-ensure_space(fz_context *ctx, unsigned int tofree)
+/* Evict the least recently used item of shard n that is not used
+ * outside of the store, of given kind (any kind if kind < 0). Takes the
+ * shard lock itself. Returns the size of evicted item and sets its kind,
+ * or returns 0 if there was nothing to evict. */
+static unsigned int
+evict_lru(fz_context *ctx, int n, int kind, int *evicted_kind)
 {
-	fz_item *item, *prev;
-	unsigned int count;
 	fz_store *store = ctx->store;
+	fz_item *item;
+	unsigned int size = 0;
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, FZ_LOCK_STORE + n);
+	for (item = store->shards[n].tail; item; item = item->prev)
+	{
+		if (item->val->refs == 1 && (kind < 0 || item->type->kind == kind))
+			break;
+	}
+	if (item)
+	{
+		size = item->size;
+		*evicted_kind = item->type->kind;
+		add_count(ctx, &store->kinds[*evicted_kind].evictions, 1);
+		evict(ctx, n, item); /* Drops then retakes lock */
+	}
+	fz_unlock(ctx, FZ_LOCK_STORE + n);
+	return size;
+}
 
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
+/* Count bytes of unused items of given kind (any kind if kind < 0),
+ * stopping once there are enough. */
+static unsigned int
+evictable(fz_context *ctx, int kind, unsigned int enough)
+{
+	fz_store *store = ctx->store;
+	fz_item *item;
+	unsigned int count = 0;
+	int n;
+
+	for (n = 0; n < FZ_STORE_SHARDS && count < enough; n++)
 	{
-		if (item->val->refs == 1)
+		fz_lock(ctx, FZ_LOCK_STORE + n);
+		for (item = store->shards[n].tail; item && count < enough; item = item->prev)
 		{
-			count += item->size;
-			if (count >= tofree)
-				break;
+			if (item->val->refs == 1 && (kind < 0 || item->type->kind == kind))
+				count += item->size;
 		}
+		fz_unlock(ctx, FZ_LOCK_STORE + n);
 	}
+	return count;
+}
 
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
+/* Evict unused items of given kind (any kind if kind < 0) until tofree
+ * bytes are freed, taking the least recently used item of each shard in
+ * turn, so the store as a whole is only approximately LRU. Must be
+ * called with no shard lock held. */
+static int
+scavenge(fz_context *ctx, int kind, unsigned int tofree)
+{
+	unsigned int count = 0;
+	unsigned int size;
+	int n, progress, evicted_kind;
+
+	do
 	{
-		return 0;
+		progress = 0;
+		for (n = 0; n < FZ_STORE_SHARDS && count < tofree; n++)
+		{
+			size = evict_lru(ctx, n, kind, &evicted_kind);
+			if (size)
+			{
+				count += size;
+				progress = 1;
+			}
+		}
 	}
+	while (progress && count < tofree);
+	/* Success is managing to evict any blocks */
+	return count != 0;
+}
+
+/* Make room for a new item of given kind and size, both in the store and
+ * in the budget of its kind. Must be called with no shard lock held.
+ * Returns 0 if that much can't be freed. */
+static int
+ensure_space(fz_context *ctx, int kind, unsigned int itemsize)
+{
+	fz_store *store = ctx->store;
+	fz_store_stats *stats = &store->kinds[kind];
+	unsigned int tofree = 0, kind_tofree = 0;
+	unsigned int count = 0, kind_count = 0;
+	unsigned int size;
+	int n, progress, evicted_kind;
 
-	/* Actually free the items */
-	count = 0;
-	for (item = store->tail; item; item = prev)
+	if (store->max != FZ_STORE_UNLIMITED && store->size + itemsize > store->max)
+		tofree = store->size + itemsize - store->max;
+	if (stats->max != FZ_STORE_UNLIMITED && stats->size + itemsize > stats->max)
+		kind_tofree = stats->size + itemsize - stats->max;
+	if (tofree == 0 && kind_tofree == 0)
+		return 1;
+
+	/* First check that we *can* free that much; if not, we'd rather not
+	 * cache this. */
+	if (kind_tofree > 0 && evictable(ctx, kind, kind_tofree) < kind_tofree)
+		return 0;
+	if (tofree > 0 && evictable(ctx, -1, tofree) < tofree)
+		return 0;
+
+	/* Actually free the items, those of our kind first if its budget
+	 * is exceeded. Threads storing at the same time may each see the
+	 * same free space, so the store can overshoot by the size of items
+	 * being stored concurrently. */
+	do
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
+		progress = 0;
+		for (n = 0; n < FZ_STORE_SHARDS; n++)
 		{
-			/* Free this item. Evict has to drop the lock to
-			 * manage that, which could cause prev to be removed
-			 * in the meantime. To avoid that we bump its reference
-			 * count here. This may cause another simultaneous
-			 * evict process to fail to make enough space as prev is
-			 * pinned - but that will only happen if we're near to
-			 * the limit anyway, and it will only cause something to
-			 * not be cached. */
-			count += item->size;
-			if (prev)
-				prev->val->refs++;
-			evict(ctx, item); /* Drops then retakes lock */
-			/* So the store has 1 reference to prev, as do we, so
-			 * no other evict process can have thrown prev away in
-			 * the meantime. So we are safe to just decrement its
-			 * reference count here. */
-			if (prev)
-				--prev->val->refs;
-
-			if (count >= tofree)
-				return count;
+			if (count >= tofree && kind_count >= kind_tofree)
+				return 1;
+			size = evict_lru(ctx, n, kind_count < kind_tofree ? kind : -1, &evicted_kind);
+			if (size)
+			{
+				count += size;
+				if (evicted_kind == kind)
+					kind_count += size;
+				progress = 1;
+			}
 		}
 	}
+	while (progress);
 
-	return count;
+	return count >= tofree && kind_count >= kind_tofree;
 }
 
 void *
 fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_store_type *type)
 {
 	fz_item *item = NULL;
-	unsigned int size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	int n;
 
 	if (!store)
 		return NULL;
@@ -220,71 +359,61 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 		hash.free = val->free;
 		use_hash = type->make_hash_key(&hash, key);
 	}
+	n = shard_of(&hash, use_hash);
+	shard = &store->shards[n];
 
-	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (store->max != FZ_STORE_UNLIMITED)
+	/* ensure_space takes the shard locks itself */
+	if (!ensure_space(ctx, type->kind, itemsize))
 	{
-		size = store->size + itemsize;
-		while (size > store->max)
-		{
-			/* ensure_space may drop, then retake the lock */
-			if (ensure_space(ctx, size - store->max) == 0)
-			{
-				/* Failed to free any space */
-				fz_unlock(ctx, FZ_LOCK_ALLOC);
-				fz_free(ctx, item);
-				type->drop_key(ctx, key);
-				return NULL;
-			}
-		}
+		/* Failed to free enough space */
+		fz_free(ctx, item);
+		return NULL;
 	}
-	store->size += itemsize;
 
+	type->keep_key(ctx, key);
 	item->key = key;
 	item->val = val;
 	item->size = itemsize;
 	item->next = NULL;
 	item->type = type;
 
+	fz_lock(ctx, FZ_LOCK_STORE + n);
+
 	/* If we can index it fast, put it into the hash table */
 	if (use_hash)
 	{
 		fz_item *existing;
+		fz_storable *existing_val;
 
 		fz_try(ctx)
 		{
 			/* May drop and retake the lock */
-			existing = fz_hash_insert(ctx, store->hash, &hash, item);
+			existing = fz_hash_insert(ctx, shard->hash, &hash, item);
 		}
 		fz_catch(ctx)
 		{
-			store->size -= itemsize;
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, FZ_LOCK_STORE + n);
+			type->drop_key(ctx, key);
 			fz_free(ctx, item);
 			return NULL;
 		}
 		if (existing)
 		{
 			/* Take a new reference */
-			existing->val->refs++;
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			existing_val = existing->val;
+			fz_keep_refs(ctx, &existing_val->refs);
+			fz_unlock(ctx, FZ_LOCK_STORE + n);
+			type->drop_key(ctx, key);
 			fz_free(ctx, item);
-			return existing->val;
+			return existing_val;
 		}
 	}
 	/* Now we can never fail, bump the ref */
-	if (val->refs > 0)
-		val->refs++;
+	fz_keep_refs(ctx, &val->refs);
+	account(ctx, item, 1);
 	/* Regardless of whether it's indexed, it goes into the linked list */
-	item->next = store->head;
-	if (item->next)
-		item->next->prev = item;
-	else
-		store->tail = item;
-	store->head = item;
-	item->prev = NULL;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	link_item_at_head(shard, item);
+	fz_unlock(ctx, FZ_LOCK_STORE + n);
 
 	return NULL;
 }
@@ -293,9 +422,12 @@ void *
 fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *type)
 {
 	fz_item *item;
+	fz_storable *val;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	int n;
 
 	if (!store)
 		return NULL;
@@ -308,17 +440,19 @@ fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *
 		hash.free = free;
 		use_hash = type->make_hash_key(&hash, key);
 	}
+	n = shard_of(&hash, use_hash);
+	shard = &store->shards[n];
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, FZ_LOCK_STORE + n);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 		{
 			if (item->val->free == free && !type->cmp_key(item->key, key))
 				break;
@@ -327,30 +461,17 @@ fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *
 	if (item)
 	{
 		/* LRU: Move the block to the front */
-		/* Unlink from present position */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-		/* Insert at head */
-		item->next = store->head;
-		if (item->next)
-			item->next->prev = item;
-		else
-			store->tail = item;
-		item->prev = NULL;
-		store->head = item;
+		unlink_item(shard, item);
+		link_item_at_head(shard, item);
 		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-			item->val->refs++;
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return (void *)item->val;
+		val = item->val;
+		fz_keep_refs(ctx, &val->refs);
+		fz_unlock(ctx, FZ_LOCK_STORE + n);
+		add_count(ctx, &store->kinds[type->kind].hits, 1);
+		return (void *)val;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, FZ_LOCK_STORE + n);
+	add_count(ctx, &store->kinds[type->kind].misses, 1);
 
 	return NULL;
 }
@@ -360,67 +481,69 @@ fz_remove_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	int drop;
-	fz_store_hash hash;
+	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	int n;
 
 	if (type->make_hash_key)
 	{
 		hash.free = free;
 		use_hash = type->make_hash_key(&hash, key);
 	}
+	n = shard_of(&hash, use_hash);
+	shard = &store->shards[n];
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, FZ_LOCK_STORE + n);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+			fz_hash_remove(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 			if (item->val->free == free && !type->cmp_key(item->key, key))
 				break;
 	}
 	if (item)
 	{
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-		drop = (item->val->refs > 0 && --item->val->refs == 0);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		account(ctx, item, -1);
+		unlink_item(shard, item);
+		drop = fz_drop_refs(ctx, &item->val->refs);
+		fz_unlock(ctx, FZ_LOCK_STORE + n);
 		if (drop)
 			item->val->free(ctx, item->val);
 		type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
 	}
 	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, FZ_LOCK_STORE + n);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	int n;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	/* Run through all the items in the store */
-	while (store->head)
+	for (n = 0; n < FZ_STORE_SHARDS; n++)
 	{
-		evict(ctx, store->head); /* Drops then retakes lock */
+		fz_lock(ctx, FZ_LOCK_STORE + n);
+		while (store->shards[n].head)
+		{
+			evict(ctx, n, store->shards[n].head); /* Drops then retakes lock */
+		}
+		fz_unlock(ctx, FZ_LOCK_STORE + n);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 fz_store *
@@ -428,26 +551,23 @@ fz_keep_store_context(fz_context *ctx)
 {
 	if (ctx == NULL || ctx->store == NULL)
 		return NULL;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	ctx->store->refs++;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_keep_refs(ctx, &ctx->store->refs);
 	return ctx->store;
 }
 
 void
 fz_drop_store_context(fz_context *ctx)
 {
-	int refs;
+	int n;
+
 	if (ctx == NULL || ctx->store == NULL)
 		return;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	refs = --ctx->store->refs;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (refs != 0)
+	if (!fz_drop_refs(ctx, &ctx->store->refs))
 		return;
 
 	fz_empty_store(ctx);
-	fz_free_hash(ctx, ctx->store->hash);
+	for (n = 0; n < FZ_STORE_SHARDS; n++)
+		fz_free_hash(ctx, ctx->store->shards[n].hash);
 	fz_free(ctx, ctx->store);
 	ctx->store = NULL;
 }
@@ -458,62 +578,36 @@ fz_print_store(fz_context *ctx, FILE *out)
 {
 	fz_item *item, *next;
 	fz_store *store = ctx->store;
+	int n;
 
 	fprintf(out, "-- resource store contents --\n");
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	for (item = store->head; item; item = next)
-	{
-		next = item->next;
-		if (next)
-			next->val->refs++;
-		fprintf(out, "store[*][refs=%d][size=%d] ", item->val->refs, item->size);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		item->type->debug(item->key);
-		fprintf(out, " = %p\n", item->val);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (next)
-			next->val->refs--;
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-}
-#endif
-
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
-static int
-scavenge(fz_context *ctx, unsigned int tofree)
-{
-	fz_store *store = ctx->store;
-	unsigned int count = 0;
-	fz_item *item, *prev;
-
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
+	for (n = 0; n < FZ_STORE_SHARDS; n++)
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
+		fz_lock(ctx, FZ_LOCK_STORE + n);
+		for (item = store->shards[n].head; item; item = next)
 		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
-
-			if (count >= tofree)
-				break;
-
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
+			next = item->next;
+			if (next)
+				fz_keep_refs(ctx, &next->val->refs);
+			fprintf(out, "store[%d][refs=%d][size=%d] ", n, item->val->refs, item->size);
+			fz_unlock(ctx, FZ_LOCK_STORE + n);
+			item->type->debug(item->key);
+			fprintf(out, " = %p\n", item->val);
+			fz_lock(ctx, FZ_LOCK_STORE + n);
+			if (next)
+				fz_drop_refs(ctx, &next->val->refs);
 		}
+		fz_unlock(ctx, FZ_LOCK_STORE + n);
 	}
-	/* Success is managing to evict any blocks */
-	return count != 0;
 }
+#endif
 
 int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase)
 {
 	fz_store *store;
 	unsigned int max;
+	int success = 0;
 
 	if (ctx == NULL)
 		return 0;
@@ -547,22 +641,113 @@ int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase)
 		else
 			tofree = size + store->size - max;
 
-		if (scavenge(ctx, tofree))
+		if (scavenge(ctx, -1, tofree))
 		{
-#ifdef DEBUG_SCAVENGING
-			printf("scavenged: store=%d\n", store->size);
-			fz_print_store(ctx, stderr);
-			Memento_stats();
-#endif
-			return 1;
+			success = 1;
+			break;
 		}
 	}
 	while (max > 0);
 
 #ifdef DEBUG_SCAVENGING
-	printf("scavenging failed\n");
-	fz_print_store(ctx, stderr);
-	Memento_listBlocks();
+	if (success)
+	{
+		printf("scavenged: store=%d\n", store->size);
+		fz_print_store(ctx, stderr);
+		Memento_stats();
+	}
+	else
+	{
+		printf("scavenging failed\n");
+		fz_print_store(ctx, stderr);
+		Memento_listBlocks();
+	}
 #endif
-	return 0;
+	return success;
+}
+
+void
+fz_set_store_max(fz_context *ctx, unsigned int max)
+{
+	fz_store *store;
+
+	if (ctx == NULL || ctx->store == NULL)
+		return;
+	store = ctx->store;
+
+	store->max = max;
+	if (max != FZ_STORE_UNLIMITED && store->size > max)
+		scavenge(ctx, -1, store->size - max);
+}
+
+int
+fz_shrink_store(fz_context *ctx, unsigned int percent)
+{
+	fz_store *store;
+	unsigned int new_size;
+
+	if (ctx == NULL || ctx->store == NULL)
+		return 0;
+	if (percent >= 100)
+		return 1;
+	store = ctx->store;
+
+	new_size = store->size / 100 * percent;
+	if (store->size > new_size)
+		scavenge(ctx, -1, store->size - new_size);
+	return store->size <= new_size;
+}
+
+void
+fz_get_store_usage(fz_context *ctx, unsigned int *size, unsigned int *max)
+{
+	*size = 0;
+	*max = 0;
+	if (ctx == NULL || ctx->store == NULL)
+		return;
+	*size = ctx->store->size;
+	*max = ctx->store->max;
+}
+
+void
+fz_set_store_kind_max(fz_context *ctx, int kind, unsigned int max)
+{
+	fz_store_stats *stats;
+
+	if (ctx == NULL || ctx->store == NULL || kind < 0 || kind >= FZ_STORE_KINDS)
+		return;
+	stats = &ctx->store->kinds[kind];
+
+	stats->max = max;
+	if (max != FZ_STORE_UNLIMITED && stats->size > max)
+		scavenge(ctx, kind, stats->size - max);
+}
+
+void
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats)
+{
+	if (ctx == NULL || ctx->store == NULL)
+	{
+		memset(stats, 0, sizeof(fz_store_stats) * FZ_STORE_KINDS);
+		return;
+	}
+	memcpy(stats, ctx->store->kinds, sizeof(fz_store_stats) * FZ_STORE_KINDS);
+}
+
+void
+fz_print_store_stats(fz_context *ctx, FILE *out)
+{
+	fz_store_stats stats[FZ_STORE_KINDS];
+	unsigned int size, max;
+	int i;
+
+	fz_get_store_usage(ctx, &size, &max);
+	fz_get_store_stats(ctx, stats);
+	fprintf(out, "-- resource store: %u bytes, max %u --\n", size, max);
+	for (i = 0; i < FZ_STORE_KINDS; i++)
+	{
+		fprintf(out, "%-9s %10u bytes, max %10u, %6u items, %8u hits, %8u misses, %6u evictions\n",
+			kind_names[i], stats[i].size, stats[i].max, stats[i].items,
+			stats[i].hits, stats[i].misses, stats[i].evictions);
+	}
 }
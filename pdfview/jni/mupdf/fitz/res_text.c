@@ -5,7 +5,8 @@ fz_new_text(fz_context *ctx, fz_font *font, fz_matrix trm, int wmode)
 {
 	fz_text *text;
 
-	text = fz_malloc_struct(ctx, fz_text);
+	/* Text being built is transient, fz_clone_text keeps it */
+	text = fz_malloc_transient(ctx, sizeof(fz_text));
 	text->font = fz_keep_font(ctx, font);
 	text->trm = trm;
 	text->wmode = wmode;
@@ -105,7 +106,10 @@ fz_grow_text(fz_context *ctx, fz_text *text, int n)
 		return;
 	while (text->len + n > new_cap)
 		new_cap = new_cap + 36;
-	text->items = fz_resize_array(ctx, text->items, new_cap, sizeof(fz_text_item));
+	if (text->items)
+		text->items = fz_resize_array(ctx, text->items, new_cap, sizeof(fz_text_item));
+	else
+		text->items = fz_malloc_transient(ctx, new_cap * sizeof(fz_text_item));
 	text->cap = new_cap;
 }
 
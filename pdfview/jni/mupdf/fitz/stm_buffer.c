@@ -28,12 +28,11 @@ fz_new_buffer(fz_context *ctx, int size)
 fz_buffer *
 fz_keep_buffer(fz_context *ctx, fz_buffer *buf)
 {
+	/* Buffers (compressed image data in particular) may be shared by
+	 * several rendering threads, so count references like other
+	 * shared resources do. */
 	if (buf)
-	{
-		if (buf->refs == 1 && buf->cap > buf->len+1)
-			fz_resize_buffer(ctx, buf, buf->len);
-		buf->refs ++;
-	}
+		fz_keep_refs(ctx, &buf->refs);
 
 	return buf;
 }
@@ -43,7 +42,7 @@ fz_drop_buffer(fz_context *ctx, fz_buffer *buf)
 {
 	if (!buf)
 		return;
-	if (--buf->refs == 0)
+	if (fz_drop_refs(ctx, &buf->refs))
 	{
 		fz_free(ctx, buf->data);
 		fz_free(ctx, buf);
@@ -1,5 +1,27 @@
+/* lseek64, pread64 and fstat64 are only declared by glibc if asked for */
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
 #include "fitz-internal.h"
 
+#ifdef _WIN32
+#define fz_lseek _lseeki64
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__) || defined(__ANDROID__)
+#define fz_lseek lseek64
+#define fz_pread pread64
+#define fz_fstat fstat64
+#define fz_stat_buf stat64
+#else
+#define fz_lseek lseek /* off_t is 64 bits on the BSDs */
+#define fz_pread pread
+#define fz_fstat fstat
+#define fz_stat_buf stat
+#endif
+#endif
+
 fz_stream *
 fz_new_stream(fz_context *ctx, void *state,
 	int(*read)(fz_stream *stm, unsigned char *buf, int len),
@@ -62,17 +84,36 @@ fz_close(fz_stream *stm)
 
 /* File stream */
 
+/*
+	An open file, shared by the stream that opened it and by the readers
+	opened over it with fz_open_reader, and closed with the last of them.
+	Only mapped files use the map fields; size is recorded by fz_open_mmap,
+	it is 0 for files opened with fz_open_fd.
+*/
+struct file
+{
+	int refs;
+	int fd;
+	fz_off_t size;
+	fz_off_t window;
+	unsigned char *map; /* NULL, or window mapped from map_ofs */
+	fz_off_t map_ofs;
+	fz_off_t map_len;
+};
+
 static int read_file(fz_stream *stm, unsigned char *buf, int len)
 {
-	int n = read(*(int*)stm->state, buf, len);
+	struct file *file = stm->state;
+	int n = read(file->fd, buf, len);
 	if (n < 0)
 		fz_throw(stm->ctx, "read error: %s", strerror(errno));
 	return n;
 }
 
-static void seek_file(fz_stream *stm, int offset, int whence)
+static void seek_file(fz_stream *stm, fz_off_t offset, int whence)
 {
-	int n = lseek(*(int*)stm->state, offset, whence);
+	struct file *file = stm->state;
+	fz_off_t n = fz_lseek(file->fd, offset, whence);
 	if (n < 0)
 		fz_throw(stm->ctx, "cannot lseek: %s", strerror(errno));
 	stm->pos = n;
@@ -82,30 +123,34 @@ static void seek_file(fz_stream *stm, int offset, int whence)
 
 static void close_file(fz_context *ctx, void *state)
 {
-	int n = close(*(int*)state);
-	if (n < 0)
+	struct file *file = state;
+	if (!fz_drop_refs(ctx, &file->refs))
+		return;
+#ifndef _WIN32
+	if (file->map)
+		munmap(file->map, file->map_len);
+#endif
+	if (close(file->fd) < 0)
 		fz_warn(ctx, "close error: %s", strerror(errno));
-	fz_free(ctx, state);
+	fz_free(ctx, file);
+}
+
+static struct file *
+new_file(fz_context *ctx, int fd)
+{
+	struct file *file = fz_malloc_struct(ctx, struct file);
+	file->refs = 1;
+	file->fd = fd;
+	return file;
 }
 
 fz_stream *
 fz_open_fd(fz_context *ctx, int fd)
 {
 	fz_stream *stm;
-	int *state;
 
-	state = fz_malloc_struct(ctx, int);
-	*state = fd;
-
-	fz_try(ctx)
-	{
-		stm = fz_new_stream(ctx, state, read_file, close_file);
-	}
-	fz_catch(ctx)
-	{
-		fz_free(ctx, state);
-		fz_rethrow(ctx);
-	}
+	/* fz_new_stream closes the file if it fails */
+	stm = fz_new_stream(ctx, new_file(ctx, fd), read_file, close_file);
 	stm->seek = seek_file;
 
 	return stm;
@@ -134,6 +179,234 @@ fz_open_file(fz_context *ctx, const char *name)
 	return fz_open_fd(ctx, fd);
 }
 
+/* Mapped file stream */
+
+#ifndef _WIN32
+
+/*
+	On 64-bit systems the whole file is mapped at once. Elsewhere address
+	space is scarce, so a window of the file is mapped and moved along as
+	the stream is read.
+*/
+#define MMAP_WINDOW (4 << 20)
+
+/* Map the window holding ofs, returns 0 if it cannot be mapped */
+static int map_window(struct file *file, fz_off_t ofs)
+{
+	fz_off_t start = ofs - ofs % file->window;
+	void *map;
+
+	if (file->map && file->map_ofs == start)
+		return 1;
+	if (file->map)
+		munmap(file->map, file->map_len);
+	file->map = NULL;
+
+	/* off_t may be too narrow to reach this far into the file */
+	if ((off_t)start != start)
+		return 0;
+
+	file->map_ofs = start;
+	file->map_len = file->size - start;
+	if (file->map_len > file->window)
+		file->map_len = file->window;
+	map = mmap(NULL, file->map_len, PROT_READ, MAP_PRIVATE, file->fd, (off_t)start);
+	if (map == MAP_FAILED)
+		return 0;
+	file->map = map;
+	return 1;
+}
+
+/* The whole file is mapped, and the mapping never moves */
+static int mapped_whole(struct file *file)
+{
+	return file->map && file->map_ofs == 0 && file->map_len == file->size;
+}
+
+static int read_mmap(fz_stream *stm, unsigned char *buf, int len)
+{
+	struct file *file = stm->state;
+	/* fz_fill_buffer reads into bp, anything else is a copy to the caller */
+	int fill = (buf == stm->bp);
+	unsigned char *p;
+	fz_off_t n;
+
+	if (stm->pos >= file->size)
+		return 0;
+
+	if (!map_window(file, stm->pos))
+	{
+		if (fill)
+		{
+			stm->bp = buf = stm->buf;
+			stm->ep = stm->buf + sizeof stm->buf;
+			len = sizeof stm->buf;
+		}
+		if (fz_lseek(file->fd, stm->pos, 0) < 0)
+			fz_throw(stm->ctx, "cannot lseek: %s", strerror(errno));
+		n = read(file->fd, buf, len);
+		if (n < 0)
+			fz_throw(stm->ctx, "read error: %s", strerror(errno));
+		return n;
+	}
+
+	p = file->map + (stm->pos - file->map_ofs);
+	n = file->map_len - (stm->pos - file->map_ofs);
+	if (n > INT_MAX)
+		n = INT_MAX;
+	if (!fill)
+	{
+		if (n > len)
+			n = len;
+		memcpy(buf, p, n);
+		return n;
+	}
+
+	/* Hand out the mapping itself as the stream buffer */
+	stm->bp = p;
+	stm->ep = p + n;
+	return n;
+}
+
+static void seek_mmap(fz_stream *stm, fz_off_t offset, int whence)
+{
+	struct file *file = stm->state;
+
+	if (whence == 2)
+		offset += file->size;
+	if (offset < 0)
+		offset = 0;
+	if (offset > file->size)
+		offset = file->size;
+
+	if (file->map && offset >= file->map_ofs && offset < file->map_ofs + file->map_len &&
+		file->map_len <= INT_MAX)
+	{
+		/* Make the whole window the buffer so later seeks stay in it */
+		stm->bp = file->map;
+		stm->rp = file->map + (offset - file->map_ofs);
+		stm->wp = stm->ep = file->map + file->map_len;
+		stm->pos = file->map_ofs + file->map_len;
+	}
+	else
+	{
+		stm->pos = offset;
+		stm->rp = stm->wp = stm->bp;
+	}
+}
+
+#endif
+
+fz_stream *
+fz_open_mmap(fz_context *ctx, int fd)
+{
+#ifdef _WIN32
+	return fz_open_fd(ctx, fd);
+#else
+	fz_stream *stm;
+	struct file *file;
+	fz_off_t size;
+
+	/* Not fstat, its st_size overflows for big files with 32-bit off_t */
+	size = fz_lseek(fd, 0, 2);
+	if (size <= 0 || fz_lseek(fd, 0, 0) < 0)
+		return fz_open_fd(ctx, fd);
+
+	file = new_file(ctx, fd);
+	file->size = size;
+	file->window = sizeof(void *) >= 8 ? size : MMAP_WINDOW;
+	if (!map_window(file, 0))
+	{
+		fz_free(ctx, file);
+		return fz_open_fd(ctx, fd);
+	}
+
+	stm = fz_new_stream(ctx, file, read_mmap, close_file);
+	stm->seek = seek_mmap;
+	seek_mmap(stm, 0, 0);
+
+	return stm;
+#endif
+}
+
+/* Reader streams */
+
+#ifndef _WIN32
+
+/* Readers never touch the file offset, so they don't disturb each other */
+static int read_pread(fz_stream *stm, unsigned char *buf, int len)
+{
+	struct file *file = stm->state;
+	int n = fz_pread(file->fd, buf, len, stm->pos);
+	if (n < 0)
+		fz_throw(stm->ctx, "read error: %s", strerror(errno));
+	return n;
+}
+
+static void seek_pread(fz_stream *stm, fz_off_t offset, int whence)
+{
+	struct file *file = stm->state;
+	struct fz_stat_buf info;
+
+	/* Not lseek, that would move the offset other streams read at, and
+	 * not plain fstat, see fz_open_mmap */
+	if (whence == 2 && file->size > 0)
+		offset += file->size;
+	else if (whence == 2)
+	{
+		if (fz_fstat(file->fd, &info) < 0)
+			fz_throw(stm->ctx, "cannot stat: %s", strerror(errno));
+		offset += info.st_size;
+	}
+	if (offset < 0)
+		offset = 0;
+	stm->pos = offset;
+	stm->rp = stm->bp;
+	stm->wp = stm->bp;
+}
+
+#endif
+
+fz_stream *
+fz_open_reader(fz_context *ctx, fz_stream *stm, fz_off_t offset)
+{
+#ifdef _WIN32
+	return NULL;
+#else
+	struct file *file = stm->state;
+	fz_stream *reader;
+
+	if (stm->close != close_file)
+		return NULL;
+
+	fz_keep_refs(ctx, &file->refs);
+	if (mapped_whole(file))
+	{
+		/* Share the mapping, reads stay zero copy */
+		reader = fz_new_stream(ctx, file, read_mmap, close_file);
+		reader->seek = seek_mmap;
+	}
+	else
+	{
+		reader = fz_new_stream(ctx, file, read_pread, close_file);
+		reader->seek = seek_pread;
+	}
+	fz_seek(reader, offset, 0);
+
+	/* Start with what stm has buffered from there, it was likely just read */
+	if (reader->read == read_pread && offset < stm->pos && offset >= stm->pos - (stm->wp - stm->bp))
+	{
+		unsigned char *p = stm->wp - (stm->pos - offset);
+		int n = fz_mini(stm->wp - p, sizeof reader->buf);
+		memcpy(reader->buf, p, n);
+		reader->wp = reader->buf + n;
+		reader->pos = offset + n;
+	}
+
+	return reader;
+#endif
+}
+
 #ifdef _WIN32
 fz_stream *
 fz_open_file_w(fz_context *ctx, const wchar_t *name)
@@ -152,7 +425,7 @@ static int read_buffer(fz_stream *stm, unsigned char *buf, int len)
 	return 0;
 }
 
-static void seek_buffer(fz_stream *stm, int offset, int whence)
+static void seek_buffer(fz_stream *stm, fz_off_t offset, int whence)
 {
 	if (whence == 0)
 		stm->rp = stm->bp + offset;
@@ -157,14 +157,14 @@ fz_read_line(fz_stream *stm, char *mem, int n)
 		*s = '\0';
 }
 
-int
+fz_off_t
 fz_tell(fz_stream *stm)
 {
 	return stm->pos - (stm->wp - stm->rp);
 }
 
 void
-fz_seek(fz_stream *stm, int offset, int whence)
+fz_seek(fz_stream *stm, fz_off_t offset, int whence)
 {
 	if (stm->seek)
 	{
@@ -175,7 +175,7 @@ fz_seek(fz_stream *stm, int offset, int whence)
 		}
 		if (whence == 0)
 		{
-			int dist = stm->pos - offset;
+			fz_off_t dist = stm->pos - offset;
 			if (dist >= 0 && dist <= stm->wp - stm->bp)
 			{
 				stm->rp = stm->wp - dist;
@@ -118,7 +118,7 @@ struct pdf_lexbuf_s
 	int size;
 	int base_size;
 	int len;
-	int i;
+	fz_off_t i;
 	float f;
 	char *scratch;
 	char buffer[PDF_LEXBUF_SMALL];
@@ -139,7 +139,7 @@ int pdf_lex(fz_stream *f, pdf_lexbuf *lexbuf);
 pdf_obj *pdf_parse_array(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf);
 pdf_obj *pdf_parse_dict(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf);
 pdf_obj *pdf_parse_stm_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf);
-pdf_obj *pdf_parse_ind_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf, int *num, int *gen, int *stm_ofs);
+pdf_obj *pdf_parse_ind_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf, int *num, int *gen, fz_off_t *stm_ofs);
 
 /*
 	pdf_print_token: print a lexed token to a buffer, growing if necessary
@@ -155,9 +155,9 @@ typedef struct pdf_xref_entry_s pdf_xref_entry;
 struct pdf_xref_entry_s
 {
 	char type;	/* 0=unset (f)ree i(n)use (o)bjstm */
-	int ofs;	/* file offset / objstm object number */
+	fz_off_t ofs;	/* file offset / objstm object number */
 	int gen;	/* generation / objstm index */
-	int stm_ofs;	/* on-disk stream */
+	fz_off_t stm_ofs;	/* on-disk stream */
 	fz_buffer *stm_buf; /* in-memory stream (for updated objects) */
 	pdf_obj *obj;	/* stored/cached object */
 };
@@ -188,8 +188,8 @@ struct pdf_document_s
 	fz_stream *file;
 
 	int version;
-	int startxref;
-	int file_size;
+	fz_off_t startxref;
+	fz_off_t file_size;
 	pdf_crypt *crypt;
 	pdf_obj *trailer;
 	pdf_ocg_descriptor *ocg;
@@ -213,7 +213,7 @@ void pdf_cache_object(pdf_document *doc, int num, int gen);
 fz_stream *pdf_open_inline_stream(pdf_document *doc, pdf_obj *stmobj, int length, fz_stream *chain, pdf_image_params *params);
 fz_buffer *pdf_load_image_stream(pdf_document *doc, int num, int gen, int orig_num, int orig_gen, pdf_image_params *params);
 fz_stream *pdf_open_image_stream(pdf_document *doc, int num, int gen, int orig_num, int orig_gen, pdf_image_params *params);
-fz_stream *pdf_open_stream_with_offset(pdf_document *doc, int num, int gen, pdf_obj *dict, int stm_ofs);
+fz_stream *pdf_open_stream_with_offset(pdf_document *doc, int num, int gen, pdf_obj *dict, fz_off_t stm_ofs);
 fz_stream *pdf_open_image_decomp_stream(fz_context *ctx, fz_buffer *, pdf_image_params *params, int *factor);
 fz_stream *pdf_open_contents_stream(pdf_document *xref, pdf_obj *obj);
 fz_buffer *pdf_load_raw_renumbered_stream(pdf_document *doc, int num, int gen, int orig_num, int orig_gen);
@@ -553,6 +553,8 @@ struct pdf_page_s
 	pdf_annot *annots;
 };
 
+void pdf_page_geometry(pdf_document *doc, int number, fz_rect *mediabox, int *rotate, float *userunit);
+
 /*
  * Content stream parsing
  */
@@ -563,8 +565,10 @@ void pdf_run_glyph(pdf_document *doc, pdf_obj *resources, fz_buffer *contents, f
  * PDF interface to store
  */
 
-void pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, unsigned int itemsize);
-void *pdf_find_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key);
+/* kind is one of FZ_STORE_IMAGE...FZ_STORE_OTHER, see fz_set_store_kind_max.
+ * If an item is already stored for key, it is kept and val is not stored. */
+void pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, unsigned int itemsize, int kind);
+void *pdf_find_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key, int kind);
 void pdf_remove_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key);
 
 #endif
@@ -16,6 +16,7 @@ typedef struct pdf_obj_s pdf_obj;
 pdf_obj *pdf_new_null(fz_context *ctx);
 pdf_obj *pdf_new_bool(fz_context *ctx, int b);
 pdf_obj *pdf_new_int(fz_context *ctx, int i);
+pdf_obj *pdf_new_int_offset(fz_context *ctx, fz_off_t off);
 pdf_obj *pdf_new_real(fz_context *ctx, float f);
 pdf_obj *fz_new_name(fz_context *ctx, char *str);
 pdf_obj *pdf_new_string(fz_context *ctx, char *str, int len);
@@ -52,6 +53,7 @@ void pdf_dict_unmark(pdf_obj *obj);
 /* safe, silent failure, no error reporting on type mismatches */
 int pdf_to_bool(pdf_obj *obj);
 int pdf_to_int(pdf_obj *obj);
+fz_off_t pdf_to_offset(pdf_obj *obj);
 float pdf_to_real(pdf_obj *obj);
 char *pdf_to_name(pdf_obj *obj);
 char *pdf_to_str_buf(pdf_obj *obj);
@@ -25,17 +25,19 @@ pdf_load_embedded_cmap(pdf_document *xref, pdf_obj *stmobj)
 	pdf_obj *obj = NULL;
 	fz_context *ctx = xref->ctx;
 	int phase = 0;
+	int category;
 
 	fz_var(phase);
 	fz_var(obj);
 	fz_var(file);
 	fz_var(cmap);
 
-	if ((cmap = pdf_find_item(ctx, pdf_free_cmap_imp, stmobj)))
+	if ((cmap = pdf_find_item(ctx, pdf_free_cmap_imp, stmobj, FZ_STORE_FONT)))
 	{
 		return cmap;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_FONT);
 	fz_try(ctx)
 	{
 		file = pdf_open_stream(xref, pdf_to_num(stmobj), pdf_to_gen(stmobj));
@@ -63,7 +65,7 @@ pdf_load_embedded_cmap(pdf_document *xref, pdf_obj *stmobj)
 			pdf_drop_cmap(ctx, usecmap);
 		}
 
-		pdf_store_item(ctx, stmobj, cmap, pdf_cmap_size(ctx, cmap));
+		pdf_store_item(ctx, stmobj, cmap, pdf_cmap_size(ctx, cmap), FZ_STORE_FONT);
 	}
 	fz_catch(ctx)
 	{
@@ -80,6 +82,7 @@ pdf_load_embedded_cmap(pdf_document *xref, pdf_obj *stmobj)
 		else
 			fz_throw(ctx, "cannot load embedded usecmap (%d %d R)", pdf_to_num(obj), pdf_to_gen(obj));
 	}
+	fz_set_alloc_category(ctx, category);
 
 	return cmap;
 }
@@ -389,15 +389,18 @@ pdf_load_colorspace(pdf_document *xref, pdf_obj *obj)
 {
 	fz_context *ctx = xref->ctx;
 	fz_colorspace *cs;
+	int category;
 
-	if ((cs = pdf_find_item(ctx, fz_free_colorspace_imp, obj)))
+	if ((cs = pdf_find_item(ctx, fz_free_colorspace_imp, obj, FZ_STORE_OTHER)))
 	{
 		return cs;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_OTHER);
 	cs = pdf_load_colorspace_imp(xref, obj);
 
-	pdf_store_item(ctx, obj, cs, cs->size);
+	pdf_store_item(ctx, obj, cs, cs->size, FZ_STORE_OTHER);
+	fz_set_alloc_category(ctx, category);
 
 	return cs;
 }
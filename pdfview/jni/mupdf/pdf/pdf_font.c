@@ -1103,12 +1103,15 @@ pdf_load_font(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict)
 	pdf_obj *charprocs;
 	fz_context *ctx = xref->ctx;
 	pdf_font_desc *fontdesc;
+	int category;
 
-	if ((fontdesc = pdf_find_item(ctx, pdf_free_font_imp, dict)))
+	if ((fontdesc = pdf_find_item(ctx, pdf_free_font_imp, dict, FZ_STORE_FONT)))
 	{
 		return fontdesc;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_FONT);
+
 	subtype = pdf_to_name(pdf_dict_gets(dict, "Subtype"));
 	dfonts = pdf_dict_gets(dict, "DescendantFonts");
 	charprocs = pdf_dict_gets(dict, "CharProcs");
@@ -1143,7 +1146,8 @@ pdf_load_font(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict)
 	if (fontdesc->font->ft_substitute && !fontdesc->to_ttf_cmap)
 		pdf_make_width_table(ctx, fontdesc);
 
-	pdf_store_item(ctx, dict, fontdesc, fontdesc->size);
+	pdf_store_item(ctx, dict, fontdesc, fontdesc->size, FZ_STORE_FONT);
+	fz_set_alloc_category(ctx, category);
 
 	return fontdesc;
 }
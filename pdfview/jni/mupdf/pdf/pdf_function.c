@@ -1401,12 +1401,15 @@ pdf_load_function(pdf_document *xref, pdf_obj *dict, int in, int out)
 	pdf_function *func;
 	pdf_obj *obj;
 	int i;
+	int category;
 
-	if ((func = pdf_find_item(ctx, pdf_free_function_imp, dict)))
+	if ((func = pdf_find_item(ctx, pdf_free_function_imp, dict, FZ_STORE_FUNCTION)))
 	{
 		return func;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_FUNCTION);
+
 	func = fz_malloc_struct(ctx, pdf_function);
 	FZ_INIT_STORABLE(func, 1, pdf_free_function_imp);
 	func->size = sizeof(*func);
@@ -1471,7 +1474,7 @@ pdf_load_function(pdf_document *xref, pdf_obj *dict, int in, int out)
 			fz_throw(ctx, "unknown function type (%d %d R)", pdf_to_num(dict), pdf_to_gen(dict));
 		}
 
-		pdf_store_item(ctx, dict, func, func->size);
+		pdf_store_item(ctx, dict, func, func->size, FZ_STORE_FUNCTION);
 	}
 	fz_catch(ctx)
 	{
@@ -1485,6 +1488,7 @@ pdf_load_function(pdf_document *xref, pdf_obj *dict, int in, int out)
 				"unknown",
 				pdf_to_num(dict), pdf_to_gen(dict));
 	}
+	fz_set_alloc_category(ctx, category);
 
 	return func;
 }
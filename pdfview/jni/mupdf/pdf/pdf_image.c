@@ -7,9 +7,10 @@ struct pdf_image_key_s {
 	int refs;
 	fz_image *image;
 	int factor;
+	fz_bbox rect; /* region of a huge image, or empty for all of it */
 };
 
-static void pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image);
+static void pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image, int forcemask);
 
 static void
 pdf_mask_color_key(fz_pixmap *pix, int n, int *colorkey)
@@ -35,8 +36,9 @@ pdf_make_hash_image_key(fz_store_hash *hash, void *key_)
 {
 	pdf_image_key *key = (pdf_image_key *)key_;
 
-	hash->u.pi.ptr = key->image;
-	hash->u.pi.i = key->factor;
+	hash->u.pir.ptr = key->image;
+	hash->u.pir.i = key->factor;
+	hash->u.pir.r = key->rect;
 	return 1;
 }
 
@@ -45,9 +47,7 @@ pdf_keep_image_key(fz_context *ctx, void *key_)
 {
 	pdf_image_key *key = (pdf_image_key *)key_;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	key->refs++;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_keep_refs(ctx, &key->refs);
 
 	return (void *)key;
 }
@@ -56,12 +56,8 @@ static void
 pdf_drop_image_key(fz_context *ctx, void *key_)
 {
 	pdf_image_key *key = (pdf_image_key *)key_;
-	int drop;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	drop = --key->refs;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (drop == 0)
+	if (fz_drop_refs(ctx, &key->refs))
 	{
 		fz_drop_image(ctx, key->image);
 		fz_free(ctx, key);
@@ -74,7 +70,9 @@ pdf_cmp_image_key(void *k0_, void *k1_)
 	pdf_image_key *k0 = (pdf_image_key *)k0_;
 	pdf_image_key *k1 = (pdf_image_key *)k1_;
 
-	return k0->image == k1->image && k0->factor == k1->factor;
+	return k0->image == k1->image && k0->factor == k1->factor &&
+		k0->rect.x0 == k1->rect.x0 && k0->rect.y0 == k1->rect.y0 &&
+		k0->rect.x1 == k1->rect.x1 && k0->rect.y1 == k1->rect.y1;
 }
 
 #ifndef NDEBUG
@@ -83,12 +81,16 @@ pdf_debug_image(void *key_)
 {
 	pdf_image_key *key = (pdf_image_key *)key_;
 
-	printf("(image %d x %d sf=%d) ", key->image->w, key->image->h, key->factor);
+	printf("(image %d x %d sf=%d", key->image->w, key->image->h, key->factor);
+	if (!fz_is_empty_bbox(key->rect))
+		printf(" [%d %d %d %d]", key->rect.x0, key->rect.y0, key->rect.x1, key->rect.y1);
+	printf(") ");
 }
 #endif
 
 static fz_store_type pdf_image_store_type =
 {
+	FZ_STORE_IMAGE,
 	pdf_make_hash_image_key,
 	pdf_keep_image_key,
 	pdf_drop_image_key,
@@ -98,35 +100,209 @@ static fz_store_type pdf_image_store_type =
 #endif
 };
 
+/*
+	Subsample factors are rounded down to one of a few mip levels, 1, 2,
+	3, 4, 6, 8, 12, 16, ... up to 256, so that an image only ever has a
+	handful of tiles in the store and they can be derived from each other.
+*/
+static int
+pdf_image_level(int factor)
+{
+	int level = 1;
+
+	if (factor > 256)
+		factor = 256;
+	while (level * 2 <= factor)
+		level *= 2;
+	if (level >= 2 && level / 2 * 3 <= factor)
+		level = level / 2 * 3;
+	return level;
+}
+
+/* The next finer mip level, or 0 below full size */
+static int
+pdf_image_finer_level(int level)
+{
+	if (level <= 2)
+		return level - 1;
+	if ((level & (level - 1)) == 0)
+		return level / 4 * 3;
+	return level / 3 * 2;
+}
+
+static fz_bbox
+pdf_image_bbox(pdf_image *image)
+{
+	fz_bbox bbox;
+
+	bbox.x0 = bbox.y0 = 0;
+	bbox.x1 = image->base.w;
+	bbox.y1 = image->base.h;
+	return bbox;
+}
+
+/*
+	Images whose tile at the wanted level would take more than a
+	quarter of the store's image budget are decoded a region at a
+	time, just big enough for what is drawn. Regions are rounded out
+	to a grid of PDF_IMAGE_CELL pixels (at the level's size) so that
+	neighbouring tiles of a render can share them.
+*/
+#define PDF_IMAGE_CELL 256
+
+static int
+pdf_image_region(fz_context *ctx, pdf_image *image, int factor, fz_bbox area, fz_bbox *region)
+{
+	fz_store_stats stats[FZ_STORE_KINDS];
+	unsigned int size, max;
+	int w = (image->base.w + (factor-1)) / factor;
+	int h = (image->base.h + (factor-1)) / factor;
+	int n = image->base.colorspace ? image->base.colorspace->n + 1 : 1;
+
+	if (image->params.type == PDF_IMAGE_JPX)
+		return 0;
+
+	fz_get_store_usage(ctx, &size, &max);
+	fz_get_store_stats(ctx, stats);
+	if (max == FZ_STORE_UNLIMITED || (stats[FZ_STORE_IMAGE].max != FZ_STORE_UNLIMITED && stats[FZ_STORE_IMAGE].max < max))
+		max = stats[FZ_STORE_IMAGE].max;
+	if (max == FZ_STORE_UNLIMITED)
+		max = FZ_STORE_DEFAULT;
+	if ((double)w * h * n <= max / 4)
+		return 0;
+
+	region->x0 = area.x0 / factor / PDF_IMAGE_CELL * PDF_IMAGE_CELL;
+	region->y0 = area.y0 / factor / PDF_IMAGE_CELL * PDF_IMAGE_CELL;
+	region->x1 = fz_mini(w, (area.x1 + factor * PDF_IMAGE_CELL - 1) / (factor * PDF_IMAGE_CELL) * PDF_IMAGE_CELL);
+	region->y1 = fz_mini(h, (area.y1 + factor * PDF_IMAGE_CELL - 1) / (factor * PDF_IMAGE_CELL) * PDF_IMAGE_CELL);
+
+	if (region->x0 >= region->x1 || region->y0 >= region->y1)
+		return 0;
+	return region->x0 > 0 || region->y0 > 0 || region->x1 < w || region->y1 < h;
+}
+
+/* Read past the rows above a region. Returns 1 if the stream ended
+ * before them. */
+static int
+skip_image_rows(fz_context *ctx, fz_stream *stm, unsigned char *buf, int stride, int rows, int bufrows)
+{
+	int len, n;
+
+	while (rows > 0)
+	{
+		n = fz_mini(rows, bufrows);
+		len = fz_read(stm, buf, n * stride);
+		if (len < 0)
+			fz_throw(ctx, "cannot read image data");
+		if (len < n * stride)
+			return 1;
+		rows -= n;
+	}
+	return 0;
+}
+
+/* Read rows of packed samples, inverting image masks. Returns 1 if
+ * the stream ended early and the rest had to be padded. */
+static int
+read_image_samples(fz_context *ctx, fz_stream *stm, pdf_image *image, unsigned char *samples, int size)
+{
+	int len, i;
+
+	len = fz_read(stm, samples, size);
+	if (len < 0)
+	{
+		fz_throw(ctx, "cannot read image data");
+	}
+
+	if (len < size)
+		memset(samples + len, 0, size - len);
+
+	/* Invert 1-bit image masks */
+	if (image->imagemask)
+	{
+		/* 0=opaque and 1=transparent so we need to invert */
+		for (i = 0; i < size; i++)
+			samples[i] = ~samples[i];
+	}
+
+	return len < size;
+}
+
+/*
+	Decode an image at 1/factor of its size. The stream has already
+	been reduced by sfactor (DCT can scale while decoding); whatever is
+	left is box filtered a band of rows at a time, so the image is
+	never unpacked at the stream's full size. Indexed images are only
+	ever decoded at full size.
+
+	If region is given (in pixels of the reduced image, on a
+	PDF_IMAGE_CELL boundary) only that part is unpacked: rows above it
+	are read and thrown away and we stop reading after its last row.
+*/
 static fz_pixmap *
-decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int in_line, int indexed, int factor, int cache)
+decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int in_line, int indexed, int factor, int sfactor, fz_bbox *region)
 {
 	fz_pixmap *tile = NULL;
-	fz_pixmap *existing_tile;
-	int stride, len, i;
+	fz_pixmap *band = NULL;
+	int stride, skip, y, truncated;
 	unsigned char *samples = NULL;
-	int w = (image->base.w + (factor-1)) / factor;
-	int h = (image->base.h + (factor-1)) / factor;
-	pdf_image_key *key;
+	int sw = (image->base.w + (sfactor-1)) / sfactor;
+	int sh = (image->base.h + (sfactor-1)) / sfactor;
+	int box = factor / sfactor;
+	fz_bbox r;
 
 	fz_var(tile);
+	fz_var(band);
 	fz_var(samples);
 
+	if (region)
+		r = *region;
+	else
+	{
+		r.x0 = r.y0 = 0;
+		r.x1 = (sw + (box-1)) / box;
+		r.y1 = (sh + (box-1)) / box;
+	}
+
 	fz_try(ctx)
 	{
-		tile = fz_new_pixmap(ctx, image->base.colorspace, w, h);
+		tile = fz_new_pixmap(ctx, image->base.colorspace, r.x1 - r.x0, r.y1 - r.y0);
 		tile->interpolate = image->interpolate;
 
-		stride = (w * image->n * image->bpc + 7) / 8;
-
-		samples = fz_malloc_array(ctx, h, stride);
+		stride = (sw * image->n * image->bpc + 7) / 8;
+		skip = r.x0 * box * image->n * image->bpc / 8;
 
-		len = fz_read(stm, samples, h * stride);
-		if (len < 0)
+		if (box == 1)
 		{
-			fz_throw(ctx, "cannot read image data");
+			samples = fz_malloc_array(ctx, tile->h, stride);
+			truncated = skip_image_rows(ctx, stm, samples, stride, r.y0, tile->h);
+			truncated |= read_image_samples(ctx, stm, image, samples, tile->h * stride);
+			fz_unpack_tile(tile, samples + skip, image->n, image->bpc, stride, indexed);
+			if (image->usecolorkey)
+				pdf_mask_color_key(tile, image->n, image->colorkey);
+		}
+		else
+		{
+			assert(!indexed);
+			band = fz_new_pixmap(ctx, image->base.colorspace, fz_mini(r.x1 * box, sw) - r.x0 * box, box);
+			samples = fz_malloc_array(ctx, box, stride);
+			truncated = skip_image_rows(ctx, stm, samples, stride, r.y0 * box, box);
+			for (y = r.y0; y < r.y1; y++)
+			{
+				band->h = fz_mini(box, sh - y * box);
+				truncated |= read_image_samples(ctx, stm, image, samples, band->h * stride);
+				fz_unpack_tile(band, samples + skip, image->n, image->bpc, stride, 0);
+				if (image->usecolorkey)
+					pdf_mask_color_key(band, image->n, image->colorkey);
+				fz_subsample_band(tile, y - r.y0, band, box);
+			}
+			fz_drop_pixmap(ctx, band);
+			band = NULL;
 		}
 
+		fz_free(ctx, samples);
+		samples = NULL;
+
 		/* Make sure we read the EOF marker (for inline images only) */
 		if (in_line)
 		{
@@ -144,29 +320,8 @@ decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int
 		}
 
 		/* Pad truncated images */
-		if (len < stride * h)
-		{
+		if (truncated)
 			fz_warn(ctx, "padding truncated image");
-			memset(samples + len, 0, stride * h - len);
-		}
-
-		/* Invert 1-bit image masks */
-		if (image->imagemask)
-		{
-			/* 0=opaque and 1=transparent so we need to invert */
-			unsigned char *p = samples;
-			len = h * stride;
-			for (i = 0; i < len; i++)
-				p[i] = ~p[i];
-		}
-
-		fz_unpack_tile(tile, samples, image->n, image->bpc, stride, indexed);
-
-		fz_free(ctx, samples);
-		samples = NULL;
-
-		if (image->usecolorkey)
-			pdf_mask_color_key(tile, image->n, image->colorkey);
 
 		if (indexed)
 		{
@@ -189,22 +344,78 @@ decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int
 	{
 		if (tile)
 			fz_drop_pixmap(ctx, tile);
+		fz_drop_pixmap(ctx, band);
 		fz_free(ctx, samples);
 
 		fz_rethrow(ctx);
 	}
 
-	if (!cache)
-		return tile;
+	return tile;
+}
+
+/* Decode a JPX image, letting openjpeg drop resolution levels for the
+ * power of two part of factor and box filtering the rest. */
+static fz_pixmap *
+decomp_jpx_image(fz_context *ctx, pdf_image *image, int factor)
+{
+	fz_pixmap *tile = NULL;
+	fz_pixmap *reduced;
+	int reduce = 0;
+
+	fz_var(tile);
+
+	while (reduce < 5 && factor % (2 << reduce) == 0)
+		reduce++;
+
+	fz_try(ctx)
+	{
+		tile = fz_load_jpx(ctx, image->buffer->data, image->buffer->len, image->base.colorspace, 0, reduce);
+	}
+	fz_catch(ctx)
+	{
+		if (!reduce)
+			fz_rethrow(ctx);
+		/* fewer resolution levels than we asked to drop */
+		reduce = 0;
+		tile = fz_load_jpx(ctx, image->buffer->data, image->buffer->len, image->base.colorspace, 0, 0);
+	}
+
+	fz_try(ctx)
+	{
+		if (factor >> reduce > 1)
+		{
+			reduced = fz_subsample_pixmap(ctx, tile, factor >> reduce);
+			fz_drop_pixmap(ctx, tile);
+			tile = reduced;
+		}
+		fz_decode_tile(tile, image->decode);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
+		fz_rethrow(ctx);
+	}
+
+	return tile;
+}
+
+/* Put a tile in the store as the given mip level of the image, or a
+ * region of it. Any failure here will just result in us not caching. */
+static fz_pixmap *
+pdf_store_image_tile(fz_context *ctx, pdf_image *image, int factor, fz_bbox rect, fz_pixmap *tile)
+{
+	fz_pixmap *existing_tile;
+	pdf_image_key *key = NULL;
+
+	fz_var(key);
 
-	/* Now we try to cache the pixmap. Any failure here will just result
-	 * in us not caching. */
 	fz_try(ctx)
 	{
 		key = fz_malloc_struct(ctx, pdf_image_key);
 		key->refs = 1;
 		key->image = fz_keep_image(ctx, &image->base);
 		key->factor = factor;
+		key->rect = rect;
 		existing_tile = fz_store_item(ctx, key, tile, fz_pixmap_size(ctx, tile), &pdf_image_store_type);
 		if (existing_tile)
 		{
@@ -216,7 +427,8 @@ decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int
 	}
 	fz_always(ctx)
 	{
-		pdf_drop_image_key(ctx, key);
+		if (key)
+			pdf_drop_image_key(ctx, key);
 	}
 	fz_catch(ctx)
 	{
@@ -226,6 +438,32 @@ decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int
 	return tile;
 }
 
+/* Copy a region out of a tile of the whole image, dropping the tile */
+static fz_pixmap *
+pdf_crop_image_tile(fz_context *ctx, fz_pixmap *tile, fz_bbox region)
+{
+	fz_pixmap *crop = NULL;
+
+	fz_try(ctx)
+	{
+		crop = fz_new_pixmap_with_bbox(ctx, tile->colorspace, region);
+		fz_copy_pixmap_rect(ctx, crop, tile, region);
+		crop->x = 0;
+		crop->y = 0;
+		crop->interpolate = tile->interpolate;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return crop;
+}
+
 static void
 pdf_free_image(fz_context *ctx, fz_storable *image_)
 {
@@ -241,13 +479,18 @@ pdf_free_image(fz_context *ctx, fz_storable *image_)
 }
 
 static fz_pixmap *
-pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h)
+pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h, fz_bbox *subarea)
 {
 	pdf_image *image = (pdf_image *)image_;
-	fz_pixmap *tile;
+	fz_pixmap *tile = NULL;
+	fz_pixmap *finer;
 	fz_stream *stm;
-	int factor;
+	int factor, sfactor;
 	pdf_image_key key;
+	fz_bbox region;
+	int category;
+
+	fz_var(tile);
 
 	/* Check for 'simple' images which are just pixmaps */
 	if (image->buffer == NULL)
@@ -255,6 +498,8 @@ pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h)
 		tile = image->tile;
 		if (!tile)
 			return NULL;
+		if (subarea)
+			*subarea = pdf_image_bbox(image);
 		return fz_keep_pixmap(ctx, tile); /* That's all we can give you! */
 	}
 
@@ -265,28 +510,92 @@ pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h)
 		h = image->base.h;
 
 	/* What is our ideal factor? */
-	if (w == 0 || h == 0)
+	if (w <= 0 || h <= 0)
 		factor = 1;
 	else
-		for (factor=1; image->base.w/(2*factor) >= w && image->base.h/(2*factor) >= h && factor < 8; factor *= 2);
+		factor = pdf_image_level(fz_mini(image->base.w / w, image->base.h / h));
 
-	/* Can we find any suitable tiles in the cache? */
 	key.refs = 1;
 	key.image = &image->base;
-	key.factor = factor;
-	do
+	key.rect = fz_empty_bbox;
+
+	/* Only decode the wanted part of a huge image. A tile of the whole
+	 * image at this level is cropped instead, if we have one; finer
+	 * levels are not used, so that a region comes out the same
+	 * whatever happens to be in the cache. */
+	if (subarea && pdf_image_region(ctx, image, factor, *subarea, &region))
 	{
+		subarea->x0 = region.x0 * factor;
+		subarea->y0 = region.y0 * factor;
+		subarea->x1 = fz_mini(region.x1 * factor, image->base.w);
+		subarea->y1 = fz_mini(region.y1 * factor, image->base.h);
+		key.factor = factor;
+		tile = fz_find_item(ctx, fz_free_pixmap_imp, &key, &pdf_image_store_type);
+		if (tile)
+			return pdf_crop_image_tile(ctx, tile, region);
+		key.rect = region;
 		tile = fz_find_item(ctx, fz_free_pixmap_imp, &key, &pdf_image_store_type);
 		if (tile)
 			return tile;
-		key.factor >>= 1;
 	}
-	while (key.factor > 0);
+	else
+	{
+		region = fz_empty_bbox;
+		if (subarea)
+			*subarea = pdf_image_bbox(image);
+
+		/* Can we find any suitable tiles in the cache? A finer level
+		 * that divides ours is reduced, rather than decoding the image
+		 * again. */
+		for (key.factor = factor; key.factor > 0; key.factor = pdf_image_finer_level(key.factor))
+		{
+			finer = fz_find_item(ctx, fz_free_pixmap_imp, &key, &pdf_image_store_type);
+			if (!finer)
+				continue;
+			if (key.factor == factor || factor % key.factor != 0)
+				return finer;
+
+			category = fz_set_alloc_category(ctx, FZ_STORE_IMAGE);
+			fz_try(ctx)
+			{
+				tile = fz_subsample_pixmap(ctx, finer, factor / key.factor);
+			}
+			fz_always(ctx)
+			{
+				fz_drop_pixmap(ctx, finer);
+				fz_set_alloc_category(ctx, category);
+			}
+			fz_catch(ctx)
+			{
+				fz_rethrow(ctx);
+			}
+			return pdf_store_image_tile(ctx, image, factor, fz_empty_bbox, tile);
+		}
+	}
 
 	/* We need to make a new one. */
-	stm = pdf_open_image_decomp_stream(ctx, image->buffer, &image->params, &factor);
+	category = fz_set_alloc_category(ctx, FZ_STORE_IMAGE);
+	fz_try(ctx)
+	{
+		if (image->params.type == PDF_IMAGE_JPX)
+			tile = decomp_jpx_image(ctx, image, factor);
+		else
+		{
+			sfactor = factor;
+			stm = pdf_open_image_decomp_stream(ctx, image->buffer, &image->params, &sfactor);
+			tile = decomp_image_from_stream(ctx, stm, image, 0, 0, factor, sfactor, fz_is_empty_bbox(region) ? NULL : &region);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_set_alloc_category(ctx, category);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 
-	return decomp_image_from_stream(ctx, stm, image, 0, 0, factor, 1);
+	return pdf_store_image_tile(ctx, image, factor, region, tile);
 }
 
 static pdf_image *
@@ -316,7 +625,7 @@ pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *c
 		/* special case for JPEG2000 images */
 		if (pdf_is_jpx_image(ctx, dict))
 		{
-			pdf_load_jpx(xref, dict, image);
+			pdf_load_jpx(xref, dict, image, forcemask);
 
 			if (forcemask)
 			{
@@ -435,6 +744,9 @@ pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *c
 			int num = pdf_to_num(dict);
 			int gen = pdf_to_gen(dict);
 			image->buffer = pdf_load_image_stream(xref, num, gen, num, gen, &image->params);
+			/* Trimmed here rather than lazily, as the buffer is
+			 * shared by threads decoding the image later on. */
+			fz_trim_buffer(ctx, image->buffer);
 			break; /* Out of fz_try */
 		}
 
@@ -449,7 +761,7 @@ pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *c
 			stm = pdf_open_stream(xref, pdf_to_num(dict), pdf_to_gen(dict));
 		}
 
-		image->tile = decomp_image_from_stream(ctx, stm, image, cstm != NULL, indexed, 1, 0);
+		image->tile = decomp_image_from_stream(ctx, stm, image, cstm != NULL, indexed, 1, 1, NULL);
 	}
 	fz_catch(ctx)
 	{
@@ -481,8 +793,15 @@ pdf_is_jpx_image(fz_context *ctx, pdf_obj *dict)
 	return 0;
 }
 
+/*
+	JPX images with a known size and colorspace are decoded on demand,
+	like other images, so that openjpeg can skip the resolution levels
+	a zoomed out view does not need. Soft masks and indexed images, or
+	ones that need the codestream to tell their colorspace, are decoded
+	now at full size.
+*/
 static void
-pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
+pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image, int forcemask)
 {
 	fz_buffer *buf = NULL;
 	fz_colorspace *colorspace = NULL;
@@ -490,6 +809,7 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 	pdf_obj *obj;
 	fz_context *ctx = xref->ctx;
 	int indexed = 0;
+	int w, h, lazy;
 
 	fz_var(img);
 	fz_var(buf);
@@ -507,13 +827,20 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 			indexed = !strcmp(colorspace->name, "Indexed");
 		}
 
-		img = fz_load_jpx(ctx, buf->data, buf->len, colorspace, indexed);
+		w = pdf_to_int(pdf_dict_getsa(dict, "Width", "W"));
+		h = pdf_to_int(pdf_dict_getsa(dict, "Height", "H"));
+		lazy = colorspace && !indexed && !forcemask && w > 0 && h > 0;
 
-		if (img && colorspace == NULL)
-			colorspace = fz_keep_colorspace(ctx, img->colorspace);
+		if (!lazy)
+		{
+			img = fz_load_jpx(ctx, buf->data, buf->len, colorspace, indexed, 0);
 
-		fz_drop_buffer(ctx, buf);
-		buf = NULL;
+			if (img && colorspace == NULL)
+				colorspace = fz_keep_colorspace(ctx, img->colorspace);
+
+			fz_drop_buffer(ctx, buf);
+			buf = NULL;
+		}
 
 		obj = pdf_dict_getsa(dict, "SMask", "Mask");
 		if (pdf_is_dict(obj))
@@ -522,7 +849,19 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 		}
 
 		obj = pdf_dict_getsa(dict, "Decode", "D");
-		if (obj && !indexed)
+		if (lazy)
+		{
+			int i;
+
+			for (i = 0; i < FZ_MAX_COLORS * 2; i++)
+				image->decode[i] = i & 1;
+			if (obj)
+			{
+				for (i = 0; i < colorspace->n * 2; i++)
+					image->decode[i] = pdf_to_real(pdf_array_get(obj, i));
+			}
+		}
+		else if (obj && !indexed)
 		{
 			float decode[FZ_MAX_COLORS * 2];
 			int i;
@@ -532,6 +871,11 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 
 			fz_decode_tile(img, decode);
 		}
+
+		/* Trimmed here rather than lazily, as the buffer is
+		 * shared by threads decoding the image later on. */
+		if (lazy)
+			fz_trim_buffer(ctx, buf);
 	}
 	fz_catch(ctx)
 	{
@@ -544,16 +888,27 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 	image->params.type = PDF_IMAGE_RAW;
 	FZ_INIT_STORABLE(&image->base, 1, pdf_free_image);
 	image->base.get_pixmap = pdf_image_get_pixmap;
-	image->base.w = img->w;
-	image->base.h = img->h;
 	image->base.colorspace = colorspace;
-	image->tile = img;
-	image->n = img->n;
 	image->bpc = 8;
 	image->interpolate = 0;
 	image->imagemask = 0;
 	image->usecolorkey = 0;
 	image->params.colorspace = colorspace; /* Uses the same ref as for the base one */
+	if (lazy)
+	{
+		image->params.type = PDF_IMAGE_JPX;
+		image->base.w = w;
+		image->base.h = h;
+		image->n = colorspace->n;
+		image->buffer = buf;
+	}
+	else
+	{
+		image->base.w = img->w;
+		image->base.h = img->h;
+		image->tile = img;
+		image->n = img->n;
+	}
 }
 
 static int
@@ -569,15 +924,18 @@ pdf_load_image(pdf_document *xref, pdf_obj *dict)
 {
 	fz_context *ctx = xref->ctx;
 	pdf_image *image;
+	int category;
 
-	if ((image = pdf_find_item(ctx, pdf_free_image, dict)))
+	if ((image = pdf_find_item(ctx, pdf_free_image, dict, FZ_STORE_IMAGE)))
 	{
 		return (fz_image *)image;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_IMAGE);
 	image = pdf_load_image_imp(xref, NULL, dict, NULL, 0);
 
-	pdf_store_item(ctx, dict, image, pdf_image_size(ctx, image));
+	pdf_store_item(ctx, dict, image, pdf_image_size(ctx, image), FZ_STORE_IMAGE);
+	fz_set_alloc_category(ctx, category);
 
 	return (fz_image *)image;
 }
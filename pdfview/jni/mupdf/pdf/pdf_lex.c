@@ -66,7 +66,7 @@ static int
 lex_number(fz_stream *f, pdf_lexbuf *buf, int c)
 {
 	int neg = 0;
-	int i = 0;
+	fz_off_t i = 0;
 	int n;
 	int d;
 	float v;
@@ -538,7 +538,7 @@ void pdf_print_token(fz_context *ctx, fz_buffer *fzbuf, int tok, pdf_lexbuf *buf
 		fz_buffer_printf(ctx, fzbuf, "}");
 		break;
 	case PDF_TOK_INT:
-		fz_buffer_printf(ctx, fzbuf, "%d", buf->i);
+		fz_buffer_printf(ctx, fzbuf, "%lld", buf->i);
 		break;
 	case PDF_TOK_REAL:
 		{
@@ -28,7 +28,7 @@ struct pdf_obj_s
 	union
 	{
 		int b;
-		int i;
+		fz_off_t i;
 		float f;
 		struct {
 			unsigned short len;
@@ -55,11 +55,31 @@ struct pdf_obj_s
 	} u;
 };
 
+/* Objects are accounted as such whatever loads them; a throw restores
+ * the category, so these don't need a try of their own */
+static void *
+obj_malloc(fz_context *ctx, unsigned int size)
+{
+	int category = fz_set_alloc_category(ctx, FZ_ALLOC_OBJECT);
+	void *p = fz_malloc(ctx, size);
+	fz_set_alloc_category(ctx, category);
+	return p;
+}
+
+static void *
+obj_malloc_array(fz_context *ctx, unsigned int count, unsigned int size)
+{
+	int category = fz_set_alloc_category(ctx, FZ_ALLOC_OBJECT);
+	void *p = fz_malloc_array(ctx, count, size);
+	fz_set_alloc_category(ctx, category);
+	return p;
+}
+
 pdf_obj *
 pdf_new_null(fz_context *ctx)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(null)");
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(null)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_NULL;
@@ -70,7 +90,7 @@ pdf_obj *
 pdf_new_bool(fz_context *ctx, int b)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(bool)");
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(bool)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_BOOL;
@@ -82,7 +102,7 @@ pdf_obj *
 pdf_new_int(fz_context *ctx, int i)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(int)");
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(int)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_INT;
@@ -90,11 +110,23 @@ pdf_new_int(fz_context *ctx, int i)
 	return obj;
 }
 
+pdf_obj *
+pdf_new_int_offset(fz_context *ctx, fz_off_t off)
+{
+	pdf_obj *obj;
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(offset)");
+	obj->ctx = ctx;
+	obj->refs = 1;
+	obj->kind = PDF_INT;
+	obj->u.i = off;
+	return obj;
+}
+
 pdf_obj *
 pdf_new_real(fz_context *ctx, float f)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(real)");
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(real)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_REAL;
@@ -106,7 +138,7 @@ pdf_obj *
 pdf_new_string(fz_context *ctx, char *str, int len)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj, u.s.buf) + len + 1), "pdf_obj(string)");
+	obj = Memento_label(obj_malloc(ctx, offsetof(pdf_obj, u.s.buf) + len + 1), "pdf_obj(string)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_STRING;
@@ -120,7 +152,7 @@ pdf_obj *
 fz_new_name(fz_context *ctx, char *str)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj, u.n) + strlen(str) + 1), "pdf_obj(name)");
+	obj = Memento_label(obj_malloc(ctx, offsetof(pdf_obj, u.n) + strlen(str) + 1), "pdf_obj(name)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_NAME;
@@ -132,7 +164,7 @@ pdf_obj *
 pdf_new_indirect(fz_context *ctx, int num, int gen, void *xref)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(indirect)");
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(indirect)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_INDIRECT;
@@ -225,12 +257,24 @@ int pdf_to_int(pdf_obj *obj)
 	if (!obj)
 		return 0;
 	if (obj->kind == PDF_INT)
-		return obj->u.i;
+		return (int)obj->u.i;
 	if (obj->kind == PDF_REAL)
 		return (int)(obj->u.f + 0.5f); /* No roundf in MSVC */
 	return 0;
 }
 
+fz_off_t pdf_to_offset(pdf_obj *obj)
+{
+	RESOLVE(obj);
+	if (!obj)
+		return 0;
+	if (obj->kind == PDF_INT)
+		return obj->u.i;
+	if (obj->kind == PDF_REAL)
+		return (fz_off_t)(obj->u.f + 0.5f);
+	return 0;
+}
+
 float pdf_to_real(pdf_obj *obj)
 {
 	RESOLVE(obj);
@@ -335,7 +379,11 @@ pdf_objcmp(pdf_obj *a, pdf_obj *b)
 		return a->u.b - b->u.b;
 
 	case PDF_INT:
-		return a->u.i - b->u.i;
+		if (a->u.i < b->u.i)
+			return -1;
+		if (a->u.i > b->u.i)
+			return 1;
+		return 0;
 
 	case PDF_REAL:
 		if (a->u.f < b->u.f)
@@ -417,7 +465,7 @@ pdf_new_array(fz_context *ctx, int initialcap)
 	pdf_obj *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(array)");
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(array)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_ARRAY;
@@ -427,7 +475,7 @@ pdf_new_array(fz_context *ctx, int initialcap)
 
 	fz_try(ctx)
 	{
-		obj->u.a.items = Memento_label(fz_malloc_array(ctx, obj->u.a.cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
+		obj->u.a.items = Memento_label(obj_malloc_array(ctx, obj->u.a.cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
 	}
 	fz_catch(ctx)
 	{
@@ -674,7 +722,7 @@ pdf_new_dict(fz_context *ctx, int initialcap)
 	pdf_obj *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(dict)");
+	obj = Memento_label(obj_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(dict)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_DICT;
@@ -686,7 +734,7 @@ pdf_new_dict(fz_context *ctx, int initialcap)
 
 	fz_try(ctx)
 	{
-		obj->u.d.items = Memento_label(fz_malloc_array(ctx, obj->u.d.cap, sizeof(struct keyval)), "pdf_obj(dict items)");
+		obj->u.d.items = Memento_label(obj_malloc_array(ctx, obj->u.d.cap, sizeof(struct keyval)), "pdf_obj(dict items)");
 	}
 	fz_catch(ctx)
 	{
@@ -1363,7 +1411,7 @@ static void fmt_obj(struct fmt *fmt, pdf_obj *obj)
 		fmt_puts(fmt, pdf_to_bool(obj) ? "true" : "false");
 	else if (pdf_is_int(obj))
 	{
-		sprintf(buf, "%d", pdf_to_int(obj));
+		sprintf(buf, "%lld", pdf_to_offset(obj));
 		fmt_puts(fmt, buf);
 	}
 	else if (pdf_is_real(obj))
@@ -285,30 +285,25 @@ found:
 	return useBM;
 }
 
-pdf_page *
-pdf_load_page(pdf_document *xref, int number)
+/*
+ * Page size and rotation as pdf_load_page sets them, taken from the page
+ * dictionary only, so callers can learn page geometry without loading
+ * the page and its annotations.
+ */
+void
+pdf_page_geometry(pdf_document *xref, int number, fz_rect *mediaboxp, int *rotatep, float *userunitp)
 {
 	fz_context *ctx = xref->ctx;
-	pdf_page *page;
-	pdf_annot *annot;
-	pdf_obj *pageobj, *pageref, *obj;
-	fz_rect mediabox, cropbox, realbox;
-	fz_matrix ctm;
+	pdf_obj *pageobj, *obj;
+	fz_rect mediabox, cropbox, box;
 	float userunit;
+	int rotate;
 
 	pdf_load_page_tree(xref);
 	if (number < 0 || number >= xref->page_len)
 		fz_throw(ctx, "cannot find page %d", number + 1);
 
 	pageobj = xref->page_objs[number];
-	pageref = xref->page_refs[number];
-
-	page = fz_malloc_struct(ctx, pdf_page);
-	page->resources = NULL;
-	page->contents = NULL;
-	page->transparency = 0;
-	page->links = NULL;
-	page->annots = NULL;
 
 	obj = pdf_dict_gets(pageobj, "UserUnit");
 	if (pdf_is_real(obj))
@@ -330,26 +325,58 @@ pdf_load_page(pdf_document *xref, int number)
 	if (!fz_is_empty_rect(cropbox))
 		mediabox = fz_intersect_rect(mediabox, cropbox);
 
-	page->mediabox.x0 = fz_min(mediabox.x0, mediabox.x1) * userunit;
-	page->mediabox.y0 = fz_min(mediabox.y0, mediabox.y1) * userunit;
-	page->mediabox.x1 = fz_max(mediabox.x0, mediabox.x1) * userunit;
-	page->mediabox.y1 = fz_max(mediabox.y0, mediabox.y1) * userunit;
+	box.x0 = fz_min(mediabox.x0, mediabox.x1) * userunit;
+	box.y0 = fz_min(mediabox.y0, mediabox.y1) * userunit;
+	box.x1 = fz_max(mediabox.x0, mediabox.x1) * userunit;
+	box.y1 = fz_max(mediabox.y0, mediabox.y1) * userunit;
 
-	if (page->mediabox.x1 - page->mediabox.x0 < 1 || page->mediabox.y1 - page->mediabox.y0 < 1)
+	if (box.x1 - box.x0 < 1 || box.y1 - box.y0 < 1)
 	{
 		fz_warn(ctx, "invalid page size in page %d", number + 1);
-		page->mediabox = fz_unit_rect;
+		box = fz_unit_rect;
 	}
 
-	page->rotate = pdf_to_int(pdf_dict_gets(pageobj, "Rotate"));
-	/* Snap page->rotate to 0, 90, 180 or 270 */
-	if (page->rotate < 0)
-		page->rotate = 360 - ((-page->rotate) % 360);
-	if (page->rotate >= 360)
-		page->rotate = page->rotate % 360;
-	page->rotate = 90*((page->rotate + 45)/90);
-	if (page->rotate > 360)
-		page->rotate = 0;
+	rotate = pdf_to_int(pdf_dict_gets(pageobj, "Rotate"));
+	/* Snap rotate to 0, 90, 180 or 270 */
+	if (rotate < 0)
+		rotate = 360 - ((-rotate) % 360);
+	if (rotate >= 360)
+		rotate = rotate % 360;
+	rotate = 90*((rotate + 45)/90);
+	if (rotate > 360)
+		rotate = 0;
+
+	*mediaboxp = box;
+	*rotatep = rotate;
+	*userunitp = userunit;
+}
+
+pdf_page *
+pdf_load_page(pdf_document *xref, int number)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_page *page;
+	pdf_annot *annot;
+	pdf_obj *pageobj, *pageref, *obj;
+	fz_rect realbox;
+	fz_matrix ctm;
+	float userunit;
+
+	pdf_load_page_tree(xref);
+	if (number < 0 || number >= xref->page_len)
+		fz_throw(ctx, "cannot find page %d", number + 1);
+
+	pageobj = xref->page_objs[number];
+	pageref = xref->page_refs[number];
+
+	page = fz_malloc_struct(ctx, pdf_page);
+	page->resources = NULL;
+	page->contents = NULL;
+	page->transparency = 0;
+	page->links = NULL;
+	page->annots = NULL;
+
+	pdf_page_geometry(xref, number, &page->mediabox, &page->rotate, &userunit);
 
 	ctm = fz_concat(fz_rotate(-page->rotate), fz_scale(1, -1));
 	realbox = fz_transform_rect(ctm, page->mediabox);
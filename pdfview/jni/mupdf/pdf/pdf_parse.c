@@ -175,7 +175,8 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 {
 	pdf_obj *ary = NULL;
 	pdf_obj *obj = NULL;
-	int a = 0, b = 0, n = 0;
+	fz_off_t a = 0;
+	int b = 0, n = 0;
 	int tok;
 	fz_context *ctx = file->ctx;
 	pdf_obj *op;
@@ -194,7 +195,7 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 			{
 				if (n > 0)
 				{
-					obj = pdf_new_int(ctx, a);
+					obj = pdf_new_int_offset(ctx, a);
 					pdf_array_push(ary, obj);
 					pdf_drop_obj(obj);
 					obj = NULL;
@@ -211,7 +212,7 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 
 			if (tok == PDF_TOK_INT && n == 2)
 			{
-				obj = pdf_new_int(ctx, a);
+				obj = pdf_new_int_offset(ctx, a);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
@@ -317,7 +318,8 @@ pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 	pdf_obj *key = NULL;
 	pdf_obj *val = NULL;
 	int tok;
-	int a, b;
+	fz_off_t a;
+	int b;
 	fz_context *ctx = file->ctx;
 
 	dict = pdf_new_dict(ctx, 8);
@@ -369,7 +371,7 @@ pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 				if (tok == PDF_TOK_CLOSE_DICT || tok == PDF_TOK_NAME ||
 					(tok == PDF_TOK_KEYWORD && !strcmp(buf->scratch, "ID")))
 				{
-					val = pdf_new_int(ctx, a);
+					val = pdf_new_int_offset(ctx, a);
 					pdf_dict_put(dict, key, val);
 					pdf_drop_obj(val);
 					val = NULL;
@@ -430,7 +432,7 @@ pdf_parse_stm_obj(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 	case PDF_TOK_TRUE: return pdf_new_bool(ctx, 1); break;
 	case PDF_TOK_FALSE: return pdf_new_bool(ctx, 0); break;
 	case PDF_TOK_NULL: return pdf_new_null(ctx); break;
-	case PDF_TOK_INT: return pdf_new_int(ctx, buf->i); break;
+	case PDF_TOK_INT: return pdf_new_int_offset(ctx, buf->i); break;
 	default: fz_throw(ctx, "unknown token in object stream");
 	}
 	return NULL; /* Stupid MSVC */
@@ -439,12 +441,14 @@ pdf_parse_stm_obj(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 pdf_obj *
 pdf_parse_ind_obj(pdf_document *xref,
 	fz_stream *file, pdf_lexbuf *buf,
-	int *onum, int *ogen, int *ostmofs)
+	int *onum, int *ogen, fz_off_t *ostmofs)
 {
 	pdf_obj *obj = NULL;
-	int num = 0, gen = 0, stm_ofs;
+	int num = 0, gen = 0;
+	fz_off_t stm_ofs;
 	int tok;
-	int a, b;
+	fz_off_t a;
+	int b;
 	fz_context *ctx = file->ctx;
 
 	fz_var(obj);
@@ -488,7 +492,7 @@ pdf_parse_ind_obj(pdf_document *xref,
 
 		if (tok == PDF_TOK_STREAM || tok == PDF_TOK_ENDOBJ)
 		{
-			obj = pdf_new_int(ctx, a);
+			obj = pdf_new_int_offset(ctx, a);
 			goto skip;
 		}
 		if (tok == PDF_TOK_INT)
@@ -39,19 +39,22 @@ pdf_load_pattern(pdf_document *xref, pdf_obj *dict)
 	pdf_pattern *pat;
 	pdf_obj *obj;
 	fz_context *ctx = xref->ctx;
+	int category;
 
-	if ((pat = pdf_find_item(ctx, pdf_free_pattern_imp, dict)))
+	if ((pat = pdf_find_item(ctx, pdf_free_pattern_imp, dict, FZ_STORE_OTHER)))
 	{
 		return pat;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_OTHER);
 	pat = fz_malloc_struct(ctx, pdf_pattern);
+	fz_set_alloc_category(ctx, category);
 	FZ_INIT_STORABLE(pat, 1, pdf_free_pattern_imp);
 	pat->resources = NULL;
 	pat->contents = NULL;
 
 	/* Store pattern now, to avoid possible recursion if objects refer back to this one */
-	pdf_store_item(ctx, dict, pat, pdf_pattern_size(pat));
+	pdf_store_item(ctx, dict, pat, pdf_pattern_size(pat), FZ_STORE_OTHER);
 
 	pat->ismask = pdf_to_int(pdf_dict_gets(dict, "PaintType")) == 2;
 	pat->xstep = pdf_to_real(pdf_dict_gets(dict, "XStep"));
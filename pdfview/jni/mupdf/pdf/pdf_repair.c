@@ -10,13 +10,13 @@ struct entry
 {
 	int num;
 	int gen;
-	int ofs;
-	int stm_ofs;
+	fz_off_t ofs;
+	fz_off_t stm_ofs;
 	int stm_len;
 };
 
 static void
-pdf_repair_obj(fz_stream *file, pdf_lexbuf *buf, int *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id)
+pdf_repair_obj(fz_stream *file, pdf_lexbuf *buf, fz_off_t *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id)
 {
 	int tok;
 	int stm_len;
@@ -224,8 +224,9 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 
 	int num = 0;
 	int gen = 0;
-	int tmpofs, numofs = 0, genofs = 0;
-	int stm_len, stm_ofs = 0;
+	fz_off_t tmpofs, numofs = 0, genofs = 0;
+	int stm_len;
+	fz_off_t stm_ofs = 0;
 	int tok;
 	int next;
 	int i, n, c;
@@ -531,5 +532,5 @@ pdf_repair_obj_stms(pdf_document *xref)
 	/* Ensure that streamed objects reside inside a known non-streamed object */
 	for (i = 0; i < xref->len; i++)
 		if (xref->table[i].type == 'o' && xref->table[xref->table[i].ofs].type != 'n')
-			fz_throw(xref->ctx, "invalid reference to non-object-stream: %d (%d 0 R)", xref->table[i].ofs, i);
+			fz_throw(xref->ctx, "invalid reference to non-object-stream: %lld (%d 0 R)", xref->table[i].ofs, i);
 }
@@ -1113,12 +1113,15 @@ pdf_load_shading(pdf_document *xref, pdf_obj *dict)
 	pdf_obj *obj;
 	fz_context *ctx = xref->ctx;
 	fz_shade *shade;
+	int category;
 
-	if ((shade = pdf_find_item(ctx, fz_free_shade_imp, dict)))
+	if ((shade = pdf_find_item(ctx, fz_free_shade_imp, dict, FZ_STORE_SHADE)))
 	{
 		return shade;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_SHADE);
+
 	/* Type 2 pattern dictionary */
 	if (pdf_dict_gets(dict, "PatternType"))
 	{
@@ -1150,7 +1153,8 @@ pdf_load_shading(pdf_document *xref, pdf_obj *dict)
 		shade = pdf_load_shading_dict(xref, dict, fz_identity);
 	}
 
-	pdf_store_item(ctx, dict, shade, fz_shade_size(shade));
+	pdf_store_item(ctx, dict, shade, fz_shade_size(shade), FZ_STORE_SHADE);
+	fz_set_alloc_category(ctx, category);
 
 	return shade;
 }
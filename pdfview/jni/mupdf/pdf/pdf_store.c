@@ -45,34 +45,47 @@ pdf_debug_key(void *key_)
 }
 #endif
 
-static fz_store_type pdf_obj_store_type =
-{
-	pdf_make_hash_key,
-	pdf_keep_key,
-	pdf_drop_key,
-	pdf_cmp_key,
 #ifndef NDEBUG
-	pdf_debug_key
+#define PDF_OBJ_STORE_TYPE(kind) \
+	{ kind, pdf_make_hash_key, pdf_keep_key, pdf_drop_key, pdf_cmp_key, pdf_debug_key }
+#else
+#define PDF_OBJ_STORE_TYPE(kind) \
+	{ kind, pdf_make_hash_key, pdf_keep_key, pdf_drop_key, pdf_cmp_key }
 #endif
+
+/* Indexed by kind (FZ_STORE_IMAGE...), so each kind is budgeted separately */
+static fz_store_type pdf_obj_store_types[FZ_STORE_KINDS] =
+{
+	PDF_OBJ_STORE_TYPE(FZ_STORE_IMAGE),
+	PDF_OBJ_STORE_TYPE(FZ_STORE_FONT),
+	PDF_OBJ_STORE_TYPE(FZ_STORE_SHADE),
+	PDF_OBJ_STORE_TYPE(FZ_STORE_FUNCTION),
+	PDF_OBJ_STORE_TYPE(FZ_STORE_OTHER)
 };
 
+/* Another thread may have loaded and stored the same object meanwhile.
+ * Its item then stays in the store and the reference fz_store_item took
+ * to it is dropped; the caller goes on using val, which some callers
+ * have stored before filling it in, so it can't be swapped for the
+ * other one. */
 void
-pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, unsigned int itemsize)
+pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, unsigned int itemsize, int kind)
 {
 	void *existing;
-	existing = fz_store_item(ctx, key, val, itemsize, &pdf_obj_store_type);
-	assert(existing == NULL);
+	existing = fz_store_item(ctx, key, val, itemsize, &pdf_obj_store_types[kind]);
+	if (existing)
+		fz_drop_storable(ctx, existing);
 }
 
 void *
-pdf_find_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key)
+pdf_find_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key, int kind)
 {
-	return fz_find_item(ctx, free, key, &pdf_obj_store_type);
+	return fz_find_item(ctx, free, key, &pdf_obj_store_types[kind]);
 }
 
 void
 pdf_remove_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key)
 {
-	fz_remove_item(ctx, free, key, &pdf_obj_store_type);
+	/* Items are found by key and free function, kind doesn't matter */
+	fz_remove_item(ctx, free, key, &pdf_obj_store_types[FZ_STORE_OTHER]);
 }
-
@@ -223,25 +223,32 @@ build_filter_chain(fz_stream *chain, pdf_document *xref, pdf_obj *fs, pdf_obj *p
  * Build a filter for reading raw stream data.
  * This is a null filter to constrain reading to the stream length (and to
  * allow for other people accessing the file), followed by a decryption
- * filter.
+ * filter. Where the file allows it the null filter reads through a private
+ * reader, so the stream keeps its own position and buffer while objects are
+ * loaded through xref->file, and can be read on another thread.
  *
  * orig_num and orig_gen are used purely to seed the encryption.
  */
 static fz_stream *
-pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int orig_num, int orig_gen, int offset)
+pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int orig_num, int orig_gen, fz_off_t offset)
 {
 	fz_context *ctx = chain->ctx;
+	fz_stream *reader;
 	int hascrypt;
 	int len;
 
 	if (num > 0 && num < xref->len && xref->table[num].stm_buf)
 		return fz_open_buffer(ctx, xref->table[num].stm_buf);
 
-	/* don't close chain when we close this filter */
-	fz_keep_stream(chain);
+	reader = fz_open_reader(ctx, chain, offset);
+	if (!reader)
+	{
+		/* don't close chain when we close this filter */
+		reader = fz_keep_stream(chain);
+	}
 
 	len = pdf_to_int(pdf_dict_gets(stmobj, "Length"));
-	chain = fz_open_null(chain, len, offset);
+	chain = fz_open_null(reader, len, offset);
 
 	fz_try(ctx)
 	{
@@ -263,7 +270,7 @@ pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int n
  * to stream length and decrypting.
  */
 static fz_stream *
-pdf_open_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int gen, int offset, pdf_image_params *imparams)
+pdf_open_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int gen, fz_off_t offset, pdf_image_params *imparams)
 {
 	pdf_obj *filters;
 	pdf_obj *params;
@@ -335,7 +342,8 @@ pdf_open_raw_renumbered_stream(pdf_document *xref, int num, int gen, int orig_nu
 /*
  * Open a stream for reading uncompressed data.
  * Put the opened file in xref->stream.
- * Using xref->file while a stream is open is a Bad idea.
+ * Unless the document was opened from a file (see pdf_open_raw_filter),
+ * using xref->file while a stream is open is a Bad idea.
  */
 fz_stream *
 pdf_open_stream(pdf_document *xref, int num, int gen)
@@ -379,8 +387,16 @@ pdf_open_image_decomp_stream(fz_context *ctx, fz_buffer *buffer, pdf_image_param
 				params->u.fax.eob,
 				params->u.fax.bi1);
 	case PDF_IMAGE_JPEG:
-		if (*factor > 8)
+		/* libjpeg can scale by 1/2, 1/4 and 1/8; use the largest of
+		 * those that divides the factor and leave the rest to the caller */
+		if (*factor % 8 == 0)
 			*factor = 8;
+		else if (*factor % 4 == 0)
+			*factor = 4;
+		else if (*factor % 2 == 0)
+			*factor = 2;
+		else
+			*factor = 1;
 		return fz_open_resized_dctd(chain, params->u.jpeg.ct, *factor);
 	case PDF_IMAGE_RLD:
 		*factor = 1;
@@ -406,7 +422,7 @@ pdf_open_image_decomp_stream(fz_context *ctx, fz_buffer *buffer, pdf_image_param
 }
 
 fz_stream *
-pdf_open_stream_with_offset(pdf_document *xref, int num, int gen, pdf_obj *dict, int stm_ofs)
+pdf_open_stream_with_offset(pdf_document *xref, int num, int gen, pdf_obj *dict, fz_off_t stm_ofs)
 {
 	if (stm_ofs == 0)
 		fz_throw(xref->ctx, "object is not a stream");
@@ -40,13 +40,16 @@ pdf_load_xobject(pdf_document *xref, pdf_obj *dict)
 	pdf_xobject *form;
 	pdf_obj *obj;
 	fz_context *ctx = xref->ctx;
+	int category;
 
-	if ((form = pdf_find_item(ctx, pdf_free_xobject_imp, dict)))
+	if ((form = pdf_find_item(ctx, pdf_free_xobject_imp, dict, FZ_STORE_OTHER)))
 	{
 		return form;
 	}
 
+	category = fz_set_alloc_category(ctx, FZ_STORE_OTHER);
 	form = fz_malloc_struct(ctx, pdf_xobject);
+	fz_set_alloc_category(ctx, category);
 	FZ_INIT_STORABLE(form, 1, pdf_free_xobject_imp);
 	form->resources = NULL;
 	form->contents = NULL;
@@ -54,7 +57,7 @@ pdf_load_xobject(pdf_document *xref, pdf_obj *dict)
 	form->me = NULL;
 
 	/* Store item immediately, to avoid possible recursion if objects refer back to this one */
-	pdf_store_item(ctx, dict, form, pdf_xobject_size(form));
+	pdf_store_item(ctx, dict, form, pdf_xobject_size(form), FZ_STORE_OTHER);
 
 	obj = pdf_dict_gets(dict, "BBox");
 	form->bbox = pdf_to_rect(ctx, obj);
@@ -200,7 +203,7 @@ pdf_new_xobject(pdf_document *xref, fz_rect *bbox, fz_matrix *mat)
 		pdf_drop_obj(dict);
 		dict = NULL;
 
-		pdf_store_item(ctx, idict, form, pdf_xobject_size(form));
+		pdf_store_item(ctx, idict, form, pdf_xobject_size(form), FZ_STORE_OTHER);
 
 		form->contents = pdf_keep_obj(idict);
 		form->me = pdf_keep_obj(idict);
@@ -29,14 +29,17 @@ static void
 pdf_read_start_xref(pdf_document *xref)
 {
 	unsigned char buf[1024];
-	int t, n;
+	fz_off_t t;
+	int n;
 	int i;
 
 	fz_seek(xref->file, 0, 2);
 
 	xref->file_size = fz_tell(xref->file);
 
-	t = fz_maxi(0, xref->file_size - (int)sizeof buf);
+	t = xref->file_size - (fz_off_t)sizeof buf;
+	if (t < 0)
+		t = 0;
 	fz_seek(xref->file, t, 0);
 
 	n = fz_read(xref->file, buf, sizeof buf);
@@ -50,7 +53,7 @@ pdf_read_start_xref(pdf_document *xref)
 			i += 9;
 			while (iswhite(buf[i]) && i < n)
 				i ++;
-			xref->startxref = atoi((char*)(buf + i));
+			xref->startxref = fz_atoo((char*)(buf + i));
 
 			return;
 		}
@@ -68,7 +71,7 @@ pdf_read_old_trailer(pdf_document *xref, pdf_lexbuf *buf)
 {
 	int len;
 	char *s;
-	int t;
+	fz_off_t t;
 	int tok;
 	int c;
 
@@ -240,7 +243,7 @@ pdf_read_old_xref(pdf_document *xref, pdf_lexbuf *buf)
 				while (*s != '\0' && iswhite(*s))
 					s++;
 
-				xref->table[i].ofs = atoi(s);
+				xref->table[i].ofs = fz_atoo(s);
 				xref->table[i].gen = atoi(s + 11);
 				xref->table[i].type = s[17];
 				if (s[17] != 'f' && s[17] != 'n' && s[17] != 'o')
@@ -281,7 +284,7 @@ pdf_read_new_xref_section(pdf_document *xref, fz_stream *stm, int i0, int i1, in
 	for (i = i0; i < i0 + i1; i++)
 	{
 		int a = 0;
-		int b = 0;
+		fz_off_t b = 0;
 		int c = 0;
 
 		if (fz_is_eof(stm))
@@ -312,7 +315,8 @@ pdf_read_new_xref(pdf_document *xref, pdf_lexbuf *buf)
 	pdf_obj *trailer = NULL;
 	pdf_obj *index = NULL;
 	pdf_obj *obj = NULL;
-	int num, gen, stm_ofs;
+	int num, gen;
+	fz_off_t stm_ofs;
 	int size, w0, w1, w2;
 	int t;
 	fz_context *ctx = xref->ctx;
@@ -394,7 +398,7 @@ pdf_read_new_xref(pdf_document *xref, pdf_lexbuf *buf)
 
 /* File is locked on entry, and exit (but may be dropped in the middle) */
 static pdf_obj *
-pdf_read_xref(pdf_document *xref, int ofs, pdf_lexbuf *buf)
+pdf_read_xref(pdf_document *xref, fz_off_t ofs, pdf_lexbuf *buf)
 {
 	int c;
 	fz_context *ctx = xref->ctx;
@@ -417,18 +421,18 @@ pdf_read_xref(pdf_document *xref, int ofs, pdf_lexbuf *buf)
 	}
 	fz_catch(ctx)
 	{
-		fz_throw(ctx, "cannot read xref (ofs=%d)", ofs);
+		fz_throw(ctx, "cannot read xref (ofs=%lld)", ofs);
 	}
 	return trailer;
 }
 
 static void
-pdf_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf)
+pdf_read_xref_sections(pdf_document *xref, fz_off_t ofs, pdf_lexbuf *buf)
 {
 	pdf_obj *trailer = NULL;
 	fz_context *ctx = xref->ctx;
-	int xrefstmofs = 0;
-	int prevofs = 0;
+	fz_off_t xrefstmofs = 0;
+	fz_off_t prevofs = 0;
 
 	fz_var(trailer);
 	fz_var(xrefstmofs);
@@ -441,8 +445,8 @@ pdf_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf)
 			trailer = pdf_read_xref(xref, ofs, buf);
 
 			/* FIXME: do we overwrite free entries properly? */
-			xrefstmofs = pdf_to_int(pdf_dict_gets(trailer, "XRefStm"));
-			prevofs = pdf_to_int(pdf_dict_gets(trailer, "Prev"));
+			xrefstmofs = pdf_to_offset(pdf_dict_gets(trailer, "XRefStm"));
+			prevofs = pdf_to_offset(pdf_dict_gets(trailer, "Prev"));
 
 			if (xrefstmofs < 0)
 				fz_throw(ctx, "negative xref stream offset");
@@ -465,7 +469,7 @@ pdf_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf)
 	fz_catch(ctx)
 	{
 		pdf_drop_obj(trailer);
-		fz_throw(ctx, "cannot read xref at offset %d", ofs);
+		fz_throw(ctx, "cannot read xref at offset %lld", ofs);
 	}
 }
 
@@ -511,11 +515,11 @@ pdf_load_xref(pdf_document *xref, pdf_lexbuf *buf)
 			if (xref->table[i].ofs == 0)
 				xref->table[i].type = 'f';
 			else if (xref->table[i].ofs <= 0 || xref->table[i].ofs >= xref->file_size)
-				fz_throw(ctx, "object offset out of range: %d (%d 0 R)", xref->table[i].ofs, i);
+				fz_throw(ctx, "object offset out of range: %lld (%d 0 R)", xref->table[i].ofs, i);
 		}
 		if (xref->table[i].type == 'o')
 			if (xref->table[i].ofs <= 0 || xref->table[i].ofs >= xref->len || xref->table[xref->table[i].ofs].type != 'n')
-				fz_throw(ctx, "invalid reference to an objstm that does not exist: %d (%d 0 R)", xref->table[i].ofs, i);
+				fz_throw(ctx, "invalid reference to an objstm that does not exist: %lld (%d 0 R)", xref->table[i].ofs, i);
 	}
 }
 
@@ -860,7 +864,7 @@ pdf_print_xref(pdf_document *xref)
 	printf("xref\n0 %d\n", xref->len);
 	for (i = 0; i < xref->len; i++)
 	{
-		printf("%05d: %010d %05d %c (stm_ofs=%d; stm_buf=%p)\n", i,
+		printf("%05d: %010lld %05d %c (stm_ofs=%lld; stm_buf=%p)\n", i,
 			xref->table[i].ofs,
 			xref->table[i].gen,
 			xref->table[i].type ? xref->table[i].type : '-',
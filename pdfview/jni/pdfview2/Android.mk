@@ -8,6 +8,9 @@ LOCAL_ARM_MODE := arm
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/../mupdf/fitz $(LOCAL_PATH)/../mupdf/pdf $(LOCAL_PATH)/../freetype-overlay/include $(LOCAL_PATH)/../freetype/include $(LOCAL_PATH)/pdfview2/include
 LOCAL_LDLIBS := -L$(SYSROOT)/usr/lib -lz -llog
 LOCAL_STATIC_LIBRARIES := pdf fitz fitzdraw jpeg jbig2dec openjpeg freetype
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+  LOCAL_STATIC_LIBRARIES += fitzneon cpufeatures
+endif
 LOCAL_MODULE    := pdfview2
 LOCAL_SRC_FILES := pdfview2.c
 
@@ -1,4 +1,7 @@
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include <wctype.h>
 #include <jni.h>
 
@@ -15,8 +18,17 @@ static jintArray get_page_image_bitmap(JNIEnv *env,
       pdf_t *pdf, int pageno, int zoom_pmil, int left, int top, int rotation,
       int skipImages,
       int *width, int *height);
+static int render_tile(pdf_t *pdf, int pageno, int zoom_pmil,
+        int left, int top, int rotation, int skipImages, int width, int height,
+        fz_colorspace *colorspace, fz_cookie *cookie,
+        render_pass_callback_t on_pass, void *user,
+        unsigned short *pixels, fz_pixmap **out);
 static void copy_alpha(unsigned char* out, unsigned char *in, unsigned int w, unsigned int h);
+static void lock_fz_mutex(void *user, int lock);
+static void unlock_fz_mutex(void *user, int lock);
 fz_rect get_page_box(pdf_t *pdf, int pageno);
+static fz_rect load_page_box(pdf_t *pdf, int pageno);
+static void sync_idle_glyph_fronts(pdf_t *pdf);
 
 
 #define NUM_BOXES 5
@@ -145,12 +157,16 @@ Java_cx_hell_android_lib_pdf_PDF_getPageCount(
 		JNIEnv *env,
 		jobject this) {
 	pdf_t *pdf = NULL;
+    int count = 0;
     pdf = get_pdf_from_this(env, this);
 	if (pdf == NULL) {
         // __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "pdf is null");
         return -1;
     }
-	return fz_count_pages(pdf->doc);
+    pthread_mutex_lock(&pdf->lock);
+	count = fz_count_pages(pdf->doc);
+    pthread_mutex_unlock(&pdf->lock);
+    return count;
 }
 
 
@@ -191,32 +207,673 @@ Java_cx_hell_android_lib_pdf_PDF_renderPage(
 }
 
 
+/**
+ * Get memory of direct ByteBuffer that tile of given size is packed into.
+ * @return pointer to buffer's memory or NULL if buffer is not direct or
+ * is too small for width * height RGB_565 pixels
+ */
+static unsigned short* get_tile_buffer(JNIEnv *env, jobject buffer, int width, int height) {
+    unsigned short *pixels = NULL;
+    jlong capacity = 0;
+
+    pixels = (unsigned short*)(*env)->GetDirectBufferAddress(env, buffer);
+    capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+    if (pixels == NULL || capacity < (jlong)width * height * 2) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG,
+                "buffer is not direct or too small (%d bytes for %dx%d)",
+                (int)capacity, width, height);
+        return NULL;
+    }
+    return pixels;
+}
+
+
+/**
+ * Pack RGBA pixmap into RGB_565 pixels, in layout expected by
+ * Bitmap.copyPixelsFromBuffer for RGB_565 bitmaps (native endian, red in
+ * top bits). Alpha is dropped, tiles are drawn on white anyway.
+ */
+static void pack_rgb565(unsigned short *pixels, fz_pixmap *image) {
+    unsigned char *s = image->samples;
+    int count = image->w * image->h;
+
+    while (count--) {
+        *pixels++ = ((s[0] & 0xf8) << 8) | ((s[1] & 0xfc) << 3) | (s[2] >> 3);
+        s += 4;
+    }
+}
+
+
+/**
+ * Implementation of native method PDF.renderPageDirect.
+ * Draws tile and packs it into memory of direct ByteBuffer as RGB_565
+ * pixels, see pack_rgb565. No Java array is allocated and Java side doesn't
+ * need to convert pixels.
+ * @param cookie pointer to fz_cookie created by newCookie, or 0; if it's
+ * aborted from other thread, rendering stops early
+ * @return error code: 0 means ok, 1 - pdf is null, 2 - buffer is not direct
+ * or too small, 3 - rendering failed, 4 - aborted by cookie
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_renderPageDirect(
+        JNIEnv *env,
+        jobject this,
+        jint pageno,
+        jint zoom,
+        jint left,
+        jint top,
+        jint rotation,
+        jboolean skipImages,
+        jobject size,
+        jobject buffer,
+        jint cookie_ptr) {
+    pdf_t *pdf = NULL;
+    fz_cookie *cookie = (fz_cookie*)cookie_ptr;
+    unsigned short *pixels = NULL;
+    int width, height;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+
+    get_size(env, size, &width, &height);
+
+    pixels = get_tile_buffer(env, buffer, width, height);
+    if (pixels == NULL) return 2;
+
+    if (render_tile(pdf, pageno, zoom, left, top, rotation, skipImages,
+            width, height, fz_device_rgb, cookie, NULL, NULL, pixels, NULL) != 0)
+        return (cookie && cookie->abort) ? 4 : 3;
+
+    save_size(env, size, width, height);
+    return 0;
+}
+
+
+/**
+ * Java side of progressive render, see render_progressive_pass.
+ */
+typedef struct {
+    JNIEnv *env;
+    jobject size;
+    jobject callback;
+    jmethodID on_pass_rendered;
+    int stopped; /* set when callback returned false */
+} render_callback_t;
+
+
+/**
+ * Passes tile drawn so far to PDF.RenderCallback.onPassRendered; render_tile
+ * has already packed it into the buffer, its size is saved to size object first.
+ */
+static int render_progressive_pass(void *user, fz_pixmap *image, int pass) {
+    render_callback_t *dest = (render_callback_t*)user;
+    JNIEnv *env = dest->env;
+    jboolean go_on = JNI_FALSE;
+
+    save_size(env, dest->size, image->w, image->h);
+    go_on = (*env)->CallBooleanMethod(env, dest->callback, dest->on_pass_rendered, pass);
+    if ((*env)->ExceptionCheck(env)) return 0;
+    if (!go_on) dest->stopped = 1;
+    return go_on ? 1 : 0;
+}
+
+
+/**
+ * Implementation of native method PDF.renderPageProgressive.
+ * Same as renderPageDirect, but tile is drawn twice from the same display
+ * list: fast draft first, then at full quality. Callback is called after
+ * each pass, when buffer holds that pass; returning false from it after
+ * draft pass skips the full pass. Pages without images and shadings get
+ * full pass only, see render_tile.
+ * @return error code: same as for renderPageDirect, 4 is also returned if
+ * callback stopped rendering after draft pass
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_renderPageProgressive(
+        JNIEnv *env,
+        jobject this,
+        jint pageno,
+        jint zoom,
+        jint left,
+        jint top,
+        jint rotation,
+        jboolean skipImages,
+        jobject size,
+        jobject buffer,
+        jint cookie_ptr,
+        jobject callback) {
+    static jmethodID on_pass_rendered = NULL;
+    pdf_t *pdf = NULL;
+    fz_cookie *cookie = (fz_cookie*)cookie_ptr;
+    unsigned short *pixels = NULL;
+    render_callback_t dest;
+    int width, height;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    if (on_pass_rendered == NULL) {
+        jclass callback_class = (*env)->FindClass(env, "cx/hell/android/lib/pdf/PDF$RenderCallback");
+        if (callback_class == NULL) {
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't find class PDF$RenderCallback");
+            return 3;
+        }
+        on_pass_rendered = (*env)->GetMethodID(env, callback_class, "onPassRendered", "(I)Z");
+        (*env)->DeleteLocalRef(env, callback_class);
+        if (on_pass_rendered == NULL) return 3;
+    }
+
+    get_size(env, size, &width, &height);
+
+    pixels = get_tile_buffer(env, buffer, width, height);
+    if (pixels == NULL) return 2;
+
+    dest.env = env;
+    dest.size = size;
+    dest.callback = callback;
+    dest.on_pass_rendered = on_pass_rendered;
+    dest.stopped = 0;
+    if (render_tile(pdf, pageno, zoom, left, top, rotation, skipImages,
+            width, height, fz_device_rgb, cookie, render_progressive_pass, &dest,
+            pixels, NULL) != 0) {
+        if ((*env)->ExceptionCheck(env)) return 3;
+        return ((cookie && cookie->abort) || dest.stopped) ? 4 : 3;
+    }
+
+    return 0; /* pixels and size were saved by callback */
+}
+
+
+/**
+ * Implementation of native method PDF.newCookie.
+ * Cookie lets other thread abort render in progress and read its progress.
+ * @return pointer to new fz_cookie, to be freed with freeCookie
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_newCookie(
+        JNIEnv *env,
+        jclass cls) {
+    fz_cookie *cookie = (fz_cookie*)calloc(1, sizeof(fz_cookie));
+    return (int)cookie;
+}
+
+
+/**
+ * Implementation of native method PDF.abortCookie.
+ * Render using this cookie stops soon, possibly before it even started.
+ */
+JNIEXPORT void JNICALL
+Java_cx_hell_android_lib_pdf_PDF_abortCookie(
+        JNIEnv *env,
+        jclass cls,
+        jint cookie_ptr) {
+    fz_cookie *cookie = (fz_cookie*)cookie_ptr;
+    if (cookie) cookie->abort = 1;
+}
+
+
+/**
+ * Implementation of native method PDF.getCookieProgress.
+ * @return progress of render in percents, or -1 if it's not known yet
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getCookieProgress(
+        JNIEnv *env,
+        jclass cls,
+        jint cookie_ptr) {
+    fz_cookie *cookie = (fz_cookie*)cookie_ptr;
+    int progress, progress_max;
+    if (cookie == NULL) return -1;
+    /* fields are written by rendering thread, read them once */
+    progress = cookie->progress;
+    progress_max = cookie->progress_max;
+    if (progress_max <= 0) return -1;
+    return MIN(100, (int)(100.0 * progress / progress_max));
+}
+
+
+/**
+ * Implementation of native method PDF.freeCookie.
+ * Cookie must not be used by any render anymore.
+ */
+JNIEXPORT void JNICALL
+Java_cx_hell_android_lib_pdf_PDF_freeCookie(
+        JNIEnv *env,
+        jclass cls,
+        jint cookie_ptr) {
+    free((fz_cookie*)cookie_ptr);
+}
+
+
+/**
+ * Implementation of native method PDF.prefetchPage.
+ * Returns at once, images of page are decoded in background, see prefetch_t.
+ * Called from UI thread, so pdf->lock is not taken here: page is checked
+ * against page geometry table if it's built already, and again by prefetch
+ * thread before it's loaded.
+ * @return 0 if ok, 1 if pdf is null, 2 if page is out of range, 3 if
+ * prefetch threads couldn't be started
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_prefetchPage(
+        JNIEnv *env,
+        jobject this,
+        jint pageno,
+        jint zoom) {
+    pdf_t *pdf = NULL;
+    int page_count = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    /* -1 while geometry is not built; stale value is only a hint anyway */
+    page_count = pdf->page_count;
+    if (pageno < 0 || (page_count >= 0 && pageno >= page_count) || zoom <= 0) return 2;
+    return prefetch_page(pdf, pageno, zoom) ? 3 : 0;
+}
+
+
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getPageSize(
+        JNIEnv *env,
+        jobject this,
+        jint pageno,
+        jobject size) {
+    int width, height, error;
+    pdf_t *pdf = NULL;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+
+    pthread_mutex_lock(&pdf->lock);
+    error = get_page_size(pdf, pageno, &width, &height);
+    pthread_mutex_unlock(&pdf->lock);
+    if (error != 0) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "get_page_size error: %d", (int)error);
+        return 2;
+    }
+
+    save_size(env, size, width, height);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.getPageSizes.
+ * Stores width and height of each page into sizes array, so layout of whole
+ * document can be computed with single call.
+ * @param sizes array of at least 2 * page count ints, receives width and
+ * height of page 0, then width and height of page 1 and so on
+ * @return error code: 0 means ok, 1 - pdf is null, 2 - array is too small,
+ * 3 - page sizes couldn't be read
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getPageSizes(
+        JNIEnv *env,
+        jobject this,
+        jintArray sizes) {
+    pdf_t *pdf = NULL;
+    jint *jsizes = NULL;
+    int i = 0;
+    int error = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+
+    pthread_mutex_lock(&pdf->lock);
+    if (load_page_geometry(pdf) != 0) {
+        error = 3;
+    } else if ((*env)->GetArrayLength(env, sizes) < 2 * pdf->page_count) {
+        error = 2;
+    } else {
+        jsizes = (*env)->GetIntArrayElements(env, sizes, NULL);
+        for(i = 0; i < pdf->page_count; ++i) {
+            fz_rect *box = &(pdf->pages[i].box);
+            jsizes[2*i] = box->x1 - box->x0;
+            jsizes[2*i + 1] = box->y1 - box->y0;
+        }
+        (*env)->ReleaseIntArrayElements(env, sizes, jsizes, 0);
+    }
+    pthread_mutex_unlock(&pdf->lock);
+
+    if (error != 0)
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "getPageSizes error: %d", error);
+    return error;
+}
+
+
+/**
+ * Implementation of native method PDF.setStoreSize.
+ * Sets max size of store that keeps decoded images, fonts and other
+ * resources between pages and tiles; render contexts share it.
+ * If store is bigger than that, unused items are evicted at once.
+ * @return 0 if ok, 1 if pdf is null
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_setStoreSize(
+        JNIEnv *env,
+        jobject this,
+        jint size) {
+    pdf_t *pdf = NULL;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    __android_log_print(ANDROID_LOG_INFO, PDFVIEW_LOG_TAG, "store size set to %d bytes", (int)size);
+    pthread_mutex_lock(&pdf->lock);
+    fz_set_store_max(pdf->ctx, size > 0 ? size : FZ_STORE_UNLIMITED);
+    pthread_mutex_unlock(&pdf->lock);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.trimMemory.
+ * Frees cached data, the more the higher level is:
+ * from RUNNING_MODERATE store is shrunk by a quarter, from RUNNING_CRITICAL
+ * by half; from BACKGROUND pending prefetch is cancelled and unused display
+ * lists, glyph caches and page arena are dropped too (lists keep images and
+ * fonts in store alive), from MODERATE
+ * store is emptied and at COMPLETE search index is freed as well.
+ * Data used by renders in progress is left alone.
+ * @param level one of Android's ComponentCallbacks2.TRIM_MEMORY_* levels
+ * @return 0 if ok, 1 if pdf is null
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_trimMemory(
+        JNIEnv *env,
+        jobject this,
+        jint level) {
+    pdf_t *pdf = NULL;
+    unsigned int before = 0, after = 0, max = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+
+    pthread_mutex_lock(&pdf->lock);
+    fz_get_store_usage(pdf->ctx, &before, &max);
+    if (level >= TRIM_MEMORY_BACKGROUND) {
+        cancel_prefetch(pdf);
+        free_unused_display_lists(pdf);
+        fz_purge_glyph_cache(pdf->ctx);
+        sync_idle_glyph_fronts(pdf);
+        /* next page run allocates it again */
+        fz_free_arena(pdf->ctx, pdf->arena);
+        pdf->arena = NULL;
+    }
+    if (level >= TRIM_MEMORY_MODERATE) {
+        fz_empty_store(pdf->ctx);
+    } else if (level >= TRIM_MEMORY_RUNNING_CRITICAL) {
+        fz_shrink_store(pdf->ctx, 50);
+    } else if (level >= TRIM_MEMORY_RUNNING_MODERATE) {
+        fz_shrink_store(pdf->ctx, 75);
+    }
+    if (level >= TRIM_MEMORY_COMPLETE) {
+        free_search_index(pdf);
+    }
+    fz_get_store_usage(pdf->ctx, &after, &max);
+    pthread_mutex_unlock(&pdf->lock);
+
+    __android_log_print(ANDROID_LOG_INFO, PDFVIEW_LOG_TAG, "trimMemory(%d): store %u -> %u bytes", (int)level, before, after);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.getMemoryUsage.
+ * @param usage array of at least 4 ints, receives current store size,
+ * max store size, glyph cache size (all in bytes) and number of cached
+ * display lists
+ * @return error code: 0 means ok, 1 - pdf is null, 2 - array is too small
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getMemoryUsage(
+        JNIEnv *env,
+        jobject this,
+        jintArray usage) {
+    pdf_t *pdf = NULL;
+    unsigned int store_size = 0, store_max = 0;
+    jint values[4];
+    int i = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    if ((*env)->GetArrayLength(env, usage) < 4) return 2;
+
+    pthread_mutex_lock(&pdf->lock);
+    fz_get_store_usage(pdf->ctx, &store_size, &store_max);
+    values[0] = store_size;
+    values[1] = store_max;
+    values[2] = fz_glyph_cache_usage(pdf->ctx);
+    values[3] = 0;
+    for(i = 0; i < DISPLAY_LIST_CACHE_SIZE; ++i) {
+        if (pdf->display_lists[i].list) values[3] += 1;
+    }
+    pthread_mutex_unlock(&pdf->lock);
+
+    (*env)->SetIntArrayRegion(env, usage, 0, 4, values);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.setStoreBudget.
+ * Limits size of one kind of items in store, so that e.g. big images
+ * can't evict all fonts. Unused items of that kind above new budget are
+ * evicted at once.
+ * @param kind one of PDF.STORE_* kinds
+ * @param size budget in bytes, 0 or less to limit only store as a whole
+ * @return 0 if ok, 1 if pdf is null, 2 if kind is invalid
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_setStoreBudget(
+        JNIEnv *env,
+        jobject this,
+        jint kind,
+        jint size) {
+    pdf_t *pdf = NULL;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    if (kind < 0 || kind >= FZ_STORE_KINDS) return 2;
+    __android_log_print(ANDROID_LOG_INFO, PDFVIEW_LOG_TAG, "store budget of kind %d set to %d bytes", (int)kind, (int)size);
+    pthread_mutex_lock(&pdf->lock);
+    fz_set_store_kind_max(pdf->ctx, kind, size > 0 ? size : FZ_STORE_UNLIMITED);
+    pthread_mutex_unlock(&pdf->lock);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.getStoreStats.
+ * @param stats array of at least STORE_STATS_SIZE * FZ_STORE_KINDS ints,
+ * receives size, budget (both in bytes), number of items, hits, misses
+ * and evictions of each kind of store items, kind after kind
+ * @return error code: 0 means ok, 1 - pdf is null, 2 - array is too small
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getStoreStats(
+        JNIEnv *env,
+        jobject this,
+        jintArray stats) {
+    pdf_t *pdf = NULL;
+    fz_store_stats kinds[FZ_STORE_KINDS];
+    jint values[STORE_STATS_SIZE * FZ_STORE_KINDS];
+    int i = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    if ((*env)->GetArrayLength(env, stats) < STORE_STATS_SIZE * FZ_STORE_KINDS) return 2;
+
+    fz_get_store_stats(pdf->ctx, kinds);
+    for(i = 0; i < FZ_STORE_KINDS; ++i) {
+        values[i * STORE_STATS_SIZE + 0] = kinds[i].size;
+        values[i * STORE_STATS_SIZE + 1] = kinds[i].max;
+        values[i * STORE_STATS_SIZE + 2] = kinds[i].items;
+        values[i * STORE_STATS_SIZE + 3] = kinds[i].hits;
+        values[i * STORE_STATS_SIZE + 4] = kinds[i].misses;
+        values[i * STORE_STATS_SIZE + 5] = kinds[i].evictions;
+    }
+
+    (*env)->SetIntArrayRegion(env, stats, 0, STORE_STATS_SIZE * FZ_STORE_KINDS, values);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.setGlyphCacheSize.
+ * Sets max size of cache of rendered glyphs, shared by render contexts.
+ * Least recently used glyphs are evicted to keep it below that size.
+ * @return 0 if ok, 1 if pdf is null
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_setGlyphCacheSize(
+        JNIEnv *env,
+        jobject this,
+        jint size) {
+    pdf_t *pdf = NULL;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    __android_log_print(ANDROID_LOG_INFO, PDFVIEW_LOG_TAG, "glyph cache size set to %d bytes", (int)size);
+    fz_set_glyph_cache_max(pdf->ctx, size > 0 ? size : 0);
+    pthread_mutex_lock(&pdf->lock);
+    sync_idle_glyph_fronts(pdf);
+    pthread_mutex_unlock(&pdf->lock);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.getGlyphCacheStats.
+ * @param stats array of at least STORE_STATS_SIZE ints, receives size,
+ * max size (both in bytes), number of glyphs, hits, misses and evictions
+ * @return error code: 0 means ok, 1 - pdf is null, 2 - array is too small
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getGlyphCacheStats(
+        JNIEnv *env,
+        jobject this,
+        jintArray stats) {
+    pdf_t *pdf = NULL;
+    fz_store_stats glyphs;
+    jint values[STORE_STATS_SIZE];
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    if ((*env)->GetArrayLength(env, stats) < STORE_STATS_SIZE) return 2;
+
+    fz_get_glyph_cache_stats(pdf->ctx, &glyphs);
+    values[0] = glyphs.size;
+    values[1] = glyphs.max;
+    values[2] = glyphs.items;
+    values[3] = glyphs.hits;
+    values[4] = glyphs.misses;
+    values[5] = glyphs.evictions;
+
+    (*env)->SetIntArrayRegion(env, stats, 0, STORE_STATS_SIZE, values);
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.getAllocStats.
+ * Works only if fitz is built with FZ_ALLOC_STATS defined.
+ * @param stats array of at least ALLOC_STATS_SIZE * FZ_ALLOC_CATEGORIES ints,
+ * receives live bytes, peak bytes and number of blocks of each allocation
+ * category, category after category
+ * @return error code: 0 means ok, 1 - pdf is null, 2 - array is too small,
+ * 3 - allocations are not accounted in this build
+ */
 JNIEXPORT jint JNICALL
-Java_cx_hell_android_lib_pdf_PDF_getPageSize(
+Java_cx_hell_android_lib_pdf_PDF_getAllocStats(
         JNIEnv *env,
         jobject this,
-        jint pageno,
-        jobject size) {
-    int width, height, error;
+        jintArray stats) {
     pdf_t *pdf = NULL;
+    fz_alloc_stats categories[FZ_ALLOC_CATEGORIES];
+    jint values[ALLOC_STATS_SIZE * FZ_ALLOC_CATEGORIES];
+    int i = 0;
 
     pdf = get_pdf_from_this(env, this);
     if (pdf == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
         return 1;
     }
+    if ((*env)->GetArrayLength(env, stats) < ALLOC_STATS_SIZE * FZ_ALLOC_CATEGORIES) return 2;
 
-    error = get_page_size(pdf, pageno, &width, &height);
-    if (error != 0) {
-        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "get_page_size error: %d", (int)error);
-        return 2;
+    if (!fz_get_alloc_stats(pdf->ctx, categories)) return 3;
+    for(i = 0; i < FZ_ALLOC_CATEGORIES; ++i) {
+        values[i * ALLOC_STATS_SIZE + 0] = categories[i].size;
+        values[i * ALLOC_STATS_SIZE + 1] = categories[i].peak;
+        values[i * ALLOC_STATS_SIZE + 2] = categories[i].blocks;
     }
 
-    save_size(env, size, width, height);
+    (*env)->SetIntArrayRegion(env, stats, 0, ALLOC_STATS_SIZE * FZ_ALLOC_CATEGORIES, values);
     return 0;
 }
 
 
+/**
+ * Log live and peak memory of each allocation category after page was
+ * recorded, then start measuring peaks of next page.
+ * Does nothing unless fitz is built with FZ_ALLOC_STATS defined.
+ * Caller must hold pdf->lock.
+ */
+static void log_page_alloc_stats(pdf_t *pdf, int pageno) {
+    fz_alloc_stats s[FZ_ALLOC_CATEGORIES];
+
+    if (!fz_get_alloc_stats(pdf->ctx, s)) return;
+    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG,
+            "page %d memory in kB (live/peak): images %u/%u, fonts %u/%u, shades %u/%u, "
+            "functions %u/%u, other %u/%u, objects %u/%u, display lists %u/%u, glyphs %u/%u, scratch %u/%u",
+            pageno,
+            s[FZ_STORE_IMAGE].size >> 10, s[FZ_STORE_IMAGE].peak >> 10,
+            s[FZ_STORE_FONT].size >> 10, s[FZ_STORE_FONT].peak >> 10,
+            s[FZ_STORE_SHADE].size >> 10, s[FZ_STORE_SHADE].peak >> 10,
+            s[FZ_STORE_FUNCTION].size >> 10, s[FZ_STORE_FUNCTION].peak >> 10,
+            s[FZ_STORE_OTHER].size >> 10, s[FZ_STORE_OTHER].peak >> 10,
+            s[FZ_ALLOC_OBJECT].size >> 10, s[FZ_ALLOC_OBJECT].peak >> 10,
+            s[FZ_ALLOC_DISPLAY_LIST].size >> 10, s[FZ_ALLOC_DISPLAY_LIST].peak >> 10,
+            s[FZ_ALLOC_GLYPH].size >> 10, s[FZ_ALLOC_GLYPH].peak >> 10,
+            s[FZ_ALLOC_SCRATCH].size >> 10, s[FZ_ALLOC_SCRATCH].peak >> 10);
+    fz_reset_alloc_peaks(pdf->ctx);
+}
+
+
 // #ifdef pro
 // /**
 //  * Get document outline.
@@ -367,81 +1024,307 @@ wchar_t* widestrstr(wchar_t* haystack, int haystack_length, wchar_t* needle, int
     return NULL;
 }
 
-/* TODO: Specialcase searches for 7-bit text to make them faster */
-JNIEXPORT jobject JNICALL
-Java_cx_hell_android_lib_pdf_PDF_find(
+/**
+ * Run page on pdf->ctx. Paths and text built by interpreter are taken from
+ * pdf->arena, which is reset in one go when page is done, instead of going
+ * through malloc one by one.
+ * Caller must hold pdf->lock.
+ */
+static void run_page(pdf_t *pdf, fz_page *page, fz_device *dev, fz_cookie *cookie) {
+    if (pdf->arena == NULL)
+        pdf->arena = fz_new_arena(pdf->ctx, PAGE_ARENA_CHUNK);
+    fz_attach_arena(pdf->ctx, pdf->arena);
+    fz_try(pdf->ctx) {
+        fz_run_page(pdf->doc, page, dev, fz_identity, cookie);
+    } fz_always(pdf->ctx) {
+        fz_attach_arena(pdf->ctx, NULL);
+        fz_reset_arena(pdf->ctx, pdf->arena);
+    } fz_catch(pdf->ctx) {
+        fz_rethrow(pdf->ctx);
+    }
+}
+
+
+/**
+ * Run page through text device.
+ * Caller must hold pdf->lock.
+ * @param sheet receives text sheet, to be freed with fz_free_text_sheet after text page
+ * @return text page to be freed with fz_free_text_page, or NULL on error
+ */
+static fz_text_page* extract_text_page(pdf_t *pdf, int pageno, fz_text_sheet **sheet) {
+    fz_page *page = NULL;
+    fz_text_page *text_page = NULL;
+    fz_device *dev = NULL;
+
+    *sheet = NULL;
+    fz_var(page);
+    fz_var(text_page);
+    fz_var(dev);
+    fz_try(pdf->ctx) {
+        page = fz_load_page(pdf->doc, pageno);
+        *sheet = fz_new_text_sheet(pdf->ctx);
+        text_page = fz_new_text_page(pdf->ctx, get_page_box(pdf, pageno));
+        dev = fz_new_text_device(pdf->ctx, *sheet, text_page);
+        run_page(pdf, page, dev, NULL);
+    } fz_always(pdf->ctx) {
+        /* text device adds last line to text page when freed */
+        fz_free_device(dev);
+        fz_free_page(pdf->doc, page);
+    } fz_catch(pdf->ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to extract text of page %d: %s", pageno, pdf->ctx->error->message);
+        if (text_page) fz_free_text_page(pdf->ctx, text_page);
+        if (*sheet) fz_free_text_sheet(pdf->ctx, *sheet);
+        *sheet = NULL;
+        return NULL;
+    }
+    return text_page;
+}
+
+
+/**
+ * Run recorded page through text device.
+ * Unlike extract_text_page, this doesn't need pdf->lock: page is only
+ * recorded under lock, and text is extracted with caller's render ctx.
+ * @param sheet receives text sheet, to be freed with fz_free_text_sheet after text page
+ * @return text page to be freed with fz_free_text_page, or NULL on error
+ */
+static fz_text_page* extract_text_from_list(fz_context *ctx, int pageno, fz_display_list *list,
+        fz_rect page_bbox, fz_cookie *cookie, fz_text_sheet **sheet) {
+    fz_text_page *text_page = NULL;
+    fz_device *dev = NULL;
+
+    *sheet = NULL;
+    fz_var(text_page);
+    fz_var(dev);
+    fz_try(ctx) {
+        *sheet = fz_new_text_sheet(ctx);
+        text_page = fz_new_text_page(ctx, page_bbox);
+        dev = fz_new_text_device(ctx, *sheet, text_page);
+        fz_run_display_list(list, dev, fz_identity, fz_infinite_bbox, cookie);
+    } fz_always(ctx) {
+        /* text device adds last line to text page when freed */
+        fz_free_device(dev);
+    } fz_catch(ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to extract text of page %d: %s", pageno, ctx->error->message);
+        if (text_page) fz_free_text_page(ctx, text_page);
+        if (*sheet) fz_free_text_sheet(ctx, *sheet);
+        *sheet = NULL;
+        return NULL;
+    }
+    return text_page;
+}
+
+
+/**
+ * Store case-folded text of page in search index.
+ * Index keeps only text (lines separated by '\n', chars above 0xffff stored
+ * as 0xffff), 2 bytes per char, so it can hold whole long documents.
+ * Character boxes are not kept, find extracts them again for pages that match.
+ * Caller must hold pdf->lock.
+ * @param text_page extracted text of page
+ * @return 0 if page is indexed
+ */
+static int index_page_text(pdf_t *pdf, int pageno, fz_text_page *text_page) {
+    search_index_page_t *entry = NULL;
+    int block_no, line_no, span_no, char_no;
+    int len = 0;
+
+    if (pdf->search_index == NULL) {
+        int count = fz_count_pages(pdf->doc);
+        pdf->search_index = (search_index_page_t*)calloc(MAX(count, 1), sizeof(search_index_page_t));
+        if (pdf->search_index == NULL) return 1;
+        pdf->search_index_len = count;
+    }
+    if (pageno < 0 || pageno >= pdf->search_index_len) return 2;
+    entry = &(pdf->search_index[pageno]);
+    if (entry->text) return 0;
+
+    for(block_no = 0; block_no < text_page->len; ++block_no) {
+        fz_text_block *text_block = &(text_page->blocks[block_no]);
+        for(line_no = 0; line_no < text_block->len; ++line_no) {
+            fz_text_line *text_line = &(text_block->lines[line_no]);
+            for(span_no = 0; span_no < text_line->len; ++span_no) {
+                len += text_line->spans[span_no].len;
+            }
+            len += 1;
+        }
+    }
+
+    entry->text = (unsigned short*)malloc(MAX(len, 1) * sizeof(unsigned short));
+    if (entry->text == NULL) return 1;
+    entry->len = 0;
+    for(block_no = 0; block_no < text_page->len; ++block_no) {
+        fz_text_block *text_block = &(text_page->blocks[block_no]);
+        for(line_no = 0; line_no < text_block->len; ++line_no) {
+            fz_text_line *text_line = &(text_block->lines[line_no]);
+            for(span_no = 0; span_no < text_line->len; ++span_no) {
+                fz_text_span *text_span = &(text_line->spans[span_no]);
+                for(char_no = 0; char_no < text_span->len; ++char_no) {
+                    wchar_t c = towlower(text_span->text[char_no].c);
+                    entry->text[entry->len++] = c > 0xffff ? 0xffff : c;
+                }
+            }
+            entry->text[entry->len++] = '\n';
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Check if indexed page text may contain needle.
+ * May give false positives (for chars above 0xffff), never false negatives.
+ * @param needle case-folded text to find
+ * @return 1 if needle may be found on page, 0 if it's certainly not there
+ */
+static int search_index_match(search_index_page_t *entry, const wchar_t *needle, int needle_len) {
+    unsigned short first;
+    int i, j;
+
+    if (needle_len == 0) return 1;
+    first = needle[0] > 0xffff ? 0xffff : needle[0];
+    for(i = 0; i + needle_len <= entry->len; ++i) {
+        if (entry->text[i] != first) continue;
+        for(j = 1; j < needle_len; ++j) {
+            unsigned short c = needle[j] > 0xffff ? 0xffff : needle[j];
+            if (entry->text[i + j] != c) break;
+        }
+        if (j == needle_len) return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Implementation of native method PDF.indexPage.
+ * Adds text of page to search index, so later searches can skip extracting
+ * text of pages that don't match. Meant to be called for all pages from
+ * low priority background thread.
+ * Page is only recorded under pdf->lock, text is extracted with render ctx
+ * outside of it, as in find_all_page, so tiles don't wait for indexing.
+ * While findAll runs, nothing is done and 4 is returned: findAll indexes
+ * pages it searches, so caller should try again later instead of
+ * extracting the same pages at the same time.
+ * @return 0 if page is indexed (now or before), 4 if findAll is running,
+ * other error code on error
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_indexPage(
         JNIEnv *env,
         jobject this,
-        jstring text,
-        jint pageno,
-        jint rotation) {
-    int i = 0;
+        jint pageno) {
     pdf_t *pdf = NULL;
-    const jchar *jtext = NULL;
-    wchar_t *ctext = NULL;
-    size_t needle_len = 0;
-    jboolean is_copy;
-    jobject results = NULL;
-    fz_rect pagebox;
-    fz_page *page = NULL;
+    fz_display_list *list = NULL;
+    fz_rect page_bbox;
+    fz_context *ctx = NULL;
+    int ctx_slot = -1;
     fz_text_sheet *sheet = NULL;
-    fz_text_page *text_page = NULL;  /* contains text */
-    fz_device *dev = NULL;
+    fz_text_page *text_page = NULL;
+    int error = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+
+    pthread_mutex_lock(&pdf->lock);
+    if (pdf->find_all_running) {
+        pthread_mutex_unlock(&pdf->lock);
+        return 4;
+    }
+    if (pdf->search_index && pageno >= 0 && pageno < pdf->search_index_len
+            && pdf->search_index[pageno].text) {
+        pthread_mutex_unlock(&pdf->lock);
+        return 0;
+    }
+    /* images don't matter for text, and this list is not cached */
+    list = record_display_list(pdf, pageno, 1, NULL);
+    if (list) page_bbox = get_page_box(pdf, pageno);
+    pthread_mutex_unlock(&pdf->lock);
+    if (list == NULL) return 2;
+
+    ctx = acquire_render_ctx(pdf, &ctx_slot);
+    if (ctx)
+        text_page = extract_text_from_list(ctx, pageno, list, page_bbox, NULL, &sheet);
+
+    if (text_page) {
+        pthread_mutex_lock(&pdf->lock);
+        error = index_page_text(pdf, pageno, text_page) ? 3 : 0;
+        pthread_mutex_unlock(&pdf->lock);
+    } else {
+        error = 2;
+    }
+
+    if (ctx) {
+        if (text_page) fz_free_text_page(ctx, text_page);
+        if (sheet) fz_free_text_sheet(ctx, sheet);
+        fz_free_display_list(ctx, list);
+        release_render_ctx(pdf, ctx_slot);
+    } else {
+        pthread_mutex_lock(&pdf->lock);
+        fz_free_display_list(pdf->ctx, list);
+        pthread_mutex_unlock(&pdf->lock);
+    }
+    return error;
+}
+
+
+/**
+ * Free search index.
+ */
+void free_search_index(pdf_t *pdf) {
+    int i = 0;
+    if (pdf->search_index == NULL) return;
+    for(i = 0; i < pdf->search_index_len; ++i) {
+        free(pdf->search_index[i].text);
+    }
+    free(pdf->search_index);
+    pdf->search_index = NULL;
+    pdf->search_index_len = 0;
+}
+
+
+/**
+ * Find needle in text page, one hit per line at most.
+ * Boxes of matched chars are converted to APV's coordinates and appended
+ * to result. Uses only text_page, so it can be called without pdf->lock.
+ * @param page_bbox page box as returned by get_page_box
+ * @param needle case-folded text to find
+ * @return 0 if ok, 1 if out of memory
+ */
+static int find_in_text_page(fz_text_page *text_page, fz_rect page_bbox, int rotation,
+        wchar_t *needle, int needle_len, find_page_result_t *result) {
     wchar_t *textlinechars = NULL;
     size_t textlinechars_len = 0; /* not including \0 */
     fz_rect *textlineboxes = NULL; /* array of boxes of textlinechars, has textlinechars_len elements */
     wchar_t *found = NULL;
-    jobject find_result = NULL;
     fz_text_block *text_block = NULL;
     fz_text_line *text_line = NULL;
     fz_text_span *text_span = NULL;
-    fz_text_char *text_char = NULL;
     int block_no = 0;
     int line_no = 0;
     int char_no = 0;
     int span_no = 0;
-
-    jtext = (*env)->GetStringChars(env, text, &is_copy);
-
-    if (jtext == NULL) {
-        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "text cannot be null");
-        (*env)->ReleaseStringChars(env, text, jtext);
-        return NULL;
-    }
-
-    needle_len = (*env)->GetStringLength(env, text);
-
-    ctext = malloc((needle_len + 1) * sizeof(wchar_t));
-    for (i=0; i<needle_len; i++) {
-        ctext[i] = towlower(jtext[i]);
-    }
-    ctext[needle_len] = 0; /* This will be needed if wcsstr() ever starts to work */
-
-    pdf = get_pdf_from_this(env, this);
-
-    page = fz_load_page(pdf->doc, pageno);
-    sheet = fz_new_text_sheet(pdf->ctx);
-    pagebox = get_page_box(pdf, pageno);
-    text_page = fz_new_text_page(pdf->ctx, pagebox);
-    dev = fz_new_text_device(pdf->ctx, sheet, text_page);
-
-    fz_run_page(pdf->doc, page, dev, fz_identity, NULL);
+    int error = 0;
 
     /* search text_page by extracting wchar_t text for each line */
-    for(block_no = 0; block_no < text_page->len; ++block_no) {  /* for each block */
-        // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "checking block %d of %d", block_no, text_page->len);
+    for(block_no = 0; block_no < text_page->len && !error; ++block_no) {  /* for each block */
         text_block = &(text_page->blocks[block_no]);
-        for(line_no = 0; line_no < text_block->len; ++line_no) {  /* for each line */
-            // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "checking line %d of %d", line_no, text_block->len);
+        for(line_no = 0; line_no < text_block->len && !error; ++line_no) {  /* for each line */
             text_line = &(text_block->lines[line_no]);
             /* cound chars in line */
             textlinechars_len = 0;
             for(span_no = 0; span_no < text_line->len; ++span_no) {
                 textlinechars_len += text_line->spans[span_no].len;
             }
-            // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "text line chars len: %d", textlinechars_len);
             textlinechars = (wchar_t*)malloc((textlinechars_len + 1) * sizeof(wchar_t));
-            textlineboxes = (fz_rect*)malloc(textlinechars_len * sizeof(fz_rect));
+            textlineboxes = (fz_rect*)malloc(MAX(textlinechars_len, 1) * sizeof(fz_rect));
+            if (!textlinechars || !textlineboxes) {
+                free(textlinechars);
+                free(textlineboxes);
+                return 1;
+            }
             /* copy chars and boxes */
             char_no = 0;
             for(span_no = 0; span_no < text_line->len; ++span_no) {
@@ -455,50 +1338,431 @@ Java_cx_hell_android_lib_pdf_PDF_find(
             }
             textlinechars[textlinechars_len] = 0;
 
-            // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "copied textlinechars");
-            found = widestrstr(textlinechars, textlinechars_len, ctext, needle_len);
-            // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "widestrstr result: %d", (int)found);
-            if (found) {
-                int i = 0; /* used for char in textlinechars */
-                int i0 = 0, i1 = 0; /* indexes of match in textlinechars */
-                find_result = create_find_result(env);
-                set_find_result_page(env, find_result, pageno);
-                fz_rect charbox;
-                i0 = found - textlinechars;
-                i1 = i0 + needle_len;
-                // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "copying chars from %d to %d", i0, i1);
-                for(i = i0; i < i1; ++i) {
-                    charbox = textlineboxes[i];
-                    convert_box_pdf_to_apv(pdf, pageno, rotation, &charbox);
-                    add_find_result_marker(env, find_result,
-                            charbox.x0, charbox.y0,
-                            charbox.x1, charbox.y1);
-                }
-                // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "adding find result to list");
-                add_find_result_to_list(env, &results, find_result);
-                // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "added find result to list");
-            }
+            found = widestrstr(textlinechars, textlinechars_len, needle, needle_len);
+            if (found) {
+                int i = 0; /* used for char in textlinechars */
+                int i0 = 0; /* index of match in textlinechars */
+                float *boxes = NULL;
+                int *hit_lens = NULL;
+                i0 = found - textlinechars;
+                boxes = (float*)realloc(result->boxes, (result->box_count + needle_len) * 4 * sizeof(float));
+                if (boxes) result->boxes = boxes;
+                hit_lens = (int*)realloc(result->hit_lens, (result->hit_count + 1) * sizeof(int));
+                if (hit_lens) result->hit_lens = hit_lens;
+                if (boxes && hit_lens) {
+                    for(i = 0; i < needle_len; ++i) {
+                        fz_rect charbox = textlineboxes[i0 + i];
+                        float *out = result->boxes + (result->box_count + i) * 4;
+                        convert_box_to_apv(page_bbox, rotation, &charbox);
+                        out[0] = charbox.x0;
+                        out[1] = charbox.y0;
+                        out[2] = charbox.x1;
+                        out[3] = charbox.y1;
+                    }
+                    result->box_count += needle_len;
+                    result->hit_lens[result->hit_count++] = needle_len;
+                } else {
+                    error = 1;
+                }
+            }
+
+            free(textlinechars);
+            textlinechars = NULL;
+            free(textlineboxes);
+            textlineboxes = NULL;
+        }
+    }
+    return error;
+}
+
+
+/**
+ * Free hits of one page, so result can be reused.
+ */
+static void free_find_page_result(find_page_result_t *result) {
+    free(result->boxes);
+    free(result->hit_lens);
+    memset(result, 0, sizeof(find_page_result_t));
+}
+
+
+/**
+ * Convert Java string to case-folded wchar_t string.
+ * @return string to be freed by caller, or NULL
+ */
+static wchar_t* get_find_needle(JNIEnv *env, jstring text, int *needle_len) {
+    const jchar *jtext = NULL;
+    wchar_t *ctext = NULL;
+    int i = 0;
+
+    jtext = (*env)->GetStringChars(env, text, NULL);
+    if (jtext == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "text cannot be null");
+        return NULL;
+    }
+    *needle_len = (*env)->GetStringLength(env, text);
+    ctext = malloc((*needle_len + 1) * sizeof(wchar_t));
+    if (ctext) {
+        for (i=0; i<*needle_len; i++) {
+            ctext[i] = towlower(jtext[i]);
+        }
+        ctext[*needle_len] = 0; /* This will be needed if wcsstr() ever starts to work */
+    }
+    (*env)->ReleaseStringChars(env, text, jtext);
+    return ctext;
+}
+
+
+/**
+ * Implementation of native method PDF.find.
+ * Pages in search index are checked there first, text with char boxes is
+ * extracted only if page may contain searched text. Pages not indexed yet
+ * are added to index.
+ */
+JNIEXPORT jobject JNICALL
+Java_cx_hell_android_lib_pdf_PDF_find(
+        JNIEnv *env,
+        jobject this,
+        jstring text,
+        jint pageno,
+        jint rotation) {
+    int i = 0;
+    int hit_no = 0;
+    int box_no = 0;
+    pdf_t *pdf = NULL;
+    wchar_t *ctext = NULL;
+    int needle_len = 0;
+    jobject results = NULL;
+    fz_text_sheet *sheet = NULL;
+    fz_text_page *text_page = NULL;  /* contains text */
+    find_page_result_t hits;
+    jobject find_result = NULL;
+
+    memset(&hits, 0, sizeof(hits));
+    ctext = get_find_needle(env, text, &needle_len);
+    if (ctext == NULL) return NULL;
+
+    pdf = get_pdf_from_this(env, this);
+
+    pthread_mutex_lock(&pdf->lock);
+
+    if (!pdf->search_index || pageno < 0 || pageno >= pdf->search_index_len
+            || !pdf->search_index[pageno].text) {
+        text_page = extract_text_page(pdf, pageno, &sheet);
+        if (text_page) index_page_text(pdf, pageno, text_page);
+    }
+    if (pdf->search_index && pageno >= 0 && pageno < pdf->search_index_len
+            && pdf->search_index[pageno].text
+            && !search_index_match(&(pdf->search_index[pageno]), ctext, needle_len)) {
+        /* not on this page, no need to look at char boxes */
+        goto done;
+    }
+    if (text_page == NULL)
+        text_page = extract_text_page(pdf, pageno, &sheet);
+    if (text_page == NULL)
+        goto done;
+
+    find_in_text_page(text_page, get_page_box(pdf, pageno), rotation, ctext, needle_len, &hits);
+    for(hit_no = 0; hit_no < hits.hit_count; ++hit_no) {
+        find_result = create_find_result(env);
+        set_find_result_page(env, find_result, pageno);
+        for(i = 0; i < hits.hit_lens[hit_no]; ++i, ++box_no) {
+            float *box = hits.boxes + box_no * 4;
+            add_find_result_marker(env, find_result, box[0], box[1], box[2], box[3]);
+        }
+        add_find_result_to_list(env, &results, find_result);
+    }
+
+done:
+    if (text_page) {
+        fz_free_text_page(pdf->ctx, text_page);
+        fz_free_text_sheet(pdf->ctx, sheet);
+    }
+    pthread_mutex_unlock(&pdf->lock);
+
+    free_find_page_result(&hits);
+    free(ctext);
+    return results;
+}
+
+
+/**
+ * State of one findAll call, shared by its worker threads.
+ * Workers take pages in order, but may finish them out of order; results
+ * are kept per page until calling thread passes them to Java in order.
+ */
+typedef struct {
+    pdf_t *pdf;
+    wchar_t *needle;
+    int needle_len;
+    int rotation;
+    int start_page;
+    int page_count;
+    int next; /* next page to be taken by worker, counted from start_page */
+    int cancelled;
+    find_page_result_t *results; /* page_count entries, counted from start_page */
+    pthread_mutex_t mutex; /* guards next, cancelled and results[].done */
+    pthread_cond_t page_done;
+    fz_cookie cookies[MAX_RENDER_CONTEXTS]; /* one per worker, aborted on cancel */
+} find_all_t;
+
+typedef struct {
+    find_all_t *job;
+    int worker_no;
+    pthread_t thread;
+} find_all_worker_t;
+
+
+/**
+ * Search one page in findAll worker.
+ * Page is skipped if search index says it's not there. Otherwise it's
+ * recorded under pdf->lock (document can't be used by many threads), and
+ * text extraction and matching are done with worker's own render ctx.
+ */
+static void find_all_page(find_all_t *job, int worker_no, int pageno, find_page_result_t *result) {
+    pdf_t *pdf = job->pdf;
+    fz_cookie *cookie = &(job->cookies[worker_no]);
+    fz_display_list *list = NULL;
+    fz_rect page_bbox;
+    int indexed = 0;
+    fz_context *ctx = NULL;
+    int ctx_slot = -1;
+    fz_text_sheet *sheet = NULL;
+    fz_text_page *text_page = NULL;
+
+    pthread_mutex_lock(&pdf->lock);
+    indexed = pdf->search_index && pageno < pdf->search_index_len
+        && pdf->search_index[pageno].text;
+    if (indexed && !search_index_match(&(pdf->search_index[pageno]), job->needle, job->needle_len)) {
+        pthread_mutex_unlock(&pdf->lock);
+        return;
+    }
+    /* images don't matter for text, and this list is not cached */
+    list = record_display_list(pdf, pageno, 1, cookie);
+    page_bbox = get_page_box(pdf, pageno);
+    pthread_mutex_unlock(&pdf->lock);
+    if (list == NULL) return;
+
+    ctx = acquire_render_ctx(pdf, &ctx_slot);
+    if (ctx)
+        text_page = extract_text_from_list(ctx, pageno, list, page_bbox, cookie, &sheet);
+
+    if (text_page && !cookie->abort) {
+        if (!indexed) {
+            pthread_mutex_lock(&pdf->lock);
+            index_page_text(pdf, pageno, text_page);
+            pthread_mutex_unlock(&pdf->lock);
+        }
+        if (find_in_text_page(text_page, page_bbox, job->rotation, job->needle, job->needle_len, result))
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "out of memory while searching page %d", pageno);
+    }
+
+    if (ctx) {
+        if (text_page) fz_free_text_page(ctx, text_page);
+        if (sheet) fz_free_text_sheet(ctx, sheet);
+        fz_free_display_list(ctx, list);
+        release_render_ctx(pdf, ctx_slot);
+    } else {
+        pthread_mutex_lock(&pdf->lock);
+        fz_free_display_list(pdf->ctx, list);
+        pthread_mutex_unlock(&pdf->lock);
+    }
+}
+
+
+/**
+ * Worker thread of findAll: searches pages until all are taken or search
+ * is cancelled.
+ */
+static void* find_all_worker(void *arg) {
+    find_all_worker_t *worker = (find_all_worker_t*)arg;
+    find_all_t *job = worker->job;
+    int i = 0;
+
+    for(;;) {
+        pthread_mutex_lock(&job->mutex);
+        if (job->cancelled || job->next >= job->page_count) {
+            pthread_mutex_unlock(&job->mutex);
+            break;
+        }
+        i = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+
+        find_all_page(job, worker->worker_no, (job->start_page + i) % job->page_count, &(job->results[i]));
+
+        pthread_mutex_lock(&job->mutex);
+        job->results[i].done = 1;
+        pthread_cond_broadcast(&job->page_done);
+        pthread_mutex_unlock(&job->mutex);
+    }
+    return NULL;
+}
+
+
+/**
+ * Stop findAll workers: no more pages are taken, pages being searched
+ * are aborted.
+ */
+static void cancel_find_all(find_all_t *job) {
+    int i = 0;
+    pthread_mutex_lock(&job->mutex);
+    job->cancelled = 1;
+    for(i = 0; i < MAX_RENDER_CONTEXTS; ++i) job->cookies[i].abort = 1;
+    pthread_mutex_unlock(&job->mutex);
+}
+
+
+/**
+ * Pass hits of one page to Java callback.
+ * @return 0 if search should go on, 1 if callback asked to stop
+ */
+static int report_find_all_page(JNIEnv *env, jobject callback, jmethodID on_hit, jmethodID on_progress,
+        int pageno, int pages_done, int page_count, find_page_result_t *result) {
+    int hit_no = 0;
+    int box_no = 0;
+    jboolean go_on = JNI_TRUE;
+
+    for(hit_no = 0; hit_no < result->hit_count && go_on; ++hit_no) {
+        int len = result->hit_lens[hit_no];
+        jfloatArray boxes = (*env)->NewFloatArray(env, len * 4);
+        if (boxes == NULL) return 1; /* OutOfMemoryError is pending */
+        (*env)->SetFloatArrayRegion(env, boxes, 0, len * 4, result->boxes + box_no * 4);
+        go_on = (*env)->CallBooleanMethod(env, callback, on_hit, pageno, boxes);
+        (*env)->DeleteLocalRef(env, boxes);
+        if ((*env)->ExceptionCheck(env)) return 1;
+        box_no += len;
+    }
+    if (go_on) {
+        go_on = (*env)->CallBooleanMethod(env, callback, on_progress, pageno, pages_done, page_count);
+        if ((*env)->ExceptionCheck(env)) return 1;
+    }
+    return go_on ? 0 : 1;
+}
+
+
+/**
+ * Implementation of native method PDF.findAll.
+ * Searches all pages, starting at start_page and wrapping around at the
+ * end of document. Pages are searched by up to threads worker threads,
+ * while calling thread passes results to callback in page order as soon
+ * as they're ready: onHit once for each hit, with boxes of its chars packed
+ * in one float array, and onProgress after each page. If any callback
+ * returns false, workers are stopped and findAll returns.
+ * @return 0 if all pages were searched, 1 if pdf is null, 2 if search was
+ * stopped, 3 on other error
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_findAll(
+        JNIEnv *env,
+        jobject this,
+        jstring text,
+        jint start_page,
+        jint rotation,
+        jint threads,
+        jobject callback) {
+    static jmethodID on_hit = NULL;
+    static jmethodID on_progress = NULL;
+    pdf_t *pdf = NULL;
+    find_all_t job;
+    find_all_worker_t workers[MAX_RENDER_CONTEXTS];
+    int started = 0;
+    int stopped = 0;
+    int i = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
 
-            // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "freeing textlinechars and textlineboxes");
-            free(textlinechars);
-            textlinechars = NULL;
-            free(textlineboxes);
-            textlineboxes = NULL;
+    if (on_hit == NULL || on_progress == NULL) {
+        jclass callback_class = (*env)->FindClass(env, "cx/hell/android/lib/pdf/PDF$FindCallback");
+        if (callback_class == NULL) {
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't find class PDF$FindCallback");
+            return 3;
+        }
+        on_hit = (*env)->GetMethodID(env, callback_class, "onHit", "(I[F)Z");
+        on_progress = (*env)->GetMethodID(env, callback_class, "onProgress", "(III)Z");
+        (*env)->DeleteLocalRef(env, callback_class);
+        if (on_hit == NULL || on_progress == NULL) {
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't find PDF$FindCallback methods");
+            return 3;
         }
     }
 
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "freeing text_page, sheet, dev");
-    // fz_free_text_page(pdf->ctx, text_page);
-    // fz_free_device(dev);
+    memset(&job, 0, sizeof(job));
+    job.pdf = pdf;
+    job.rotation = rotation;
+    job.needle = get_find_needle(env, text, &job.needle_len);
+    if (job.needle == NULL) return 3;
+
+    pthread_mutex_lock(&pdf->lock);
+    job.page_count = fz_count_pages(pdf->doc);
+    pthread_mutex_unlock(&pdf->lock);
+    if (job.page_count <= 0) {
+        free(job.needle);
+        return 0;
+    }
+    job.start_page = start_page >= 0 && start_page < job.page_count ? start_page : 0;
+    job.results = (find_page_result_t*)calloc(job.page_count, sizeof(find_page_result_t));
+    if (job.results == NULL) {
+        free(job.needle);
+        return 3;
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.page_done, NULL);
+
+    /* background indexer waits until we're done, see indexPage */
+    pthread_mutex_lock(&pdf->lock);
+    pdf->find_all_running += 1;
+    pthread_mutex_unlock(&pdf->lock);
+
+    threads = MAX(1, MIN(threads, MIN(MAX_RENDER_CONTEXTS, job.page_count)));
+    for(i = 0; i < threads; ++i) {
+        workers[started].job = &job;
+        workers[started].worker_no = started;
+        if (pthread_create(&workers[started].thread, NULL, find_all_worker, &workers[started]) == 0)
+            started += 1;
+    }
 
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "freeing ctext");
-    free(ctext);
-    (*env)->ReleaseStringChars(env, text, jtext);
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "returning results");
-    return results;
-}
+    if (started == 0) {
+        __android_log_print(ANDROID_LOG_WARN, PDFVIEW_LOG_TAG, "couldn't start find threads, searching on calling thread");
+        workers[0].job = &job;
+        workers[0].worker_no = 0;
+    }
 
+    for(i = 0; i < job.page_count && !stopped; ++i) {
+        if (started == 0) {
+            /* no workers, search next page here */
+            find_all_page(&job, 0, (job.start_page + i) % job.page_count, &(job.results[i]));
+            job.results[i].done = 1;
+        }
+        pthread_mutex_lock(&job.mutex);
+        while (!job.results[i].done)
+            pthread_cond_wait(&job.page_done, &job.mutex);
+        pthread_mutex_unlock(&job.mutex);
+
+        stopped = report_find_all_page(env, callback, on_hit, on_progress,
+                (job.start_page + i) % job.page_count, i + 1, job.page_count, &(job.results[i]));
+        free_find_page_result(&(job.results[i]));
+    }
 
+    if (stopped) cancel_find_all(&job);
+    for(i = 0; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    for(i = 0; i < job.page_count; ++i)
+        free_find_page_result(&(job.results[i]));
+    free(job.results);
+    free(job.needle);
+    pthread_cond_destroy(&job.page_done);
+    pthread_mutex_destroy(&job.mutex);
+
+    pthread_mutex_lock(&pdf->lock);
+    pdf->find_all_running -= 1;
+    pthread_mutex_unlock(&pdf->lock);
+    return stopped ? 2 : 0;
+}
 
 
 // #ifdef pro
@@ -746,6 +2010,7 @@ void save_size(JNIEnv *env, jobject size, int width, int height) {
  */
 pdf_t* create_pdf_t() {
     pdf_t *pdf = NULL;
+    int i = 0;
     pdf = (pdf_t*)malloc(sizeof(pdf_t));
 
     pdf->ctx = NULL;
@@ -754,7 +2019,46 @@ pdf_t* create_pdf_t() {
     pdf->invalid_password = 0;
 
     pdf->box[0] = 0;
-    
+
+    for(i = 0; i < DISPLAY_LIST_CACHE_SIZE; ++i) {
+        pdf->display_lists[i].pageno = -1;
+        pdf->display_lists[i].skip_images = 0;
+        pdf->display_lists[i].last_used = 0;
+        pdf->display_lists[i].users = 0;
+        pdf->display_lists[i].list = NULL;
+    }
+    pdf->display_list_clock = 0;
+
+    pthread_mutex_init(&pdf->lock, NULL);
+    for(i = 0; i < FZ_LOCK_MAX; ++i) {
+        pthread_mutex_init(&pdf->fz_mutexes[i], NULL);
+    }
+    pdf->locks.user = pdf;
+    pdf->locks.lock = lock_fz_mutex;
+    pdf->locks.unlock = unlock_fz_mutex;
+
+    for(i = 0; i < MAX_RENDER_CONTEXTS; ++i) {
+        pdf->render_ctxs[i] = NULL;
+        pdf->render_ctx_busy[i] = 0;
+        pdf->render_scratch[i] = NULL;
+        pdf->render_scratch_pixels[i] = 0;
+    }
+    pthread_cond_init(&pdf->render_ctx_free, NULL);
+
+    pdf->pages = NULL;
+    pdf->page_count = -1;
+
+    pdf->search_index = NULL;
+    pdf->search_index_len = 0;
+    pdf->find_all_running = 0;
+
+    pdf->arena = NULL;
+
+    memset(&pdf->prefetch, 0, sizeof(prefetch_t));
+    pthread_mutex_init(&pdf->prefetch.mutex, NULL);
+    pthread_cond_init(&pdf->prefetch.wake, NULL);
+    pdf->prefetch.pageno = -1;
+
     return pdf;
 }
 
@@ -763,18 +2067,57 @@ pdf_t* create_pdf_t() {
  * free pdf_t
  */
 void free_pdf_t(pdf_t *pdf) {
+    int i = 0;
+    /* prefetch threads use display lists and contexts cloned from ctx */
+    stop_prefetch(pdf);
+    free(pdf->pages);
+    free_search_index(pdf);
+    free_display_lists(pdf);
+    for(i = 0; i < MAX_RENDER_CONTEXTS; ++i) {
+        if (pdf->render_ctxs[i]) {
+            fz_drop_pixmap(pdf->render_ctxs[i], pdf->render_scratch[i]);
+            pdf->render_scratch[i] = NULL;
+            fz_free_context(pdf->render_ctxs[i]);
+            pdf->render_ctxs[i] = NULL;
+        }
+    }
     if (pdf->doc) {
         fz_close_document(pdf->doc);
         pdf->doc = NULL;
     }
     if (pdf->ctx) {
+        fz_free_arena(pdf->ctx, pdf->arena);
+        pdf->arena = NULL;
         fz_free_context(pdf->ctx);
         pdf->ctx = NULL;
     }
+    pthread_cond_destroy(&pdf->render_ctx_free);
+    for(i = 0; i < FZ_LOCK_MAX; ++i) {
+        pthread_mutex_destroy(&pdf->fz_mutexes[i]);
+    }
+    pthread_mutex_destroy(&pdf->lock);
     free(pdf);
 }
 
 
+/**
+ * Lock callback for fitz, see fz_locks_context.
+ */
+static void lock_fz_mutex(void *user, int lock) {
+    pdf_t *pdf = (pdf_t*)user;
+    pthread_mutex_lock(&pdf->fz_mutexes[lock]);
+}
+
+
+/**
+ * Unlock callback for fitz, see fz_locks_context.
+ */
+static void unlock_fz_mutex(void *user, int lock) {
+    pdf_t *pdf = (pdf_t*)user;
+    pthread_mutex_unlock(&pdf->fz_mutexes[lock]);
+}
+
+
 
 #if 0
 /**
@@ -843,14 +2186,20 @@ pdf_t* parse_pdf_file(const char *filename, int fileno, const char* password) {
     pdf = create_pdf_t();
 
     if (pdf->ctx == NULL) {
-        pdf->ctx = fz_new_context(NULL, NULL, 1024 * 1024);
+        /* real locks are needed to clone ctx for rendering threads */
+        pdf->ctx = fz_new_context(NULL, &pdf->locks, 1024 * 1024);
     }
 
     if (filename) {
-        stream = fz_open_file(pdf->ctx, (char*)filename);
-    } else {
-        stream = fz_open_fd(pdf->ctx, fileno);
+        fileno = open(filename, O_BINARY | O_RDONLY, 0);
+        if (fileno == -1) {
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "cannot open %s: %s", filename, strerror(errno));
+            free_pdf_t(pdf);
+            return NULL;
+        }
     }
+    /* file is read straight from its mapping; falls back to read() if it can't be mapped */
+    stream = fz_open_mmap(pdf->ctx, fileno);
     pdf->doc = (fz_document*) pdf_open_document_with_stream(stream);
     fz_close(stream); /* pdf->doc holds ref */
 
@@ -890,88 +2239,708 @@ pdf_t* parse_pdf_file(const char *filename, int fileno, const char* password) {
     zoom_x = max_width / page_width;
     zoom_y = max_height / page_height;
 
-    zoom = (zoom_x < zoom_y) ? zoom_x : zoom_y;
+    zoom = (zoom_x < zoom_y) ? zoom_x : zoom_y;
+
+    return zoom;
+}*/
+
+
+/**
+ * Draw display list into tile pixmap, clearing it to white first.
+ * Draft pass is meant to be shown while full pass is still being drawn:
+ * it uses fewer anti-aliasing levels, decodes images at a quarter of their
+ * drawn size and leaves out shadings. Throws on error.
+ */
+static void draw_tile(fz_context *ctx, fz_display_list *list, fz_matrix ctm,
+        fz_bbox bbox, fz_pixmap *image, fz_cookie *cookie, int draft) {
+    fz_device *dev = NULL;
+    int aa_level = fz_aa_level(ctx);
+
+    fz_var(dev);
+    fz_try(ctx) {
+        fz_clear_pixmap_with_value(ctx, image, 0xff);
+        dev = fz_new_draw_device(ctx, image);
+        if (draft) {
+            /* render ctx is not shared while we hold it, so this is local to this thread */
+            fz_set_aa_level(ctx, DRAFT_AA_LEVEL);
+            dev->hints |= FZ_IGNORE_SHADE | FZ_DRAFT_IMAGE;
+        }
+
+        /* replay recorded page, only commands touching this tile are drawn */
+        fz_run_display_list(list, dev, ctm, bbox, cookie);
+    } fz_always(ctx) {
+        fz_free_device(dev);
+        if (draft) fz_set_aa_level(ctx, aa_level);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+/**
+ * Get scratch pixmap of render ctx in given slot, placed at bbox.
+ * Pixmap is kept until pdf_t is freed and is only reallocated when tile
+ * has more pixels than it can hold, so RGB_565 tiles don't allocate full
+ * size pixmaps each time. Must be called by thread that holds that render ctx.
+ * Throws if pixmap can't be allocated.
+ */
+static fz_pixmap* get_render_scratch(pdf_t *pdf, fz_context *ctx, int slot, fz_bbox bbox) {
+    fz_pixmap *image = pdf->render_scratch[slot];
+    int w = bbox.x1 - bbox.x0;
+    int h = bbox.y1 - bbox.y0;
+
+    if (image == NULL || pdf->render_scratch_pixels[slot] < w * h) {
+        pdf->render_scratch[slot] = NULL;
+        fz_drop_pixmap(ctx, image);
+        image = fz_new_pixmap_with_bbox(ctx, fz_device_rgb, bbox);
+        pdf->render_scratch[slot] = image;
+        pdf->render_scratch_pixels[slot] = w * h;
+    }
+    /* samples are w * h * n bytes with no padding, so smaller tile just uses less of them */
+    image->x = bbox.x0;
+    image->y = bbox.y0;
+    image->w = w;
+    image->h = h;
+    return image;
+}
+
+
+/**
+ * Render part of page into pixmap.
+ * Parameters left, top, width and height are interprted after scalling, so if
+ * we have 100x200 page scalled by 25% and request 0x0 x 25x50 tile, we should
+ * get 25x50 bitmap of whole page content. pageno is 0-based.
+ * Can be called from many threads at once: only getting display list holds
+ * pdf->lock, drawing is done with thread's own render ctx.
+ * If cookie is not NULL and gets aborted, rendering is stopped and NULL
+ * is returned.
+ * If on_pass is not NULL, tile is rendered progressively: draft pass is drawn
+ * first (see draw_tile) and on_pass is called with RENDER_PASS_DRAFT, then
+ * full pass is drawn into the same pixmap, replaying the same display list,
+ * and on_pass is called with RENDER_PASS_FULL. If on_pass returns 0 after
+ * draft pass, full pass is skipped and NULL is returned. Pages without
+ * images and shadings draw about as fast in full as in draft, so their
+ * draft pass is skipped and on_pass is called only once, with
+ * RENDER_PASS_FULL.
+ * If pixels is not NULL, tile is drawn into scratch pixmap of render ctx
+ * (see get_render_scratch) and packed into pixels as RGB_565 after each
+ * pass, before on_pass is called; colorspace must be fz_device_rgb and out
+ * is not used. Otherwise new pixmap is allocated and returned in out.
+ * @return 0 if tile was drawn, -1 on error or if rendering was stopped
+ */
+static int render_tile(pdf_t *pdf, int pageno, int zoom_pmil,
+        int left, int top, int rotation, int skipImages, int width, int height,
+        fz_colorspace *colorspace, fz_cookie *cookie,
+        render_pass_callback_t on_pass, void *user,
+        unsigned short *pixels, fz_pixmap **out) {
+    fz_matrix ctm;
+    double zoom;
+    fz_bbox bbox;
+    fz_rect pagebox;
+    cached_display_list_t *entry = NULL;
+    fz_context *ctx = NULL;
+    int ctx_slot = -1;
+    fz_pixmap *image = NULL;
+    int pass = on_pass ? RENDER_PASS_DRAFT : RENDER_PASS_FULL;
+
+    zoom = (double)zoom_pmil / 1000.0;
+
+    pthread_mutex_lock(&pdf->lock);
+    if (cookie && cookie->abort) {
+        /* aborted while waiting for lock */
+        pthread_mutex_unlock(&pdf->lock);
+        return -1;
+    }
+    if (pdf->last_pageno != pageno) {
+        pdf->last_pageno = pageno;
+    }
+    entry = acquire_display_list(pdf, pageno, skipImages, cookie);
+    if (entry) pagebox = get_page_box(pdf, pageno);
+    pthread_mutex_unlock(&pdf->lock);
+    if (!entry) return -1; /* TODO: handle/propagate errors */
+
+    /* translate coords to apv coords so we can easily cut out our tile */
+    ctm = fz_identity;
+    ctm = fz_concat(ctm, fz_scale(zoom, zoom));
+    if (rotation != 0) ctm = fz_concat(ctm, fz_rotate(-rotation * 90));
+    bbox = fz_round_rect(fz_transform_rect(ctm, pagebox));
+
+    /* now bbox holds page after transform, but we only need tile at (left,right) from top-left corner */
+    bbox.x0 = bbox.x0 + left;
+    bbox.y0 = bbox.y0 + top;
+    bbox.x1 = bbox.x0 + width;
+    bbox.y1 = bbox.y0 + height;
+
+    ctx = acquire_render_ctx(pdf, &ctx_slot);
+    if (!ctx || (cookie && cookie->abort)) {
+        if (ctx) release_render_ctx(pdf, ctx_slot);
+        release_display_list(pdf, entry);
+        return -1;
+    }
+
+    if (!fz_count_slow_display_nodes(entry->list))
+        pass = RENDER_PASS_FULL;
+
+    fz_var(image);
+    fz_var(pass);
+    fz_try(ctx) {
+        if (pixels)
+            image = get_render_scratch(pdf, ctx, ctx_slot, bbox);
+        else
+            image = fz_new_pixmap_with_bbox(ctx, colorspace, bbox);
+        for (;;) {
+            draw_tile(ctx, entry->list, ctm, bbox, image, cookie, pass == RENDER_PASS_DRAFT);
+            if (cookie && cookie->abort) break;
+            if (pixels) pack_rgb565(pixels, image);
+            if (on_pass && !on_pass(user, image, pass)) break;
+            if (pass == RENDER_PASS_FULL) break;
+            pass = RENDER_PASS_FULL;
+        }
+    } fz_catch(ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to render page %d: %s", pageno, ctx->error->message);
+        if (!pixels) fz_drop_pixmap(ctx, image);
+        image = NULL;
+    }
+
+    if (image && (pass != RENDER_PASS_FULL || (cookie && cookie->abort))) {
+        /* tile is only partially drawn or full pass was not wanted */
+        if (!pixels) fz_drop_pixmap(ctx, image);
+        image = NULL;
+    }
+
+    release_render_ctx(pdf, ctx_slot);
+    release_display_list(pdf, entry);
+    if (!image) return -1;
+    if (out) *out = pixels ? NULL : image;
+    return 0;
+}
+
+
+/**
+ * Get part of page as bitmap.
+ * See render_tile for meaning of parameters.
+ */
+static jintArray get_page_image_bitmap(JNIEnv *env,
+      pdf_t *pdf, int pageno, int zoom_pmil, int left, int top, int rotation,
+      int skipImages,
+      int *width, int *height) {
+    fz_pixmap *image = NULL;
+    static int runs = 0;
+    int num_pixels;
+    jintArray jints; /* return value */
+    int *jbuf; /* pointer to internal jint */
+
+    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "get_page_image_bitmap(pageno: %d) start", (int)pageno);
+
+    if (render_tile(pdf, pageno, zoom_pmil, left, top, rotation, skipImages,
+            *width, *height, fz_device_bgr, NULL, NULL, NULL, NULL, &image) != 0)
+        return NULL;
+
+    /*
+    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "got image %d x %d, asked for %d x %d",
+            fz_pixmap_width(pdf->ctx, image), fz_pixmap_height(pdf->ctx, image),
+            *width, *height);
+    */
+
+    /* renderPageDirect avoids this copy */
+    num_pixels = fz_pixmap_width(pdf->ctx, image) * fz_pixmap_height(pdf->ctx, image);
+    jints = (*env)->NewIntArray(env, num_pixels);
+	jbuf = (*env)->GetIntArrayElements(env, jints, NULL);
+    memcpy(jbuf, fz_pixmap_samples(pdf->ctx, image), num_pixels * 4);
+    (*env)->ReleaseIntArrayElements(env, jints, jbuf, 0);
+
+    *width = fz_pixmap_width(pdf->ctx, image);
+    *height = fz_pixmap_height(pdf->ctx, image);
+    fz_drop_pixmap(pdf->ctx, image);
+    runs += 1;
+    return jints;
+}
+
+
+/**
+ * Get display list of given page, record it if it's not cached yet.
+ * Interpreting page content is the expensive part of rendering, so page
+ * is run through list device only once and then each tile just replays
+ * the list. Least recently used list is dropped when cache is full, but
+ * lists that are being replayed by other threads are never dropped; if all
+ * slots are in use, uncached list is returned.
+ * Lists recorded with skip_images don't contain images at all, so they
+ * are cached separately.
+ * Caller must hold pdf->lock and release the list with release_display_list
+ * after replaying it (replaying itself doesn't need the lock).
+ * @param pdf pdf struct
+ * @param pageno 0-based page number
+ * @param skip_images if true, images are not recorded
+ * @param cookie if not NULL, recording can be aborted with it, incomplete
+ * list is then dropped
+ * @return display list entry or NULL on error or abort
+ */
+cached_display_list_t* acquire_display_list(pdf_t *pdf, int pageno, int skip_images, fz_cookie *cookie) {
+    cached_display_list_t *entry = NULL;
+    fz_display_list *list = NULL;
+    int i = 0;
+
+    skip_images = skip_images ? 1 : 0;
+    pdf->display_list_clock += 1;
+
+    for(i = 0; i < DISPLAY_LIST_CACHE_SIZE; ++i) {
+        cached_display_list_t *e = &(pdf->display_lists[i]);
+        if (e->list && e->pageno == pageno && e->skip_images == skip_images) {
+            e->last_used = pdf->display_list_clock;
+            e->users += 1;
+            return e;
+        }
+        if (e->users > 0) continue;
+        /* prefer empty slot, then least recently used one */
+        if (entry == NULL || (entry->list != NULL
+                    && (e->list == NULL || e->last_used < entry->last_used)))
+            entry = e;
+    }
+
+    list = record_display_list(pdf, pageno, skip_images, cookie);
+    if (list == NULL) return NULL;
+
+    if (entry == NULL) {
+        /* all slots are being replayed, freed in release_display_list */
+        entry = (cached_display_list_t*)malloc(sizeof(cached_display_list_t));
+        entry->list = NULL;
+    }
+
+    /* evict least recently used slot */
+    if (entry->list)
+        fz_free_display_list(pdf->ctx, entry->list);
+    entry->pageno = pageno;
+    entry->skip_images = skip_images;
+    entry->last_used = pdf->display_list_clock;
+    entry->users = 1;
+    entry->list = list;
+    return entry;
+}
+
+
+/**
+ * Run page through list device, without caching the result.
+ * Caller must hold pdf->lock.
+ * @return display list to be freed with fz_free_display_list or NULL on
+ * error or abort
+ */
+fz_display_list* record_display_list(pdf_t *pdf, int pageno, int skip_images, fz_cookie *cookie) {
+    fz_display_list *list = NULL;
+    fz_page *page = NULL;
+    fz_device *dev = NULL;
+
+    fz_var(page);
+    fz_var(dev);
+    fz_var(list);
+    fz_try(pdf->ctx) {
+        page = fz_load_page(pdf->doc, pageno);
+        list = fz_new_display_list(pdf->ctx);
+        dev = fz_new_list_device(pdf->ctx, list);
+        if (skip_images)
+            dev->hints |= FZ_IGNORE_IMAGE;
+        run_page(pdf, page, dev, cookie);
+    } fz_always(pdf->ctx) {
+        fz_free_device(dev);
+        fz_free_page(pdf->doc, page);
+    } fz_catch(pdf->ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to record page %d: %s", pageno, pdf->ctx->error->message);
+        fz_free_display_list(pdf->ctx, list);
+        return NULL;
+    }
+
+    if (cookie && cookie->abort) {
+        fz_free_display_list(pdf->ctx, list);
+        return NULL;
+    }
+    log_page_alloc_stats(pdf, pageno);
+    return list;
+}
+
+
+/**
+ * Release display list entry returned by acquire_display_list.
+ * Takes pdf->lock.
+ */
+void release_display_list(pdf_t *pdf, cached_display_list_t *entry) {
+    pthread_mutex_lock(&pdf->lock);
+    entry->users -= 1;
+    if (entry < pdf->display_lists || entry >= pdf->display_lists + DISPLAY_LIST_CACHE_SIZE) {
+        fz_free_display_list(pdf->ctx, entry->list);
+        free(entry);
+    }
+    pthread_mutex_unlock(&pdf->lock);
+}
+
+
+/**
+ * Get context for rendering thread, wait if all of them are in use.
+ * Contexts are cloned from pdf->ctx on first use and kept until pdf_t is freed.
+ * @param slot receives index to be passed to release_render_ctx
+ * @return render context or NULL if it couldn't be created
+ */
+fz_context* acquire_render_ctx(pdf_t *pdf, int *slot) {
+    fz_context *ctx = NULL;
+    int i = 0;
+
+    pthread_mutex_lock(&pdf->lock);
+    for(;;) {
+        for(i = 0; i < MAX_RENDER_CONTEXTS; ++i) {
+            if (!pdf->render_ctx_busy[i]) break;
+        }
+        if (i < MAX_RENDER_CONTEXTS) break;
+        pthread_cond_wait(&pdf->render_ctx_free, &pdf->lock);
+    }
+    if (pdf->render_ctxs[i] == NULL) {
+        pdf->render_ctxs[i] = fz_clone_context(pdf->ctx);
+        if (pdf->render_ctxs[i] == NULL)
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to clone context");
+    }
+    ctx = pdf->render_ctxs[i];
+    if (ctx) {
+        pdf->render_ctx_busy[i] = 1;
+        *slot = i;
+    }
+    pthread_mutex_unlock(&pdf->lock);
+    return ctx;
+}
+
+
+/**
+ * Flush front glyph caches of idle render contexts if shared glyph cache
+ * evicted glyphs since they were last used. Otherwise they would keep
+ * evicted glyphs, and atlases those are in, alive until their next render.
+ * Must be called with pdf->lock held.
+ */
+static void sync_idle_glyph_fronts(pdf_t *pdf) {
+    int i = 0;
+
+    for(i = 0; i < MAX_RENDER_CONTEXTS; ++i) {
+        if (pdf->render_ctxs[i] && !pdf->render_ctx_busy[i])
+            fz_sync_glyph_front(pdf->render_ctxs[i]);
+    }
+}
+
+
+/**
+ * Return context taken with acquire_render_ctx.
+ * Glyphs may have been evicted during that render, so idle contexts' front
+ * glyph caches are flushed if needed, see sync_idle_glyph_fronts.
+ */
+void release_render_ctx(pdf_t *pdf, int slot) {
+    pthread_mutex_lock(&pdf->lock);
+    pdf->render_ctx_busy[slot] = 0;
+    sync_idle_glyph_fronts(pdf);
+    pthread_cond_signal(&pdf->render_ctx_free);
+    pthread_mutex_unlock(&pdf->lock);
+}
+
+
+/**
+ * User of device that collects images for prefetch threads.
+ */
+typedef struct {
+    pdf_t *pdf;
+    unsigned int generation; /* request images are collected for */
+} prefetch_collector_t;
+
+
+/**
+ * Check if image drawn at w x h should be prefetched.
+ * Mip level is guessed the same way as pdf_image does it (rounded down
+ * to power of two, so guessed level is never smaller than real one).
+ * Images that take more than a quarter of image budget at that level are
+ * decoded region by region while tiles are drawn (see pdf_image_region),
+ * so decoding them whole would only waste memory.
+ */
+static int prefetch_image_fits(fz_context *ctx, fz_image *image, int w, int h) {
+    fz_store_stats stats[FZ_STORE_KINDS];
+    unsigned int size = 0, max = 0;
+    int n = image->colorspace ? image->colorspace->n + 1 : 1;
+    int factor = 1;
+
+    w = MIN(w, image->w);
+    h = MIN(h, image->h);
+    if (w > 0 && h > 0) {
+        while (factor < 256 && factor * 2 <= MIN(image->w / w, image->h / h))
+            factor *= 2;
+    }
+
+    fz_get_store_usage(ctx, &size, &max);
+    fz_get_store_stats(ctx, stats);
+    if (max == FZ_STORE_UNLIMITED || (stats[FZ_STORE_IMAGE].max != FZ_STORE_UNLIMITED && stats[FZ_STORE_IMAGE].max < max))
+        max = stats[FZ_STORE_IMAGE].max;
+    if (max == FZ_STORE_UNLIMITED)
+        max = FZ_STORE_DEFAULT;
+    return (double)((image->w + factor - 1) / factor) * ((image->h + factor - 1) / factor) * n <= max / 4;
+}
+
+
+/**
+ * Queue image for prefetch threads.
+ * Image is wanted at the size draw device asks fz_image_to_pixmap for,
+ * so that tile finds decoded image in store.
+ */
+static void collect_prefetch_image(fz_device *dev, fz_image *image, fz_matrix ctm) {
+    prefetch_collector_t *collector = (prefetch_collector_t*)dev->user;
+    prefetch_t *prefetch = &(collector->pdf->prefetch);
+    prefetch_image_t *item = NULL;
+    int w = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+    int h = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+
+    if (image->w == 0 || image->h == 0 || !prefetch_image_fits(dev->ctx, image, w, h))
+        return;
+
+    pthread_mutex_lock(&prefetch->mutex);
+    if (collector->generation == prefetch->generation && !prefetch->stopped
+            && prefetch->queue_len < PREFETCH_QUEUE_SIZE) {
+        item = &(prefetch->queue[(prefetch->queue_head + prefetch->queue_len) % PREFETCH_QUEUE_SIZE]);
+        item->image = fz_keep_image(dev->ctx, image);
+        item->w = w;
+        item->h = h;
+        item->generation = collector->generation;
+        prefetch->queue_len += 1;
+        pthread_cond_signal(&prefetch->wake);
+    }
+    pthread_mutex_unlock(&prefetch->mutex);
+}
+
+static void collect_prefetch_fill_image(fz_device *dev, fz_image *image, fz_matrix ctm, float alpha) {
+    collect_prefetch_image(dev, image, ctm);
+}
+
+static void collect_prefetch_fill_image_mask(fz_device *dev, fz_image *image, fz_matrix ctm,
+        fz_colorspace *colorspace, float *color, float alpha) {
+    collect_prefetch_image(dev, image, ctm);
+}
+
+static void collect_prefetch_clip_image_mask(fz_device *dev, fz_image *image, fz_rect *rect, fz_matrix ctm) {
+    collect_prefetch_image(dev, image, ctm);
+}
+
+
+/**
+ * Replay page through device that queues its images for prefetch threads.
+ * Display list is taken from cache (or recorded and cached) just like
+ * render_tile does it, so first tile of page doesn't have to record it.
+ */
+static void collect_prefetch_images(pdf_t *pdf, fz_context *ctx, int pageno, int zoom_pmil, unsigned int generation) {
+    prefetch_t *prefetch = &(pdf->prefetch);
+    prefetch_collector_t collector;
+    cached_display_list_t *entry = NULL;
+    fz_device *dev = NULL;
+    fz_rect pagebox;
+    fz_matrix ctm;
+
+    pthread_mutex_lock(&pdf->lock);
+    /* prefetchPage doesn't check page against document */
+    if (pageno < fz_count_pages(pdf->doc))
+        entry = acquire_display_list(pdf, pageno, 0, &(prefetch->cookie));
+    if (entry) pagebox = get_page_box(pdf, pageno);
+    pthread_mutex_unlock(&pdf->lock);
+    if (!entry) return;
+
+    ctm = fz_scale((double)zoom_pmil / 1000.0, (double)zoom_pmil / 1000.0);
+    collector.pdf = pdf;
+    collector.generation = generation;
+
+    fz_var(dev);
+    fz_try(ctx) {
+        dev = fz_new_device(ctx, &collector);
+        dev->fill_image = collect_prefetch_fill_image;
+        dev->fill_image_mask = collect_prefetch_fill_image_mask;
+        dev->clip_image_mask = collect_prefetch_clip_image_mask;
+        /* images outside of page box are never drawn */
+        fz_run_display_list(entry->list, dev, ctm,
+                fz_round_rect(fz_transform_rect(ctm, pagebox)), &(prefetch->cookie));
+    } fz_always(ctx) {
+        fz_free_device(dev);
+    } fz_catch(ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to collect images of page %d: %s", pageno, ctx->error->message);
+    }
+    release_display_list(pdf, entry);
+}
+
 
-    return zoom;
-}*/
+/**
+ * Decode queued image into store, or just drop it if its request has
+ * been superseded.
+ */
+static void prefetch_image(fz_context *ctx, prefetch_image_t *item, int decode) {
+    fz_pixmap *pixmap = NULL;
+
+    fz_var(pixmap);
+    fz_try(ctx) {
+        /* store keeps decoded image, our reference is not needed */
+        if (decode)
+            pixmap = fz_image_to_pixmap(ctx, item->image, item->w, item->h);
+    } fz_always(ctx) {
+        fz_drop_pixmap(ctx, pixmap);
+    } fz_catch(ctx) {
+        __android_log_print(ANDROID_LOG_WARN, PDFVIEW_LOG_TAG, "failed to prefetch image: %s", ctx->error->message);
+    }
+    fz_drop_image(ctx, item->image);
+}
 
 
 /**
- * Get part of page as bitmap.
- * Parameters left, top, width and height are interprted after scalling, so if
- * we have 100x200 page scalled by 25% and request 0x0 x 25x50 tile, we should
- * get 25x50 bitmap of whole page content. pageno is 0-based.
+ * Prefetch thread: decodes queued images, collects images of requested
+ * page when queue is empty. Runs until stop_prefetch.
+ * Each prefetch thread has its own ctx cloned from pdf->ctx rather than
+ * one from render ctx pool, so that long decodes never make visible tiles
+ * wait for a context.
  */
-static jintArray get_page_image_bitmap(JNIEnv *env,
-      pdf_t *pdf, int pageno, int zoom_pmil, int left, int top, int rotation,
-      int skipImages,
-      int *width, int *height) {
-    unsigned char *bytes = NULL;
-    fz_matrix ctm;
-    double zoom;
-    fz_bbox bbox;
-    fz_page *page = NULL;
-    fz_pixmap *image = NULL;
-    static int runs = 0;
-    fz_device *dev = NULL;
-    int num_pixels;
-    jintArray jints; /* return value */
-    int *jbuf; /* pointer to internal jint */
+static void* prefetch_worker(void *arg) {
+    pdf_t *pdf = (pdf_t*)arg;
+    prefetch_t *prefetch = &(pdf->prefetch);
+    fz_context *ctx = NULL;
+    prefetch_image_t item;
+    int decode = 0;
+    int pageno = -1;
+    int zoom_pmil = 0;
+    unsigned int generation = 0;
+
+    /* visible tiles go first; on Linux this only applies to calling thread */
+    setpriority(PRIO_PROCESS, 0, PREFETCH_NICE);
+
+    pthread_mutex_lock(&pdf->lock);
+    ctx = fz_clone_context(pdf->ctx);
+    pthread_mutex_unlock(&pdf->lock);
+    if (ctx == NULL) {
+        /* other thread or stop_prefetch takes care of queue */
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to clone context for prefetch");
+        return NULL;
+    }
 
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "get_page_image_bitmap(pageno: %d) start", (int)pageno);
+    pthread_mutex_lock(&prefetch->mutex);
+    while (!prefetch->stopped) {
+        if (prefetch->queue_len > 0) {
+            item = prefetch->queue[prefetch->queue_head];
+            prefetch->queue_head = (prefetch->queue_head + 1) % PREFETCH_QUEUE_SIZE;
+            prefetch->queue_len -= 1;
+            decode = item.generation == prefetch->generation;
+            pthread_mutex_unlock(&prefetch->mutex);
+            prefetch_image(ctx, &item, decode);
+            pthread_mutex_lock(&prefetch->mutex);
+        } else if (prefetch->pageno >= 0) {
+            pageno = prefetch->pageno;
+            zoom_pmil = prefetch->zoom_pmil;
+            generation = prefetch->generation;
+            prefetch->pageno = -1;
+            pthread_mutex_unlock(&prefetch->mutex);
+            collect_prefetch_images(pdf, ctx, pageno, zoom_pmil, generation);
+            pthread_mutex_lock(&prefetch->mutex);
+        } else {
+            pthread_cond_wait(&prefetch->wake, &prefetch->mutex);
+        }
+    }
+    pthread_mutex_unlock(&prefetch->mutex);
+    fz_free_context(ctx);
+    return NULL;
+}
 
-    zoom = (double)zoom_pmil / 1000.0;
 
-    if (pdf->last_pageno != pageno) {
-        pdf->last_pageno = pageno;
+/**
+ * Request images of page to be decoded in background at given zoom.
+ * Supersedes previous request. Prefetch threads are started on first call.
+ * @return 0 if ok, 1 if no prefetch thread could be started
+ */
+int prefetch_page(pdf_t *pdf, int pageno, int zoom_pmil) {
+    prefetch_t *prefetch = &(pdf->prefetch);
+    int error = 0;
+
+    pthread_mutex_lock(&prefetch->mutex);
+    while (prefetch->thread_count < PREFETCH_THREADS && !prefetch->stopped) {
+        if (pthread_create(&(prefetch->threads[prefetch->thread_count]), NULL, prefetch_worker, pdf) != 0) {
+            __android_log_print(ANDROID_LOG_WARN, PDFVIEW_LOG_TAG, "couldn't start prefetch thread");
+            break;
+        }
+        prefetch->thread_count += 1;
+    }
+    if (prefetch->thread_count > 0) {
+        prefetch->generation += 1;
+        prefetch->pageno = pageno;
+        prefetch->zoom_pmil = zoom_pmil;
+        pthread_cond_broadcast(&prefetch->wake);
+    } else {
+        error = 1;
     }
+    pthread_mutex_unlock(&prefetch->mutex);
+    return error;
+}
 
-    page = fz_load_page(pdf->doc, pageno);
-    if (!page) return NULL; /* TODO: handle/propagate errors */
 
-    fz_rect pagebox = get_page_box(pdf, pageno);
+/**
+ * Forget requested page, queued images are dropped without decoding.
+ * Images being decoded right now are finished.
+ */
+void cancel_prefetch(pdf_t *pdf) {
+    prefetch_t *prefetch = &(pdf->prefetch);
+    pthread_mutex_lock(&prefetch->mutex);
+    prefetch->generation += 1;
+    prefetch->pageno = -1;
+    pthread_mutex_unlock(&prefetch->mutex);
+}
 
-    /* translate coords to apv coords so we can easily cut out our tile */
-    ctm = fz_identity;
-    ctm = fz_concat(ctm, fz_scale(zoom, zoom));
-    if (rotation != 0) ctm = fz_concat(ctm, fz_rotate(-rotation * 90));
-    bbox = fz_round_rect(fz_transform_rect(ctm, pagebox));
 
-    /* now bbox holds page after transform, but we only need tile at (left,right) from top-left corner */
-    bbox.x0 = bbox.x0 + left;
-    bbox.y0 = bbox.y0 + top;
-    bbox.x1 = bbox.x0 + *width;
-    bbox.y1 = bbox.y0 + *height;
+/**
+ * Stop and join prefetch threads and free everything in prefetch_t.
+ * Called when pdf_t is freed, before display lists and pdf->ctx are.
+ */
+void stop_prefetch(pdf_t *pdf) {
+    prefetch_t *prefetch = &(pdf->prefetch);
+    int i = 0;
 
-    image = fz_new_pixmap_with_bbox(pdf->ctx, fz_device_bgr, bbox);
-    fz_clear_pixmap_with_value(pdf->ctx, image, 0xff);
-    dev = fz_new_draw_device(pdf->ctx, image);
+    pthread_mutex_lock(&prefetch->mutex);
+    prefetch->stopped = 1;
+    prefetch->cookie.abort = 1;
+    pthread_cond_broadcast(&prefetch->wake);
+    pthread_mutex_unlock(&prefetch->mutex);
 
-    if (skipImages)
-        dev->hints |= FZ_IGNORE_IMAGE;
+    for(i = 0; i < prefetch->thread_count; ++i)
+        pthread_join(prefetch->threads[i], NULL);
+    prefetch->thread_count = 0;
 
-    fz_run_page(pdf->doc, page, dev, ctm, NULL);
-    fz_free_device(dev);
+    for(i = 0; i < prefetch->queue_len; ++i)
+        fz_drop_image(pdf->ctx, prefetch->queue[(prefetch->queue_head + i) % PREFETCH_QUEUE_SIZE].image);
+    prefetch->queue_len = 0;
 
-    /*
-    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "got image %d x %d, asked for %d x %d",
-            fz_pixmap_width(pdf->ctx, image), fz_pixmap_height(pdf->ctx, image),
-            *width, *height);
-    */
+    pthread_cond_destroy(&prefetch->wake);
+    pthread_mutex_destroy(&prefetch->mutex);
+}
 
-    /* TODO: learn jni and avoid copying bytes ;) */
-    num_pixels = fz_pixmap_width(pdf->ctx, image) * fz_pixmap_height(pdf->ctx, image);
-    jints = (*env)->NewIntArray(env, num_pixels);
-	jbuf = (*env)->GetIntArrayElements(env, jints, NULL);
-    memcpy(jbuf, fz_pixmap_samples(pdf->ctx, image), num_pixels * 4);
-    (*env)->ReleaseIntArrayElements(env, jints, jbuf, 0);
 
-    *width = fz_pixmap_width(pdf->ctx, image);
-    *height = fz_pixmap_height(pdf->ctx, image);
-    fz_drop_pixmap(pdf->ctx, image);
-	fz_free_page(pdf->doc, page);
-    runs += 1;
-    return jints;
+/**
+ * Free all cached display lists.
+ */
+void free_display_lists(pdf_t *pdf) {
+    int i = 0;
+    for(i = 0; i < DISPLAY_LIST_CACHE_SIZE; ++i) {
+        if (pdf->display_lists[i].list) {
+            fz_free_display_list(pdf->ctx, pdf->display_lists[i].list);
+            pdf->display_lists[i].list = NULL;
+        }
+        pdf->display_lists[i].pageno = -1;
+    }
+}
+
+/**
+ * Free cached display lists that aren't being replayed.
+ * Caller must hold pdf->lock.
+ * @return number of lists freed
+ */
+int free_unused_display_lists(pdf_t *pdf) {
+    int i = 0;
+    int freed = 0;
+    for(i = 0; i < DISPLAY_LIST_CACHE_SIZE; ++i) {
+        cached_display_list_t *e = &(pdf->display_lists[i]);
+        if (e->list && e->users == 0) {
+            fz_free_display_list(pdf->ctx, e->list);
+            e->list = NULL;
+            e->pageno = -1;
+            freed += 1;
+        }
+    }
+    return freed;
 }
 
 /**
@@ -991,10 +2960,82 @@ int get_page_size(pdf_t *pdf, int pageno, int *width, int *height) {
 }
 
 
+/**
+ * Build pdf->pages, geometry of all pages, if it's not built yet.
+ * Only page dictionaries are read, pages are not loaded, so this is
+ * fast even for thousands of pages. If pdf->box is set, page boxes are
+ * taken from that box where pages have it; otherwise they're page bounds
+ * as returned by fz_bound_page.
+ * Caller must hold pdf->lock.
+ * @return 0 if pdf->pages is ready, error code otherwise
+ */
+int load_page_geometry(pdf_t *pdf) {
+    pdf_document *xref = (pdf_document*)pdf->doc;
+    page_geometry_t *pages = NULL;
+    int count = 0;
+    int i = 0;
+
+    if (pdf->page_count >= 0)
+        return pdf->pages ? 0 : 1;
+
+    fz_var(pages);
+    fz_try(pdf->ctx) {
+        count = pdf_count_pages(xref);
+        pages = (page_geometry_t*)malloc(MAX(count, 1) * sizeof(page_geometry_t));
+        if (!pages) fz_throw(pdf->ctx, "out of memory");
+        for(i = 0; i < count; ++i) {
+            page_geometry_t *g = &pages[i];
+            fz_rect mediabox;
+            pdf_obj *obj = NULL;
+
+            pdf_page_geometry(xref, i, &mediabox, &g->rotate, &g->user_unit);
+            if (pdf->box[0] && strcmp(pdf->box, "MediaBox") != 0)
+                obj = pdf_dict_gets(xref->page_objs[i], pdf->box);
+            if (obj && pdf_is_array(obj)) {
+                g->box = pdf_to_rect(pdf->ctx, obj);
+                g->box.x0 *= g->user_unit;
+                g->box.y0 *= g->user_unit;
+                g->box.x1 *= g->user_unit;
+                g->box.y1 *= g->user_unit;
+            } else {
+                /* same as pdf_bound_page */
+                mediabox = fz_transform_rect(fz_rotate(g->rotate), mediabox);
+                g->box.x0 = g->box.y0 = 0;
+                g->box.x1 = mediabox.x1 - mediabox.x0;
+                g->box.y1 = mediabox.y1 - mediabox.y0;
+            }
+        }
+    } fz_catch(pdf->ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to read page geometry: %s", pdf->ctx->error->message);
+        free(pages);
+        pdf->pages = NULL;
+        pdf->page_count = 0;
+        return 2;
+    }
+
+    pdf->pages = pages;
+    pdf->page_count = count;
+    return 0;
+}
+
+
 /**
  * Get page box.
+ * Box comes from pdf->pages table; if it couldn't be built, page is loaded.
+ * Caller must hold pdf->lock.
  */
 fz_rect get_page_box(pdf_t *pdf, int pageno) {
+    if (load_page_geometry(pdf) == 0 && pageno >= 0 && pageno < pdf->page_count)
+        return pdf->pages[pageno].box;
+    return load_page_box(pdf, pageno);
+}
+
+
+/**
+ * Get page box by looking at page dictionary or loading the page.
+ * Slow path of get_page_box.
+ */
+static fz_rect load_page_box(pdf_t *pdf, int pageno) {
     fz_rect box;
     fz_page *page = NULL;
     if (pdf->box && pdf->box[0] && strcmp(pdf->box, "MediaBox") != 0) {
@@ -1105,9 +3146,6 @@ int convert_point_pdf_to_apv(pdf_t *pdf, int page, int *x, int *y) {
  */
 int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox) {
     fz_rect page_bbox;
-    fz_rect param_bbox;
-    float height = 0;
-    float width = 0;
 
     /*
     __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG,
@@ -1115,11 +3153,30 @@ int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox) {
             page, bbox->x0, bbox->y0, bbox->x1, bbox->y1);
     */
 
-    param_bbox = *bbox;
-
     page_bbox = get_page_box(pdf, page);
     // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "page bbox is %.1f, %.1f, %.1f, %.1f", page_bbox.x0, page_bbox.y0, page_bbox.x1, page_bbox.y1);
 
+    convert_box_to_apv(page_bbox, rotation, bbox);
+
+    /*
+    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG,
+            "result after transformations: %.2f, %.2f, %.2f, %.2f",
+            bbox->x0, bbox->y0, bbox->x1, bbox->y1);
+    */
+
+    return 0;
+}
+
+
+/**
+ * Convert box from pdf to APV coordinates, given box of its page.
+ * Doesn't touch document, so it can be used without holding pdf->lock.
+ */
+void convert_box_to_apv(fz_rect page_bbox, int rotation, fz_rect *bbox) {
+    fz_rect param_bbox;
+
+    param_bbox = *bbox;
+
     if (rotation != 0) {
         fz_matrix m;
         m = fz_rotate(-rotation * 90);
@@ -1146,14 +3203,6 @@ int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox) {
     bbox->x1 = (MAX(param_bbox.x0, param_bbox.x1) - MIN(page_bbox.x0, page_bbox.x1));
     bbox->y0 = height - (MAX(param_bbox.y0, param_bbox.y1) - MIN(page_bbox.y0, page_bbox.y1));
     */
-
-    /*
-    __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG,
-            "result after transformations: %.2f, %.2f, %.2f, %.2f",
-            bbox->x0, bbox->y0, bbox->x1, bbox->y1);
-    */
-
-    return 0;
 }
 
 
@@ -1268,98 +3317,305 @@ int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox) {
 // #endif
 
 
-void append_chars(char **buf, size_t *buf_size, const char *new_chars, size_t new_chars_len) {
-    /*
-    __android_log_print(ANDROID_LOG_DEBUG,
-            PDFVIEW_LOG_TAG,
-            "appending chars %d chars, current buf len: %d, current buf size: %d",
-            (int)new_chars_len,
-            *buf != NULL ? (int)strlen(*buf) : -1,
-            (int)*buf_size);
-    */
-    if (*buf == NULL) {
-        *buf = (char*)malloc(256);
-        (*buf)[0] = 0;
-        *buf_size = 256;
-    }
+/**
+ * Prepare sink that passes text to write in chunks of TEXT_SINK_CHUNK bytes.
+ */
+void init_text_sink(text_sink_t *sink, int (*write)(text_sink_t*, const char*, int), void *user) {
+    sink->write = write;
+    sink->user = user;
+    sink->error = 0;
+    sink->len = 0;
+}
 
-    size_t new_len = strlen(*buf) + new_chars_len; /* new_len is number of chars, new_len+1 is min buf size */
-    if (*buf_size < (new_len + 1)) {
-        size_t new_size = 0; 
-        char *new_buf = NULL; 
-        /*
-        __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG,
-                "need to resize buf");
-        */
-        new_size = (new_len + 3) * 1.5;
-        new_buf = (char*)realloc(*buf, new_size);
-        *buf_size = new_size;
-        *buf = new_buf;
-    }
-    strlcat(*buf, new_chars, new_len+1);
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "new string after append chars: \"%s\"", *buf);
+
+/**
+ * Pass collected text to sink's write.
+ * @return 0 if ok, nonzero if sink failed (now or before)
+ */
+static int flush_text_sink(text_sink_t *sink) {
+    if (sink->len > 0 && !sink->error)
+        sink->error = sink->write(sink, sink->buf, sink->len);
+    sink->len = 0;
+    return sink->error;
 }
 
 
 /**
- * Extract text from given pdf page.
- * Returns dynamically allocated string to be freed by caller or NULL.
+ * Append one char to sink as UTF-8.
  */
-char* extract_text(pdf_t *pdf, int pageno) {
-    fz_device *dev = NULL;
-    fz_page *page = NULL;
-    fz_text_sheet *text_sheet = NULL;
-    fz_text_page *text_page = NULL;
-    fz_rect pagebox;
+static void put_text_sink_char(text_sink_t *sink, int c) {
+    if (sink->len + 4 > TEXT_SINK_CHUNK) /* UTF-8 takes up to 4 bytes per char */
+        flush_text_sink(sink);
+    if (sink->error) return;
+    sink->len += fz_runetochar(sink->buf + sink->len, c);
+}
+
+
+/**
+ * Write text of page to sink, one line of text per line of output.
+ * Uses only text_page, so it can be called without pdf->lock.
+ * @return 0 if ok, nonzero if sink failed
+ */
+static int write_text_page(fz_text_page *text_page, text_sink_t *sink) {
     int block_no = 0;
     int line_no = 0;
     int span_no = 0;
     int char_no = 0;
-    char runechars[128] = "";
-    int runelen = 0;
-
-    size_t text_buf_size = 0;
-    char *text = NULL; /* utf-8 text */
-
-    if (pdf == NULL) {
-        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "extract_text: pdf is NULL");
-        return NULL;
-    }
 
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "rendering page text");
-    page = fz_load_page(pdf->doc, pageno);
-    text_sheet = fz_new_text_sheet(pdf->ctx);
-    pagebox = get_page_box(pdf, pageno);
-    text_page = fz_new_text_page(pdf->ctx, pagebox);
-    dev = fz_new_text_device(pdf->ctx, text_sheet, text_page);
-    fz_run_page(pdf->doc, page, dev, fz_identity, NULL);
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "done rendering page text");
-
-    /* for now lets just flatten */
-    for(block_no = 0; block_no < text_page->len; ++block_no) {
+    for(block_no = 0; block_no < text_page->len && !sink->error; ++block_no) {
         fz_text_block *text_block = &(text_page->blocks[block_no]);
         for(line_no = 0; line_no < text_block->len; ++line_no) {
             fz_text_line *line = &(text_block->lines[line_no]);
             for(span_no = 0; span_no < line->len; ++span_no) {
                 fz_text_span *span = &(line->spans[span_no]);
                 for(char_no = 0; char_no < span->len; ++char_no) {
-                    fz_text_char *text_char = &(span->text[char_no]);
-                    runelen = fz_runetochar(runechars, text_char->c);
-                    append_chars(&text, &text_buf_size, runechars, runelen);
+                    put_text_sink_char(sink, span->text[char_no].c);
                 }
             }
-            append_chars(&text, &text_buf_size, "\n", 1);
+            put_text_sink_char(sink, '\n');
+        }
+    }
+    return sink->error;
+}
+
+
+/**
+ * Export text of pages first_page..last_page (inclusive) to sink.
+ * Pages are separated by form feeds. Only one page is extracted at a time
+ * and pdf->lock is taken for each page separately, so long exports need
+ * little memory and don't stop rendering; sink is called without lock.
+ * Pages that can't be extracted are logged and left empty.
+ * @return 0 if ok, 2 if page range is invalid, 3 if sink failed
+ */
+int export_text(pdf_t *pdf, int first_page, int last_page, text_sink_t *sink) {
+    fz_text_sheet *sheet = NULL;
+    fz_text_page *text_page = NULL;
+    int pageno = 0;
+    int page_count = 0;
+
+    pthread_mutex_lock(&pdf->lock);
+    page_count = fz_count_pages(pdf->doc);
+    pthread_mutex_unlock(&pdf->lock);
+    if (first_page < 0 || last_page >= page_count || first_page > last_page)
+        return 2;
+
+    for(pageno = first_page; pageno <= last_page && !sink->error; ++pageno) {
+        pthread_mutex_lock(&pdf->lock);
+        text_page = extract_text_page(pdf, pageno, &sheet);
+        pthread_mutex_unlock(&pdf->lock);
+
+        if (pageno > first_page) put_text_sink_char(sink, '\f');
+        if (text_page == NULL) continue;
+        write_text_page(text_page, sink);
+
+        pthread_mutex_lock(&pdf->lock);
+        fz_free_text_page(pdf->ctx, text_page);
+        fz_free_text_sheet(pdf->ctx, sheet);
+        pthread_mutex_unlock(&pdf->lock);
+    }
+    return flush_text_sink(sink) ? 3 : 0;
+}
+
+
+/**
+ * Text sink writing to file descriptor, user points to int with descriptor.
+ */
+static int write_text_to_fd(text_sink_t *sink, const char *data, int len) {
+    int fd = *(int*)sink->user;
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to write text: %s", strerror(errno));
+            return 1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+/**
+ * User data of text sink writing to fz_buffer.
+ * ctx must be usable by thread that writes to sink.
+ */
+typedef struct {
+    fz_context *ctx;
+    fz_buffer *buffer;
+} text_buffer_sink_t;
+
+/**
+ * Text sink appending to growable fz_buffer, user points to text_buffer_sink_t.
+ */
+static int write_text_to_buffer(text_sink_t *sink, const char *data, int len) {
+    text_buffer_sink_t *dest = (text_buffer_sink_t*)sink->user;
+    fz_try(dest->ctx) {
+        fz_write_buffer(dest->ctx, dest->buffer, (unsigned char*)data, len);
+    } fz_catch(dest->ctx) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to write text: %s", dest->ctx->error->message);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * User data of text sink calling PDF.TextCallback.onText.
+ */
+typedef struct {
+    JNIEnv *env;
+    jobject callback;
+    jmethodID on_text;
+    jbyteArray chunk; /* TEXT_SINK_CHUNK bytes, reused for each call */
+} text_callback_sink_t;
+
+/**
+ * Text sink passing chunks to Java, user points to text_callback_sink_t.
+ */
+static int write_text_to_callback(text_sink_t *sink, const char *data, int len) {
+    text_callback_sink_t *dest = (text_callback_sink_t*)sink->user;
+    JNIEnv *env = dest->env;
+    jboolean go_on = JNI_FALSE;
+
+    (*env)->SetByteArrayRegion(env, dest->chunk, 0, len, (const jbyte*)data);
+    go_on = (*env)->CallBooleanMethod(env, dest->callback, dest->on_text, dest->chunk, len);
+    if ((*env)->ExceptionCheck(env)) return 1;
+    return go_on ? 0 : 1;
+}
+
+
+/**
+ * Implementation of native method PDF.exportTextToFile.
+ * Writes UTF-8 text of pages first_page..last_page to file descriptor.
+ * @return 0 if ok, 1 if pdf is null, see export_text for other errors
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_exportTextToFile(
+        JNIEnv *env,
+        jobject this,
+        jint first_page,
+        jint last_page,
+        jobject file_descriptor) {
+    pdf_t *pdf = NULL;
+    text_sink_t *sink = NULL;
+    int fd = -1;
+    int error = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    fd = get_descriptor_from_file_descriptor(env, file_descriptor);
+    sink = (text_sink_t*)malloc(sizeof(text_sink_t));
+    if (sink == NULL) return 3;
+    init_text_sink(sink, write_text_to_fd, &fd);
+    error = export_text(pdf, first_page, last_page, sink);
+    free(sink);
+    return error;
+}
+
+
+/**
+ * Implementation of native method PDF.exportText.
+ * Passes UTF-8 text of pages first_page..last_page to callback in chunks.
+ * @return 0 if ok, 1 if pdf is null, see export_text for other errors
+ */
+JNIEXPORT jint JNICALL
+Java_cx_hell_android_lib_pdf_PDF_exportText(
+        JNIEnv *env,
+        jobject this,
+        jint first_page,
+        jint last_page,
+        jobject callback) {
+    static jmethodID on_text = NULL;
+    pdf_t *pdf = NULL;
+    text_sink_t *sink = NULL;
+    text_callback_sink_t dest;
+    int error = 0;
+
+    pdf = get_pdf_from_this(env, this);
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "this.pdf is null");
+        return 1;
+    }
+    if (on_text == NULL) {
+        jclass callback_class = (*env)->FindClass(env, "cx/hell/android/lib/pdf/PDF$TextCallback");
+        if (callback_class == NULL) {
+            __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "couldn't find class PDF$TextCallback");
+            return 3;
         }
+        on_text = (*env)->GetMethodID(env, callback_class, "onText", "([BI)Z");
+        (*env)->DeleteLocalRef(env, callback_class);
+        if (on_text == NULL) return 3;
+    }
+
+    dest.env = env;
+    dest.callback = callback;
+    dest.on_text = on_text;
+    dest.chunk = (*env)->NewByteArray(env, TEXT_SINK_CHUNK);
+    if (dest.chunk == NULL) return 3;
+    sink = (text_sink_t*)malloc(sizeof(text_sink_t));
+    if (sink == NULL) {
+        (*env)->DeleteLocalRef(env, dest.chunk);
+        return 3;
     }
+    init_text_sink(sink, write_text_to_callback, &dest);
+    error = export_text(pdf, first_page, last_page, sink);
+    free(sink);
+    (*env)->DeleteLocalRef(env, dest.chunk);
+    return error;
+}
 
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "done extracting text");
 
-    // fz_free_text_page(pdf->ctx, text_page);
-    // fz_free_text_sheet(pdf->ctx, text_sheet);
-    // fz_free_page(pdf->doc, page);
-    // fz_free_device(dev);
+/**
+ * Extract text from given pdf page.
+ * Returns dynamically allocated string to be freed by caller or NULL.
+ */
+char* extract_text(pdf_t *pdf, int pageno) {
+    fz_text_sheet *sheet = NULL;
+    fz_text_page *text_page = NULL;
+    text_buffer_sink_t dest;
+    text_sink_t *sink = NULL;
+    char *text = NULL; /* utf-8 text */
+
+    if (pdf == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "extract_text: pdf is NULL");
+        return NULL;
+    }
+    sink = (text_sink_t*)malloc(sizeof(text_sink_t));
+    if (sink == NULL) return NULL;
+
+    pthread_mutex_lock(&pdf->lock);
+    dest.ctx = pdf->ctx;
+    dest.buffer = NULL;
+    fz_try(pdf->ctx) {
+        dest.buffer = fz_new_buffer(pdf->ctx, 1024);
+    } fz_catch(pdf->ctx) {
+        pthread_mutex_unlock(&pdf->lock);
+        free(sink);
+        return NULL;
+    }
+    init_text_sink(sink, write_text_to_buffer, &dest);
+
+    text_page = extract_text_page(pdf, pageno, &sheet);
+    if (text_page) {
+        write_text_page(text_page, sink);
+        if (flush_text_sink(sink) == 0) {
+            text = (char*)malloc(dest.buffer->len + 1);
+            if (text) {
+                memcpy(text, dest.buffer->data, dest.buffer->len);
+                text[dest.buffer->len] = 0;
+            }
+        }
+        fz_free_text_page(pdf->ctx, text_page);
+        fz_free_text_sheet(pdf->ctx, sheet);
+    }
+    fz_drop_buffer(pdf->ctx, dest.buffer);
+    pthread_mutex_unlock(&pdf->lock);
 
-    // __android_log_print(ANDROID_LOG_DEBUG, PDFVIEW_LOG_TAG, "extracted text, len: %d, chars: %s", text_len, text);
+    free(sink);
     return text;
 }
 
@@ -7,17 +7,155 @@
 #define PDFVIEW2_H__
 
 
+#include <pthread.h>
+
 #include "fitz.h"
 #include "mupdf.h"
 
 #define MAX_BOX_NAME 8
 
+/* number of page display lists kept in pdf_t */
+#define DISPLAY_LIST_CACHE_SIZE 4
+
+/* max number of threads rendering tiles of one pdf at the same time */
+#define MAX_RENDER_CONTEXTS 4
+
+/* levels passed to PDF.trimMemory, same as Android's ComponentCallbacks2.TRIM_MEMORY_* */
+#define TRIM_MEMORY_RUNNING_MODERATE 5
+#define TRIM_MEMORY_RUNNING_CRITICAL 15
+#define TRIM_MEMORY_BACKGROUND 40
+#define TRIM_MEMORY_MODERATE 60
+#define TRIM_MEMORY_COMPLETE 80
+
+/* number of ints per store kind filled by PDF.getStoreStats */
+#define STORE_STATS_SIZE 6
+
+/* number of ints per allocation category filled by PDF.getAllocStats */
+#define ALLOC_STATS_SIZE 3
+
+/* passes of progressive render, same as PDF.RENDER_PASS_* */
+#define RENDER_PASS_DRAFT 0
+#define RENDER_PASS_FULL 1
+
+/* chunk size of arena holding interpreter's transient objects, see run_page */
+#define PAGE_ARENA_CHUNK (64 * 1024)
+
+/* anti-aliasing level (see fz_set_aa_level) used for draft pass */
+#define DRAFT_AA_LEVEL 2
+
+/* exported text is passed to text_sink_t in chunks of this many bytes */
+#define TEXT_SINK_CHUNK 8192
+
+/* number of threads decoding images of pages passed to PDF.prefetchPage */
+#define PREFETCH_THREADS 2
+
+/* max number of images waiting for prefetch threads, further images of page are not prefetched */
+#define PREFETCH_QUEUE_SIZE 64
+
+/* nice value of prefetch threads, same as Java's Thread.MIN_PRIORITY on Android */
+#define PREFETCH_NICE 19
+
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 
+/**
+ * Display list of one page, recorded once and replayed for each tile.
+ */
+typedef struct {
+    int pageno; /* -1 if this slot is empty */
+    int skip_images; /* list was recorded without images */
+    unsigned int last_used; /* value of pdf_t.display_list_clock at last use */
+    int users; /* number of threads replaying this list, it can't be evicted while in use */
+    fz_display_list *list;
+} cached_display_list_t;
+
+/**
+ * Geometry of one page, read from page dictionary without loading the page.
+ */
+typedef struct {
+    fz_rect box; /* page box in APV's convention, as returned by get_page_box */
+    int rotate; /* /Rotate snapped to 0, 90, 180 or 270 */
+    float user_unit;
+} page_geometry_t;
+
+/**
+ * Search index entry: case-folded text of one page.
+ */
+typedef struct {
+    unsigned short *text; /* NULL if page is not indexed yet */
+    int len;
+} search_index_page_t;
+
+/**
+ * Hits found on one page, boxes are in APV's coordinates.
+ */
+typedef struct {
+    float *boxes; /* x0, y0, x1, y1 of each matched char, hit after hit */
+    int *hit_lens; /* number of chars in each hit */
+    int hit_count;
+    int box_count;
+    int done; /* set when page has been searched */
+} find_page_result_t;
+
+/**
+ * Called by progressive render after each pass, with tile drawn so far.
+ * Returns 0 to skip remaining passes.
+ */
+typedef int (*render_pass_callback_t)(void *user, fz_pixmap *image, int pass);
+
+/**
+ * Destination of exported UTF-8 text.
+ * Text is collected in buf and passed to write when buf is full, so
+ * exporting any number of pages needs only this much memory.
+ */
+typedef struct text_sink_s {
+    int (*write)(struct text_sink_s *sink, const char *data, int len); /* returns 0 if ok, nonzero to stop */
+    void *user; /* passed to write */
+    int error; /* set when write failed, further text is dropped */
+    int len; /* number of bytes in buf */
+    char buf[TEXT_SINK_CHUNK];
+} text_sink_t;
+
+/**
+ * Image waiting to be decoded by prefetch thread.
+ */
+typedef struct {
+    fz_image *image; /* kept until it's decoded or dropped */
+    int w, h; /* size image is drawn at, as in draw device */
+    unsigned int generation; /* value of prefetch_t.generation when page was requested */
+} prefetch_image_t;
+
+/**
+ * Background decoding of images of page that is about to be shown.
+ * Requested page is recorded (its display list stays cached for render)
+ * and replayed through device that only collects images; collected images
+ * are decoded by prefetch threads into store, so that tiles find them
+ * there. Each request supersedes previous one: images queued for older
+ * requests are dropped without decoding.
+ * Lock order is pdf_t.lock first, then mutex.
+ */
+typedef struct {
+    pthread_mutex_t mutex; /* guards all other fields */
+    pthread_cond_t wake; /* signalled when there's work or threads should stop */
+    pthread_t threads[PREFETCH_THREADS];
+    int thread_count; /* threads are started on first request */
+    int pageno; /* page waiting to be collected, -1 if none */
+    int zoom_pmil;
+    unsigned int generation; /* incremented by each request */
+    prefetch_image_t queue[PREFETCH_QUEUE_SIZE]; /* ring of collected images, in page order */
+    int queue_head;
+    int queue_len;
+    int stopped;
+    fz_cookie cookie; /* aborted when stopped, stops page being recorded or replayed */
+} prefetch_t;
+
 /**
  * Holds pdf info.
+ * Document and ctx may be used by one thread at a time only, so all access
+ * to them (and to display list cache) is guarded by lock. Tiles are drawn
+ * outside of that lock, each rendering thread uses its own ctx cloned from
+ * ctx; clones share store and glyph cache, guarded by fz_mutexes.
  */
 typedef struct {
     int last_pageno;
@@ -26,6 +164,23 @@ typedef struct {
     int fileno; /* used only when opening by file descriptor */
     int invalid_password;
     char box[MAX_BOX_NAME + 1];
+    cached_display_list_t display_lists[DISPLAY_LIST_CACHE_SIZE]; /* LRU of recorded pages */
+    unsigned int display_list_clock;
+    pthread_mutex_t lock;
+    pthread_mutex_t fz_mutexes[FZ_LOCK_MAX];
+    fz_locks_context locks;
+    fz_context *render_ctxs[MAX_RENDER_CONTEXTS]; /* lazily cloned from ctx */
+    int render_ctx_busy[MAX_RENDER_CONTEXTS];
+    fz_pixmap *render_scratch[MAX_RENDER_CONTEXTS]; /* RGB tile pixmap of each render ctx, reused by RGB_565 tiles */
+    int render_scratch_pixels[MAX_RENDER_CONTEXTS]; /* number of pixels render_scratch can hold */
+    pthread_cond_t render_ctx_free; /* signalled when render ctx is released */
+    page_geometry_t *pages; /* geometry of all pages, built lazily in one pass */
+    int page_count; /* number of entries in pages, -1 if not built yet, 0 if building failed */
+    search_index_page_t *search_index; /* text of pages, for fast repeated searches */
+    int search_index_len;
+    int find_all_running; /* number of findAll calls in progress, indexPage does nothing meanwhile */
+    fz_arena *arena; /* transient objects of page being run on ctx, NULL until first run */
+    prefetch_t prefetch;
 } pdf_t;
 
 
@@ -43,6 +198,7 @@ void save_size(JNIEnv *env, jobject size, int width, int height);
 void fix_samples(unsigned char *bytes, unsigned int w, unsigned int h);
 void rgb_to_alpha(unsigned char *bytes, unsigned int w, unsigned int h);
 int get_page_size(pdf_t *pdf, int pageno, int *width, int *height);
+int load_page_geometry(pdf_t *pdf);
 void pdf_android_loghandler(const char *m);
 jobject create_find_result(JNIEnv *env);
 void set_find_result_page(JNIEnv *env, jobject findResult, int page);
@@ -50,8 +206,22 @@ void add_find_result_marker(JNIEnv *env, jobject findResult, int x0, int y0, int
 void add_find_result_to_list(JNIEnv *env, jobject *list, jobject find_result);
 int convert_point_pdf_to_apv(pdf_t *pdf, int page, int *x, int *y);
 int convert_box_pdf_to_apv(pdf_t *pdf, int page, int rotation, fz_rect *bbox);
+void convert_box_to_apv(fz_rect page_bbox, int rotation, fz_rect *bbox);
 int find_next(JNIEnv *env, jobject this, int direction);
 pdf_page* get_page(pdf_t *pdf, int pageno);
+cached_display_list_t* acquire_display_list(pdf_t *pdf, int pageno, int skip_images, fz_cookie *cookie);
+void release_display_list(pdf_t *pdf, cached_display_list_t *entry);
+void free_display_lists(pdf_t *pdf);
+int free_unused_display_lists(pdf_t *pdf);
+void free_search_index(pdf_t *pdf);
+fz_display_list* record_display_list(pdf_t *pdf, int pageno, int skip_images, fz_cookie *cookie);
+void init_text_sink(text_sink_t *sink, int (*write)(text_sink_t*, const char*, int), void *user);
+int export_text(pdf_t *pdf, int first_page, int last_page, text_sink_t *sink);
+fz_context* acquire_render_ctx(pdf_t *pdf, int *slot);
+void release_render_ctx(pdf_t *pdf, int slot);
+int prefetch_page(pdf_t *pdf, int pageno, int zoom_pmil);
+void cancel_prefetch(pdf_t *pdf);
+void stop_prefetch(pdf_t *pdf);
 
 
 // #ifdef pro
@@ -29,6 +29,23 @@ public class FindResult {
 	 */
 	public List<Rect> markers;
 	
+	public FindResult() {
+	}
+	
+	/**
+	 * Create find result from boxes of matched chars.
+	 * @param boxes x0, y0, x1, y1 of each char, as passed to PDF.FindCallback.onHit
+	 */
+	public FindResult(int page, float[] boxes) {
+		this.page = page;
+		for(int i = 0; i + 3 < boxes.length; i += 4) {
+			int x0 = (int)boxes[i], y0 = (int)boxes[i+1];
+			int x1 = (int)boxes[i+2], y1 = (int)boxes[i+3];
+			/* boxes of spaces may be empty */
+			if (x0 < x1 && y0 < y1) this.addMarker(x0, y0, x1, y1);
+		}
+	}
+	
 	/**
 	 * Add marker.
 	 */
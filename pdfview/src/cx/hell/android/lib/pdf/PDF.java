@@ -2,6 +2,7 @@ package cx.hell.android.lib.pdf;
 
 import java.io.File;
 import java.io.FileDescriptor;
+import java.nio.ByteBuffer;
 import java.util.List;
 
 import cx.hell.android.lib.pagesview.FindResult;
@@ -21,6 +22,13 @@ public class PDF {
 	
 	private final static String TAG = "cx.hell.android.pdfview";
 	
+	/**
+	 * Max number of threads that can render tiles at the same time.
+	 * Native code has this many render contexts (MAX_RENDER_CONTEXTS in pdfview2.h),
+	 * more threads would just wait for a free one.
+	 */
+	public final static int MAX_RENDER_THREADS = 4;
+	
 	static {
         System.loadLibrary("pdfview2");
 	}
@@ -230,8 +238,10 @@ public class PDF {
 	
 	/**
 	 * Return page count from pdf_t struct.
+	 * Native methods that use the document are not synchronized in Java,
+	 * native code takes care of locking, so tiles can be rendered in parallel.
 	 */
-	synchronized public native int getPageCount();
+	public native int getPageCount();
 	
 	/**
 	 * Render a page.
@@ -242,8 +252,128 @@ public class PDF {
 	 * @param passes requested size, used for size of resulting bitmap
 	 * @return bytes of bitmap in Androids format
 	 */
-	synchronized public native int[] renderPage(int n, int zoom, int left, int top, 
+	public native int[] renderPage(int n, int zoom, int left, int top, 
 			int rotation, boolean skipImages, PDF.Size rect);
+
+	/**
+	 * Error code returned by renderPageDirect when render was aborted through its cookie.
+	 */
+	public final static int RENDER_ABORTED = 4;
+	
+	/**
+	 * Render a page directly into memory of a direct buffer.
+	 * Avoids allocating and copying int array for each tile.
+	 * Pixels are stored as 16 bit RGB_565 values, so buffer can be passed to
+	 * Bitmap.copyPixelsFromBuffer of an RGB_565 bitmap.
+	 * @param n page number, starting from 0
+	 * @param zoom page size scaling
+	 * @param rect requested size, updated to size of rendered tile
+	 * @param buffer direct buffer with at least rect.width * rect.height * 2 bytes
+	 * @param cookie lets other thread abort this render, may be null
+	 * @return error code, 0 means ok, RENDER_ABORTED if cookie was aborted
+	 */
+	public int renderPageDirect(int n, int zoom, int left, int top,
+			int rotation, boolean skipImages, PDF.Size rect, ByteBuffer buffer, Cookie cookie) {
+		return this.renderPageDirect(n, zoom, left, top, rotation, skipImages, rect, buffer,
+				cookie != null ? cookie.cookie_ptr : 0);
+	}
+	
+	private native int renderPageDirect(int n, int zoom, int left, int top,
+			int rotation, boolean skipImages, PDF.Size rect, ByteBuffer buffer, int cookie);
+	
+	/**
+	 * Pass of progressive render: fast, lower quality preview of tile.
+	 */
+	public final static int RENDER_PASS_DRAFT = 0;
+	
+	/**
+	 * Pass of progressive render: tile at full quality.
+	 */
+	public final static int RENDER_PASS_FULL = 1;
+	
+	/**
+	 * Receives passes of progressive render.
+	 * Called on rendering thread, while render is in progress.
+	 */
+	public interface RenderCallback {
+		/**
+		 * Called when buffer passed to renderPageProgressive holds given pass of tile.
+		 * @param pass RENDER_PASS_DRAFT or RENDER_PASS_FULL
+		 * @return false to skip remaining passes
+		 */
+		boolean onPassRendered(int pass);
+	}
+	
+	/**
+	 * Render a page directly into memory of a direct buffer in two passes.
+	 * Draft pass (less anti-aliasing, images decoded at lower resolution,
+	 * no shadings) is drawn first, so that it can be shown at once, then
+	 * the full pass is drawn into the same buffer. Both passes replay the
+	 * same cached display list. Callback is called after each pass.
+	 * Pages without images and shadings are drawn in full pass only,
+	 * so callback is called once, with RENDER_PASS_FULL.
+	 * @see #renderPageDirect
+	 * @return error code, 0 means ok, RENDER_ABORTED if cookie was aborted
+	 * or callback returned false after draft pass
+	 */
+	public int renderPageProgressive(int n, int zoom, int left, int top,
+			int rotation, boolean skipImages, PDF.Size rect, ByteBuffer buffer, Cookie cookie,
+			RenderCallback callback) {
+		return this.renderPageProgressive(n, zoom, left, top, rotation, skipImages, rect, buffer,
+				cookie != null ? cookie.cookie_ptr : 0, callback);
+	}
+	
+	private native int renderPageProgressive(int n, int zoom, int left, int top,
+			int rotation, boolean skipImages, PDF.Size rect, ByteBuffer buffer, int cookie,
+			RenderCallback callback);
+	
+	/**
+	 * Handle of one render in progress, lets other threads abort it
+	 * and check its progress. Holds pointer to native fz_cookie.
+	 * Must be freed when render is done and no one can abort it anymore.
+	 */
+	public static class Cookie {
+		private int cookie_ptr;
+		
+		public Cookie() {
+			this.cookie_ptr = newCookie();
+		}
+		
+		/**
+		 * Ask render to stop as soon as possible.
+		 */
+		public synchronized void abort() {
+			if (this.cookie_ptr != 0) abortCookie(this.cookie_ptr);
+		}
+		
+		/**
+		 * @return render progress in percents or -1 if unknown
+		 */
+		public synchronized int getProgress() {
+			if (this.cookie_ptr == 0) return -1;
+			return getCookieProgress(this.cookie_ptr);
+		}
+		
+		public synchronized void free() {
+			if (this.cookie_ptr != 0) freeCookie(this.cookie_ptr);
+			this.cookie_ptr = 0;
+		}
+	}
+	
+	private static native int newCookie();
+	private static native void abortCookie(int cookie);
+	private static native int getCookieProgress(int cookie);
+	private static native void freeCookie(int cookie);
+	
+	/**
+	 * Decode images of page in background, at size they'd be drawn at
+	 * given zoom, so that its tiles don't have to wait for that.
+	 * Returns at once; each call supersedes previous one.
+	 * @param n page number, starting from 0
+	 * @param zoom page size scaling, as passed to renderPage
+	 * @return error code, 0 means ok
+	 */
+	public native int prefetchPage(int n, int zoom);
 	
 	/**
 	 * Get PDF page size, store it in size struct, return error code.
@@ -251,7 +381,127 @@ public class PDF {
 	 * @param size size struct that holds result
 	 * @return error code
 	 */
-	synchronized public native int getPageSize(int n, PDF.Size size);
+	public native int getPageSize(int n, PDF.Size size);
+	
+	/**
+	 * Get sizes of all pages at once.
+	 * Much faster than calling getPageSize for each page of long document.
+	 * @param sizes array of at least 2 * getPageCount() elements, receives
+	 * width and height of each page, in page order
+	 * @return error code
+	 */
+	public native int getPageSizes(int[] sizes);
+	
+	/**
+	 * Set max size of native store, which keeps decoded images, fonts
+	 * and other resources so they don't have to be decoded for each tile.
+	 * @param size size in bytes, 0 means unlimited
+	 * @return error code, 0 means ok
+	 */
+	public native int setStoreSize(int size);
+	
+	/**
+	 * Kinds of items in native store, for setStoreBudget and getStoreStats.
+	 */
+	public final static int STORE_IMAGE = 0;
+	public final static int STORE_FONT = 1;
+	public final static int STORE_SHADE = 2;
+	public final static int STORE_FUNCTION = 3;
+	public final static int STORE_OTHER = 4;
+	public final static int STORE_KINDS = 5;
+	
+	/**
+	 * Number of ints per kind returned by getStoreStats.
+	 */
+	public final static int STORE_STATS_SIZE = 6;
+	
+	/**
+	 * Limit size of one kind of items in native store, so that for
+	 * example decoding big images doesn't evict all fonts.
+	 * @param kind one of STORE_* kinds
+	 * @param size budget in bytes, 0 means only store size limits it
+	 * @return error code, 0 means ok
+	 */
+	public native int setStoreBudget(int kind, int size);
+	
+	/**
+	 * Get native store statistics.
+	 * @param stats array of at least STORE_STATS_SIZE * STORE_KINDS
+	 * elements, receives size and budget (in bytes), number of items,
+	 * hits, misses and evictions of each kind, kind after kind
+	 * @return error code, 0 means ok
+	 */
+	public native int getStoreStats(int[] stats);
+	
+	/**
+	 * Set max size of native cache of rendered glyphs. Least recently
+	 * used glyphs are evicted to keep it below that size.
+	 * @param size size in bytes
+	 * @return error code, 0 means ok
+	 */
+	public native int setGlyphCacheSize(int size);
+	
+	/**
+	 * Get native glyph cache statistics.
+	 * @param stats array of at least STORE_STATS_SIZE elements, receives
+	 * size and max size (in bytes), number of glyphs, hits, misses and
+	 * evictions
+	 * @return error code, 0 means ok
+	 */
+	public native int getGlyphCacheStats(int[] stats);
+	
+	/**
+	 * Categories of native allocations for getAllocStats: the five
+	 * STORE_* kinds, then these.
+	 */
+	public final static int ALLOC_OBJECT = 5;
+	public final static int ALLOC_DISPLAY_LIST = 6;
+	public final static int ALLOC_GLYPH = 7;
+	public final static int ALLOC_SCRATCH = 8;
+	public final static int ALLOC_CATEGORIES = 9;
+	
+	/**
+	 * Number of ints per category returned by getAllocStats.
+	 */
+	public final static int ALLOC_STATS_SIZE = 3;
+	
+	/**
+	 * Get native memory usage by category. Available only if native
+	 * library is built with FZ_ALLOC_STATS defined.
+	 * @param stats array of at least ALLOC_STATS_SIZE * ALLOC_CATEGORIES
+	 * elements, receives live bytes, peak bytes and number of blocks of
+	 * each category, category after category
+	 * @return error code, 0 means ok, 3 if allocations are not accounted
+	 */
+	public native int getAllocStats(int[] stats);
+	
+	/**
+	 * Levels for trimMemory, same as in Android's ComponentCallbacks2.
+	 */
+	public final static int TRIM_MEMORY_RUNNING_MODERATE = 5;
+	public final static int TRIM_MEMORY_RUNNING_LOW = 10;
+	public final static int TRIM_MEMORY_RUNNING_CRITICAL = 15;
+	public final static int TRIM_MEMORY_UI_HIDDEN = 20;
+	public final static int TRIM_MEMORY_BACKGROUND = 40;
+	public final static int TRIM_MEMORY_MODERATE = 60;
+	public final static int TRIM_MEMORY_COMPLETE = 80;
+	
+	/**
+	 * Free native caches, the more the higher level is.
+	 * Meant to be called from onTrimMemory and onLowMemory.
+	 * @param level one of TRIM_MEMORY_* levels
+	 * @return error code, 0 means ok
+	 */
+	public native int trimMemory(int level);
+	
+	/**
+	 * Get native memory usage.
+	 * @param usage array of at least 4 elements, receives current and max
+	 * store size, glyph cache size (all in bytes) and number of cached page
+	 * display lists
+	 * @return error code, 0 means ok
+	 */
+	public native int getMemoryUsage(int[] usage);
 	
 	/**
 	 * Export PDF to a text file.
@@ -261,7 +511,91 @@ public class PDF {
 	/**
 	 * Find text on given page, return list of find results.
 	 */
-	synchronized public native List<FindResult> find(String text, int page, int rotation);
+	public native List<FindResult> find(String text, int page, int rotation);
+	
+	/**
+	 * Error code returned by indexPage when findAll is running.
+	 */
+	public final static int INDEX_BUSY = 4;
+	
+	/**
+	 * Add text of page to search index, so that find on that page
+	 * doesn't have to extract text again unless page contains searched text.
+	 * Takes a while, should be called from background thread.
+	 * Does nothing while findAll is running, since findAll indexes pages
+	 * it searches; page should be indexed again later.
+	 * @return error code, 0 means ok, INDEX_BUSY if findAll is running
+	 */
+	public native int indexPage(int page);
+	
+	/**
+	 * Receives results of findAll.
+	 * Called on thread that called findAll, in order in which pages are searched.
+	 */
+	public interface FindCallback {
+		/**
+		 * Called for each hit.
+		 * @param page page of hit
+		 * @param boxes boxes of matched chars in page coordinates (not scaled),
+		 * packed as x0, y0, x1, y1 for each char
+		 * @return false to stop search
+		 */
+		boolean onHit(int page, float[] boxes);
+		
+		/**
+		 * Called after all hits of page have been passed to onHit.
+		 * @param page page that has been searched
+		 * @param pagesDone number of pages searched so far
+		 * @param pageCount number of pages to search
+		 * @return false to stop search
+		 */
+		boolean onProgress(int page, int pagesDone, int pageCount);
+	}
+	
+	/**
+	 * Error code returned by findAll when callback stopped the search.
+	 */
+	public final static int FIND_STOPPED = 2;
+	
+	/**
+	 * Find text on all pages, starting at given page and wrapping around
+	 * at the end of document.
+	 * Pages are searched by up to threads native threads, results are passed
+	 * to callback in page order while search goes on.
+	 * @param threads max number of threads, at most MAX_RENDER_THREADS are used
+	 * @return error code, 0 means all pages were searched, FIND_STOPPED
+	 * means callback stopped search
+	 */
+	public native int findAll(String text, int startPage, int rotation, int threads, FindCallback callback);
+	
+	/**
+	 * Receives text exported by exportText.
+	 */
+	public interface TextCallback {
+		/**
+		 * Called for each chunk of exported text.
+		 * @param chunk UTF-8 bytes of text, array is reused for next chunk
+		 * and chars may be split between chunks
+		 * @param length number of valid bytes in chunk
+		 * @return false to stop export
+		 */
+		boolean onText(byte[] chunk, int length);
+	}
+	
+	/**
+	 * Export text of pages firstPage..lastPage (inclusive) as UTF-8,
+	 * pages are separated by form feeds.
+	 * Pages are extracted one by one, so memory use doesn't depend on page count.
+	 * @return error code, 0 means ok
+	 */
+	public native int exportTextToFile(int firstPage, int lastPage, FileDescriptor fd);
+	
+	/**
+	 * Export text of pages firstPage..lastPage (inclusive) to callback in
+	 * chunks of UTF-8 bytes, see exportTextToFile.
+	 * @return error code, 0 means ok
+	 */
+	public native int exportText(int firstPage, int lastPage, TextCallback callback);
 	
 	/**
 	 * Clear search.
@@ -2,6 +2,8 @@ package cx.hell.android.pdfview;
 
 import java.lang.reflect.InvocationTargetException;
 import java.lang.reflect.Method;
+import android.app.ActivityManager;
+import android.content.Context;
 import android.view.MotionEvent;
 
 // #ifdef pro
@@ -83,6 +85,29 @@ final public class AndroidReflections {
 		}
 	}
 	
+	/**
+	 * Get ActivityManager.getMemoryClass, which is missing before Android 2.0.
+	 * @return heap size limit of application in megabytes, 16 if unknown
+	 */
+	public static int getMemoryClass(Context context) {
+		ActivityManager activityManager = (ActivityManager)context.getSystemService(Context.ACTIVITY_SERVICE);
+		Method getMemoryClassMethod = null;
+		try {
+			getMemoryClassMethod = ActivityManager.class.getMethod("getMemoryClass");
+		} catch (NoSuchMethodException e) {
+			return 16;
+		}
+		
+		try {
+			Integer r = (Integer)getMemoryClassMethod.invoke(activityManager);
+			return r;
+		} catch (InvocationTargetException e) {
+			throw new RuntimeException(e);
+		} catch (IllegalAccessException e) {
+			throw new RuntimeException(e);
+		}
+	}
+	
 	public static float getMotionEventY(MotionEvent motionEvent, int pointerIndex) {
 		Class<MotionEvent> motionEventClass = MotionEvent.class;
 		Method getYMethod = null;
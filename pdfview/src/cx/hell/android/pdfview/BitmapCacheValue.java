@@ -7,6 +7,8 @@ public class BitmapCacheValue {
 	/* public long millisAdded; */
 	public long millisAccessed;
 	public long priority;
+	/* true if bitmap is draft pass of progressive render, to be replaced by full pass */
+	public boolean draft;
 	
 	public BitmapCacheValue(Bitmap bitmap, long millisAdded, long priority) {
 		this.bitmap = bitmap;
@@ -3,6 +3,7 @@ package cx.hell.android.pdfview;
 import java.io.File;
 import java.io.FileDescriptor;
 import java.io.FileNotFoundException;
+import java.util.ArrayList;
 import java.util.List;
 
 
@@ -140,6 +141,7 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
 	private String findText = null;
 	private Integer currentFindResultPage = null;
 	private Integer currentFindResultNumber = null;
+	private SearchIndexer searchIndexer = null;
 
 	// zoom buttons, layout and fade animation
 	private ImageButton zoomDownButton;
@@ -332,6 +334,29 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
 		}		
 	}
 	
+	@Override
+	protected void onDestroy() {
+		if (this.searchIndexer != null) {
+			this.searchIndexer.cancel();
+			this.searchIndexer = null;
+		}
+		super.onDestroy();
+	}
+	
+	@Override
+	public void onLowMemory() {
+		super.onLowMemory();
+		if (this.pdf != null) this.pdf.trimMemory(PDF.TRIM_MEMORY_COMPLETE);
+	}
+	
+	/**
+	 * Called on Android 4.0 and newer when system wants apps to free memory.
+	 * Not marked as override, as it's missing from older SDKs.
+	 */
+	public void onTrimMemory(int level) {
+		if (this.pdf != null) this.pdf.trimMemory(level);
+	}
+	
 	@Override
 	protected void onResume() {
 		super.onResume();
@@ -509,6 +534,10 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
 	    	}
 	    	return;
 	    }
+	    this.pdf.setStoreSize(getStoreSize());
+	    /* leave a quarter of store to fonts and other small resources */
+	    this.pdf.setStoreBudget(PDF.STORE_IMAGE, getStoreSize() / 4 * 3);
+	    this.pdf.setGlyphCacheSize(Math.max(getStoreSize() / 16, 2 * 1024 * 1024));
 	    this.colorMode = Options.getColorMode(options);
 	    this.pdfPagesProvider = new PDFPagesProvider(this, pdf, 
 	    		options.getBoolean(Options.PREF_OMIT_IMAGES, false),
@@ -519,6 +548,17 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
 	    b.close();
     }
 
+    /**
+     * Size of native store that keeps decoded images and fonts between tiles.
+     * A quarter of heap size the system gives to application, which reflects
+     * how much memory the device has, but at least 1 MB and at most 64 MB.
+     * @return store size in bytes
+     */
+    private int getStoreSize() {
+    	int memoryClass = AndroidReflections.getMemoryClass(this);
+    	return Math.max(1, Math.min(memoryClass / 4, 64)) * 1024 * 1024;
+    }
+    
     /**
      * Return PDF instance wrapping file referenced by Intent.
      * Currently reads all bytes to memory, in future local files
@@ -950,9 +990,61 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
     private void findText(String text) {
     	Log.d(TAG, "findText(" + text + ")");
     	this.findText = text;
+    	this.startSearchIndexer();
     	this.find(true);
     }
     
+    /**
+     * Start indexing text of all pages in background, once per document,
+     * so that next searches don't have to extract text of every page.
+     */
+    private void startSearchIndexer() {
+    	if (this.searchIndexer != null || this.pdf == null) return;
+    	this.searchIndexer = new SearchIndexer(this.pdf, this.pagesView.getCurrentPage(), this.pagesView.getPageCount());
+    	Thread t = new Thread(this.searchIndexer);
+    	t.setPriority(Thread.MIN_PRIORITY);
+    	t.setName("SearchIndexerThread");
+    	t.start();
+    }
+    
+    /**
+     * Adds pages to native search index, starting from given page.
+     */
+    static class SearchIndexer implements Runnable {
+    	/* ms to wait before retrying page while findAll runs */
+    	private final static long INDEX_BUSY_WAIT = 250;
+    	private PDF pdf;
+    	private int startingPage;
+    	private int pageCount;
+    	private volatile boolean cancelled = false;
+    	
+    	SearchIndexer(PDF pdf, int startingPage, int pageCount) {
+    		this.pdf = pdf;
+    		this.startingPage = Math.max(startingPage, 0);
+    		this.pageCount = pageCount;
+    	}
+    	
+    	public void cancel() {
+    		this.cancelled = true;
+    	}
+    	
+    	public void run() {
+    		long start = System.currentTimeMillis();
+    		for(int i = 0; i < this.pageCount && !this.cancelled; ++i) {
+    			if (this.pdf.indexPage((this.startingPage + i) % this.pageCount) == PDF.INDEX_BUSY) {
+    				/* findAll is indexing pages itself, go on when it's done */
+    				i -= 1;
+    				try {
+    					Thread.sleep(INDEX_BUSY_WAIT);
+    				} catch (InterruptedException e) {
+    					return;
+    				}
+    			}
+    		}
+    		Log.d(TAG, "search index done in " + (System.currentTimeMillis() - start) + " ms, cancelled: " + this.cancelled);
+    	}
+    }
+    
     /**
      * Called when user presses "next" button in find panel.
      */
@@ -980,7 +1072,7 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
     /**
      * Helper class that handles search progress, search cancelling etc.
      */
-	static class Finder implements Runnable, DialogInterface.OnCancelListener, DialogInterface.OnClickListener {
+	static class Finder implements Runnable, DialogInterface.OnCancelListener, DialogInterface.OnClickListener, PDF.FindCallback {
 		private OpenFileActivity parent = null;
 		private boolean forward;
 		private AlertDialog dialog = null;
@@ -988,6 +1080,14 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
 		private int startingPage;
 		private int pageCount;
 		private boolean cancelled = false;
+		/**
+		 * Results of page being reported by findAll.
+		 */
+		private List<FindResult> pageResults = new ArrayList<FindResult>();
+		/**
+		 * True once first page with results was posted to pages view.
+		 */
+		private boolean posted = false;
 		/**
 		 * Constructor for finder.
 		 * @param parent parent activity
@@ -1011,39 +1111,46 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
 			this.dialog = dialog;
 		}
 		public void run() {
-			int page = -1;
 			this.createDialog();
 			this.showDialog();
-			for(int i = 0; i < this.pageCount; ++i) {
-				if (this.cancelled) {
-					this.dismissDialog();
-					return;
-				}
-				page = (startingPage + pageCount + (this.forward ? i : -i)) % this.pageCount;
-				Log.d(TAG, "searching on " + page);
-				this.updateDialog(page);
-				List<FindResult> findResults = this.findOnPage(page);
-				if (findResults != null && !findResults.isEmpty()) {
-					Log.d(TAG, "found something at page " + page + ": " + findResults.size() + " results");
-					this.dismissDialog();
-					this.showFindResults(findResults, page);
-					return;
-				}
-			}
+			/*
+			 * Whole document is searched in parallel, results come back in page
+			 * order and are shown while search goes on. Backward search starts
+			 * after startingPage, so that nearest result going back is the last one.
+			 */
+			int threads = Math.min(Runtime.getRuntime().availableProcessors(), PDF.MAX_RENDER_THREADS);
+			int firstPage = this.forward ? this.startingPage : (this.startingPage + 1) % this.pageCount;
+			this.parent.pdf.findAll(this.text, firstPage,
+					this.parent.pagesView.getPageRotation(), threads, this);
+			if (!this.forward && this.posted) this.showLastFindResult();
 			/* TODO: show "nothing found" message */
 			this.dismissDialog();
 		}
+
 		/**
-		 * Called by finder thread to get find results for given page.
-		 * Routed to PDF instance.
-		 * If result is not empty, then finder loop breaks, current find position
-		 * is saved and find results are displayed.
-		 * @param page page to search on
-		 * @return results 
+		 * Called by findAll for each hit.
 		 */
-		private List<FindResult> findOnPage(int page) {
-			if (this.text == null) throw new IllegalStateException("text cannot be null");
-			return this.parent.pdf.find(this.text, page, this.parent.pagesView.getPageRotation());
+		public boolean onHit(int page, float[] boxes) {
+			if (this.cancelled) return false;
+			this.pageResults.add(new FindResult(page, boxes));
+			return true;
+		}
+		/**
+		 * Called by findAll when page is searched.
+		 * Hits of page are posted to pages view, search goes on until
+		 * all pages are searched or user cancels it.
+		 */
+		public boolean onProgress(int page, int pagesDone, int pageCount) {
+			if (this.cancelled) return false;
+			if (!this.pageResults.isEmpty()) {
+				Log.d(TAG, "found something at page " + page + ": " + this.pageResults.size() + " results");
+				if (this.forward && !this.posted) this.dismissDialog();
+				this.postFindResults(this.pageResults, !this.posted);
+				this.pageResults = new ArrayList<FindResult>();
+				this.posted = true;
+			}
+			this.updateDialog(page);
+			return !this.cancelled;
 		}
 
 		private void createDialog() {
@@ -1094,22 +1201,54 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
 			Log.d(TAG, "onClick(" + dialog + ")");
 			this.cancelled = true;
 		}
-		private void showFindResults(final List<FindResult> findResults, final int page) {
+		/**
+		 * Add results of one page to results shown by pages view.
+		 * First results of forward search get focus.
+		 * @param findResults results of one page, not modified later
+		 * @param first true if these are first results of this search
+		 */
+		private void postFindResults(final List<FindResult> findResults, final boolean first) {
 			this.parent.runOnUiThread(new Runnable() {
 				public void run() {
-					int fn = Finder.this.forward ? 0 : findResults.size()-1;
-					Finder.this.parent.currentFindResultPage = page;
-					Finder.this.parent.currentFindResultNumber = fn;
-					Finder.this.parent.pagesView.setFindResults(findResults);
-					Finder.this.parent.pagesView.setFindMode(true);
-					Finder.this.parent.pagesView.scrollToFindResult(fn);
-					Finder.this.parent.findButtonsLayout.setVisibility(View.VISIBLE);					
+					PagesView pagesView = Finder.this.parent.pagesView;
+					if (first) {
+						pagesView.setFindResults(new ArrayList<FindResult>(findResults));
+						pagesView.setFindMode(true);
+						Finder.this.parent.findButtonsLayout.setVisibility(View.VISIBLE);
+						if (Finder.this.forward) Finder.this.parent.focusFindResult(0);
+					} else if (pagesView.getFindResults() != null) {
+						pagesView.getFindResults().addAll(findResults);
+					}
+					pagesView.invalidate();
+				}
+			});
+		}
+		/**
+		 * Focus on last result, called when backward search is done.
+		 */
+		private void showLastFindResult() {
+			this.parent.runOnUiThread(new Runnable() {
+				public void run() {
+					List<FindResult> findResults = Finder.this.parent.pagesView.getFindResults();
+					if (findResults == null || findResults.isEmpty()) return;
+					Finder.this.parent.focusFindResult(findResults.size() - 1);
 					Finder.this.parent.pagesView.invalidate();
 				}
 			});
 		}
 	};
     
+    /**
+     * Focus on find result, results may span many pages.
+     * Does not call invalidate().
+     * @param n index of result in pages view find results
+     */
+    private void focusFindResult(int n) {
+    	this.currentFindResultNumber = n;
+    	this.currentFindResultPage = this.pagesView.getFindResults().get(n).page;
+    	this.pagesView.scrollToFindResult(n);
+    }
+    
     /**
      * GUI for finding text.
      * Used both on initial search and for "next" and "prev" searches.
@@ -1121,10 +1260,10 @@ public class OpenFileActivity extends Activity implements SensorEventListener {
     	if (this.currentFindResultPage != null) {
     		/* searching again */
     		int nextResultNum = forward ? this.currentFindResultNumber + 1 : this.currentFindResultNumber - 1;
-    		if (nextResultNum >= 0 && nextResultNum < this.pagesView.getFindResults().size()) {
+    		List<FindResult> findResults = this.pagesView.getFindResults();
+    		if (findResults != null && nextResultNum >= 0 && nextResultNum < findResults.size()) {
     			/* no need to really find - just focus on given result and exit */
-    			this.currentFindResultNumber = nextResultNum;
-    			this.pagesView.scrollToFindResult(nextResultNum);
+    			this.focusFindResult(nextResultNum);
     			this.pagesView.invalidate();
     			return;
     		}
@@ -1,5 +1,6 @@
 package cx.hell.android.pdfview;
 
+import java.nio.ByteBuffer;
 import java.util.Collection;
 import java.util.Collections;
 import java.util.HashMap;
@@ -152,7 +153,7 @@ public class PDFPagesProvider extends PagesProvider {
 		 * @param k cache key
 		 * @return bitmap found in cache or null if there's no matching bitmap
 		 */
-		Bitmap get(Tile k) {
+		synchronized Bitmap get(Tile k) {
 			BitmapCacheValue v = this.bitmaps.get(k);
 			Bitmap b = null;
 			if (v != null) {
@@ -178,19 +179,35 @@ public class PDFPagesProvider extends PagesProvider {
 		 * @param bitmap rendered tile contents, cache value
 		 */
 		synchronized void put(Tile tile, Bitmap bitmap) {
+			this.put(tile, bitmap, false);
+		}
+		
+		/**
+		 * Put rendered tile in cache, replacing its previous bitmap.
+		 * Replaced bitmap is not recycled, as it may still be drawn on screen.
+		 * @param tile tile definition (page, position etc), cache key
+		 * @param bitmap rendered tile contents, cache value
+		 * @param draft true if bitmap is only a draft of the tile
+		 */
+		synchronized void put(Tile tile, Bitmap bitmap, boolean draft) {
+			this.bitmaps.remove(tile);
 			while (this.willExceedCacheSize(bitmap) && !this.bitmaps.isEmpty()) {
 				Log.v(TAG, "Removing oldest");
 				this.removeOldest();
 			}
-			this.bitmaps.put(tile, new BitmapCacheValue(bitmap, System.currentTimeMillis(), 0));
+			BitmapCacheValue v = new BitmapCacheValue(bitmap, System.currentTimeMillis(), 0);
+			v.draft = draft;
+			this.bitmaps.put(tile, v);
 		}
 		
 		/**
 		 * Check if cache contains specified bitmap tile. Doesn't update last-used timestamp.
+		 * Drafts don't count, tile still has to be rendered at full quality.
 		 * @return true if cache contains specified bitmap tile
 		 */
 		synchronized boolean contains(Tile tile) {
-			return this.bitmaps.containsKey(tile);
+			BitmapCacheValue v = this.bitmaps.get(tile);
+			return v != null && !v.draft;
 		}
 		
 		/**
@@ -273,7 +290,7 @@ public class PDFPagesProvider extends PagesProvider {
 		/**
 		 * Worker stops rendering if error was encountered.
 		 */
-		private boolean isFailed = false;
+		private volatile boolean isFailed = false;
 		private PDFPagesProvider pdfPagesProvider;
 		private BitmapCache bitmapCache;
 		private Collection<Tile> tiles;
@@ -284,13 +301,15 @@ public class PDFPagesProvider extends PagesProvider {
 		private static int workerThreadId = 0;
 		
 		/**
-		 * Used as a synchronized flag.
-		 * If null, then there's no designated thread to render tiles.
-		 * There might be other worker threads running, but those have finished
-		 * their work and will finish really soon.
-		 * Only this one should pick up new jobs.
+		 * Number of threads currently picking up tiles.
+		 * Each thread decrements it when it finds no more work and finishes.
+		 */
+		private int workerThreadCount = 0;
+		
+		/**
+		 * Max number of threads rendering tiles at once.
 		 */
-		private Thread workerThread = null;
+		private int maxWorkerThreads;
 		
 		/**
 		 * Create renderer worker.
@@ -299,39 +318,40 @@ public class PDFPagesProvider extends PagesProvider {
 		RendererWorker(PDFPagesProvider pdfPagesProvider) {
 			this.tiles = null;
 			this.pdfPagesProvider = pdfPagesProvider;
+			this.maxWorkerThreads = Math.max(1, Math.min(
+					Runtime.getRuntime().availableProcessors(), PDF.MAX_RENDER_THREADS));
 		}
 		
 		/**
 		 * Called by outside world to provide more work for worker.
-		 * This also starts rendering thread if one is needed.
+		 * This also starts rendering threads if more are needed: one per tile,
+		 * up to maxWorkerThreads.
 		 * @param tiles a collection of tile objects that carry information about what should be rendered next
 		 */
 		synchronized void setTiles(Collection<Tile> tiles, BitmapCache bitmapCache) {
 			this.tiles = tiles;
 			this.bitmapCache = bitmapCache;
 			
-			if (this.workerThread == null) {
+			while (this.workerThreadCount < this.maxWorkerThreads
+					&& this.workerThreadCount < tiles.size()) {
 				Thread t = new Thread(this);
 				t.setPriority(Thread.MIN_PRIORITY);
 				t.setName("RendererWorkerThread#" + RendererWorker.workerThreadId++);
-				this.workerThread = t;
+				this.workerThreadCount += 1;
 				t.start();
-				Log.d(TAG, "started new worker thread");
-			} else {
-				//Log.i(TAG, "setTiles notices tiles is not empty, that means RendererWorkerThread exists and there's no need to start new one");
+				Log.d(TAG, "started new worker thread, " + this.workerThreadCount + " running");
 			}
 		}
 		
 		/**
 		 * Get tiles that should be rendered next. May not block.
-		 * Also sets this.workerThread to null if there's no tiles to be rendered currently,
-		 * so that calling thread may finish.
-		 * If there are more tiles to be rendered, then this.workerThread is not reset.
+		 * If there's no tiles to be rendered currently (or worker failed),
+		 * returns null and counts calling thread as finished.
 		 * @return some tiles
 		 */
 		synchronized Collection<Tile> popTiles() {
-			if (this.tiles == null || this.tiles.isEmpty()) {
-				this.workerThread = null; /* returning null, so calling thread will finish it's work */
+			if (this.isFailed || this.tiles == null || this.tiles.isEmpty()) {
+				this.workerThreadCount -= 1; /* returning null, so calling thread will finish it's work */
 				return null;
 			}
 			Tile tile = this.tiles.iterator().next();
@@ -341,17 +361,16 @@ public class PDFPagesProvider extends PagesProvider {
 		
 		/**
 		 * Thread's main routine.
-		 * There might be more than one running, but only one will get new tiles. Others
-		 * will get null returned by this.popTiles and will finish their work.
+		 * Several threads run this at once, each one renders next tile
+		 * returned by this.popTiles until there are none left.
 		 */
 		public void run() {
 			while(true) {
-				if (this.isFailed) {
-					Log.i(TAG, "RendererWorker is failed, exiting");
+				Collection<Tile> tiles = this.popTiles(); /* this can't block */
+				if (tiles == null || tiles.size() == 0) {
+					if (this.isFailed) Log.i(TAG, "RendererWorker is failed, exiting");
 					break;
 				}
-				Collection<Tile> tiles = this.popTiles(); /* this can't block */
-				if (tiles == null || tiles.size() == 0) break;
 				try {
 					Map<Tile,Bitmap> renderedTiles = this.pdfPagesProvider.renderTiles(tiles, bitmapCache);
 					if (renderedTiles.size() > 0)
@@ -368,6 +387,19 @@ public class PDFPagesProvider extends PagesProvider {
 	private BitmapCache bitmapCache = null;
 	private RendererWorker rendererWorker = null;
 	private OnImageRenderedListener onImageRendererListener = null;
+	/**
+	 * Tiles being rendered right now, with cookies that can abort them.
+	 */
+	private Map<Tile,PDF.Cookie> rendersInProgress = new HashMap<Tile,PDF.Cookie>();
+	/**
+	 * Memory that native code renders tiles into, one buffer per worker thread.
+	 */
+	private ThreadLocal<ByteBuffer> renderBuffer = new ThreadLocal<ByteBuffer>();
+	/**
+	 * Page and zoom last passed to PDF.prefetchPage, so it's called once per page.
+	 */
+	private int prefetchedPage = -1;
+	private int prefetchedZoom = 0;
 	
 	public float getRenderAhead() {
 		return this.renderAhead;
@@ -420,22 +452,75 @@ public class PDFPagesProvider extends PagesProvider {
 			if (this.bitmapCache.contains(tile))
 				return null;
 			
-			PDF.Size size = new PDF.Size(tile.getPrefXSize(), tile.getPrefYSize());
-			int[] pagebytes = null;
+			final PDF.Size size = new PDF.Size(tile.getPrefXSize(), tile.getPrefYSize());
+			final ByteBuffer buffer = this.getRenderBuffer(size.width * size.height * 2);
+			final Tile renderedTile = tile;
+			PDF.Cookie cookie = new PDF.Cookie();
+			int err;
 
-			pagebytes = pdf.renderPage(tile.getPage(), tile.getZoom(), tile.getX(), tile.getY(), 
-					tile.getRotation(), omitImages, size); /* native */
+			synchronized(this.rendersInProgress) {
+				this.rendersInProgress.put(tile, cookie);
+			}
+			try {
+				/* draft is shown as soon as it's ready, full pass replaces it */
+				err = pdf.renderPageProgressive(tile.getPage(), tile.getZoom(), tile.getX(), tile.getY(), 
+						tile.getRotation(), omitImages, size, buffer, cookie, new PDF.RenderCallback() {
+					public boolean onPassRendered(int pass) {
+						if (pass == PDF.RENDER_PASS_DRAFT) {
+							Bitmap draft = copyRenderBuffer(buffer, size);
+							bitmapCache.put(renderedTile, draft, true);
+							publishBitmaps(Collections.singletonMap(renderedTile, draft));
+						}
+						return true;
+					}
+				}); /* native */
+			} finally {
+				synchronized(this.rendersInProgress) {
+					if (this.rendersInProgress.get(tile) == cookie)
+						this.rendersInProgress.remove(tile);
+				}
+				cookie.free();
+			}
 
-			if (pagebytes == null) throw new RenderingException("Couldn't render page " + tile.getPage());
+			if (err == PDF.RENDER_ABORTED) {
+				/* tile is not visible anymore, it will be requested again if needed */
+				return null;
+			}
+			if (err != 0) throw new RenderingException("Couldn't render page " + tile.getPage() + ", error: " + err);
 			
-			/* create a bitmap from the 32-bit color array */			
-			Bitmap b = Bitmap.createBitmap(pagebytes, size.width, size.height, 
-					Bitmap.Config.RGB_565);
+			Bitmap b = this.copyRenderBuffer(buffer, size);
 			this.bitmapCache.put(tile, b);
 			return b;
 		}
 	}
 	
+	/**
+	 * Create bitmap from tile that native code packed as RGB_565 pixels
+	 * straight into the buffer.
+	 */
+	private Bitmap copyRenderBuffer(ByteBuffer buffer, PDF.Size size) {
+		Bitmap b = Bitmap.createBitmap(size.width, size.height, Bitmap.Config.RGB_565);
+		buffer.rewind();
+		b.copyPixelsFromBuffer(buffer);
+		return b;
+	}
+	
+	/**
+	 * Get direct buffer that calling thread renders tiles into.
+	 * Buffer is reused between tiles and only reallocated when it's too small.
+	 * @param bytes required capacity
+	 * @return direct buffer with at least given capacity
+	 */
+	private ByteBuffer getRenderBuffer(int bytes) {
+		ByteBuffer buffer = this.renderBuffer.get();
+		if (buffer == null || buffer.capacity() < bytes) {
+			buffer = ByteBuffer.allocateDirect(bytes);
+			this.renderBuffer.set(buffer);
+		}
+		buffer.clear();
+		return buffer;
+	}
+	
 	/**
 	 * Called by worker.
 	 */
@@ -494,16 +579,15 @@ public class PDFPagesProvider extends PagesProvider {
 	public int[][] getPageSizes() {
 		int cnt = this.getPageCount();
 		int[][] sizes = new int[cnt][];
-		PDF.Size size = new PDF.Size();
-		int err;
+		int[] packed = new int[cnt * 2];
+		int err = this.pdf.getPageSizes(packed);
+		if (err != 0) {
+			throw new RuntimeException("failed to getPageSizes(...), error: " + err);
+		}
 		for(int i = 0; i < cnt; ++i) {
-			err = this.pdf.getPageSize(i, size);
-			if (err != 0) {
-				throw new RuntimeException("failed to getPageSize(" + i + ",...), error: " + err);
-			}
 			sizes[i] = new int[2];
-			sizes[i][0] = size.width;
-			sizes[i][1] = size.height;
+			sizes[i][0] = packed[2*i];
+			sizes[i][1] = packed[2*i + 1];
 		}
 		return sizes;
 	}
@@ -515,8 +599,9 @@ public class PDFPagesProvider extends PagesProvider {
 	 */
 	synchronized public void setVisibleTiles(Collection<Tile> tiles) {
 		List<Tile> newtiles = null;
+		if (!tiles.isEmpty()) this.abortInvisibleRenders(tiles);
 		for(Tile tile: tiles) {
-			if (!this.bitmapCache.contains(tile)) {
+			if (!this.bitmapCache.contains(tile) && !this.isRendering(tile)) {
 				if (newtiles == null) newtiles = new LinkedList<Tile>();
 				newtiles.add(tile);
 			}
@@ -524,5 +609,53 @@ public class PDFPagesProvider extends PagesProvider {
 		if (newtiles != null) {
 			this.rendererWorker.setTiles(newtiles, this.bitmapCache);
 		}
-	}	
+		if (!tiles.isEmpty()) this.prefetchNextPage(tiles);
+	}
+	
+	/**
+	 * Let native code decode images of page below the last one that has
+	 * tiles wanted, while reader is still on current page.
+	 * @param tiles currently visible tiles
+	 */
+	private void prefetchNextPage(Collection<Tile> tiles) {
+		int page = -1;
+		int zoom = 0;
+		if (this.omitImages) return;
+		for(Tile tile: tiles) {
+			if (tile.getPage() > page) {
+				page = tile.getPage();
+				zoom = tile.getZoom();
+			}
+		}
+		page += 1;
+		if (page == this.prefetchedPage && zoom == this.prefetchedZoom) return;
+		this.prefetchedPage = page;
+		this.prefetchedZoom = zoom;
+		this.pdf.prefetchPage(page, zoom); /* native, returns at once; fails harmlessly past last page */
+	}
+	
+	/**
+	 * Check if tile is being rendered right now, eg its draft is already
+	 * shown and full pass is in progress.
+	 */
+	private boolean isRendering(Tile tile) {
+		synchronized(this.rendersInProgress) {
+			return this.rendersInProgress.containsKey(tile);
+		}
+	}
+	
+	/**
+	 * Abort renders of tiles that went off-screen (eg during fling),
+	 * so worker threads can pick up tiles that are visible now.
+	 * @param tiles currently visible tiles
+	 */
+	private void abortInvisibleRenders(Collection<Tile> tiles) {
+		synchronized(this.rendersInProgress) {
+			for(Map.Entry<Tile,PDF.Cookie> e: this.rendersInProgress.entrySet()) {
+				if (!tiles.contains(e.getKey())) {
+					e.getValue().abort();
+				}
+			}
+		}
+	}
 }